@@ -0,0 +1,256 @@
+/*
+ * Bitmap.h
+ *
+ * The cluster allocation bitmap of a volume, read from the $Bitmap metafile.
+ * Bit n of the bitmap is set when cluster n is in use. The bitmap is kept in mapped
+ * memory as 64 bit words (on disk it is a little endian byte array, so on x86 bit n%64
+ * of word n/64 is cluster n), with a rank summary of the clusters in use before every
+ * block of BITMAP_BLOCK_WORDS words. That gives:
+ *  - whether a cluster is in use in O(1),
+ *  - the clusters in use before any cluster (rank) or in any range in O(1),
+ *  - the cluster in use of any index (select) by a binary search of the summary,
+ *  - the next free or used cluster a word at a time, stepping over whole blocks
+ *    which are full or empty through the summary,
+ *  - the runs of free clusters from those.
+ * The bits past the last cluster in the last word are set, so scans for free clusters
+ * end there.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "NTFSStruct.h"
+#include "FileLUT.h"
+#include "Volume.h"
+#include "Sink.h"
+#include "Memory.h"
+
+#ifndef BITMAP_H_
+#define BITMAP_H_
+
+#define BITMAP_BLOCK_WORDS 8						/*Words covered by each rank entry */
+#define BITMAP_BLOCK_BITS (64*BITMAP_BLOCK_WORDS)
+
+typedef struct _ClusterBitmap {
+	uint64_t *words;
+	uint64_t nWords;
+	uint64_t nClusters;
+	uint64_t *ranks;		/*Clusters in use before each block, then in all of them */
+	uint64_t nBlocks;
+} ClusterBitmap;
+
+/* A run of clusters */
+typedef struct _Extent {
+	uint64_t lcn;
+	uint64_t length;
+} Extent;
+
+/**
+ * Reads $Bitmap (found among files) off volume into bitmap, and builds its summary.
+ * Returns 0, or -1 if $Bitmap is missing or cannot be read.
+ *
+ * WARNING: Memory is mapped for the bitmap, need to freeClusterBitmap(..) it.
+ */
+int loadClusterBitmap(Volume *volume, File *files, ClusterBitmap *bitmap) {
+	File *bitmapFile = findFileRecord(files, BITMAP_RECORD);
+	uint64_t b, w;
+	if(!bitmapFile || !hasContent(bitmapFile)) {
+		printf("No $Bitmap found in MFT record %d.\n", BITMAP_RECORD);
+		return -1;
+	}
+	bitmap->nClusters = volume->totalClusters;
+	if(bitmap->nClusters == 0 || bitmap->nClusters > bitmapFile->realSize*8) {
+		bitmap->nClusters = bitmapFile->realSize*8;
+	}
+	bitmap->nWords = (bitmap->nClusters+63)/64;
+	bitmap->nBlocks = (bitmap->nWords+BITMAP_BLOCK_WORDS-1)/BITMAP_BLOCK_WORDS;
+	if(bitmap->nWords == 0 || (bitmap->words = memMap( MEM_METADATA, bitmap->nWords*sizeof(uint64_t) )) == NULL) {
+		int errsv = errno;
+		printf("Failed to map a bitmap of %" PRIu64 " clusters: %s.\n", bitmap->nClusters, strerror(errsv));
+		return -1;
+	}
+
+	char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+	Sink sink = createMemorySink((char *)bitmap->words, (bitmap->nClusters+7)/8);
+	int ret = streamFile(volume, bitmapFile, &sink, buffer);
+	free(sink.ctx);
+	memFree(buffer);
+	if(ret != 0) {
+		printf("Failed to read $Bitmap.\n");
+		memUnmap(MEM_METADATA, bitmap->words, bitmap->nWords*sizeof(uint64_t));
+		bitmap->words = NULL;
+		return -1;
+	}
+	if(bitmap->nClusters%64) {
+		bitmap->words[bitmap->nWords-1] |= ~0ULL << bitmap->nClusters%64;
+	}
+
+	bitmap->ranks = memAlloc( MEM_METADATA, (bitmap->nBlocks+1)*sizeof(uint64_t) );
+	bitmap->ranks[0] = 0;
+	for(b = 0; b < bitmap->nBlocks; b++) {
+		uint64_t used = 0;
+		for(w = b*BITMAP_BLOCK_WORDS; w < (b+1)*BITMAP_BLOCK_WORDS && w < bitmap->nWords; w++) {
+			used += __builtin_popcountll(bitmap->words[w]);
+		}
+		bitmap->ranks[b+1] = bitmap->ranks[b] + used;
+	}
+	return 0;
+}
+
+void freeClusterBitmap(ClusterBitmap *bitmap) {
+	memUnmap(MEM_METADATA, bitmap->words, bitmap->nWords*sizeof(uint64_t));
+	memFree(bitmap->ranks);
+	bitmap->words = NULL;
+	bitmap->ranks = NULL;
+}
+
+/**
+ * Returns true if cluster lcn is in use. Clusters past the end of the volume are.
+ */
+bool clusterAllocated(ClusterBitmap *bitmap, uint64_t lcn) {
+	return lcn >= bitmap->nClusters || (bitmap->words[lcn/64] >> lcn%64) & 1;
+}
+
+/**
+ * Returns the number of clusters in use before cluster lcn.
+ */
+uint64_t clusterRank(ClusterBitmap *bitmap, uint64_t lcn) {
+	uint64_t rank, w;
+	if(lcn > bitmap->nClusters) {
+		lcn = bitmap->nClusters;
+	}
+	rank = bitmap->ranks[lcn/BITMAP_BLOCK_BITS];
+	for(w = lcn/BITMAP_BLOCK_BITS*BITMAP_BLOCK_WORDS; w < lcn/64; w++) {
+		rank += __builtin_popcountll(bitmap->words[w]);
+	}
+	if(lcn%64) {
+		rank += __builtin_popcountll(bitmap->words[lcn/64] & ((1ULL << lcn%64) - 1));
+	}
+	return rank;
+}
+
+/**
+ * Returns the number of clusters in use on the volume.
+ */
+uint64_t usedClusters(ClusterBitmap *bitmap) {
+	return clusterRank(bitmap, bitmap->nClusters);
+}
+
+/**
+ * Returns the number of clusters in use among the count from lcn.
+ */
+uint64_t clustersInUse(ClusterBitmap *bitmap, uint64_t lcn, uint64_t count) {
+	return clusterRank(bitmap, lcn + count) - clusterRank(bitmap, lcn);
+}
+
+/**
+ * Returns the cluster in use which has k clusters in use before it,
+ * or nClusters if fewer than k+1 are in use.
+ */
+uint64_t clusterSelect(ClusterBitmap *bitmap, uint64_t k) {
+	uint64_t low = 0, high = bitmap->nBlocks, w;
+	if(k >= usedClusters(bitmap)) {
+		return bitmap->nClusters;
+	}
+	/*The last block with fewer than k+1 clusters in use before it */
+	while(high - low > 1) {
+		uint64_t mid = (low + high)/2;
+		if(bitmap->ranks[mid] <= k) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	k -= bitmap->ranks[low];
+	for(w = low*BITMAP_BLOCK_WORDS; ; w++) {
+		uint64_t word = bitmap->words[w];
+		uint32_t used = __builtin_popcountll(word);
+		if(k < used) {
+			while(k--) {
+				word &= word - 1;	/*Clear the lowest set bit */
+			}
+			return w*64 + __builtin_ctzll(word);
+		}
+		k -= used;
+	}
+}
+
+/**
+ * Returns the first cluster in use from lcn on, or nClusters if there is none.
+ */
+uint64_t nextUsedCluster(ClusterBitmap *bitmap, uint64_t lcn) {
+	uint64_t w, word;
+	if(lcn >= bitmap->nClusters) {
+		return bitmap->nClusters;
+	}
+	w = lcn/64;
+	word = bitmap->words[w] & (~0ULL << lcn%64);
+	while(word == 0) {
+		w++;
+		/*Step over blocks with no cluster in use */
+		while(w%BITMAP_BLOCK_WORDS == 0 && w < bitmap->nWords &&
+			  bitmap->ranks[w/BITMAP_BLOCK_WORDS+1] == bitmap->ranks[w/BITMAP_BLOCK_WORDS]) {
+			w += BITMAP_BLOCK_WORDS;
+		}
+		if(w >= bitmap->nWords) {
+			return bitmap->nClusters;
+		}
+		word = bitmap->words[w];
+	}
+	lcn = w*64 + __builtin_ctzll(word);
+	return lcn < bitmap->nClusters ? lcn : bitmap->nClusters;
+}
+
+/**
+ * Returns the first free cluster from lcn on, or nClusters if there is none.
+ */
+uint64_t nextFreeCluster(ClusterBitmap *bitmap, uint64_t lcn) {
+	uint64_t w, word;
+	if(lcn >= bitmap->nClusters) {
+		return bitmap->nClusters;
+	}
+	w = lcn/64;
+	word = ~bitmap->words[w] & (~0ULL << lcn%64);
+	while(word == 0) {
+		w++;
+		/*Step over blocks with every cluster in use */
+		while(w%BITMAP_BLOCK_WORDS == 0 && w < bitmap->nWords &&
+			  bitmap->ranks[w/BITMAP_BLOCK_WORDS+1] - bitmap->ranks[w/BITMAP_BLOCK_WORDS] == BITMAP_BLOCK_BITS) {
+			w += BITMAP_BLOCK_WORDS;
+		}
+		if(w >= bitmap->nWords) {
+			return bitmap->nClusters;
+		}
+		word = ~bitmap->words[w];
+	}
+	lcn = w*64 + __builtin_ctzll(word);
+	return lcn < bitmap->nClusters ? lcn : bitmap->nClusters;
+}
+
+/**
+ * Returns the runs of unallocated clusters in order, setting *nExtents to their number.
+ *
+ * WARNING: Memory is allocated for the array, need to memFree(..) the returned pointer.
+ */
+Extent *freeExtents(ClusterBitmap *bitmap, uint64_t *nExtents) {
+	uint64_t capacity = 64, n = 0, lcn = nextFreeCluster(bitmap, 0);
+	Extent *extents = memAlloc( MEM_METADATA, capacity*sizeof(Extent) );
+	while(lcn < bitmap->nClusters) {
+		uint64_t end = nextUsedCluster(bitmap, lcn);
+		if(n == capacity) {
+			capacity *= 2;
+			extents = memRealloc( MEM_METADATA, extents, capacity*sizeof(Extent) );
+		}
+		extents[n].lcn = lcn;
+		extents[n].length = end - lcn;
+		n++;
+		lcn = nextFreeCluster(bitmap, end);
+	}
+	*nExtents = n;
+	return extents;
+}
+
+#endif /* BITMAP_H_ */
@@ -0,0 +1,408 @@
+/*
+ * BlockReader.h
+ *
+ * Positioned reads from the block device (or an image of it), shared by every thread.
+ * Large reads are split into I/O units which up to queueDepth threads issue at once,
+ * and recently read blocks can be kept in a direct-mapped cache. Given an error map, reads
+ * carry on past unreadable sectors, zero filling them (ErrorMap.h). A read can also be
+ * submitted without waiting for it, to be called back once it is complete.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "ErrorMap.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Memory.h"
+
+#ifndef BLOCKREADER_H_
+#define BLOCKREADER_H_
+
+#define READER_BLOCK_SIZE 65536		/*Cache granularity, I/O units are aligned to it */
+#define READER_MAX_IO (16*READER_BLOCK_SIZE) /*Largest single pread(..) issued */
+#define READER_MAX_QUEUE 256		/*Most I/O units waiting on the I/O threads */
+
+/* Called once an asynchronous read is complete, with 0 or the errno of its failure */
+typedef void (*ReadDone)(void *arg, int error);
+
+/* A set of I/O units submitted together, the submitter waits for all of them */
+typedef struct _ReadGroup {
+	int pending;	/*Units not yet completed */
+	int error;		/*errno of the first failed unit, 0 if none */
+	ReadDone done;	/*For a group not waited for, called once it completes, NULL otherwise */
+	void *arg;
+} ReadGroup;
+
+/* One pread(..) of at most READER_MAX_IO bytes */
+typedef struct _ReadUnit {
+	off_t offset;
+	size_t length;
+	char *dst;
+	ReadGroup *group;
+} ReadUnit;
+
+typedef struct _CacheSlot {
+	uint64_t block;		/*Block number held, valid only if data != NULL */
+	char *data;
+} CacheSlot;
+
+typedef struct _BlockReader {
+	int fd;
+	uint32_t queueDepth;		/*Units in flight at once, including the submitting thread */
+	pthread_t *ioThreads;
+	bool stopping;
+	pthread_mutex_t lock;		/*Guards the unit queue and read groups */
+	pthread_cond_t queued;		/*Signalled when units are queued or stopping is set */
+	pthread_cond_t completed;	/*Signalled when a group completes */
+	ReadUnit queue[READER_MAX_QUEUE];
+	uint32_t queueHead, queueLength;
+
+	CacheSlot *cache;			/*NULL when caching is disabled */
+	uint32_t cacheSlots;
+	pthread_mutex_t cacheLock;
+
+	uint64_t bytesRead;			/*Bytes actually read from fd */
+	uint64_t readCalls;
+	uint64_t cacheHits;			/*Blocks served from the cache */
+	ErrorMap *errors;			/*Where unreadable regions are kept, NULL to fail on them */
+} BlockReader;
+
+/**
+ * Performs one I/O unit, zero filling anything beyond the end of the device, and with an
+ * error map, whatever cannot be read.
+ * Returns 0 or the errno of the failure.
+ */
+int performReadUnit(BlockReader *reader, ReadUnit *unit) {
+	STAT_SCOPE(TIMER_IO);
+	uint64_t traceStartNs = traceStart();
+	ssize_t done = readTolerant(reader->fd, unit->dst, unit->length, unit->offset, reader->errors);
+	if(done < 0) {
+		return errno;
+	}
+	memset(unit->dst+done, 0, unit->length-done); /*End of device */
+	__sync_fetch_and_add(&reader->bytesRead, done);
+	__sync_fetch_and_add(&reader->readCalls, 1);
+	STAT_INC(STAT_DEVICE_READS);
+	STAT_ADD(STAT_DEVICE_BYTES, done);
+	STAT_HIST(HIST_READ_BYTES, unit->length);
+	traceSpan("read", "io", traceStartNs, "offset", unit->offset, "length", unit->length);
+	return 0;
+}
+
+/**
+ * Marks unit as done, waking its submitter once the whole group is complete, or for an
+ * asynchronous group, calling it back (without the lock) and freeing it.
+ * Must be called holding reader->lock.
+ */
+void completeReadUnit(BlockReader *reader, ReadUnit *unit, int error) {
+	ReadGroup *group = unit->group;
+	if(error && !group->error) {
+		group->error = error;
+	}
+	if(--group->pending == 0) {
+		if(group->done) {
+			pthread_mutex_unlock(&reader->lock);
+			group->done(group->arg, group->error);
+			free(group);
+			pthread_mutex_lock(&reader->lock);
+		} else {
+			pthread_cond_broadcast(&reader->completed);
+		}
+	}
+}
+
+/**
+ * Takes the next unit off the queue into *unit. Must be called holding reader->lock.
+ */
+bool dequeueReadUnit(BlockReader *reader, ReadUnit *unit) {
+	if(reader->queueLength == 0) {
+		return false;
+	}
+	*unit = reader->queue[reader->queueHead];
+	reader->queueHead = (reader->queueHead + 1) % READER_MAX_QUEUE;
+	reader->queueLength--;
+	return true;
+}
+
+void *ioThread(void *arg) {
+	BlockReader *reader = arg;
+	ReadUnit unit;
+	traceThreadName("io");
+	pthread_mutex_lock(&reader->lock);
+	while(!reader->stopping) {
+		if(!dequeueReadUnit(reader, &unit)) {
+			pthread_cond_wait(&reader->queued, &reader->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&reader->lock);
+		int error = performReadUnit(reader, &unit);
+		pthread_mutex_lock(&reader->lock);
+		completeReadUnit(reader, &unit, error);
+	}
+	pthread_mutex_unlock(&reader->lock);
+	return NULL;
+}
+
+/**
+ * Creates a reader for fd, issuing up to queueDepth reads at once and caching up to
+ * cacheBytes of recently read blocks (0 disables the cache).
+ */
+BlockReader *openBlockReader(int fd, uint32_t queueDepth, uint64_t cacheBytes) {
+	BlockReader *reader = calloc( 1, sizeof(BlockReader) );
+	uint32_t i;
+	reader->fd = fd;
+	reader->queueDepth = queueDepth < 1 ? 1 : queueDepth;
+	pthread_mutex_init(&reader->lock, NULL);
+	pthread_mutex_init(&reader->cacheLock, NULL);
+	pthread_cond_init(&reader->queued, NULL);
+	pthread_cond_init(&reader->completed, NULL);
+
+	/*The submitting thread performs I/O too, so one thread fewer is needed */
+	reader->ioThreads = malloc( reader->queueDepth*sizeof(pthread_t) );
+	for(i = 0; i+1 < reader->queueDepth; i++) {
+		pthread_create(&reader->ioThreads[i], NULL, ioThread, reader);
+	}
+
+	reader->cacheSlots = cacheBytes / READER_BLOCK_SIZE;
+	if(reader->cacheSlots > 0) {
+		reader->cache = memCalloc( MEM_CACHE, reader->cacheSlots, sizeof(CacheSlot) );
+	}
+	return reader;
+}
+
+void closeBlockReader(BlockReader *reader) {
+	uint32_t i;
+	pthread_mutex_lock(&reader->lock);
+	reader->stopping = true;
+	pthread_cond_broadcast(&reader->queued);
+	pthread_mutex_unlock(&reader->lock);
+	for(i = 0; i+1 < reader->queueDepth; i++) {
+		pthread_join(reader->ioThreads[i], NULL);
+	}
+	for(i = 0; i < reader->cacheSlots; i++) {
+		memFree(reader->cache[i].data);
+	}
+	memFree(reader->cache);
+	free(reader->ioThreads);
+	pthread_mutex_destroy(&reader->lock);
+	pthread_mutex_destroy(&reader->cacheLock);
+	pthread_cond_destroy(&reader->queued);
+	pthread_cond_destroy(&reader->completed);
+	free(reader);
+}
+
+/**
+ * Copies block from the cache into dst. Returns false if it is not cached.
+ */
+bool cacheLookup(BlockReader *reader, uint64_t block, char *dst) {
+	bool hit = false;
+	if(!reader->cache) {
+		return false;
+	}
+	CacheSlot *slot = &reader->cache[block % reader->cacheSlots];
+	pthread_mutex_lock(&reader->cacheLock);
+	if(slot->data && slot->block == block) {
+		memcpy(dst, slot->data, READER_BLOCK_SIZE);
+		hit = true;
+	}
+	pthread_mutex_unlock(&reader->cacheLock);
+	if(hit) {
+		__sync_fetch_and_add(&reader->cacheHits, 1);
+		STAT_INC(STAT_CACHE_HITS);
+	} else {
+		STAT_INC(STAT_CACHE_MISSES);
+	}
+	return hit;
+}
+
+void cacheInsert(BlockReader *reader, uint64_t block, char *data) {
+	if(!reader->cache) {
+		return;
+	}
+	CacheSlot *slot = &reader->cache[block % reader->cacheSlots];
+	pthread_mutex_lock(&reader->cacheLock);
+	if(!slot->data) {
+		slot->data = memAlloc( MEM_CACHE, READER_BLOCK_SIZE );
+	}
+	memcpy(slot->data, data, READER_BLOCK_SIZE);
+	slot->block = block;
+	pthread_mutex_unlock(&reader->cacheLock);
+}
+
+/**
+ * Drops from the cache the blocks holding any of the length bytes at offset, so they are
+ * read again, as after a retry pass reads what was zero filled in them.
+ */
+void cacheDrop(BlockReader *reader, uint64_t offset, uint64_t length) {
+	uint64_t block;
+	if(!reader->cache || length == 0) {
+		return;
+	}
+	pthread_mutex_lock(&reader->cacheLock);
+	for(block = offset / READER_BLOCK_SIZE; block <= (offset + length - 1) / READER_BLOCK_SIZE; block++) {
+		CacheSlot *slot = &reader->cache[block % reader->cacheSlots];
+		if(slot->data && slot->block == block) {
+			memFree(slot->data);
+			slot->data = NULL;
+		}
+	}
+	pthread_mutex_unlock(&reader->cacheLock);
+}
+
+/**
+ * Queues unit for the I/O threads, or performs it here if there are none or the queue is
+ * full. Must be called holding reader->lock.
+ */
+void submitReadUnit(BlockReader *reader, ReadUnit *unit) {
+	unit->group->pending++;
+	if(reader->queueDepth > 1 && reader->queueLength < READER_MAX_QUEUE) {
+		reader->queue[(reader->queueHead + reader->queueLength++) % READER_MAX_QUEUE] = *unit;
+		pthread_cond_signal(&reader->queued);
+	} else {
+		pthread_mutex_unlock(&reader->lock);
+		int error = performReadUnit(reader, unit);
+		pthread_mutex_lock(&reader->lock);
+		completeReadUnit(reader, unit, error);
+	}
+}
+
+/**
+ * Helps with queued units until every unit of group is done.
+ * Must be called holding reader->lock.
+ */
+void waitReadGroup(BlockReader *reader, ReadGroup *group) {
+	ReadUnit unit;
+	while(group->pending > 0) {
+		if(dequeueReadUnit(reader, &unit)) {
+			pthread_mutex_unlock(&reader->lock);
+			int error = performReadUnit(reader, &unit);
+			pthread_mutex_lock(&reader->lock);
+			completeReadUnit(reader, &unit, error);
+		} else {
+			pthread_cond_wait(&reader->completed, &reader->lock);
+		}
+	}
+}
+
+/**
+ * Reads the whole blocks first to first+count-1 into blocks, from the cache where possible.
+ * Blocks still missing are read in units of up to READER_MAX_IO, shared out among the
+ * I/O threads, and then cached. Returns 0 or the errno of the first failed read.
+ */
+int readWholeBlocks(BlockReader *reader, uint64_t first, uint64_t count, char *blocks) {
+	ReadGroup group = { 0, 0 };
+	ReadUnit unit;
+	uint64_t b = 0;
+
+	pthread_mutex_lock(&reader->lock);
+	while(b < count) {
+		if(cacheLookup(reader, first+b, blocks + b*READER_BLOCK_SIZE)) {
+			b++;
+			continue;
+		}
+		/*Extend the unit over the following uncached blocks */
+		uint64_t n = 1;
+		bool hitAfter = false;
+		while(b+n < count && n*READER_BLOCK_SIZE < READER_MAX_IO) {
+			if(cacheLookup(reader, first+b+n, blocks + (b+n)*READER_BLOCK_SIZE)) {
+				hitAfter = true;
+				break;
+			}
+			n++;
+		}
+		unit.offset = (first+b)*READER_BLOCK_SIZE;
+		unit.length = n*READER_BLOCK_SIZE;
+		unit.dst = blocks + b*READER_BLOCK_SIZE;
+		unit.group = &group;
+		submitReadUnit(reader, &unit);
+		b += n + (hitAfter ? 1 : 0); /*The block ending the unit was served by the cache */
+	}
+	waitReadGroup(reader, &group);
+	pthread_mutex_unlock(&reader->lock);
+
+	if(!group.error) {
+		for(b = 0; b < count; b++) {
+			cacheInsert(reader, first+b, blocks + b*READER_BLOCK_SIZE);
+		}
+	}
+	return group.error;
+}
+
+/**
+ * Reads length bytes at offset on the device into dst.
+ * Without a cache the range is read exactly, split into units of up to READER_MAX_IO which
+ * are issued queueDepth at a time. With a cache, whole blocks are read and kept.
+ *
+ * Returns 0, or the errno of the failure (also left in errno).
+ */
+int readBlocks(BlockReader *reader, uint64_t offset, size_t length, char *dst) {
+	int error;
+	if(length == 0) {
+		return 0;
+	}
+
+	if(!reader->cache) {
+		ReadGroup group = { 0, 0 };
+		ReadUnit unit;
+		size_t done = 0;
+		pthread_mutex_lock(&reader->lock);
+		while(done < length) {
+			unit.offset = offset + done;
+			unit.length = length - done < READER_MAX_IO ? length - done : READER_MAX_IO;
+			unit.dst = dst + done;
+			unit.group = &group;
+			submitReadUnit(reader, &unit);
+			done += unit.length;
+		}
+		waitReadGroup(reader, &group);
+		pthread_mutex_unlock(&reader->lock);
+		error = group.error;
+	} else {
+		uint64_t first = offset / READER_BLOCK_SIZE;
+		uint64_t count = (offset + length - 1) / READER_BLOCK_SIZE - first + 1;
+		if(offset % READER_BLOCK_SIZE == 0 && length % READER_BLOCK_SIZE == 0) {
+			error = readWholeBlocks(reader, first, count, dst);
+		} else { /*Unaligned, read whole blocks aside and copy the part wanted */
+			char *blocks = memAlloc( MEM_IO, count*READER_BLOCK_SIZE );
+			error = readWholeBlocks(reader, first, count, blocks);
+			memcpy(dst, blocks + offset % READER_BLOCK_SIZE, length);
+			memFree(blocks);
+		}
+	}
+	errno = error;
+	return error;
+}
+
+/**
+ * Submits a read of length bytes at offset on the device into dst, split into units as
+ * readBlocks(..) without a cache, and returns without waiting for it. done(arg, error) is
+ * called once it is complete, from an I/O thread, or from this one when there are none or
+ * the queue is full. These reads do not go through the cache.
+ */
+void readBlocksAsync(BlockReader *reader, uint64_t offset, size_t length, char *dst, ReadDone done, void *arg) {
+	ReadGroup *group = malloc( sizeof(ReadGroup) );
+	ReadUnit unit;
+	size_t submitted = 0;
+	group->pending = 1;		/*Held until every unit is submitted, so it cannot complete before */
+	group->error = 0;
+	group->done = done;
+	group->arg = arg;
+	unit.group = group;
+	pthread_mutex_lock(&reader->lock);
+	while(submitted < length) {
+		unit.offset = offset + submitted;
+		unit.length = length - submitted < READER_MAX_IO ? length - submitted : READER_MAX_IO;
+		unit.dst = dst + submitted;
+		submitReadUnit(reader, &unit);
+		submitted += unit.length;
+	}
+	completeReadUnit(reader, &unit, 0);
+	pthread_mutex_unlock(&reader->lock);
+}
+
+#endif /* BLOCKREADER_H_ */
@@ -0,0 +1,339 @@
+/*
+ * Carve.h
+ *
+ * Carving of deleted files out of unallocated space by their header and footer signatures.
+ * The free cluster ranges of $Bitmap are read in large sequential chunks shared out among
+ * threads, and searched for every signature at once with the automaton of Matcher.h.
+ * Each header is paired with the first footer of its type which follows it in the same
+ * free range, and the bytes between are handed to the sinks as a file.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "FileLUT.h"
+#include "Volume.h"
+#include "Bitmap.h"
+#include "Sink.h"
+#include "Matcher.h"
+#include "Memory.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef CARVE_H_
+#define CARVE_H_
+
+#define CARVE_CHUNK (4*1024*1024)	/*Bytes of free space searched by one read */
+
+typedef struct _CarveType {
+	const char *extension;
+	const char *header;
+	uint32_t headerLength;
+	const char *footer;
+	uint32_t footerLength;
+	uint32_t footerSlack;	/*Bytes of the file following its footer */
+	uint64_t maxSize;
+} CarveType;
+
+static const CarveType carveTypes[] = {
+	{ "jpg", "\xFF\xD8\xFF", 3, "\xFF\xD9", 2, 0, 20*1024*1024 },
+	{ "png", "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8, 0, 20*1024*1024 },
+	{ "gif", "GIF87a", 6, "\x00\x3B", 2, 0, 5*1024*1024 },
+	{ "gif", "GIF89a", 6, "\x00\x3B", 2, 0, 5*1024*1024 },
+	{ "pdf", "%PDF-", 5, "%%EOF", 5, 0, 50*1024*1024 },
+	{ "zip", "PK\x03\x04", 4, "PK\x05\x06", 4, 18, 100*1024*1024 }	/*End of central directory record */
+};
+#define CARVE_TYPES (sizeof(carveTypes)/sizeof(CarveType))
+
+typedef struct _CarveHit {
+	uint64_t offset;		/*Bytes from the start of the partition */
+	uint32_t extent;		/*Free extent the hit lies in */
+	uint32_t pattern;
+} CarveHit;
+
+typedef struct _CarvedFile {
+	uint64_t offset;
+	uint64_t length;
+	const CarveType *type;
+} CarvedFile;
+
+/**
+ * Builds the automaton matching the header and footer of every carveTypes entry;
+ * pattern 2t is the header of carveTypes[t], pattern 2t+1 its footer.
+ *
+ * WARNING: Memory is allocated for the matcher, need to freeMatcher(..) it.
+ */
+Matcher *createCarver() {
+	const uint8_t *patterns[2*CARVE_TYPES];
+	uint32_t lengths[2*CARVE_TYPES], t;
+	for(t = 0; t < CARVE_TYPES; t++) {
+		patterns[2*t] = (const uint8_t *)carveTypes[t].header;
+		lengths[2*t] = carveTypes[t].headerLength;
+		patterns[2*t+1] = (const uint8_t *)carveTypes[t].footer;
+		lengths[2*t+1] = carveTypes[t].footerLength;
+	}
+	return createMatcher(patterns, lengths, 2*CARVE_TYPES);
+}
+
+/**
+ * Appends a hit to the growing array *hits of *nHits entries.
+ */
+void addCarveHit(CarveHit **hits, uint64_t *nHits, uint64_t *capacity, uint64_t offset,
+				 uint32_t extent, uint32_t pattern) {
+	if(*nHits == *capacity) {
+		*capacity = *capacity ? 2 * *capacity : 1024;
+		*hits = memRealloc( MEM_SEARCH, *hits, *capacity*sizeof(CarveHit) );
+	}
+	(*hits)[*nHits].offset = offset;
+	(*hits)[*nHits].extent = extent;
+	(*hits)[*nHits].pattern = pattern;
+	(*nHits)++;
+}
+
+/* Where the hits of one chunk go */
+typedef struct _CarveScan {
+	CarveHit **hits;
+	uint64_t *nHits, *capacity;
+	uint64_t offset;
+	size_t reportLength;
+	uint32_t extent;
+} CarveScan;
+
+void carveFound(void *ctx, uint32_t pattern, size_t start) {
+	CarveScan *scan = ctx;
+	if(start < scan->reportLength) {
+		addCarveHit(scan->hits, scan->nHits, scan->capacity, scan->offset + start, scan->extent, pattern);
+	}
+}
+
+/**
+ * Searches length bytes of data, which lie at offset on the partition, for every signature.
+ * Only matches starting in the first reportLength bytes are kept, the rest overlap the
+ * following chunk.
+ */
+void carveScan(Matcher *carver, const uint8_t *data, size_t length, size_t reportLength,
+			   uint64_t offset, uint32_t extent, CarveHit **hits, uint64_t *nHits, uint64_t *capacity) {
+	CarveScan scan = { hits, nHits, capacity, offset, reportLength, extent };
+	matcherScan(carver, data, length, carveFound, &scan);
+}
+
+/* A piece of a free extent read and searched at once */
+typedef struct _CarveChunk {
+	uint64_t offset;		/*Bytes from the start of the partition */
+	uint64_t length;		/*Bytes whose matches belong to this chunk */
+	uint64_t readLength;	/*Including the overlap with the following chunk */
+	uint32_t extent;
+} CarveChunk;
+
+/* Work shared among the threads of carveVolume(..) */
+typedef struct _CarveJob {
+	Volume *volume;
+	Matcher *carver;
+	CarveChunk *chunks;
+	uint64_t nChunks;
+	uint64_t next;			/*Next chunk to take, taken atomically */
+	CarvedFile *carved;
+	uint64_t nCarved;
+	int failures;
+} CarveJob;
+
+typedef struct _CarveWorker {
+	CarveJob *job;
+	Sink *sink;
+	CarveHit *hits;
+	uint64_t nHits, capacity;
+} CarveWorker;
+
+void *carveSearchWorker(void *arg) {
+	CarveWorker *worker = arg;
+	CarveJob *job = worker->job;
+	char *buffer = memAlloc( MEM_IO, CARVE_CHUNK + job->carver->maxLength );
+	uint64_t i;
+	traceThreadName("carve");
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nChunks) {
+		CarveChunk *chunk = &job->chunks[i];
+		uint64_t traceStartNs = traceStart();
+		if(readBlocks(job->volume->reader, job->volume->partitionOffset + chunk->offset,
+					  chunk->readLength, buffer) != 0) {
+			int errsv = errno;
+			printf("Failed to read free space at %" PRIu64 ": %s.\n", chunk->offset, strerror(errsv));
+			__sync_fetch_and_add(&job->failures, 1);
+			continue;
+		}
+		carveScan(job->carver, (uint8_t *)buffer, chunk->readLength, chunk->length, chunk->offset,
+				  chunk->extent, &worker->hits, &worker->nHits, &worker->capacity);
+		STAT_ADD(STAT_CARVE_BYTES, chunk->length);
+		traceSpan("search", "carve", traceStartNs, "offset", chunk->offset, "length", chunk->length);
+	}
+	memFree(buffer);
+	return NULL;
+}
+
+void *carveStreamWorker(void *arg) {
+	CarveWorker *worker = arg;
+	CarveJob *job = worker->job;
+	char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+	char fileName[64];
+	uint64_t i;
+	traceThreadName("carve");
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nCarved) {
+		CarvedFile *carved = &job->carved[i];
+		File file;
+		memset(&file, 0, sizeof(file));
+		snprintf(fileName, sizeof(fileName), "carved_%" PRIu64 ".%s", carved->offset, carved->type->extension);
+		file.fileName = fileName;
+		file.recordFlags = IN_USE;
+		file.realSize = carved->length;
+		if(streamExtent(job->volume, &file, carved->offset, worker->sink, buffer) != 0) {
+			__sync_fetch_and_add(&job->failures, 1);
+		}
+	}
+	memFree(buffer);
+	return NULL;
+}
+
+int compareCarveHits(const void *a, const void *b) {
+	const CarveHit *x = a, *y = b;
+	if(x->offset != y->offset) {
+		return x->offset < y->offset ? -1 : 1;
+	}
+	return (int)x->pattern - (int)y->pattern;
+}
+
+/**
+ * Pairs each header among the sorted hits with the first footer of its type after it,
+ * in the same extent and within the type's maximum size. Headers inside a file already
+ * carved are skipped. Returns the carved files, setting *nCarved to their number.
+ */
+CarvedFile *pairCarveHits(CarveHit *hits, uint64_t nHits, Extent *extents, uint32_t bytesPerCluster,
+						  uint64_t *nCarved) {
+	CarvedFile *carved = NULL;
+	uint64_t capacity = 0, n = 0, carvedEnd = 0, i, j;
+	for(i = 0; i < nHits; i++) {
+		if(hits[i].pattern % 2 != 0 || hits[i].offset < carvedEnd) {
+			continue;	/*A footer, or inside the last file carved */
+		}
+		const CarveType *type = &carveTypes[hits[i].pattern/2];
+		uint64_t extentEnd = (extents[hits[i].extent].lcn + extents[hits[i].extent].length)*bytesPerCluster;
+		uint64_t limit = hits[i].offset + type->maxSize < extentEnd ? hits[i].offset + type->maxSize : extentEnd;
+		for(j = i+1; j < nHits && hits[j].offset < limit; j++) {
+			if(hits[j].pattern == hits[i].pattern+1 && hits[j].offset >= hits[i].offset + type->headerLength) {
+				uint64_t end = hits[j].offset + type->footerLength + type->footerSlack;
+				if(n == capacity) {
+					capacity = capacity ? 2*capacity : 64;
+					carved = memRealloc( MEM_SEARCH, carved, capacity*sizeof(CarvedFile) );
+				}
+				carved[n].offset = hits[i].offset;
+				carved[n].length = (end < extentEnd ? end : extentEnd) - hits[i].offset;
+				carved[n].type = type;
+				carvedEnd = carved[n].offset + carved[n].length;
+				n++;
+				break;
+			}
+		}
+	}
+	*nCarved = n;
+	return carved;
+}
+
+/**
+ * Carves the free extents of volume, searching them with one thread per sink and then
+ * streaming every file found through the sinks. Prints the number carved of each type.
+ *
+ * Returns the number of chunks or files which could not be read or written.
+ */
+int carveVolume(Volume *volume, Extent *extents, uint64_t nExtents, Sink *sinks, int nThreads) {
+	CarveJob job;
+	CarveWorker *workers = calloc( nThreads, sizeof(CarveWorker) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	uint64_t capacity = 0, freeBytes = 0, i, nHits = 0;
+	int t;
+
+	memset(&job, 0, sizeof(job));
+	job.volume = volume;
+	job.carver = createCarver();
+
+	/*Cut the extents into chunks, overlapping so signatures across a cut are found */
+	for(i = 0; i < nExtents; i++) {
+		uint64_t offset = extents[i].lcn*volume->bytesPerCluster;
+		uint64_t end = offset + extents[i].length*volume->bytesPerCluster;
+		freeBytes += end - offset;
+		for(; offset < end; offset += CARVE_CHUNK) {
+			if(job.nChunks == capacity) {
+				capacity = capacity ? 2*capacity : 1024;
+				job.chunks = memRealloc( MEM_SEARCH, job.chunks, capacity*sizeof(CarveChunk) );
+			}
+			CarveChunk *chunk = &job.chunks[job.nChunks++];
+			chunk->offset = offset;
+			chunk->length = end - offset < CARVE_CHUNK ? end - offset : CARVE_CHUNK;
+			chunk->readLength = chunk->length + job.carver->maxLength-1;
+			if(chunk->readLength > end - offset) {
+				chunk->readLength = end - offset;
+			}
+			chunk->extent = i;
+		}
+	}
+
+	for(t = 0; t < nThreads; t++) {
+		workers[t].job = &job;
+		workers[t].sink = &sinks[t];
+		pthread_create(&threads[t], NULL, carveSearchWorker, &workers[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		nHits += workers[t].nHits;
+	}
+
+	/*Gather the hits of every thread in order on disk */
+	CarveHit *hits = memAlloc( MEM_SEARCH, (nHits ? nHits : 1)*sizeof(CarveHit) );
+	nHits = 0;
+	for(t = 0; t < nThreads; t++) {
+		if(workers[t].nHits) {
+			memcpy(hits + nHits, workers[t].hits, workers[t].nHits*sizeof(CarveHit));
+		}
+		nHits += workers[t].nHits;
+		memFree(workers[t].hits);
+	}
+	qsort(hits, nHits, sizeof(CarveHit), compareCarveHits);
+	STAT_ADD(STAT_CARVE_HITS, nHits);
+	job.carved = pairCarveHits(hits, nHits, extents, volume->bytesPerCluster, &job.nCarved);
+	memFree(hits);
+
+	job.next = 0;
+	for(t = 0; t < nThreads; t++) {
+		pthread_create(&threads[t], NULL, carveStreamWorker, &workers[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	printf("Searched %" PRIu64 " bytes of free space in %" PRIu64 " extents, %" PRIu64 " signatures found.\n",
+		   freeBytes, nExtents, nHits);
+	printf("Carved %" PRIu64 " files:\n", job.nCarved);
+	for(i = 0; i < CARVE_TYPES; i++) {
+		uint64_t count = 0, k;
+		for(k = 0; k < i && strcmp(carveTypes[k].extension, carveTypes[i].extension) != 0; k++) {
+		}
+		if(k < i) {
+			continue;	/*Counted with the first type of the same extension */
+		}
+		for(k = 0; k < job.nCarved; k++) {
+			count += strcmp(job.carved[k].type->extension, carveTypes[i].extension) == 0;
+		}
+		if(count > 0) {
+			printf("\t%s: %" PRIu64 "\n", carveTypes[i].extension, count);
+		}
+	}
+
+	memFree(job.carved);
+	memFree(job.chunks);
+	freeMatcher(job.carver);
+	free(threads);
+	free(workers);
+	return job.failures;
+}
+
+#endif /* CARVE_H_ */
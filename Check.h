@@ -0,0 +1,357 @@
+/*
+ * Check.h
+ *
+ * A read-only consistency check of a volume, before its image is trusted. The catalog is
+ * shared out among threads by record number, and in a first pass each thread checks its
+ * records:
+ *  - the fixups of each FILE record held (it was not torn),
+ *  - every cluster of each file in use, of its data and of its index blocks, is allocated
+ *    in $Bitmap (through its rank summary),
+ *  - the parent of each file in use is a directory in use, of the same sequence number,
+ *  - each entry of the $I30 index of each directory leads to a record in use, of the same
+ *    sequence number, and the index blocks are sound.
+ * The cluster map, sorted by cluster, is then swept once for clusters owned by more than
+ * one run (cross-linked), index blocks included, and in a second parallel pass each file in use is looked up
+ * among the index entries of its parent directory.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "Volume.h"
+#include "Bitmap.h"
+#include "ClusterMap.h"
+#include "Index.h"
+#include "Sink.h"
+#include "Memory.h"
+#include "Trace.h"
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+typedef enum _CheckKind {
+	CHECK_BAD_FIXUP,		/*A FILE record was torn */
+	CHECK_UNALLOCATED,		/*Clusters of a file in use are free in $Bitmap */
+	CHECK_CROSS_LINKED,		/*Clusters owned by two runs */
+	CHECK_ORPHAN,			/*The parent of a file in use is missing, reused or not a directory */
+	CHECK_STALE_ENTRY,		/*An index entry leads to a record not in use, or reused */
+	CHECK_UNINDEXED,		/*A file in use is missing from the index of its parent */
+	CHECK_BAD_INDEX,		/*Index nodes of a directory are damaged, or cannot be read */
+	CHECK_KINDS
+} CheckKind;
+
+static const char *checkKindNames[CHECK_KINDS] = {
+	"bad-fixup", "unallocated", "cross-linked", "orphan", "stale-entry", "unindexed", "bad-index"
+};
+
+typedef struct _CheckProblem {
+	CheckKind kind;
+	uint32_t recordNumber;		/*The file, or directory for index problems */
+	uint64_t other;				/*Record of the parent, entry or other owner */
+	uint64_t lcn;				/*First cluster concerned */
+	uint64_t count;				/*Clusters, or damaged index nodes */
+} CheckProblem;
+
+/* An entry of a directory index, by record number */
+typedef struct _IndexPair {
+	uint32_t directory;
+	uint32_t file;
+} IndexPair;
+
+/* A slice of the records, checked by one thread */
+typedef struct _CheckSlice {
+	Volume *volume;
+	File **byRecord;
+	uint32_t nRecords;
+	uint32_t first, last;
+	ClusterBitmap *bitmap;
+	IndexPair *pairs;			/*Entries of every index, sorted, for the second pass */
+	uint64_t nPairs, pairCapacity;
+	CheckProblem *problems;
+	uint64_t nProblems, problemCapacity;
+	uint64_t nEntries;			/*Index entries visited */
+} CheckSlice;
+
+void addProblem(CheckSlice *slice, CheckKind kind, uint32_t recordNumber, uint64_t other, uint64_t lcn, uint64_t count) {
+	if(slice->nProblems == slice->problemCapacity) {
+		slice->problemCapacity = slice->problemCapacity ? 2*slice->problemCapacity : 64;
+		slice->problems = memRealloc( MEM_METADATA, slice->problems, slice->problemCapacity*sizeof(CheckProblem) );
+	}
+	CheckProblem *problem = &slice->problems[slice->nProblems++];
+	problem->kind = kind;
+	problem->recordNumber = recordNumber;
+	problem->other = other;
+	problem->lcn = lcn;
+	problem->count = count;
+}
+
+void checkIndexEntry(void *ctx, File *directory, INDEX_ENTRY_HEADER *entry) {
+	CheckSlice *slice = ctx;
+	uint64_t fileReference = entry->fileReference;
+	slice->nEntries++;
+	if(!referencedFile(slice->byRecord, slice->nRecords, fileReference)) {
+		addProblem(slice, CHECK_STALE_ENTRY, directory->recordNumber, fileReference & FILE_REFERENCE_RECORD, 0, 0);
+		return;
+	}
+	if(slice->nPairs == slice->pairCapacity) {
+		slice->pairCapacity = slice->pairCapacity ? 2*slice->pairCapacity : 1024;
+		slice->pairs = memRealloc( MEM_METADATA, slice->pairs, slice->pairCapacity*sizeof(IndexPair) );
+	}
+	slice->pairs[slice->nPairs].directory = directory->recordNumber;
+	slice->pairs[slice->nPairs++].file = fileReference & FILE_REFERENCE_RECORD;
+}
+
+/**
+ * Checks the clusters of file, of its data and its index blocks, against the bitmap, adding
+ * a problem for those free.
+ */
+void checkFileClusters(CheckSlice *slice, File *file) {
+	uint64_t freeClusters = 0, firstFree = 0;
+	int s;
+	for(s = 0; s < OWNED_STREAMS; s++) {
+		uint64_t lcn = 0, length, vcn = 0;
+		FOR_EACH_OWNED_RUN(ownedRuns(file, ownedStreams[s]), lcn, length, vcn) {
+			uint64_t used = clustersInUse(slice->bitmap, lcn, length);
+			if(used < length) {
+				if(freeClusters == 0) {
+					firstFree = nextFreeCluster(slice->bitmap, lcn);
+				}
+				freeClusters += length - used;
+			}
+		}
+	}
+	if(freeClusters) {
+		addProblem(slice, CHECK_UNALLOCATED, file->recordNumber, 0, firstFree, freeClusters);
+	}
+}
+
+void *checkRecords(void *arg) {
+	CheckSlice *slice = arg;
+	uint64_t traceStartNs = traceStart();
+	uint32_t r;
+	traceThreadName("check");
+	for(r = slice->first; r < slice->last; r++) {
+		File *file = slice->byRecord[r];
+		if(!file) {
+			continue;
+		}
+		if(file->badFixup) {
+			addProblem(slice, CHECK_BAD_FIXUP, r, 0, 0, 0);
+		}
+		if(!(file->recordFlags & IN_USE)) {
+			continue;
+		}
+		checkFileClusters(slice, file);
+		/*Extension records have no name, nor parent */
+		if(file->fileName && r != ROOT_RECORD) {
+			File *parent = referencedFile(slice->byRecord, slice->nRecords, file->parentReference);
+			if(!parent || !(parent->recordFlags & DIRECTORY)) {
+				addProblem(slice, CHECK_ORPHAN, r, file->parentReference & FILE_REFERENCE_RECORD, 0, 0);
+			}
+		}
+		if((file->recordFlags & DIRECTORY) && file->index) {
+			int bad = visitDirectoryIndex(slice->volume, file, checkIndexEntry, slice);
+			if(bad != 0) {
+				addProblem(slice, CHECK_BAD_INDEX, r, 0, 0, bad > 0 ? bad : 0);
+			}
+		}
+	}
+	traceSpan("check", "records", traceStartNs, "first", slice->first, "records", slice->last - slice->first);
+	return NULL;
+}
+
+int compareIndexPairs(const void *a, const void *b) {
+	const IndexPair *x = a, *y = b;
+	if(x->directory != y->directory) {
+		return x->directory < y->directory ? -1 : 1;
+	}
+	return x->file < y->file ? -1 : x->file > y->file;
+}
+
+/**
+ * Looks up each named file in use of the slice among the entries of the index of its
+ * parent, in slice->pairs: the sorted entries of every index.
+ */
+void *checkIndexed(void *arg) {
+	CheckSlice *slice = arg;
+	uint32_t r;
+	for(r = slice->first; r < slice->last; r++) {
+		File *file = slice->byRecord[r];
+		if(!file || !(file->recordFlags & IN_USE) || !file->fileName || r == ROOT_RECORD) {
+			continue;
+		}
+		File *parent = referencedFile(slice->byRecord, slice->nRecords, file->parentReference);
+		if(!parent || !(parent->recordFlags & DIRECTORY) || !parent->index) {
+			continue;	/*An orphan already, or the parent index is not known */
+		}
+		IndexPair key = { parent->recordNumber, r };
+		if(!bsearch(&key, slice->pairs, slice->nPairs, sizeof(IndexPair), compareIndexPairs)) {
+			addProblem(slice, CHECK_UNINDEXED, r, parent->recordNumber, 0, 0);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Sweeps the runs of map, in cluster order, for clusters owned by more than one run,
+ * adding a problem for each run starting inside the furthest reaching run before it.
+ */
+void checkCrossLinks(CheckSlice *slice, ClusterMap *map) {
+	uint64_t i, reach = 0;
+	OwnerRun *furthest = NULL;
+	for(i = 0; i < map->nRuns; i++) {
+		OwnerRun *run = &map->runs[i];
+		if(furthest && run->lcn < reach) {
+			uint64_t end = run->lcn + run->length < reach ? run->lcn + run->length : reach;
+			addProblem(slice, CHECK_CROSS_LINKED, run->recordNumber, furthest->recordNumber, run->lcn, end - run->lcn);
+		}
+		if(!furthest || run->lcn + run->length > reach) {
+			furthest = run;
+			reach = run->lcn + run->length;
+		}
+	}
+}
+
+int compareProblems(const void *a, const void *b) {
+	const CheckProblem *x = a, *y = b;
+	if(x->kind != y->kind) {
+		return (int)x->kind - (int)y->kind;
+	}
+	if(x->recordNumber != y->recordNumber) {
+		return x->recordNumber < y->recordNumber ? -1 : 1;
+	}
+	return x->lcn < y->lcn ? -1 : x->lcn > y->lcn;
+}
+
+/**
+ * Prints problem as a line of the report: its kind, record, details and path.
+ */
+void printProblem(CheckProblem *problem, File **byRecord, uint32_t nRecords) {
+	char path[MAX_PATH_LENGTH] = "";
+	File *file = problem->recordNumber < nRecords ? byRecord[problem->recordNumber] : NULL;
+	if(file && filePath(byRecord, nRecords, file, path, sizeof(path)) == 0) {
+		snprintf(path, sizeof(path), "/");	/*The root directory */
+	}
+	printf("%-13s %-8u ", checkKindNames[problem->kind], problem->recordNumber);
+	switch(problem->kind) {
+	case CHECK_UNALLOCATED:
+		printf("%" PRIu64 " clusters free in $Bitmap, from cluster %" PRIu64, problem->count, problem->lcn);
+		break;
+	case CHECK_CROSS_LINKED:
+		printf("%" PRIu64 " clusters from %" PRIu64 " also owned by record %" PRIu64,
+			   problem->count, problem->lcn, problem->other);
+		break;
+	case CHECK_ORPHAN:
+		printf("parent record %" PRIu64 " is not a directory in use", problem->other);
+		break;
+	case CHECK_STALE_ENTRY:
+		printf("entry for record %" PRIu64 ", which is not in use or was reused", problem->other);
+		break;
+	case CHECK_UNINDEXED:
+		printf("missing from the index of record %" PRIu64, problem->other);
+		break;
+	case CHECK_BAD_INDEX:
+		if(problem->count) {
+			printf("%" PRIu64 " index nodes damaged", problem->count);
+		} else {
+			printf("index blocks cannot be read");
+		}
+		break;
+	default:
+		printf("record failed its fixups");
+	}
+	printf("  %s\n", path);
+}
+
+/**
+ * Checks the consistency of the files of volume with bitmap and map, with nThreads
+ * threads, and prints a report: every problem found, then the number of each kind.
+ * Returns the number of problems.
+ */
+uint64_t checkVolume(Volume *volume, File *files, ClusterBitmap *bitmap, ClusterMap *map, int nThreads) {
+	uint32_t nRecords;
+	uint64_t nPairs = 0, nProblems = 0, nEntries = 0, totals[CHECK_KINDS] = { 0 }, i;
+	int t, k;
+	File **byRecord = indexRecords(files, &nRecords);
+	CheckSlice *slices = calloc( nThreads, sizeof(CheckSlice) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+
+	/*Records, their clusters, parents and indexes */
+	for(t = 0; t < nThreads; t++) {
+		slices[t].volume = volume;
+		slices[t].byRecord = byRecord;
+		slices[t].nRecords = nRecords;
+		slices[t].first = (uint64_t)nRecords*t/nThreads;
+		slices[t].last = (uint64_t)nRecords*(t+1)/nThreads;
+		slices[t].bitmap = bitmap;
+		pthread_create(&threads[t], NULL, checkRecords, &slices[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		nPairs += slices[t].nPairs;
+		nEntries += slices[t].nEntries;
+	}
+
+	/*The index entries of every directory, sorted to look files up in */
+	IndexPair *pairs = memAlloc( MEM_METADATA, (nPairs ? nPairs : 1)*sizeof(IndexPair) );
+	nPairs = 0;
+	for(t = 0; t < nThreads; t++) {
+		if(slices[t].nPairs) {
+			memcpy(pairs + nPairs, slices[t].pairs, slices[t].nPairs*sizeof(IndexPair));
+		}
+		nPairs += slices[t].nPairs;
+		memFree(slices[t].pairs);
+	}
+	qsort(pairs, nPairs, sizeof(IndexPair), compareIndexPairs);
+	checkCrossLinks(&slices[0], map);
+	for(t = 0; t < nThreads; t++) {
+		slices[t].pairs = pairs;
+		slices[t].nPairs = nPairs;
+		pthread_create(&threads[t], NULL, checkIndexed, &slices[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		nProblems += slices[t].nProblems;
+	}
+
+	/*Every thread's problems, by kind and record */
+	CheckProblem *problems = memAlloc( MEM_METADATA, (nProblems ? nProblems : 1)*sizeof(CheckProblem) );
+	nProblems = 0;
+	for(t = 0; t < nThreads; t++) {
+		if(slices[t].nProblems) {
+			memcpy(problems + nProblems, slices[t].problems, slices[t].nProblems*sizeof(CheckProblem));
+		}
+		nProblems += slices[t].nProblems;
+		memFree(slices[t].problems);
+	}
+	qsort(problems, nProblems, sizeof(CheckProblem), compareProblems);
+	if(nProblems) {
+		printf("%-13s %-8s %s\n", "problem", "record", "details  path");
+	}
+	for(i = 0; i < nProblems; i++) {
+		printProblem(&problems[i], byRecord, nRecords);
+		totals[problems[i].kind]++;
+	}
+	printf("Checked %u records, %" PRIu64 " clusters in use and %" PRIu64 " index entries: %" PRIu64 " problems",
+		   nRecords, usedClusters(bitmap), nEntries, nProblems);
+	for(k = 0; k < CHECK_KINDS; k++) {
+		printf("%s %" PRIu64 " %s", k ? "," : ":", totals[k], checkKindNames[k]);
+	}
+	printf(".\n");
+
+	memFree(problems);
+	memFree(pairs);
+	memFree(byRecord);
+	free(threads);
+	free(slices);
+	return nProblems;
+}
+
+#endif /* CHECK_H_ */
@@ -0,0 +1,413 @@
+/*
+ * ClusterMap.h
+ *
+ * Reverse map of the clusters of a volume to the files owning them, for finding which
+ * file a cluster or byte offset (a hit of a raw search, say) belongs to.
+ * Every run of every file in use, of its unnamed $DATA or of the $INDEX_ALLOCATION of its
+ * index, becomes an interval (LCN, length, record, stream, VCN), and the intervals are
+ * kept sorted by LCN so that point and range lookups are binary
+ * searches. Runs may be cross-linked, starting inside a run before them, so the map also
+ * keeps the furthest cluster reached by the runs up to each one, also searched: every run
+ * holding a cluster lies between the first to reach past it and the last to start by it.
+ * The map is built in parallel: the catalog is shared out among threads which fill and
+ * sort slices of the array, and the sorted slices are then merged in pairs, also
+ * in parallel. It is saved next to the MFT copy it was built from, keyed on the content
+ * of that copy, and loaded from there while the copy is unchanged.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "FileLUT.h"
+#include "MFTRecord.h"
+#include "Memory.h"
+
+#ifndef CLUSTERMAP_H_
+#define CLUSTERMAP_H_
+
+#define CLUSTER_MAP_MAGIC "NTFSOWN2"
+#define CLUSTER_MAP_SUFFIX ".owners"	/*Appended to the name of the MFT copy */
+#define OWNED_STREAMS 2					/*$DATA and $INDEX_ALLOCATION */
+
+/* Clusters lcn to lcn+length-1 hold clusters vcn onwards of a stream of a record */
+typedef struct _OwnerRun {
+	uint64_t lcn;
+	uint64_t length;
+	uint64_t vcn;
+	uint32_t recordNumber;
+	uint32_t stream;		/*Attribute type of the stream, DATA or INDEX_ALLOCATION */
+} OwnerRun;
+
+typedef struct _ClusterMap {
+	OwnerRun *runs;
+	uint64_t nRuns;
+	uint64_t crossLinked;	/*Runs starting inside the run before them */
+	uint64_t key;			/*Of the MFT copy the map was built from */
+	uint64_t *reach;		/*Past the last cluster of any of runs 0 to i, not saved */
+} ClusterMap;
+
+/* Precedes the runs in a saved map */
+typedef struct _ClusterMapHeader {
+	char magic[8];
+	uint64_t key;
+	uint64_t nRuns;
+	uint64_t crossLinked;
+} ClusterMapHeader;
+
+/**
+ * Returns a 64 bit FNV-1a hash of the records of copy, taken a word at a time,
+ * which identifies the catalog a map was built from.
+ */
+uint64_t mftCopyKey(MFTCopy *copy) {
+	uint64_t key = 0xCBF29CE484222325ULL, i, word;
+	for(i = 0; i + sizeof(uint64_t) <= copy->length; i += sizeof(uint64_t)) {
+		memcpy(&word, copy->records + i, sizeof(uint64_t));
+		key = (key ^ word) * 0x100000001B3ULL;
+	}
+	return key ^ copy->length;
+}
+
+int compareOwnerRuns(const void *a, const void *b) {
+	const OwnerRun *x = a, *y = b;
+	if(x->lcn != y->lcn) {
+		return x->lcn < y->lcn ? -1 : 1;
+	}
+	return x->recordNumber < y->recordNumber ? -1 : x->recordNumber > y->recordNumber;
+}
+
+/*
+ * Loops over the allocated runs of the run list runs, setting lcn, length and vcn for each.
+ * Sparse runs take no clusters and are stepped over.
+ */
+#define FOR_EACH_OWNED_RUN(runs, lcn, length, vcn) \
+	for(DataRun *p_run = (runs); p_run; (vcn) += *p_run->length, p_run = p_run->p_next) \
+		if(p_run->offset && ((lcn) += *p_run->offset, (length) = *p_run->length) > 0)
+
+static const uint32_t ownedStreams[OWNED_STREAMS] = { DATA, INDEX_ALLOCATION };
+
+/**
+ * Returns the run list of stream of file, DATA or INDEX_ALLOCATION, or NULL if it has none.
+ */
+DataRun *ownedRuns(File *file, uint32_t stream) {
+	if(stream == DATA) {
+		return file->runs;
+	}
+	return file->index ? file->index->runs : NULL;
+}
+
+/**
+ * Returns the name a report gives stream, DATA or INDEX_ALLOCATION.
+ */
+const char *ownedStreamName(uint32_t stream) {
+	return stream == DATA ? "data" : "index";
+}
+
+bool ownsClusters(File *file) {
+	return (file->recordFlags & IN_USE) && (file->runs != NULL || (file->index && file->index->runs != NULL));
+}
+
+/* A slice of the catalog and of the map, handled by one thread */
+typedef struct _ClusterMapSlice {
+	File **files;
+	uint32_t firstFile, lastFile;
+	OwnerRun *runs;			/*The whole array */
+	uint64_t first, count;	/*The slice of it */
+} ClusterMapSlice;
+
+void *countOwnerRuns(void *arg) {
+	ClusterMapSlice *slice = arg;
+	uint32_t f;
+	slice->count = 0;
+	int s;
+	for(f = slice->firstFile; f < slice->lastFile; f++) {
+		if(!ownsClusters(slice->files[f])) {
+			continue;
+		}
+		for(s = 0; s < OWNED_STREAMS; s++) {
+			uint64_t lcn = 0, length, vcn = 0;
+			FOR_EACH_OWNED_RUN(ownedRuns(slice->files[f], ownedStreams[s]), lcn, length, vcn) {
+				slice->count++;
+			}
+		}
+	}
+	return NULL;
+}
+
+void *fillOwnerRuns(void *arg) {
+	ClusterMapSlice *slice = arg;
+	OwnerRun *run = slice->runs + slice->first;
+	uint32_t f;
+	int s;
+	for(f = slice->firstFile; f < slice->lastFile; f++) {
+		File *file = slice->files[f];
+		if(!ownsClusters(file)) {
+			continue;
+		}
+		for(s = 0; s < OWNED_STREAMS; s++) {
+			uint64_t lcn = 0, length, vcn = 0;
+			FOR_EACH_OWNED_RUN(ownedRuns(file, ownedStreams[s]), lcn, length, vcn) {
+				run->lcn = lcn;
+				run->length = length;
+				run->vcn = vcn;
+				run->recordNumber = file->recordNumber;
+				run->stream = ownedStreams[s];
+				run++;
+			}
+		}
+	}
+	qsort(slice->runs + slice->first, slice->count, sizeof(OwnerRun), compareOwnerRuns);
+	return NULL;
+}
+
+/* Two adjacent sorted slices of from, merged into the same place in to */
+typedef struct _OwnerMerge {
+	OwnerRun *from, *to;
+	uint64_t first, middle, last;
+} OwnerMerge;
+
+void *mergeOwnerRuns(void *arg) {
+	OwnerMerge *merge = arg;
+	uint64_t i = merge->first, j = merge->middle, k = merge->first;
+	while(i < merge->middle && j < merge->last) {
+		if(compareOwnerRuns(&merge->from[j], &merge->from[i]) < 0) {
+			merge->to[k++] = merge->from[j++];
+		} else {
+			merge->to[k++] = merge->from[i++];
+		}
+	}
+	memcpy(merge->to + k, merge->from + i, (merge->middle - i)*sizeof(OwnerRun));
+	k += merge->middle - i;
+	memcpy(merge->to + k, merge->from + j, (merge->last - j)*sizeof(OwnerRun));
+	return NULL;
+}
+
+/**
+ * Fills the reach of the runs of map, a running maximum of where they end.
+ */
+void computeOwnerReach(ClusterMap *map) {
+	uint64_t i, reach = 0;
+	map->reach = memAlloc( MEM_CATALOG, (map->nRuns ? map->nRuns : 1)*sizeof(uint64_t) );
+	for(i = 0; i < map->nRuns; i++) {
+		if(map->runs[i].lcn + map->runs[i].length > reach) {
+			reach = map->runs[i].lcn + map->runs[i].length;
+		}
+		map->reach[i] = reach;
+	}
+}
+
+/**
+ * Builds the map of the clusters owned by the files in use in files, with nThreads threads.
+ *
+ * WARNING: Memory is allocated for the runs, need to freeClusterMap(..) the map.
+ */
+void buildClusterMap(File *files, int nThreads, ClusterMap *map) {
+	uint32_t nFiles;
+	uint64_t i;
+	File **fileArray = indexFiles(files, &nFiles);
+	ClusterMapSlice *slices = calloc( nThreads, sizeof(ClusterMapSlice) );
+	uint64_t *bounds = malloc( (nThreads+1)*sizeof(uint64_t) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	int t, width;
+
+	for(t = 0; t < nThreads; t++) {
+		slices[t].files = fileArray;
+		slices[t].firstFile = (uint64_t)nFiles*t/nThreads;
+		slices[t].lastFile = (uint64_t)nFiles*(t+1)/nThreads;
+		pthread_create(&threads[t], NULL, countOwnerRuns, &slices[t]);
+	}
+	map->nRuns = 0;
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		slices[t].first = bounds[t] = map->nRuns;
+		map->nRuns += slices[t].count;
+	}
+	bounds[nThreads] = map->nRuns;
+
+	map->runs = memAlloc( MEM_CATALOG, (map->nRuns ? map->nRuns : 1)*sizeof(OwnerRun) );
+	for(t = 0; t < nThreads; t++) {
+		slices[t].runs = map->runs;
+		pthread_create(&threads[t], NULL, fillOwnerRuns, &slices[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+
+	/*Merge the sorted slices in pairs, a round at a time */
+	if(nThreads > 1) {
+		OwnerRun *from = map->runs;
+		OwnerRun *to = memAlloc( MEM_CATALOG, (map->nRuns ? map->nRuns : 1)*sizeof(OwnerRun) );
+		OwnerMerge *merges = malloc( nThreads*sizeof(OwnerMerge) );
+		for(width = 1; width < nThreads; width *= 2) {
+			int nMerges = 0;
+			for(t = 0; t < nThreads; t += 2*width) {
+				OwnerMerge *merge = &merges[nMerges++];
+				merge->from = from;
+				merge->to = to;
+				merge->first = bounds[t];
+				merge->middle = bounds[t+width < nThreads ? t+width : nThreads];
+				merge->last = bounds[t+2*width < nThreads ? t+2*width : nThreads];
+				pthread_create(&threads[nMerges-1], NULL, mergeOwnerRuns, merge);
+			}
+			for(t = 0; t < nMerges; t++) {
+				pthread_join(threads[t], NULL);
+			}
+			OwnerRun *swap = from;
+			from = to;
+			to = swap;
+		}
+		memFree(to);
+		map->runs = from;
+		free(merges);
+	}
+
+	map->crossLinked = 0;
+	for(i = 1; i < map->nRuns; i++) {
+		if(map->runs[i].lcn < map->runs[i-1].lcn + map->runs[i-1].length) {
+			map->crossLinked++;
+		}
+	}
+	computeOwnerReach(map);
+	free(threads);
+	free(bounds);
+	free(slices);
+	memFree(fileArray);
+}
+
+void freeClusterMap(ClusterMap *map) {
+	memFree(map->runs);
+	memFree(map->reach);
+	map->runs = NULL;
+	map->reach = NULL;
+	map->nRuns = 0;
+}
+
+/**
+ * Returns the index of the first run starting after lcn.
+ */
+uint64_t ownerUpperBound(ClusterMap *map, uint64_t lcn) {
+	uint64_t low = 0, high = map->nRuns;
+	while(low < high) {
+		uint64_t mid = low + (high - low)/2;
+		if(map->runs[mid].lcn <= lcn) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/**
+ * Returns the index of the first run whose reach is past lcn: no run before it holds lcn
+ * or any cluster after it.
+ */
+uint64_t ownerReachBound(ClusterMap *map, uint64_t lcn) {
+	uint64_t low = 0, high = map->nRuns;
+	while(low < high) {
+		uint64_t mid = low + (high - low)/2;
+		if(map->reach[mid] <= lcn) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/**
+ * Returns the first run holding cluster lcn, in order, or NULL if no file in use owns it.
+ * Others holding it too, if it is cross-linked, are among findClusterOwners(map, lcn, 1, ..).
+ */
+OwnerRun *findClusterOwner(ClusterMap *map, uint64_t lcn) {
+	uint64_t i, last = ownerUpperBound(map, lcn);
+	for(i = ownerReachBound(map, lcn); i < last; i++) {
+		if(lcn - map->runs[i].lcn < map->runs[i].length) {
+			return &map->runs[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Returns the first of the runs which may hold any of the count clusters from lcn, in
+ * order, setting *nOwners to their number. Every run holding one is among them, but with
+ * cross-linked runs some of them may end before lcn, so callers clip each to the range.
+ */
+OwnerRun *findClusterOwners(ClusterMap *map, uint64_t lcn, uint64_t count, uint64_t *nOwners) {
+	uint64_t first = ownerReachBound(map, lcn);
+	uint64_t last = count ? ownerUpperBound(map, lcn + count - 1) : first;
+	*nOwners = last > first ? last - first : 0;
+	return map->runs + first;
+}
+
+/**
+ * Writes map to path. Returns 0, or -1 if it cannot be written.
+ */
+int saveClusterMap(ClusterMap *map, char *path) {
+	ClusterMapHeader header;
+	FILE *out;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CLUSTER_MAP_MAGIC, sizeof(header.magic));
+	header.key = map->key;
+	header.nRuns = map->nRuns;
+	header.crossLinked = map->crossLinked;
+	if((out = fopen(path, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create cluster map %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	if(fwrite(&header, sizeof(header), 1, out) != 1 ||
+	   (map->nRuns && fwrite(map->runs, sizeof(OwnerRun), map->nRuns, out) != map->nRuns)) {
+		int errsv = errno;
+		printf("Failed to write cluster map %s: %s.\n", path, strerror(errsv));
+		fclose(out);
+		return -1;
+	}
+	if(fclose(out) != 0) {
+		int errsv = errno;
+		printf("Failed to write cluster map %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Reads the map saved at path into map if it was built from the catalog with key.
+ * Returns 0, or -1 if there is no such map.
+ *
+ * WARNING: Memory is allocated for the runs, need to freeClusterMap(..) the map.
+ */
+int loadClusterMap(char *path, uint64_t key, ClusterMap *map) {
+	ClusterMapHeader header;
+	FILE *in;
+	if((in = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, CLUSTER_MAP_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.key != key) {
+		fclose(in);
+		return -1;
+	}
+	map->key = key;
+	map->nRuns = header.nRuns;
+	map->crossLinked = header.crossLinked;
+	map->runs = memAlloc( MEM_CATALOG, (map->nRuns ? map->nRuns : 1)*sizeof(OwnerRun) );
+	if(map->nRuns && fread(map->runs, sizeof(OwnerRun), map->nRuns, in) != map->nRuns) {
+		printf("Cluster map %s is truncated, rebuilding it.\n", path);
+		map->reach = NULL;
+		freeClusterMap(map);
+		fclose(in);
+		return -1;
+	}
+	fclose(in);
+	computeOwnerReach(map);
+	return 0;
+}
+
+#endif /* CLUSTERMAP_H_ */
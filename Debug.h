@@ -1,5 +1,27 @@
+/*
+ * Debug.h
+ *
+ * Debug output, built in with -DNTFS_DEBUG=1 (and -DNTFS_VERBOSE=1 for raw dumps).
+ * Otherwise the compiler drops it, arguments are still type checked.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
 #ifndef DEBUG_H
 #define DEBUG_H
-	static const uint8_t DEBUG = 0;
-	static const uint8_t VERBOSE = 0;
+
+#ifndef NTFS_DEBUG
+#define NTFS_DEBUG 0
+#endif
+#ifndef NTFS_VERBOSE
+#define NTFS_VERBOSE 0
+#endif
+
+	static const uint8_t DEBUG = NTFS_DEBUG;
+	static const uint8_t VERBOSE = NTFS_VERBOSE;
+
+#define DEBUG_PRINT(...)	do { if(NTFS_DEBUG) printf(__VA_ARGS__); } while(0)
+#define VERBOSE_PRINT(...)	do { if(NTFS_DEBUG && NTFS_VERBOSE) printf(__VA_ARGS__); } while(0)
+
 #endif
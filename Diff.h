@@ -0,0 +1,329 @@
+/*
+ * Diff.h
+ *
+ * Comparison of the MFT against a baseline copy of it taken earlier. The records of both
+ * copies are aligned by record number and compared by threads in contiguous ranges: the
+ * LSN and sequence number of the headers first, then the whole record with memcmp(..),
+ * which the C library does a vector at a time. Only the records which differ are decoded,
+ * from the baseline (the current ones are in the catalog already), and classified as
+ * created, deleted, renamed, moved, resized or with changed timestamps.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "MFTRecord.h"
+#include "Memory.h"
+#include "Trace.h"
+
+#ifndef DIFF_H_
+#define DIFF_H_
+
+#define DIFF_TIMES 4	/*Of $STANDARD_INFORMATION: created, altered, MFT changed, read */
+
+static const char *diffTimeNames[DIFF_TIMES] = { "created", "modified", "mft changed", "accessed" };
+
+/* Changes found in a record, as bits */
+#define DIFF_CREATED	0x01
+#define DIFF_DELETED	0x02
+#define DIFF_RENAMED	0x04
+#define DIFF_MOVED		0x08
+#define DIFF_RESIZED	0x10
+#define DIFF_TIMESTAMPS	0x20
+#define DIFF_OTHER		0x40	/*Differs in nothing classified, another attribute say */
+
+/* The base FILE records of a copy, by record number */
+typedef struct _RecordSlots {
+	char **records;		/*NULL where the copy has no such record */
+	uint32_t nRecords;
+} RecordSlots;
+
+/* A range of record numbers compared by one thread */
+typedef struct _DiffRange {
+	RecordSlots *baseline, *current;
+	uint32_t first, last;	/*Records first to last-1 */
+	uint8_t *differs;		/*Set for each record which differs, the whole array */
+	uint32_t nDiffering;
+} DiffRange;
+
+/**
+ * Fills slots with the base FILE records of copy, by the record number in their headers.
+ *
+ * WARNING: Memory is allocated for the slots, need to memFree(slots->records)
+ */
+void indexCopiedRecords(MFTCopy *copy, RecordSlots *slots) {
+	uint64_t slot;
+	slots->nRecords = 0;
+	for(slot = 0; slot < copy->nSlots; slot++) {
+		NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)(copy->records + slot*MFT_RECORD_LENGTH);
+		if(isFileRecord((char *)header) && header->dwMFTRecNumber >= slots->nRecords) {
+			slots->nRecords = header->dwMFTRecNumber + 1;
+		}
+	}
+	slots->records = memCalloc( MEM_CATALOG, slots->nRecords ? slots->nRecords : 1, sizeof(char *) );
+	for(slot = 0; slot < copy->nSlots; slot++) {
+		char *record = copy->records + slot*MFT_RECORD_LENGTH;
+		NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+		if(isFileRecord(record) && header->n64BaseMftRec == 0 && !slots->records[header->dwMFTRecNumber]) {
+			slots->records[header->dwMFTRecNumber] = record;
+		}
+	}
+}
+
+char *slotRecord(RecordSlots *slots, uint32_t recordNumber) {
+	return recordNumber < slots->nRecords ? slots->records[recordNumber] : NULL;
+}
+
+/**
+ * Compares the records of a range of both copies, applying the fixups of the baseline on
+ * the way (those of the current copy were applied by the scan).
+ */
+void *compareRange(void *arg) {
+	DiffRange *range = arg;
+	uint32_t r;
+	uint64_t traceStartNs = traceStart();
+	traceThreadName("diff");
+	for(r = range->first; r < range->last; r++) {
+		char *before = slotRecord(range->baseline, r), *after = slotRecord(range->current, r);
+		if(!before && !after) {
+			continue;
+		}
+		if(before) {
+			applyFixup(before, MFT_RECORD_LENGTH);
+		}
+		if(before && after) {
+			NTFS_MFT_FILE_ENTRY_HEADER *headerBefore = (NTFS_MFT_FILE_ENTRY_HEADER *)before;
+			NTFS_MFT_FILE_ENTRY_HEADER *headerAfter = (NTFS_MFT_FILE_ENTRY_HEADER *)after;
+			if(headerBefore->n64LogSeqNumber == headerAfter->n64LogSeqNumber &&
+			   headerBefore->wSequence == headerAfter->wSequence &&
+			   memcmp(before, after, MFT_RECORD_LENGTH) == 0) {
+				continue;
+			}
+		}
+		range->differs[r] = 1;
+		range->nDiffering++;
+	}
+	traceSpan("compare", "diff", traceStartNs, "first", range->first, "records", range->last - range->first);
+	return NULL;
+}
+
+/**
+ * Copies the times of the $STANDARD_INFORMATION of record into times, in the order of
+ * diffTimeNames. Returns false if it has none.
+ */
+bool readStandardTimes(char *record, uint64_t *times) {
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	uint32_t attrOffset = header->wAttribOffset;
+	while(attrOffset + sizeof(NTFS_ATTRIBUTE) <= MFT_RECORD_LENGTH && attrOffset + 8 < header->dwRecLength) {
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record + attrOffset);
+		if(attr->dwFullLength == 0 || attr->dwFullLength > MFT_RECORD_LENGTH - attrOffset) {
+			return false;
+		}
+		if(attr->dwType == STANDARD_INFORMATION) {
+			if(attr->uchNonResFlag || attr->Attr.Resident.dwLength < 4*sizeof(uint64_t) ||
+			   attr->Attr.Resident.wAttrOffset + 4*sizeof(uint64_t) > attr->dwFullLength) {
+				return false;
+			}
+			STD_INFORMATION *info = (STD_INFORMATION *)(record + attrOffset + attr->Attr.Resident.wAttrOffset);
+			times[0] = info->fileCreateTime;
+			times[1] = info->fileAltTime;
+			times[2] = info->mftChangeTime;
+			times[3] = info->fileReadTime;
+			return true;
+		}
+		attrOffset += attr->dwFullLength;
+	}
+	return false;
+}
+
+/**
+ * Returns the file record recordNumber of the baseline held, decoding it into byRecord
+ * the first time it is wanted, or NULL if the baseline has no such record.
+ */
+File *decodeBaseline(RecordSlots *baseline, File **byRecord, uint32_t recordNumber) {
+	ScanCounters counters = { 0 };
+	char *record = slotRecord(baseline, recordNumber);
+	if(!record) {
+		return NULL;
+	}
+	if(!byRecord[recordNumber]) {
+		byRecord[recordNumber] = parseFileRecord(NULL, record, 0, &counters);
+	}
+	return byRecord[recordNumber];
+}
+
+/**
+ * Writes the path file had in the baseline into path (size bytes), decoding its parents
+ * from the baseline as far as they are not decoded yet.
+ */
+void pathInBaseline(RecordSlots *baseline, File **byRecord, File *file, char *path, size_t size) {
+	File *current = file;
+	int depth;
+	for(depth = 0; depth < MAX_PATH_DEPTH && current && current->recordNumber != ROOT_RECORD; depth++) {
+		uint64_t parent = current->parentReference & FILE_REFERENCE_RECORD;
+		current = parent < baseline->nRecords ? decodeBaseline(baseline, byRecord, parent) : NULL;
+	}
+	if(filePath(byRecord, baseline->nRecords, file, path, size) == 0) {
+		snprintf(path, size, "/");
+	}
+}
+
+/**
+ * Returns the changes between file as it was (before) and as it is (after), either of
+ * which may be NULL or not in use, and the times of their $STANDARD_INFORMATION.
+ */
+uint8_t classifyChanges(File *before, File *after, uint64_t *timesBefore, uint64_t *timesAfter, bool timed) {
+	bool wasInUse = before && (before->recordFlags & IN_USE);
+	bool isInUse = after && (after->recordFlags & IN_USE);
+	uint8_t changes = 0;
+	if(!wasInUse && !isInUse) {
+		return 0;	/*Only the remains of deleted files changed */
+	}
+	if(!wasInUse) {
+		return DIFF_CREATED;
+	}
+	if(!isInUse) {
+		return DIFF_DELETED;
+	}
+	if(before->sequence != after->sequence) {
+		return DIFF_DELETED | DIFF_CREATED;	/*The record was reused */
+	}
+	if((before->fileName || after->fileName) &&
+	   (!before->fileName || !after->fileName || strcmp(before->fileName, after->fileName) != 0)) {
+		changes |= DIFF_RENAMED;
+	}
+	if((before->parentReference & FILE_REFERENCE_RECORD) != (after->parentReference & FILE_REFERENCE_RECORD)) {
+		changes |= DIFF_MOVED;
+	}
+	if(before->realSize != after->realSize) {
+		changes |= DIFF_RESIZED;
+	}
+	if(timed && memcmp(timesBefore, timesAfter, DIFF_TIMES*sizeof(uint64_t)) != 0) {
+		changes |= DIFF_TIMESTAMPS;
+	}
+	return changes ? changes : DIFF_OTHER;
+}
+
+/**
+ * Compares the catalog of the current MFT copy, scanned into files, with the MFT copy at
+ * baselinePath, taken earlier, with nThreads threads, and prints a line for each file
+ * created, deleted, renamed, moved, resized or with changed timestamps since.
+ * Returns 0, or -1 if the baseline cannot be opened.
+ */
+int diffMFTCopies(File *files, MFTCopy *copy, char *baselinePath, int nThreads) {
+	MFTCopy baselineCopy;
+	RecordSlots baseline, current;
+	uint32_t nRecords, nCurrentRecords, r, counts[7] = { 0 };
+	uint32_t nDiffering = 0;
+	int t, c;
+	char path[MAX_PATH_LENGTH], oldPath[MAX_PATH_LENGTH];
+	uint64_t startNs = traceStart();
+
+	if(openMFTCopy(baselinePath, &baselineCopy) != 0) {
+		return -1;
+	}
+	indexCopiedRecords(&baselineCopy, &baseline);
+	indexCopiedRecords(copy, &current);
+	nRecords = baseline.nRecords > current.nRecords ? baseline.nRecords : current.nRecords;
+
+	/*Compare in parallel, over contiguous ranges of record numbers */
+	uint8_t *differs = memCalloc( MEM_CATALOG, nRecords ? nRecords : 1, 1 );
+	DiffRange *ranges = calloc( nThreads, sizeof(DiffRange) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	for(t = 0; t < nThreads; t++) {
+		ranges[t].baseline = &baseline;
+		ranges[t].current = &current;
+		ranges[t].first = (uint64_t)nRecords*t/nThreads;
+		ranges[t].last = (uint64_t)nRecords*(t+1)/nThreads;
+		ranges[t].differs = differs;
+		pthread_create(&threads[t], NULL, compareRange, &ranges[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		nDiffering += ranges[t].nDiffering;
+	}
+	free(threads);
+	free(ranges);
+
+	/*Decode only the records which differ */
+	File **byRecord = indexRecords(files, &nCurrentRecords);
+	File **baselineByRecord = memCalloc( MEM_CATALOG, baseline.nRecords ? baseline.nRecords : 1, sizeof(File *) );
+	for(r = 0; r < nRecords; r++) {
+		uint64_t timesBefore[DIFF_TIMES], timesAfter[DIFF_TIMES];
+		if(!differs[r]) {
+			continue;
+		}
+		File *before = decodeBaseline(&baseline, baselineByRecord, r);
+		File *after = r < nCurrentRecords ? byRecord[r] : NULL;
+		bool timed = slotRecord(&baseline, r) && slotRecord(&current, r) &&
+					 readStandardTimes(slotRecord(&baseline, r), timesBefore) &&
+					 readStandardTimes(slotRecord(&current, r), timesAfter);
+		uint8_t changes = classifyChanges(before, after, timesBefore, timesAfter, timed);
+		if(!changes) {
+			continue;
+		}
+		for(c = 0; c < 7; c++) {
+			counts[c] += (changes >> c) & 1;
+		}
+		if(changes & DIFF_DELETED) {
+			pathInBaseline(&baseline, baselineByRecord, before, oldPath, sizeof(oldPath));
+			printf("deleted\trecord %u %s\n", r, oldPath);
+		}
+		if(!(changes & ~DIFF_DELETED)) {
+			continue;
+		}
+		if(filePath(byRecord, nCurrentRecords, after, path, sizeof(path)) == 0) {
+			snprintf(path, sizeof(path), "/");
+		}
+		if(changes & DIFF_CREATED) {
+			printf("created\trecord %u %s\n", r, path);
+		}
+		if(changes & DIFF_RENAMED) {
+			printf("renamed\trecord %u %s (was %s)\n", r, path, before->fileName ? before->fileName : "no name");
+		}
+		if(changes & DIFF_MOVED) {
+			pathInBaseline(&baseline, baselineByRecord, before, oldPath, sizeof(oldPath));
+			printf("moved\trecord %u %s (was %s)\n", r, path, oldPath);
+		}
+		if(changes & DIFF_RESIZED) {
+			printf("resized\trecord %u %s %" PRIu64 " -> %" PRIu64 " bytes\n", r, path, before->realSize, after->realSize);
+		}
+		if(changes & DIFF_TIMESTAMPS) {
+			int k;
+			printf("times\trecord %u %s", r, path);
+			for(k = 0; k < DIFF_TIMES; k++) {
+				if(timesBefore[k] != timesAfter[k]) {
+					printf(" %s", diffTimeNames[k]);
+				}
+			}
+			printf("\n");
+		}
+		if(changes & DIFF_OTHER) {
+			printf("changed\trecord %u %s\n", r, path);
+		}
+	}
+	printf("%u of %u records differ from %s: %u created, %u deleted, %u renamed, %u moved, %u resized, "
+		   "%u with new timestamps, %u otherwise changed.\n",
+		   nDiffering, nRecords, baselinePath, counts[0], counts[1], counts[2], counts[3], counts[4], counts[5], counts[6]);
+	traceSpan("diff", "diff", startNs, "records", nRecords, "differing", nDiffering);
+
+	for(r = 0; r < baseline.nRecords; r++) {
+		freeFiles(baselineByRecord[r]);	/*Each decoded on its own */
+	}
+	memFree(baselineByRecord);
+	memFree(byRecord);
+	memFree(differs);
+	memFree(baseline.records);
+	memFree(current.records);
+	closeMFTCopy(&baselineCopy);
+	return 0;
+}
+
+#endif /* DIFF_H_ */
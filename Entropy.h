@@ -0,0 +1,285 @@
+/*
+ * Entropy.h
+ *
+ * Triage of files which look encrypted, without extracting them. The entropy sink counts
+ * the bytes of each file, or of its first bytes, into a byte histogram as they stream, and
+ * from it works out the Shannon entropy and the chi-square against a uniform histogram.
+ * Encrypted content has an entropy close to 8 bits per byte and a chi-square close to its
+ * 255 degrees of freedom; compressed content has a high entropy too, but a chi-square far
+ * above. Both are kept in the entropy and chiSquare columns of the catalog, and saved next
+ * to the MFT copy for top to rank files by.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include "FileLUT.h"
+#include "Sink.h"
+#include "Trace.h"
+#include "Memory.h"
+
+#ifndef ENTROPY_H_
+#define ENTROPY_H_
+
+#define ENTROPY_LANES 4					/*Sub-histograms counted into in turn */
+#define ENTROPY_ENCRYPTED_BITS 7.9		/*Bits per byte from which content may be encrypted */
+#define ENTROPY_CHI_SQUARE_LIMIT 330.0	/*Exceeded by 1 in 1000 random files, at 255 degrees of freedom */
+#define ENTROPY_MIN_BYTES 4096			/*Fewer bytes do not tell encrypted content from compressed */
+#define ENTROPY_COLUMNS_MAGIC "NTFSENT1"
+#define ENTROPY_COLUMNS_SUFFIX ".entropy"
+
+/* A pass of the entropy sinks, shared by them, its totals added atomically */
+typedef struct _EntropyRun {
+	uint64_t limit;			/*Bytes measured from the start of each file, 0 for all */
+	uint64_t nFiles;
+	uint64_t nBytes;
+	uint64_t nFlagged;		/*Files which look encrypted */
+	uint64_t histogramNs;	/*Spent counting bytes, over all threads */
+} EntropyRun;
+
+typedef struct _EntropyCtx {
+	EntropyRun *run;
+	uint64_t counts[256];
+	uint64_t nBytes;
+	uint64_t histogramNs;
+} EntropyCtx;
+
+/* The columns saved for each record, -1 where it was not measured */
+typedef struct _EntropyColumn {
+	float entropy;
+	float chiSquare;
+} EntropyColumn;
+
+typedef struct _EntropyColumnsHeader {
+	char magic[8];
+	uint64_t key;		/*mftCopyKey(..) of the MFT copy the catalog was scanned from */
+	uint64_t limit;		/*As in EntropyRun */
+	uint32_t nRecords;
+	uint32_t reserved;
+} EntropyColumnsHeader;
+
+/**
+ * Adds the bytes of data to counts. A word of 8 bytes is loaded at a time and its bytes
+ * are counted into ENTROPY_LANES sub-histograms in turn, so that runs of the same byte do
+ * not make each increment wait for the store of the one before; the sub-histograms are
+ * summed at the end, a loop the compiler vectorises. Each lane counts a quarter of length
+ * at most in 32 bits, so length must stay under 16GB (sinks get a few MB at a time).
+ */
+void countBytes(uint64_t *counts, const uint8_t *data, size_t length) {
+	uint32_t lanes[ENTROPY_LANES][256];
+	size_t i = 0;
+	int b;
+	memset(lanes, 0, sizeof(lanes));
+	for(; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		lanes[0][word & 0xFF]++;
+		lanes[1][(word >> 8) & 0xFF]++;
+		lanes[2][(word >> 16) & 0xFF]++;
+		lanes[3][(word >> 24) & 0xFF]++;
+		lanes[0][(word >> 32) & 0xFF]++;
+		lanes[1][(word >> 40) & 0xFF]++;
+		lanes[2][(word >> 48) & 0xFF]++;
+		lanes[3][word >> 56]++;
+	}
+	for(; i < length; i++) {
+		lanes[0][data[i]]++;
+	}
+	for(b = 0; b < 256; b++) {
+		counts[b] += (uint64_t)lanes[0][b] + lanes[1][b] + lanes[2][b] + lanes[3][b];
+	}
+}
+
+/**
+ * Returns the Shannon entropy of the histogram counts of n bytes in bits per byte, from
+ * log2(n) - sum(c*log2(c))/n, 0 for no bytes.
+ */
+double shannonEntropy(uint64_t *counts, uint64_t n) {
+	double sum = 0;
+	int b;
+	if(n == 0) {
+		return 0;
+	}
+	for(b = 0; b < 256; b++) {
+		if(counts[b]) {
+			sum += counts[b]*log2((double)counts[b]);
+		}
+	}
+	return log2((double)n) - sum/n;
+}
+
+/**
+ * Returns the chi-square of the histogram counts of n bytes against a uniform one, 0 for
+ * no bytes.
+ */
+double chiSquare(uint64_t *counts, uint64_t n) {
+	double expected = n/256.0, sum = 0;
+	int b;
+	if(n == 0) {
+		return 0;
+	}
+	for(b = 0; b < 256; b++) {
+		double difference = counts[b] - expected;
+		sum += difference*difference;
+	}
+	return sum/expected;
+}
+
+/**
+ * Returns true if content of nBytes with entropy and chiSquare looks encrypted: as random
+ * as a random file would be, over enough bytes to tell.
+ */
+bool looksEncrypted(double entropy, double chiSquare, uint64_t nBytes) {
+	return nBytes >= ENTROPY_MIN_BYTES && entropy >= ENTROPY_ENCRYPTED_BITS && chiSquare < ENTROPY_CHI_SQUARE_LIMIT;
+}
+
+/*------------------------------------ Entropy sink ------------------------------------*/
+
+int entropyBegin(void *ctx, File *file) {
+	EntropyCtx *entropy = ctx;
+	memset(entropy->counts, 0, sizeof(entropy->counts));
+	entropy->nBytes = 0;
+	entropy->histogramNs = 0;
+	return 0;
+}
+
+int entropyWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	EntropyCtx *entropy = ctx;
+	uint64_t limit = entropy->run->limit;
+	if(limit && fileOffset + length > limit) {
+		length = fileOffset < limit ? limit - fileOffset : 0;	/*A sweep hands on whole files */
+	}
+	uint64_t startNs = traceClock();
+	countBytes(entropy->counts, (uint8_t *)data, length);
+	entropy->histogramNs += traceClock() - startNs;
+	entropy->nBytes += length;
+	return 0;
+}
+
+/**
+ * Fills the columns of file from its histogram and prints them: entropy, chi-square,
+ * bytes measured, record number and name, marked if it looks encrypted.
+ */
+int entropyEnd(void *ctx, File *file) {
+	EntropyCtx *entropy = ctx;
+	EntropyRun *run = entropy->run;
+	file->entropy = shannonEntropy(entropy->counts, entropy->nBytes);
+	file->chiSquare = chiSquare(entropy->counts, entropy->nBytes);
+	bool encrypted = looksEncrypted(file->entropy, file->chiSquare, entropy->nBytes);
+	printf("%.4f  %.1f  %" PRIu64 "  %u  %s%s\n", file->entropy, file->chiSquare, entropy->nBytes,
+		   file->recordNumber, file->fileName ? file->fileName : "", encrypted ? "  encrypted?" : "");
+	__sync_fetch_and_add(&run->nFiles, 1);
+	__sync_fetch_and_add(&run->nBytes, entropy->nBytes);
+	__sync_fetch_and_add(&run->histogramNs, entropy->histogramNs);
+	if(encrypted) {
+		__sync_fetch_and_add(&run->nFlagged, 1);
+	}
+	return 0;
+}
+
+/**
+ * Returns a sink measuring the entropy of each file, or of its first run->limit bytes,
+ * into the catalog columns.
+ */
+Sink createEntropySink(EntropyRun *run) {
+	EntropyCtx *entropy = malloc( sizeof(EntropyCtx) );
+	entropy->run = run;
+	Sink sink = { entropyBegin, entropyWrite, entropyEnd, entropy, run->limit };
+	return sink;
+}
+
+/**
+ * Prints the totals of run: the files measured and flagged, and the rate of counting.
+ */
+void printEntropyReport(EntropyRun *run) {
+	double seconds = run->histogramNs / 1e9;
+	printf("%" PRIu64 " files measured, %" PRIu64 " look encrypted (entropy from %.1f bits per byte, chi-square "
+		   "under %.0f).\n", run->nFiles, run->nFlagged, ENTROPY_ENCRYPTED_BITS, ENTROPY_CHI_SQUARE_LIMIT);
+	printf("%.1f MB counted into histograms, %.0f MB/s per thread.\n", run->nBytes/1e6,
+		   seconds > 0 ? run->nBytes/1e6/seconds : 0);
+}
+
+/*---------------------------------- Catalog columns ----------------------------------*/
+
+/**
+ * Writes the entropy columns of the files in byRecord (as returned by indexRecords(..))
+ * to path, with key and the limit they were measured up to.
+ * Returns 0, or -1 if they cannot be written.
+ */
+int saveEntropyColumns(File **byRecord, uint32_t nRecords, uint64_t key, uint64_t limit, char *path) {
+	EntropyColumnsHeader header;
+	FILE *out;
+	uint32_t r;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, ENTROPY_COLUMNS_MAGIC, sizeof(header.magic));
+	header.key = key;
+	header.limit = limit;
+	header.nRecords = nRecords;
+	EntropyColumn *columns = memAlloc( MEM_CATALOG, (nRecords ? nRecords : 1)*sizeof(EntropyColumn) );
+	for(r = 0; r < nRecords; r++) {
+		columns[r].entropy = byRecord[r] ? byRecord[r]->entropy : -1;
+		columns[r].chiSquare = byRecord[r] ? byRecord[r]->chiSquare : -1;
+	}
+	if((out = fopen(path, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create entropy columns %s: %s.\n", path, strerror(errsv));
+		memFree(columns);
+		return -1;
+	}
+	bool written = fwrite(&header, sizeof(header), 1, out) == 1 &&
+				   (nRecords == 0 || fwrite(columns, sizeof(EntropyColumn), nRecords, out) == nRecords);
+	int errsv = errno;
+	if(fclose(out) != 0 && written) {
+		errsv = errno;
+		written = false;
+	}
+	memFree(columns);
+	if(!written) {
+		printf("Failed to write entropy columns %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Fills the entropy columns of the files in byRecord from path, if they were saved for
+ * the catalog with key, and sets *limit to the bytes of each file they measured.
+ * Returns 0, or -1 if there are no such columns.
+ */
+int loadEntropyColumns(File **byRecord, uint32_t nRecords, uint64_t key, char *path, uint64_t *limit) {
+	EntropyColumnsHeader header;
+	FILE *in;
+	uint32_t r;
+	if((in = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	if(fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, ENTROPY_COLUMNS_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.key != key || header.nRecords != nRecords) {
+		fclose(in);
+		return -1;
+	}
+	EntropyColumn *columns = memAlloc( MEM_CATALOG, (nRecords ? nRecords : 1)*sizeof(EntropyColumn) );
+	if(nRecords && fread(columns, sizeof(EntropyColumn), nRecords, in) != nRecords) {
+		printf("Entropy columns %s are truncated.\n", path);
+		memFree(columns);
+		fclose(in);
+		return -1;
+	}
+	fclose(in);
+	for(r = 0; r < nRecords; r++) {
+		if(byRecord[r]) {
+			byRecord[r]->entropy = columns[r].entropy;
+			byRecord[r]->chiSquare = columns[r].chiSquare;
+		}
+	}
+	*limit = header.limit;
+	memFree(columns);
+	return 0;
+}
+
+#endif /* ENTROPY_H_ */
@@ -0,0 +1,374 @@
+/*
+ * ErrorMap.h
+ *
+ * Reads which carry on past unreadable sectors. A read failing with EIO is retried in
+ * halves down to ERROR_SKIP_BYTES, and the piece still failing is zero filled and skipped
+ * rather than retried, so a failing disk costs a few failed reads per bad region instead
+ * of minutes of retries per sector. The regions skipped are kept in an error map, sorted
+ * by offset, which is saved between runs so known bad regions are not read again. A retry
+ * pass revisits the regions skipped sector by sector, dropping from the map whatever can
+ * now be read and marking the rest unreadable. What it reads can be written into a copy of
+ * the device, an image, in place of the zeros; what cannot be is kept in the map as
+ * unpatched, so the map saved with the image still tells where it holds zeros.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "Stats.h"
+#include "Memory.h"
+
+#ifndef ERRORMAP_H_
+#define ERRORMAP_H_
+
+#define ERROR_SECTOR 512				/*Smallest read retried */
+#define ERROR_SKIP_BYTES (64*1024)		/*Reads are not shrunk below this, it is skipped whole */
+#define ERROR_MAP_SUFFIX ".errors"		/*Appended to the name of the device */
+#define ERROR_MAP_HEADER "# RawNTFSExtraction error map: offset length state attempts\n"
+
+typedef enum _BadState {
+	BAD_SKIPPED,		/*Failed once and skipped, not retried yet */
+	BAD_UNREADABLE,		/*Still failing after the retries of a retry pass */
+	BAD_UNPATCHED		/*Read by a retry pass, but still zero filled in the image */
+} BadState;
+
+static const char *badStateNames[] = { "skipped", "unreadable", "unpatched" };
+
+/* Bytes offset to offset+length-1 on the device could not be read */
+typedef struct _BadRegion {
+	uint64_t offset;
+	uint64_t length;
+	BadState state;
+	uint32_t attempts;		/*Reads retried over the region by retry passes */
+} BadRegion;
+
+typedef struct _ErrorMap {
+	BadRegion *regions;		/*Sorted by offset, neither overlapping nor adjacent */
+	uint64_t nRegions, capacity;
+	uint64_t bytesSkipped;	/*Zero filled by reads of this run */
+	uint64_t nLoaded;		/*Regions loaded from a previous run */
+	pthread_mutex_t lock;
+} ErrorMap;
+
+void initErrorMap(ErrorMap *map) {
+	memset(map, 0, sizeof(ErrorMap));
+	pthread_mutex_init(&map->lock, NULL);
+}
+
+void freeErrorMap(ErrorMap *map) {
+	memFree(map->regions);
+	pthread_mutex_destroy(&map->lock);
+	memset(map, 0, sizeof(ErrorMap));
+}
+
+/**
+ * Returns the index of the first region of map ending after offset.
+ * Must be called holding map->lock.
+ */
+uint64_t badRegionAfter(ErrorMap *map, uint64_t offset) {
+	uint64_t low = 0, high = map->nRegions;
+	while(low < high) {
+		uint64_t mid = low + (high - low)/2;
+		if(map->regions[mid].offset + map->regions[mid].length <= offset) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/**
+ * Adds length bytes from offset to map in state, merging them with the regions they
+ * overlap or touch (a merged region is unreadable only if all of it is, and unpatched
+ * only if all of it is).
+ */
+void addBadRegion(ErrorMap *map, uint64_t offset, uint64_t length, BadState state, uint32_t attempts) {
+	uint64_t first, last, end = offset + length;
+	if(length == 0) {
+		return;
+	}
+	pthread_mutex_lock(&map->lock);
+	first = badRegionAfter(map, offset > 0 ? offset - 1 : 0);
+	for(last = first; last < map->nRegions && map->regions[last].offset <= end; last++) {
+		BadRegion *region = &map->regions[last];
+		if(region->offset < offset) {
+			offset = region->offset;
+		}
+		if(region->offset + region->length > end) {
+			end = region->offset + region->length;
+		}
+		if(region->state != state) {
+			state = BAD_SKIPPED;
+		}
+		if(region->attempts > attempts) {
+			attempts = region->attempts;
+		}
+	}
+	if(last == first) {	/*Nothing merged, make room for it */
+		if(map->nRegions == map->capacity) {
+			map->capacity = map->capacity ? 2*map->capacity : 64;
+			map->regions = memRealloc( MEM_METADATA, map->regions, map->capacity*sizeof(BadRegion) );
+		}
+		memmove(&map->regions[first+1], &map->regions[first], (map->nRegions - first)*sizeof(BadRegion));
+		map->nRegions++;
+	} else {			/*Merged into the first, drop the others */
+		memmove(&map->regions[first+1], &map->regions[last], (map->nRegions - last)*sizeof(BadRegion));
+		map->nRegions -= last - first - 1;
+	}
+	map->regions[first] = (BadRegion){ offset, end - offset, state, attempts };
+	pthread_mutex_unlock(&map->lock);
+}
+
+/**
+ * Finds the first bad region of map ending after offset, copying its bounds to *start and
+ * *end. Returns false if there is none.
+ */
+bool nextBadRegion(ErrorMap *map, uint64_t offset, uint64_t *start, uint64_t *end) {
+	bool found = false;
+	pthread_mutex_lock(&map->lock);
+	uint64_t i = badRegionAfter(map, offset);
+	if(i < map->nRegions) {
+		*start = map->regions[i].offset;
+		*end = map->regions[i].offset + map->regions[i].length;
+		found = true;
+	}
+	pthread_mutex_unlock(&map->lock);
+	return found;
+}
+
+/**
+ * Returns whether a read failed for want of the medium, rather than a bad request.
+ */
+bool isMediaError(int error) {
+	return error == EIO || error == ENXIO;
+}
+
+/**
+ * Reads from pos, of up to size bytes, after a read there failed: the read is halved
+ * until a piece of it succeeds, or it is no larger than ERROR_SKIP_BYTES and still fails.
+ * Returns the bytes read, 0 if the piece at pos is to be skipped, or -1 with errno set
+ * on a failure which is not one of the medium.
+ */
+ssize_t shrinkRead(int fd, char *dst, size_t size, uint64_t pos) {
+	while(size > ERROR_SKIP_BYTES) {
+		size = (size/2 + ERROR_SECTOR - 1) / ERROR_SECTOR * ERROR_SECTOR;
+		ssize_t n = pread(fd, dst, size, pos);
+		if(n > 0) {
+			return n;
+		}
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0 && !isMediaError(errno)) {
+			return -1;
+		}
+		if(n == 0) {
+			return 0;	/*Past the end of the device after all */
+		}
+	}
+	return 0;
+}
+
+/**
+ * Reads length bytes at offset on fd into dst, carrying on past unreadable sectors: known
+ * bad regions of errors are zero filled without being read, and a read failing with EIO
+ * is shrunk around the error, the piece still failing zero filled, skipped and added to
+ * errors. Without errors, the first failure is returned as before.
+ * Returns the bytes read or filled, less than length only at the end of the device, or
+ * -1 with errno set on a failure which is not one of the medium.
+ */
+ssize_t readTolerant(int fd, char *dst, size_t length, uint64_t offset, ErrorMap *errors) {
+	size_t done = 0;
+	while(done < length) {
+		uint64_t pos = offset + done, badStart, badEnd;
+		size_t limit = length - done;
+		if(errors && nextBadRegion(errors, pos, &badStart, &badEnd) && badStart < offset + length) {
+			if(badStart <= pos) {	/*Known bad, skip it */
+				size_t skip = (badEnd < offset + length ? badEnd : offset + length) - pos;
+				memset(dst + done, 0, skip);
+				__sync_fetch_and_add(&errors->bytesSkipped, skip);
+				STAT_ADD(STAT_BAD_BYTES, skip);
+				done += skip;
+				continue;
+			}
+			limit = badStart - pos;	/*Read up to it */
+		}
+		ssize_t n = pread(fd, dst + done, limit, pos);
+		if(n < 0 && errno == EINTR) {
+			continue;
+		}
+		if(n < 0 && errors && isMediaError(errno)) {
+			if((n = shrinkRead(fd, dst + done, limit, pos)) == 0) {
+				/*Skip to the end of the piece of ERROR_SKIP_BYTES holding pos */
+				size_t skip = ERROR_SKIP_BYTES - pos % ERROR_SKIP_BYTES;
+				skip = skip < limit ? skip : limit;
+				memset(dst + done, 0, skip);
+				addBadRegion(errors, pos, skip, BAD_SKIPPED, 0);
+				__sync_fetch_and_add(&errors->bytesSkipped, skip);
+				STAT_ADD(STAT_BAD_BYTES, skip);
+				done += skip;
+				continue;
+			}
+		}
+		if(n < 0) {
+			return -1;
+		}
+		if(n == 0) { /*End of device */
+			break;
+		}
+		done += n;
+	}
+	return done;
+}
+
+/**
+ * Revisits every region of map a sector at a time, each read up to attempts times.
+ * Sectors read are dropped from the map, those still failing are kept as unreadable.
+ * Unless patch is -1, the sectors read are also written at their offset to patch, a copy
+ * of the device, and those which cannot be are kept as unpatched. Without patch, fd is taken
+ * to be the image and regions unpatched are kept as they are. Unless recovered is
+ * NULL, the sectors read, and written to patch, are added to it as skipped: they were zero
+ * filled in what was read before.
+ * Returns the bytes recovered, or -1 on a failure which is not one of the medium.
+ */
+int64_t retryBadRegions(int fd, ErrorMap *map, uint32_t attempts, int patch, ErrorMap *recovered) {
+	char sector[ERROR_SECTOR];
+	uint64_t i, pos, nOld = map->nRegions, nRetried = 0, bytesRetried = 0, bytesUnpatched = 0;
+	int64_t bytesRecovered = 0;
+	uint32_t a;
+	BadRegion *old = map->regions;
+
+	if(nOld == 0 || attempts == 0) {
+		return 0;
+	}
+	map->regions = NULL;	/*Rebuilt from what still fails */
+	map->nRegions = map->capacity = 0;
+	for(i = 0; i < nOld; i++) {
+		uint64_t end = old[i].offset + old[i].length;
+		if(old[i].state == BAD_UNPATCHED && patch == -1) {
+			addBadRegion(map, old[i].offset, old[i].length, BAD_UNPATCHED, old[i].attempts);
+			continue;	/*Zero filled in what fd reads */
+		}
+		nRetried++;
+		bytesRetried += old[i].length;
+		for(pos = old[i].offset; pos < end; pos += ERROR_SECTOR) {
+			size_t size = end - pos < ERROR_SECTOR ? end - pos : ERROR_SECTOR;
+			ssize_t n = -1;
+			for(a = 0; a < attempts; a++) {
+				n = pread(fd, sector, size, pos);
+				if(n >= 0) {
+					break;	/*Readable, or past the end of the device */
+				} else if(errno == EINTR) {
+					a--;
+				} else if(!isMediaError(errno)) {
+					int errsv = errno;
+					printf("Failed to retry the read at offset %" PRIu64 ": %s.\n", pos, strerror(errsv));
+					memFree(old);
+					return -1;
+				}
+			}
+			if(n < 0) {
+				addBadRegion(map, pos, size, BAD_UNREADABLE, old[i].attempts + attempts);
+				continue;
+			}
+			bytesRecovered += size;
+			if(patch != -1 && n > 0 && pwrite(patch, sector, n, pos) != n) {
+				int errsv = errno;
+				printf("Failed to write the sector read at offset %" PRIu64 " to the image: %s.\n", pos, strerror(errsv));
+				addBadRegion(map, pos, size, BAD_UNPATCHED, old[i].attempts + attempts);
+				bytesUnpatched += size;
+				continue;
+			}
+			if(recovered) {
+				addBadRegion(recovered, pos, size, BAD_SKIPPED, 0);
+			}
+		}
+	}
+	printf("Retried %" PRIu64 " bytes in %" PRIu64 " bad regions %u times each: %" PRId64 " bytes now read, "
+		   "%" PRIu64 " still unreadable, %" PRIu64 " regions left in the map.\n",
+		   bytesRetried, nRetried, attempts, bytesRecovered, bytesRetried - bytesRecovered, map->nRegions);
+	if(bytesUnpatched > 0) {
+		printf("%" PRIu64 " bytes read could not be written to the image, kept in the error map as unpatched.\n",
+			   bytesUnpatched);
+	}
+	memFree(old);
+	return bytesRecovered;
+}
+
+/**
+ * Writes map to path, as text with a line per region. Regions unpatched are left out
+ * unless image is true, the map going with an image rather than the device, which can
+ * read them.
+ * Returns the number of regions written, or -1 if the map cannot be written.
+ */
+int64_t saveErrorMap(ErrorMap *map, char *path, bool image) {
+	FILE *out;
+	uint64_t i;
+	int64_t nWritten = 0;
+	if((out = fopen(path, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create error map %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	fputs(ERROR_MAP_HEADER, out);
+	for(i = 0; i < map->nRegions; i++) {
+		BadRegion *region = &map->regions[i];
+		if(region->state == BAD_UNPATCHED && !image) {
+			continue;
+		}
+		fprintf(out, "0x%012" PRIx64 " 0x%08" PRIx64 " %s %u\n",
+				region->offset, region->length, badStateNames[region->state], region->attempts);
+		nWritten++;
+	}
+	if(ferror(out) | fclose(out)) {
+		int errsv = errno;
+		printf("Failed to write error map %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	return nWritten;
+}
+
+/**
+ * Adds the regions saved at path to map. Returns 0, or -1 if there is no map at path.
+ *
+ * WARNING: Memory is allocated for the regions, need to freeErrorMap(..) the map.
+ */
+int loadErrorMap(char *path, ErrorMap *map) {
+	char line[BUFSIZ], state[16];
+	uint64_t offset, length;
+	unsigned attempts;
+	int lineNumber = 0;
+	FILE *in;
+	if((in = fopen(path, "r")) == NULL) {
+		return -1;
+	}
+	while(fgets(line, sizeof(line), in)) {
+		lineNumber++;
+		if(line[0] == '#' || line[0] == '\n') {
+			continue;
+		}
+		if(sscanf(line, "%" SCNx64 " %" SCNx64 " %15s %u", &offset, &length, state, &attempts) != 4) {
+			printf("Error map %s: line %d not understood, skipped.\n", path, lineNumber);
+			continue;
+		}
+		BadState loaded = BAD_SKIPPED;
+		if(strcmp(state, badStateNames[BAD_UNREADABLE]) == 0) {
+			loaded = BAD_UNREADABLE;
+		} else if(strcmp(state, badStateNames[BAD_UNPATCHED]) == 0) {
+			loaded = BAD_UNPATCHED;
+		}
+		addBadRegion(map, offset, length, loaded, attempts);
+		map->nLoaded++;
+	}
+	fclose(in);
+	return 0;
+}
+
+#endif /* ERRORMAP_H_ */
@@ -8,14 +8,53 @@
  * number of the corresponding MFT record.
  */
 
+#include "RunList.h"
+
 #ifndef FILELUT_H_
 #define FILELUT_H_
 
+#define ROOT_RECORD 5						/* MFT record of the root directory */
+#define EXTEND_RECORD 11					/* MFT record of $Extend, the directory of the newer metafiles */
+#define FILE_REFERENCE_RECORD 0xFFFFFFFFFFFFULL	/* Record number part of a file reference */
+#define MAX_PATH_DEPTH 256					/* Directories followed up from a file */
+#define ORPHAN_DIR "$Orphan"				/* Stands for a lost parent directory */
+
+/* An index as found in a FILE record: the $I30 of a directory, or a view index of a metafile */
+typedef struct _DirectoryIndex {
+	char *root;				/* Value of $INDEX_ROOT: index header, then the root node */
+	uint32_t rootLength;
+	DataRun *runs;			/* Run list of $INDEX_ALLOCATION, NULL if every entry is in the root */
+	uint64_t size;			/* Bytes of index blocks in $INDEX_ALLOCATION */
+	uint8_t *bitmap;		/* Value of a resident $BITMAP, a bit per index block in use, or NULL */
+	uint32_t bitmapLength;
+} DirectoryIndex;
+
+/* A reparse point, as found in the $REPARSE_POINT of a file */
+typedef struct _ReparsePoint {
+	uint32_t tag;			/* IO_REPARSE_TAG_.. */
+	char *target;			/* Substitute name of a symbolic link or mount point, with '/' between
+							   names and without the \??\ prefix, or NULL for other tags */
+	bool relative;			/* A symbolic link relative to the directory holding it */
+} ReparsePoint;
+
 /* Represents the information necessary to link file writes with file names on disk */
 typedef struct _File {
 	char *fileName;			/* File name defined in $FILE_NAME */
 	uint64_t offset;		/* Offset in clusters to the file */
 	uint32_t recordNumber;	/* MFT record number from which this originates*/
+	uint16_t recordFlags;	/* FILE record flags, IN_USE and DIRECTORY */
+	uint16_t sequence;		/* Sequence number of the record */
+	uint64_t parentReference;	/* File reference to the parent directory, in $FILE_NAME */
+	uint64_t realSize;		/* Size in bytes of the unnamed $DATA stream */
+	DataRun *runs;			/* Run list of the $DATA stream, NULL if it is resident */
+	char *residentData;		/* Content of a resident $DATA stream */
+	DirectoryIndex *index;	/* $I30 index of a directory, NULL for other files */
+	bool badFixup;			/* The fixups of the record failed, it was torn */
+	uint32_t securityId;	/* Key of its descriptor in $Secure, from $STANDARD_INFORMATION, 0 if none */
+	ReparsePoint *reparse;	/* Its reparse point, NULL for most files */
+	uint8_t *objectId;		/* GUID_LENGTH bytes of its $OBJECT_ID, NULL for most files */
+	float entropy;			/* Shannon entropy of its content in bits per byte, -1 until measured */
+	float chiSquare;		/* Chi-square of its byte histogram against a uniform one, -1 until measured */
 	struct _File *p_next;
 } File;
 
@@ -24,11 +63,24 @@ typedef struct _File {
  */
 File* addFile(File *p_head, char *fileName, uint64_t offset, uint32_t recordNumber) {
 
-	File *p_new_run = malloc( sizeof(File) );
+	File *p_new_run = memAlloc( MEM_CATALOG, sizeof(File) );
 	p_new_run->p_next = p_head;	// This item is now the head.
 	p_new_run->fileName = fileName;
 	p_new_run->offset = offset;	// Set data pointers
 	p_new_run->recordNumber = recordNumber;
+	p_new_run->recordFlags = 0;
+	p_new_run->sequence = 0;
+	p_new_run->parentReference = 0;
+	p_new_run->realSize = 0;
+	p_new_run->runs = NULL;
+	p_new_run->residentData = NULL;
+	p_new_run->index = NULL;
+	p_new_run->badFixup = false;
+	p_new_run->securityId = 0;
+	p_new_run->reparse = NULL;
+	p_new_run->objectId = NULL;
+	p_new_run->entropy = -1;
+	p_new_run->chiSquare = -1;
 
 	return (p_head = p_new_run);	// Sets the head of the list to this element.
 }
@@ -49,4 +101,174 @@ void printAllFiles(File *p_head) {
 	}
 }
 
+/*
+ * Returns true if file is an in use, regular file with content that can be streamed.
+ */
+bool hasContent(File *file) {
+	return (file->recordFlags & IN_USE) && !(file->recordFlags & DIRECTORY) &&
+		   (file->runs != NULL || file->residentData != NULL);
+}
+
+/*
+ * Returns the file with MFT record number recordNumber in the list, or NULL.
+ */
+File *findFileRecord(File *p_head, uint32_t recordNumber) {
+	for(; p_head; p_head = p_head->p_next) {
+		if(p_head->recordNumber == recordNumber) {
+			return p_head;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns the metafile in use named fileName in $Extend, such as $ObjId, or NULL. Unlike
+ * the metafiles before it, its record number is not fixed.
+ */
+File *findExtendFile(File *p_head, const char *fileName) {
+	for(; p_head; p_head = p_head->p_next) {
+		if((p_head->recordFlags & IN_USE) && p_head->fileName && strcmp(p_head->fileName, fileName) == 0 &&
+		   (p_head->parentReference & FILE_REFERENCE_RECORD) == EXTEND_RECORD) {
+			return p_head;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns an array of pointers to the files in the list, so they can be shared out among
+ * threads. Sets *nFiles to the number of files.
+ *
+ * WARNING: Memory is allocated for the array, need to memFree(..) the returned pointer.
+ */
+File **indexFiles(File *p_head, uint32_t *nFiles) {
+	File *p_current_item;
+	uint32_t n = 0;
+	for(p_current_item = p_head; p_current_item; p_current_item = p_current_item->p_next) {
+		n++;
+	}
+	File **fileArray = memAlloc( MEM_CATALOG, (n ? n : 1)*sizeof(File *) );
+	n = 0;
+	for(p_current_item = p_head; p_current_item; p_current_item = p_current_item->p_next) {
+		fileArray[n++] = p_current_item;
+	}
+	*nFiles = n;
+	return fileArray;
+}
+
+/*
+ * Returns an array of pointers to the files in the list indexed by MFT record number,
+ * NULL where there is no record. Sets *nRecords to the length of the array.
+ *
+ * WARNING: Memory is allocated for the array, need to memFree(..) the returned pointer.
+ */
+File **indexRecords(File *p_head, uint32_t *nRecords) {
+	File *p_current_item;
+	uint32_t n = 0;
+	for(p_current_item = p_head; p_current_item; p_current_item = p_current_item->p_next) {
+		if(p_current_item->recordNumber >= n) {
+			n = p_current_item->recordNumber + 1;
+		}
+	}
+	File **byRecord = memCalloc( MEM_CATALOG, n ? n : 1, sizeof(File *) );
+	for(p_current_item = p_head; p_current_item; p_current_item = p_current_item->p_next) {
+		byRecord[p_current_item->recordNumber] = p_current_item;
+	}
+	*nRecords = n;
+	return byRecord;
+}
+
+/**
+ * Returns the file in use which reference leads to, or NULL if there is none: the record
+ * is missing, not in use, or was reused since (its sequence number differs).
+ * byRecord is as returned by indexRecords(..).
+ */
+File *referencedFile(File **byRecord, uint32_t nRecords, uint64_t reference) {
+	uint64_t record = reference & FILE_REFERENCE_RECORD;
+	uint16_t sequence = reference >> 48;
+	File *file = record < nRecords ? byRecord[record] : NULL;
+	if(!file || !(file->recordFlags & IN_USE) || (sequence && file->sequence && sequence != file->sequence)) {
+		return NULL;
+	}
+	return file;
+}
+
+/*
+ * Writes the path of file from the root directory into path (size bytes), following the
+ * parent references through byRecord (as returned by indexRecords(..)). A parent which is
+ * missing, or whose record has been reused since (its sequence number differs, by more than
+ * the one added when a record is deleted), ends the path at ORPHAN_DIR instead of the root.
+ * Returns the length of the path, which is cut short if it does not fit.
+ */
+size_t filePath(File **byRecord, uint32_t nRecords, File *file, char *path, size_t size) {
+	char *names[MAX_PATH_DEPTH];
+	int depth = 0;
+	size_t length = 0;
+	bool orphan = false;
+	File *current = file;
+
+	while(depth < MAX_PATH_DEPTH && current->recordNumber != ROOT_RECORD) {
+		names[depth++] = current->fileName ? current->fileName : "?";
+		uint64_t parent = current->parentReference & FILE_REFERENCE_RECORD;
+		uint16_t parentSequence = current->parentReference >> 48;
+		File *parentFile = parent < nRecords ? byRecord[parent] : NULL;
+		if(!parentFile || parentFile == current ||
+		   (parentSequence && parentFile->sequence && parentSequence != parentFile->sequence &&
+			((parentFile->recordFlags & IN_USE) || (uint16_t)(parentSequence+1) != parentFile->sequence))) {
+			orphan = true;
+			break;
+		}
+		current = parentFile;
+	}
+	if(depth == MAX_PATH_DEPTH) {
+		orphan = true;	/*A loop among the parents */
+	}
+	if(size == 0) {
+		return 0;
+	}
+	path[0] = '\0';
+	if(orphan) {
+		length += snprintf(path + length, size - length, "%s", ORPHAN_DIR);
+	}
+	while(depth-- > 0 && length < size) {
+		length += snprintf(path + length, size - length, "/%s", names[depth]);
+	}
+	return length < size ? length : size-1;
+}
+
+/*
+ * Frees index, and the parts of it which were kept.
+ */
+void freeDirectoryIndex(DirectoryIndex *index) {
+	if(index) {
+		memFree(index->root);
+		freeList(index->runs);
+		memFree(index->bitmap);
+		memFree(index);
+	}
+}
+
+/*
+ * Free all of the File elements, with the names, run lists and data they own.
+ */
+int freeFiles(File *p_head) {
+	int items_freed = 0;
+	while (p_head) {
+		File *p_next = p_head->p_next;
+		memFree(p_head->fileName);
+		memFree(p_head->residentData);
+		freeList(p_head->runs);
+		freeDirectoryIndex(p_head->index);
+		memFree(p_head->objectId);
+		if(p_head->reparse) {
+			memFree(p_head->reparse->target);
+			memFree(p_head->reparse);
+		}
+		memFree(p_head);
+		p_head = p_next;
+		items_freed++;
+	}
+	return items_freed;
+}
+
 #endif /* FILELUT_H_ */
@@ -0,0 +1,591 @@
+/*
+ * Grep.h
+ *
+ * Search of the content of files for literal strings and regular expressions, straight
+ * off the device. The content of the selected files is cut into pieces which are each
+ * contiguous in their file and on disk; the pieces are sorted by where they lie on disk
+ * and physically adjacent pieces are coalesced into reads of up to GREP_CHUNK bytes, which
+ * worker threads take in turn. So the device is read once, in order, whatever the
+ * fragmentation of the files. Resident content is searched in place.
+ * Literals are found together with the automaton of Matcher.h, regular expressions with
+ * regexec(..). A match may cross from one piece of a file into the next (an extent or
+ * chunk boundary), so the first and last bytes of each piece are kept, and once every
+ * piece has been searched the end of each piece is searched joined to the start of the
+ * next, for matches crossing between them. A regular expression match found there may
+ * run on into the next piece, where its rest was matched alone as well: matches of that
+ * pattern starting inside it are dropped.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <regex.h>
+#include <fnmatch.h>
+#include "NTFSStruct.h"
+#include "FileLUT.h"
+#include "Volume.h"
+#include "Sink.h"
+#include "Matcher.h"
+#include "Memory.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef GREP_H_
+#define GREP_H_
+
+#define GREP_CHUNK (4*1024*1024)	/*Most bytes read at once */
+#define GREP_RESIDENT_BATCH 256		/*Resident pieces searched as one unit of work */
+#define GREP_REGEX_SPAN 256			/*Longest regular expression match found across pieces */
+#define GREP_REGEX_PREFIX "re:"		/*Marks a pattern as an extended regular expression */
+#define GREP_NAME_PREFIX "in:"		/*Marks a file name pattern selecting the files searched */
+
+typedef struct _GrepPattern {
+	char *text;				/*As given */
+	uint8_t *bytes;			/*A literal with its escapes decoded */
+	uint32_t length;
+	bool isRegex;
+	regex_t regex;
+} GrepPattern;
+
+typedef struct _GrepHit {
+	File *file;
+	uint64_t offset;		/*In the file */
+	uint32_t pattern;
+} GrepHit;
+
+/* A piece of the content of a file, contiguous both in the file and on disk */
+typedef struct _GrepPiece {
+	File *file;
+	uint64_t fileOffset;
+	uint64_t diskOffset;	/*On the partition, unused for resident content */
+	uint64_t length;
+	bool continued;			/*The next piece carries on from the end of this one */
+	bool searched;			/*Read and searched, its edges kept */
+} GrepPiece;
+
+/* Pieces searched as one unit of work, read at once unless resident */
+typedef struct _GrepRead {
+	uint64_t diskOffset;
+	uint64_t length;
+	uint64_t first, nPieces;	/*In the order of the pieces on disk */
+	bool resident;
+} GrepRead;
+
+/* Work shared among the threads of grepFiles(..) */
+typedef struct _GrepJob {
+	Volume *volume;
+	GrepPattern *patterns;
+	uint32_t nPatterns;
+	Matcher *matcher;			/*Of the literals, NULL if there are none */
+	uint32_t *literals;			/*Pattern of each pattern of the matcher */
+	GrepPiece *pieces;			/*In file order */
+	uint64_t *order;			/*The pieces in disk order */
+	uint64_t nPieces;
+	GrepRead *reads;
+	uint64_t nReads;
+	uint64_t next;				/*Next read to take, taken atomically */
+	uint32_t window;			/*Bytes kept from each end of each piece */
+	uint8_t *edges;				/*Those bytes, 2*window per piece: the first, then the last */
+	int failures;
+} GrepJob;
+
+typedef struct _GrepWorker {
+	GrepJob *job;
+	GrepHit *hits;
+	uint64_t nHits, capacity;
+} GrepWorker;
+
+/* Where the matches in one buffer are reported */
+typedef struct _GrepScan {
+	GrepWorker *worker;
+	File *file;
+	uint64_t fileOffset;	/*Of the start of the buffer */
+	size_t length;
+	size_t boundary;		/*Between two pieces when joined, 0 when searching one */
+	size_t tailLength;		/*Bytes of a piece searched again joined to the next */
+	uint64_t *reach;		/*Per pattern, where in the file regular expression matches across
+							  the boundary end, 0 for none; NULL when searching one piece */
+} GrepScan;
+
+/* The start of a piece, up to where a regular expression match from the piece before reaches */
+typedef struct _GrepShadow {
+	GrepHit start;			/*The file, first offset of the piece and the pattern */
+	uint64_t end;
+} GrepShadow;
+
+/**
+ * Decodes the escapes \xHH, \t, \n, \r and \\ of a literal pattern into bytes, which must
+ * hold strlen(text) bytes. Returns the number of bytes.
+ */
+uint32_t decodeLiteral(const char *text, uint8_t *bytes) {
+	uint32_t n = 0;
+	while(*text) {
+		unsigned int value;
+		if(text[0] == '\\' && text[1] == 'x' && sscanf(text+2, "%2x", &value) == 1 &&
+		   text[2] && text[3] && strchr("0123456789abcdefABCDEF", text[3])) {
+			bytes[n++] = value;
+			text += 4;
+		} else if(text[0] == '\\' && text[1] && strchr("tnr\\", text[1])) {
+			bytes[n++] = text[1] == 't' ? '\t' : text[1] == 'n' ? '\n' : text[1] == 'r' ? '\r' : '\\';
+			text += 2;
+		} else {
+			bytes[n++] = *text++;
+		}
+	}
+	return n;
+}
+
+void addGrepHit(GrepWorker *worker, File *file, uint64_t offset, uint32_t pattern) {
+	if(worker->nHits == worker->capacity) {
+		worker->capacity = worker->capacity ? 2*worker->capacity : 1024;
+		worker->hits = memRealloc( MEM_SEARCH, worker->hits, worker->capacity*sizeof(GrepHit) );
+	}
+	worker->hits[worker->nHits].file = file;
+	worker->hits[worker->nHits].offset = offset;
+	worker->hits[worker->nHits].pattern = pattern;
+	worker->nHits++;
+}
+
+/**
+ * Returns true if a match from start to end in the buffer of scan belongs there: a match
+ * in a piece alone, or one crossing the boundary of two joined pieces. A regular expression
+ * match reaching the end of a piece is left to the search across the boundary, where it
+ * may extend further.
+ */
+bool grepReport(GrepScan *scan, size_t start, size_t end, bool isRegex) {
+	if(scan->boundary) {
+		return start < scan->boundary && (end > scan->boundary || (isRegex && end == scan->boundary));
+	}
+	return !(isRegex && scan->tailLength && end == scan->length && start >= scan->length - scan->tailLength);
+}
+
+void grepLiteralFound(void *ctx, uint32_t pattern, size_t start) {
+	GrepScan *scan = ctx;
+	GrepJob *job = scan->worker->job;
+	uint32_t p = job->literals[pattern];
+	if(grepReport(scan, start, start + job->patterns[p].length, false)) {
+		addGrepHit(scan->worker, scan->file, scan->fileOffset + start, p);
+	}
+}
+
+/**
+ * Searches length bytes of data for every pattern, reporting the matches scan takes.
+ */
+void grepScan(GrepScan *scan, const uint8_t *data, size_t length) {
+	GrepJob *job = scan->worker->job;
+	uint32_t p;
+	if(job->matcher) {
+		matcherScan(job->matcher, data, length, grepLiteralFound, scan);
+	}
+	for(p = 0; p < job->nPatterns; p++) {
+		size_t pos = 0;
+		if(!job->patterns[p].isRegex) {
+			continue;
+		}
+		while(pos < length && (!scan->boundary || pos < scan->boundary)) {
+			regmatch_t match;
+			match.rm_so = pos;
+			match.rm_eo = length;
+			if(regexec(&job->patterns[p].regex, (const char *)data, 1, &match, REG_STARTEND) != 0) {
+				break;
+			}
+			if(match.rm_eo == match.rm_so) {	/*Empty matches are not reported */
+				pos = match.rm_so + 1;
+				continue;
+			}
+			if(grepReport(scan, match.rm_so, match.rm_eo, true)) {
+				addGrepHit(scan->worker, scan->file, scan->fileOffset + match.rm_so, p);
+				if(scan->reach && match.rm_eo > scan->boundary) {
+					scan->reach[p] = scan->fileOffset + match.rm_eo;
+				}
+			}
+			pos = match.rm_eo;
+		}
+	}
+}
+
+void *grepWorker(void *arg) {
+	GrepWorker *worker = arg;
+	GrepJob *job = worker->job;
+	char *buffer = memAlloc( MEM_IO, GREP_CHUNK );
+	uint64_t i, k;
+	traceThreadName("grep");
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nReads) {
+		GrepRead *read = &job->reads[i];
+		uint64_t traceStartNs = traceStart();
+		if(!read->resident && readBlocks(job->volume->reader, job->volume->partitionOffset + read->diskOffset,
+										 read->length, buffer) != 0) {
+			int errsv = errno;
+			printf("Failed to read file content at %" PRIu64 ": %s.\n", read->diskOffset, strerror(errsv));
+			__sync_fetch_and_add(&job->failures, 1);
+			continue;
+		}
+		for(k = read->first; k < read->first + read->nPieces; k++) {
+			uint64_t index = job->order[k];
+			GrepPiece *piece = &job->pieces[index];
+			const uint8_t *data = read->resident ? (uint8_t *)piece->file->residentData + piece->fileOffset :
+								  (uint8_t *)buffer + (piece->diskOffset - read->diskOffset);
+			size_t edge = piece->length < job->window ? piece->length : job->window;
+			GrepScan scan = { worker, piece->file, piece->fileOffset, piece->length, 0, piece->continued ? edge : 0 };
+			grepScan(&scan, data, piece->length);
+			memcpy(job->edges + 2*index*job->window, data, edge);
+			memcpy(job->edges + (2*index+1)*job->window, data + piece->length - edge, edge);
+			piece->searched = true;
+			STAT_ADD(STAT_GREP_BYTES, piece->length);
+		}
+		traceSpan("search", "grep", traceStartNs, "offset", read->diskOffset, "length", read->length);
+	}
+	memFree(buffer);
+	return NULL;
+}
+
+/**
+ * Adds a piece to the growing array *pieces of *nPieces entries.
+ */
+void addGrepPiece(GrepPiece **pieces, uint64_t *nPieces, uint64_t *capacity, File *file,
+				  uint64_t fileOffset, uint64_t diskOffset, uint64_t length) {
+	if(*nPieces == *capacity) {
+		*capacity = *capacity ? 2 * *capacity : 1024;
+		*pieces = memRealloc( MEM_SEARCH, *pieces, *capacity*sizeof(GrepPiece) );
+	}
+	GrepPiece *piece = &(*pieces)[(*nPieces)++];
+	piece->file = file;
+	piece->fileOffset = fileOffset;
+	piece->diskOffset = diskOffset;
+	piece->length = length;
+	piece->continued = false;
+	piece->searched = false;
+}
+
+/**
+ * Cuts the content of file into pieces, in file order, of at most GREP_CHUNK bytes.
+ * Sparse runs hold no content and are not searched.
+ */
+void addFilePieces(GrepPiece **pieces, uint64_t *nPieces, uint64_t *capacity, File *file, uint32_t bytesPerCluster) {
+	uint64_t fileOffset = 0, runOffset, length;
+	int64_t lcn = 0;
+	DataRun *p_current_item;
+	bool continued = false;
+	if(file->runs == NULL) {
+		for(; fileOffset < file->realSize; fileOffset += length) {
+			length = file->realSize - fileOffset < GREP_CHUNK ? file->realSize - fileOffset : GREP_CHUNK;
+			if(continued) {
+				(*pieces)[*nPieces-1].continued = true;
+			}
+			addGrepPiece(pieces, nPieces, capacity, file, fileOffset, 0, length);
+			continued = true;
+		}
+		return;
+	}
+	for(p_current_item = file->runs; p_current_item && fileOffset < file->realSize;
+		p_current_item = p_current_item->p_next) {
+		uint64_t runBytes = *p_current_item->length * bytesPerCluster;
+		if(!p_current_item->offset) { /*Sparse */
+			fileOffset += runBytes;
+			continued = false;
+			continue;
+		}
+		lcn += *p_current_item->offset;
+		for(runOffset = 0; runOffset < runBytes && fileOffset < file->realSize; runOffset += length) {
+			length = runBytes - runOffset < GREP_CHUNK ? runBytes - runOffset : GREP_CHUNK;
+			if(length > file->realSize - fileOffset) {
+				length = file->realSize - fileOffset;
+			}
+			if(continued) {
+				(*pieces)[*nPieces-1].continued = true;
+			}
+			addGrepPiece(pieces, nPieces, capacity, file, fileOffset, lcn*bytesPerCluster + runOffset, length);
+			continued = true;
+			fileOffset += length;
+		}
+	}
+}
+
+/* The pieces are sorted by disk offset through their indexes, resident ones first */
+GrepPiece *grepSortPieces;
+
+int compareGrepPieces(const void *a, const void *b) {
+	const GrepPiece *x = &grepSortPieces[*(const uint64_t *)a], *y = &grepSortPieces[*(const uint64_t *)b];
+	bool xResident = x->file->runs == NULL, yResident = y->file->runs == NULL;
+	if(xResident != yResident) {
+		return xResident ? -1 : 1;
+	}
+	if(x->diskOffset != y->diskOffset) {
+		return x->diskOffset < y->diskOffset ? -1 : 1;
+	}
+	return 0;
+}
+
+int compareGrepHits(const void *a, const void *b) {
+	const GrepHit *x = a, *y = b;
+	if(x->file->recordNumber != y->file->recordNumber) {
+		return x->file->recordNumber < y->file->recordNumber ? -1 : 1;
+	}
+	if(x->offset != y->offset) {
+		return x->offset < y->offset ? -1 : 1;
+	}
+	return (int)x->pattern - (int)y->pattern;
+}
+
+int compareGrepShadows(const void *a, const void *b) {
+	return compareGrepHits(&((const GrepShadow *)a)->start, &((const GrepShadow *)b)->start);
+}
+
+/**
+ * Drops from hits, in file order, those inside a shadow: suffixes of regular expression
+ * matches already found across the boundary before them. Returns the hits left.
+ */
+uint64_t dropShadowedHits(GrepHit *hits, uint64_t nHits, GrepShadow *shadows, uint64_t nShadows) {
+	uint64_t i, k, s = 0, n = 0;
+	if(nShadows) {
+		qsort(shadows, nShadows, sizeof(GrepShadow), compareGrepShadows);
+	}
+	for(i = 0; i < nHits; i++) {
+		GrepHit *hit = &hits[i];
+		bool shadowed = false;
+		while(s < nShadows && (shadows[s].start.file->recordNumber < hit->file->recordNumber ||
+			  (shadows[s].start.file == hit->file && shadows[s].end <= hit->offset))) {
+			s++;
+		}
+		for(k = s; k < nShadows && shadows[k].start.file == hit->file && shadows[k].start.offset <= hit->offset; k++) {
+			if(shadows[k].start.pattern == hit->pattern && hit->offset < shadows[k].end) {
+				shadowed = true;
+			}
+		}
+		if(!shadowed) {
+			hits[n++] = *hit;
+		}
+	}
+	return n;
+}
+
+/**
+ * Returns true if file has content and its name matches one of the nNames file name
+ * patterns (any file when there are none).
+ */
+bool grepSelected(File *file, char **names, int nNames) {
+	int i;
+	if(!hasContent(file)) {
+		return false;
+	}
+	for(i = 0; i < nNames; i++) {
+		if(file->fileName && fnmatch(names[i], file->fileName, 0) == 0) {
+			return true;
+		}
+	}
+	return nNames == 0;
+}
+
+/**
+ * Searches the content of the files with content among files for the patterns in args:
+ * literals, with escapes, and extended regular expressions after GREP_REGEX_PREFIX.
+ * Arguments after GREP_NAME_PREFIX are file name patterns which select the files searched.
+ * Every match is printed as path:stream:offset:pattern, in file order.
+ *
+ * Returns the number of reads which failed, or -1 if the patterns are not valid.
+ */
+int grepFiles(Volume *volume, File *files, char **args, int nArgs, int nThreads) {
+	GrepJob job;
+	GrepPiece *pieces = NULL;
+	uint64_t capacity = 0, nPieces = 0, i, k, nHits = 0;
+	char **names = malloc( (nArgs ? nArgs : 1)*sizeof(char *) );
+	const uint8_t *literals[MATCHER_MAX_PATTERNS];
+	uint32_t literalLengths[MATCHER_MAX_PATTERNS], nLiterals = 0;
+	int a, t, nNames = 0, ret = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.volume = volume;
+	job.patterns = memCalloc( MEM_SEARCH, nArgs ? nArgs : 1, sizeof(GrepPattern) );
+	job.literals = memAlloc( MEM_SEARCH, MATCHER_MAX_PATTERNS*sizeof(uint32_t) );
+	for(a = 0; a < nArgs && ret == 0; a++) {
+		if(strncmp(args[a], GREP_NAME_PREFIX, strlen(GREP_NAME_PREFIX)) == 0) {
+			names[nNames++] = args[a] + strlen(GREP_NAME_PREFIX);
+			continue;
+		}
+		GrepPattern *pattern = &job.patterns[job.nPatterns];
+		pattern->text = args[a];
+		if(strncmp(args[a], GREP_REGEX_PREFIX, strlen(GREP_REGEX_PREFIX)) == 0) {
+			int err = regcomp(&pattern->regex, args[a] + strlen(GREP_REGEX_PREFIX), REG_EXTENDED);
+			if(err != 0) {
+				char message[256];
+				regerror(err, &pattern->regex, message, sizeof(message));
+				printf("Regular expression %s is not valid: %s.\n", args[a], message);
+				ret = -1;
+				break;
+			}
+			pattern->isRegex = true;
+			if(job.window < GREP_REGEX_SPAN-1) {
+				job.window = GREP_REGEX_SPAN-1;
+			}
+		} else {
+			pattern->bytes = memAlloc( MEM_SEARCH, strlen(args[a]) + 1 );
+			pattern->length = decodeLiteral(args[a], pattern->bytes);
+			if(pattern->length == 0 || nLiterals == MATCHER_MAX_PATTERNS) {
+				printf("Pattern %s is empty, or more than %d literals were given.\n", args[a], MATCHER_MAX_PATTERNS);
+				memFree(pattern->bytes);
+				ret = -1;
+				break;
+			}
+			if(job.window < pattern->length-1) {
+				job.window = pattern->length-1;
+			}
+			job.literals[nLiterals] = job.nPatterns;
+			literals[nLiterals] = pattern->bytes;
+			literalLengths[nLiterals++] = pattern->length;
+		}
+		job.nPatterns++;
+	}
+	if(ret == 0 && job.nPatterns == 0) {
+		printf("No pattern to search for.\n");
+		ret = -1;
+	}
+	if(ret == 0 && nLiterals > 0) {
+		job.matcher = createMatcher(literals, literalLengths, nLiterals);
+	}
+
+	if(ret == 0) {
+		/*Cut the content of the selected files into pieces, then order them on disk */
+		File *p_current_item;
+		for(p_current_item = files; p_current_item; p_current_item = p_current_item->p_next) {
+			if(grepSelected(p_current_item, names, nNames)) {
+				addFilePieces(&pieces, &nPieces, &capacity, p_current_item, volume->bytesPerCluster);
+			}
+		}
+		job.pieces = pieces;
+		job.nPieces = nPieces;
+		job.order = memAlloc( MEM_SEARCH, (nPieces ? nPieces : 1)*sizeof(uint64_t) );
+		for(i = 0; i < nPieces; i++) {
+			job.order[i] = i;
+		}
+		grepSortPieces = pieces;
+		qsort(job.order, nPieces, sizeof(uint64_t), compareGrepPieces);
+		job.edges = memAlloc( MEM_SEARCH, (nPieces ? nPieces : 1)*2*(job.window ? job.window : 1) );
+
+		/*Coalesce the pieces adjacent on disk into reads */
+		job.reads = memAlloc( MEM_SEARCH, (nPieces ? nPieces : 1)*sizeof(GrepRead) );
+		for(k = 0; k < nPieces; k++) {
+			GrepPiece *piece = &pieces[job.order[k]];
+			bool resident = piece->file->runs == NULL;
+			GrepRead *last = job.nReads ? &job.reads[job.nReads-1] : NULL;
+			if(last && resident && last->resident && last->nPieces < GREP_RESIDENT_BATCH) {
+				last->nPieces++;
+			} else if(last && !resident && !last->resident && piece->diskOffset == last->diskOffset + last->length &&
+					  last->length + piece->length <= GREP_CHUNK) {
+				last->length += piece->length;
+				last->nPieces++;
+			} else {
+				GrepRead *read = &job.reads[job.nReads++];
+				read->diskOffset = piece->diskOffset;
+				read->length = resident ? 0 : piece->length;
+				read->first = k;
+				read->nPieces = 1;
+				read->resident = resident;
+			}
+		}
+
+		GrepWorker *workers = calloc( nThreads, sizeof(GrepWorker) );
+		pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+		for(t = 0; t < nThreads; t++) {
+			workers[t].job = &job;
+			pthread_create(&threads[t], NULL, grepWorker, &workers[t]);
+		}
+		for(t = 0; t < nThreads; t++) {
+			pthread_join(threads[t], NULL);
+		}
+
+		/*Matches crossing from each piece into the next of its file, both read */
+		uint8_t *joined = memAlloc( MEM_SEARCH, 2*(job.window ? job.window : 1) );
+		uint64_t *reach = memAlloc( MEM_SEARCH, job.nPatterns*sizeof(uint64_t) );
+		GrepShadow *shadows = NULL;
+		uint64_t nShadows = 0, shadowCapacity = 0;
+		for(i = 0; job.window && i+1 < nPieces; i++) {
+			if(!pieces[i].continued || !pieces[i].searched || !pieces[i+1].searched) {
+				continue;
+			}
+			size_t tail = pieces[i].length < job.window ? pieces[i].length : job.window;
+			size_t head = pieces[i+1].length < job.window ? pieces[i+1].length : job.window;
+			memcpy(joined, job.edges + (2*i+1)*job.window + job.window - tail, tail);
+			memcpy(joined + tail, job.edges + 2*(i+1)*job.window, head);
+			GrepScan scan = { &workers[0], pieces[i].file, pieces[i].fileOffset + pieces[i].length - tail,
+							  tail + head, tail, 0, reach };
+			memset(reach, 0, job.nPatterns*sizeof(uint64_t));
+			grepScan(&scan, joined, tail + head);
+			for(a = 0; a < (int)job.nPatterns; a++) {
+				if(!reach[a]) {
+					continue;
+				}
+				if(nShadows == shadowCapacity) {
+					shadowCapacity = shadowCapacity ? 2*shadowCapacity : 64;
+					shadows = memRealloc( MEM_SEARCH, shadows, shadowCapacity*sizeof(GrepShadow) );
+				}
+				GrepShadow *shadow = &shadows[nShadows++];
+				shadow->start.file = pieces[i+1].file;
+				shadow->start.offset = pieces[i+1].fileOffset;
+				shadow->start.pattern = a;
+				shadow->end = reach[a];
+			}
+		}
+		memFree(joined);
+		memFree(reach);
+
+		/*Every thread's hits, in file order */
+		for(t = 0; t < nThreads; t++) {
+			nHits += workers[t].nHits;
+		}
+		GrepHit *hits = memAlloc( MEM_SEARCH, (nHits ? nHits : 1)*sizeof(GrepHit) );
+		nHits = 0;
+		for(t = 0; t < nThreads; t++) {
+			if(workers[t].nHits) {
+				memcpy(hits + nHits, workers[t].hits, workers[t].nHits*sizeof(GrepHit));
+			}
+			nHits += workers[t].nHits;
+			memFree(workers[t].hits);
+		}
+		qsort(hits, nHits, sizeof(GrepHit), compareGrepHits);
+		nHits = dropShadowedHits(hits, nHits, shadows, nShadows);
+		memFree(shadows);
+		STAT_ADD(STAT_GREP_HITS, nHits);
+
+		uint32_t nRecords;
+		File **byRecord = indexRecords(files, &nRecords);
+		char path[MAX_PATH_LENGTH];
+		for(i = 0; i < nHits; i++) {
+			filePath(byRecord, nRecords, hits[i].file, path, sizeof(path));
+			printf("%s:$DATA:%" PRIu64 ":%s\n", path, hits[i].offset, job.patterns[hits[i].pattern].text);
+		}
+		uint64_t searched = 0;
+		for(i = 0; i < nPieces; i++) {
+			searched += pieces[i].length;
+		}
+		printf("%" PRIu64 " matches in %" PRIu64 " bytes of file content, read in %" PRIu64 " pieces.\n",
+			   nHits, searched, job.nReads);
+		ret = job.failures;
+
+		memFree(byRecord);
+		memFree(hits);
+		free(threads);
+		free(workers);
+	}
+
+	for(a = 0; a < (int)job.nPatterns; a++) {
+		if(job.patterns[a].isRegex) {
+			regfree(&job.patterns[a].regex);
+		}
+		memFree(job.patterns[a].bytes);
+	}
+	freeMatcher(job.matcher);
+	memFree(job.patterns);
+	memFree(job.literals);
+	memFree(job.order);
+	memFree(job.edges);
+	memFree(job.reads);
+	memFree(pieces);
+	free(names);
+	return ret;
+}
+
+#endif /* GREP_H_ */
@@ -0,0 +1,124 @@
+/*
+ * Hash.h
+ *
+ * SHA-256 (FIPS 180-4), used to hash file content as it streams off the volume.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef HASH_H_
+#define HASH_H_
+
+#define SHA256_DIGEST_LENGTH 32
+#define SHA256_BLOCK_LENGTH 64
+
+typedef struct _SHA256_CTX {
+	uint32_t state[8];
+	uint64_t length;					/*Bytes hashed so far */
+	uint8_t buffer[SHA256_BLOCK_LENGTH];	/*Partial block awaiting more data */
+} SHA256_CTX;
+
+static const uint32_t sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32-(n))))
+
+void sha256Init(SHA256_CTX *ctx) {
+	static const uint32_t initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->state, initial, sizeof(initial));
+	ctx->length = 0;
+}
+
+/**
+ * Compresses one 64 byte block into the hash state.
+ */
+void sha256Block(SHA256_CTX *ctx, const uint8_t *block) {
+	uint32_t w[64], a, b, c, d, e, f, g, h;
+	int i;
+	for(i = 0; i < 16; i++) {
+		w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i+1] << 16 |
+			   (uint32_t)block[4*i+2] << 8 | block[4*i+3];
+	}
+	for(; i < 64; i++) {
+		uint32_t s0 = ROTR32(w[i-15], 7) ^ ROTR32(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ROTR32(w[i-2], 17) ^ ROTR32(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	a = ctx->state[0]; b = ctx->state[1]; c = ctx->state[2]; d = ctx->state[3];
+	e = ctx->state[4]; f = ctx->state[5]; g = ctx->state[6]; h = ctx->state[7];
+	for(i = 0; i < 64; i++) {
+		uint32_t t1 = h + (ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256K[i] + w[i];
+		uint32_t t2 = (ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	ctx->state[0] += a; ctx->state[1] += b; ctx->state[2] += c; ctx->state[3] += d;
+	ctx->state[4] += e; ctx->state[5] += f; ctx->state[6] += g; ctx->state[7] += h;
+}
+
+void sha256Update(SHA256_CTX *ctx, const void *data, size_t length) {
+	const uint8_t *p = data;
+	size_t used = ctx->length % SHA256_BLOCK_LENGTH;
+	ctx->length += length;
+
+	if(used > 0) { /*Top up the partial block first */
+		size_t take = SHA256_BLOCK_LENGTH - used < length ? SHA256_BLOCK_LENGTH - used : length;
+		memcpy(ctx->buffer + used, p, take);
+		p += take;
+		length -= take;
+		if(used + take < SHA256_BLOCK_LENGTH) {
+			return;
+		}
+		sha256Block(ctx, ctx->buffer);
+	}
+	for(; length >= SHA256_BLOCK_LENGTH; p += SHA256_BLOCK_LENGTH, length -= SHA256_BLOCK_LENGTH) {
+		sha256Block(ctx, p);
+	}
+	memcpy(ctx->buffer, p, length);
+}
+
+void sha256Final(SHA256_CTX *ctx, uint8_t digest[SHA256_DIGEST_LENGTH]) {
+	uint64_t bits = ctx->length * 8;
+	uint8_t pad[SHA256_BLOCK_LENGTH + 8] = { 0x80 };
+	size_t used = ctx->length % SHA256_BLOCK_LENGTH;
+	size_t padLength = (used < 56 ? 56 : 120) - used;
+	uint8_t lengthBytes[8];
+	int i;
+	for(i = 0; i < 8; i++) {
+		lengthBytes[i] = bits >> (56 - 8*i);
+	}
+	sha256Update(ctx, pad, padLength);
+	sha256Update(ctx, lengthBytes, 8);
+	for(i = 0; i < 8; i++) {
+		digest[4*i]   = ctx->state[i] >> 24;
+		digest[4*i+1] = ctx->state[i] >> 16;
+		digest[4*i+2] = ctx->state[i] >> 8;
+		digest[4*i+3] = ctx->state[i];
+	}
+}
+
+/**
+ * Prints digest into buff as lower case hex, buff must hold 2*length+1 characters.
+ */
+void digestToHex(char *buff, const uint8_t *digest, int length) {
+	static const char hex[] = "0123456789abcdef";
+	int i;
+	for(i = 0; i < length; i++) {
+		buff[2*i] = hex[digest[i] >> 4];
+		buff[2*i+1] = hex[digest[i] & 0x0F];
+	}
+	buff[2*length] = '\0';
+}
+
+#endif /* HASH_H_ */
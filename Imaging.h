@@ -0,0 +1,476 @@
+/*
+ * Imaging.h
+ *
+ * Acquisition of a device into a raw image in one sequential pass. The device is read
+ * front to back in large blocks, each written to the image and hashed with SHA-256, and
+ * also fed to the discovery of the NTFS partitions: the MBR gives the boot sectors, each
+ * boot sector the first record of its MFT, and that record the runs of the MFT, which are
+ * written to the local MFT copy as they stream by. Whatever is found to lie behind the
+ * stream (an MFT fragment before the start of the MFT, say) is read back from the part of
+ * the image already written, never from the device, so it is read only once. A retry
+ * pass can patch the image afterwards with what the device now reads, hashing it again.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "RunList.h"
+#include "Utility.h"
+#include "Hash.h"
+#include "ErrorMap.h"
+#include "Memory.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef IMAGING_H_
+#define IMAGING_H_
+
+#define IMAGE_BLOCK (4*1024*1024)	/*Bytes read from the device at once */
+#define IMAGE_PARTITIONS 4			/*Primary partitions of the MBR */
+#define IMAGE_PARTITION_TABLE 0x1BE	/*Offset of the partition table in the MBR */
+#define IMAGE_NTFS_TYPE 0x07		/*Partition type of NTFS */
+#define IMAGE_SECTOR 512
+#define IMAGE_COPY_NAME 32			/*Longest name of a local MFT copy */
+
+/* Kinds of the metadata regions picked out of the stream */
+typedef enum _ImageRegionKind {
+	REGION_MBR,
+	REGION_BOOT,			/*Boot sector of an NTFS partition */
+	REGION_MFT_RECORD,		/*First record of an MFT, $MFT itself */
+	REGION_MFT_RUN			/*A run of an MFT, which goes to its local copy */
+} ImageRegionKind;
+
+/* A region of the device wanted for discovery. It is captured from its start, so the
+   bytes captured so far are always a prefix */
+typedef struct _ImageRegion {
+	uint64_t offset, length;	/*On the device */
+	uint64_t captured;
+	ImageRegionKind kind;
+	int partition;				/*Among the NTFS partitions, in MBR order */
+	char *buffer;				/*The region, but for MFT runs */
+	uint64_t copyOffset;		/*Of the data of an MFT run in the local copy */
+	struct _ImageRegion *p_next;
+} ImageRegion;
+
+/* What an acquisition found and did */
+typedef struct _Acquisition {
+	uint64_t bytes;					/*Imaged */
+	uint64_t bytesReadBack;			/*Of metadata behind the stream, read back from the image */
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	int nPartitions;				/*NTFS partitions in the MBR */
+	uint64_t partitionOffsets[IMAGE_PARTITIONS];
+	uint32_t bytesPerCluster[IMAGE_PARTITIONS];
+	int copyFds[IMAGE_PARTITIONS];	/*Of the local MFT copies being written, -1 for none */
+	uint32_t pendingRuns[IMAGE_PARTITIONS];
+	bool mftCopied[IMAGE_PARTITIONS];	/*The local copy $MFT<n> of partition n is complete */
+} Acquisition;
+
+/* State of an acquisition in progress */
+typedef struct _ImageTee {
+	int image;					/*Written, and read back from */
+	uint64_t streamed;			/*Bytes of the device read, and written to the image */
+	ImageRegion *regions;		/*Still being captured */
+	Acquisition *acquisition;
+	int failed;					/*A region could not be stored */
+} ImageTee;
+
+void captureRegion(ImageTee *tee, ImageRegion *region, char *block, uint64_t position, uint64_t length);
+
+/**
+ * Adds the region of length bytes at offset on the device to those wanted. What the stream
+ * already passed of it is up to the caller to capture.
+ */
+ImageRegion *addRegion(ImageTee *tee, ImageRegionKind kind, int partition, uint64_t offset, uint64_t length) {
+	ImageRegion *region = memAlloc( MEM_METADATA, sizeof(ImageRegion) );
+	region->offset = offset;
+	region->length = length;
+	region->captured = 0;
+	region->kind = kind;
+	region->partition = partition;
+	region->buffer = kind == REGION_MFT_RUN ? NULL : memAlloc( MEM_METADATA, length );
+	region->copyOffset = 0;
+	region->p_next = tee->regions;
+	tee->regions = region;
+	return region;
+}
+
+/**
+ * Stores n bytes of data as the next of region.
+ * Returns 0, or -1 if they could not be written to the local MFT copy.
+ */
+int storeRegion(ImageTee *tee, ImageRegion *region, char *data, uint64_t n) {
+	if(region->buffer) {
+		memcpy(region->buffer + region->captured, data, n);
+	} else if(pwrite(tee->acquisition->copyFds[region->partition], data, n,
+					 region->copyOffset + region->captured) != (ssize_t)n) {
+		int errsv = errno;
+		printf("Failed to write the MFT copy of partition %d: %s.\n", region->partition, strerror(errsv));
+		return -1;
+	}
+	region->captured += n;
+	return 0;
+}
+
+/**
+ * Reads the boot sector of region to find the first record of its MFT.
+ */
+void foundBootSector(ImageTee *tee, ImageRegion *region, char *block, uint64_t position, uint64_t length) {
+	NTFS_BOOT_SECTOR *boot = (NTFS_BOOT_SECTOR *)region->buffer;
+	uint32_t bytesPerCluster = boot->bpb.uchSecPerClust * boot->bpb.wBytesPerSec;
+	if(memcmp(boot->chOemID, "NTFS", 4) != 0 || bytesPerCluster == 0) {
+		printf("Partition %d has no NTFS boot sector.\n", region->partition);
+		return;
+	}
+	tee->acquisition->bytesPerCluster[region->partition] = bytesPerCluster;
+	ImageRegion *record = addRegion(tee, REGION_MFT_RECORD, region->partition,
+									region->offset + bytesPerCluster*boot->bpb.n64MFTLogicalClustNum, MFT_RECORD_LENGTH);
+	captureRegion(tee, record, block, position, length);
+}
+
+/**
+ * Reads the runs of the MFT out of its first record, region, and starts its local copy,
+ * $MFT<partition>, in the format written by main: each run as a FRAG header then its data.
+ */
+void foundMFTRecord(ImageTee *tee, ImageRegion *region, char *block, uint64_t position, uint64_t length) {
+	Acquisition *acquisition = tee->acquisition;
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)region->buffer;
+	uint32_t bytesPerCluster = acquisition->bytesPerCluster[region->partition];
+	uint16_t attrOffset = header->wAttribOffset;
+	char copyName[IMAGE_COPY_NAME];
+
+	if(memcmp(header->fileSignature, "FILE", 4) != 0 || applyFixup(region->buffer, MFT_RECORD_LENGTH) != 0) {
+		printf("MFT record 0 of partition %d is damaged, its MFT will be read from the image.\n", region->partition);
+		return;
+	}
+	while(attrOffset+8 < header->dwRecLength && attrOffset+8 < MFT_RECORD_LENGTH) {
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(region->buffer + attrOffset);
+		if(attr->dwType == 0xFFFFFFFF || attr->dwFullLength == 0 || attr->dwFullLength > MFT_RECORD_LENGTH-attrOffset) {
+			break;
+		}
+		if(attr->dwType == DATA && attr->uchNonResFlag && attr->uchNameLength == 0) {
+			break;
+		}
+		attrOffset += attr->dwFullLength;
+	}
+	NTFS_ATTRIBUTE *data = (NTFS_ATTRIBUTE *)(region->buffer + attrOffset);
+	if(attrOffset+8 >= header->dwRecLength || attrOffset+8 >= MFT_RECORD_LENGTH || data->dwType != DATA) {
+		printf("MFT record 0 of partition %d has no $DATA, its MFT will be read from the image.\n", region->partition);
+		return;
+	}
+
+	snprintf(copyName, sizeof(copyName), "$MFT%d", region->partition);
+	if((acquisition->copyFds[region->partition] = open(copyName, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+		int errsv = errno;
+		printf("Failed to create local file for storing $MFT: %s.\n", strerror(errsv));
+		tee->failed = -1;
+		return;
+	}
+	uint32_t countRuns = 0;
+	uint64_t copyOffset = 0;
+	int64_t lcn = 0;
+	uint16_t runOffset = (data->Attr).NonResident.wDatarunOffset;
+	DataRun *runs = decodeRunList(region->buffer + attrOffset + runOffset, data->dwFullLength - runOffset, &countRuns);
+	DataRun *run;
+	for(run = runs; run; run = run->p_next) {
+		if(!run->offset || !run->length) {
+			continue;	/*Sparse */
+		}
+		lcn += *run->offset;	/*Run offsets are relative to the run before */
+		uint64_t runDeviceOffset = acquisition->partitionOffsets[region->partition] + (uint64_t)lcn*bytesPerCluster;
+		FRAG *frag = createFragRecord(runDeviceOffset);
+		if(!frag || pwrite(acquisition->copyFds[region->partition], frag, sizeof(FRAG), copyOffset) != sizeof(FRAG)) {
+			int errsv = errno;
+			printf("Failed to write the MFT copy of partition %d: %s.\n", region->partition, strerror(errsv));
+			tee->failed = -1;
+		}
+		memFree(frag);
+		ImageRegion *mftRun = addRegion(tee, REGION_MFT_RUN, region->partition, runDeviceOffset,
+										*run->length*bytesPerCluster);
+		mftRun->copyOffset = copyOffset + sizeof(FRAG);
+		copyOffset += sizeof(FRAG) + mftRun->length;
+		acquisition->pendingRuns[region->partition]++;
+	}
+	freeList(runs);
+	if(countRuns > 1) {
+		printf("\t$MFT of partition %d is fragmented on disk, located %u fragments.\n", region->partition, countRuns);
+	}
+	/*Captured once all are counted, so the copy is not taken as complete early */
+	ImageRegion *wanted;
+	for(wanted = tee->regions; wanted; wanted = wanted->p_next) {
+		if(wanted->kind == REGION_MFT_RUN && wanted->partition == region->partition && wanted->captured == 0) {
+			captureRegion(tee, wanted, block, position, length);
+		}
+	}
+}
+
+/**
+ * Acts on region once it is captured whole.
+ */
+void regionCaptured(ImageTee *tee, ImageRegion *region, char *block, uint64_t position, uint64_t length) {
+	Acquisition *acquisition = tee->acquisition;
+	int p;
+	switch(region->kind) {
+		case REGION_MBR :
+			for(p = 0; p < IMAGE_PARTITIONS; p++) {
+				PARTITION *part = (PARTITION *)(region->buffer + IMAGE_PARTITION_TABLE + p*sizeof(PARTITION));
+				if(part->chType == IMAGE_NTFS_TYPE) {
+					int n = acquisition->nPartitions++;
+					acquisition->partitionOffsets[n] = (uint64_t)part->dwRelativeSector*IMAGE_SECTOR;
+					ImageRegion *boot = addRegion(tee, REGION_BOOT, n, acquisition->partitionOffsets[n],
+												  sizeof(NTFS_BOOT_SECTOR));
+					captureRegion(tee, boot, block, position, length);
+				}
+			}
+			break;
+		case REGION_BOOT :
+			foundBootSector(tee, region, block, position, length);
+			break;
+		case REGION_MFT_RECORD :
+			foundMFTRecord(tee, region, block, position, length);
+			break;
+		case REGION_MFT_RUN :
+			if(--acquisition->pendingRuns[region->partition] == 0) {
+				close(acquisition->copyFds[region->partition]);
+				acquisition->copyFds[region->partition] = -1;
+				acquisition->mftCopied[region->partition] = true;
+			}
+			break;
+	}
+}
+
+/**
+ * Captures what the stream has passed of region: from the image up to position, then
+ * from block, the length bytes at position, which were just written to the image.
+ */
+void captureRegion(ImageTee *tee, ImageRegion *region, char *block, uint64_t position, uint64_t length) {
+	uint64_t end = region->offset + region->length;
+	if(region->captured == region->length) {
+		return;
+	}
+	/*Behind the block */
+	while(region->offset + region->captured < position && region->captured < region->length && !tee->failed) {
+		uint64_t from = region->offset + region->captured;
+		uint64_t n = (end < position ? end : position) - from;
+		char *readBack = memAlloc( MEM_IO, n < IMAGE_BLOCK ? n : IMAGE_BLOCK );
+		ssize_t readStatus;
+		if(n > IMAGE_BLOCK) {
+			n = IMAGE_BLOCK;
+		}
+		if((readStatus = pread(tee->image, readBack, n, from)) != (ssize_t)n) {
+			int errsv = errno;
+			printf("Failed to read back offset %" PRIu64 " of the image: %s.\n", from,
+				   readStatus == -1 ? strerror(errsv) : "short read");
+			tee->failed = -1;
+		} else {
+			tee->acquisition->bytesReadBack += n;
+			tee->failed |= storeRegion(tee, region, readBack, n);
+		}
+		memFree(readBack);
+	}
+	/*In the block */
+	uint64_t from = region->offset + region->captured;
+	if(!tee->failed && from >= position && from < position + length && region->captured < region->length) {
+		uint64_t n = (end < position + length ? end : position + length) - from;
+		tee->failed |= storeRegion(tee, region, block + (from - position), n);
+	}
+	if(region->captured == region->length && !tee->failed) {
+		regionCaptured(tee, region, block, position, length);
+	}
+}
+
+/**
+ * Writes the SHA-256 digest of the image at imagePath to imagePath.sha256, in the form
+ * sha256sum -c checks. Returns 0, or -1 if it cannot be written.
+ */
+int writeImageHash(const char *imagePath, uint8_t *digest) {
+	char hex[2*SHA256_DIGEST_LENGTH+1], hashPath[BUFSIZ];
+	digestToHex(hex, digest, SHA256_DIGEST_LENGTH);
+	snprintf(hashPath, sizeof(hashPath), "%s.sha256", imagePath);
+	FILE *hashFile = fopen(hashPath, "w");
+	if(!hashFile || fprintf(hashFile, "%s  %s\n", hex, imagePath) < 0 || fclose(hashFile) != 0) {
+		int errsv = errno;
+		printf("Failed to write %s: %s.\n", hashPath, strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Images the device open at source into imagePath in one sequential pass, hashing it with
+ * SHA-256, which is also written to imagePath.sha256 in the form sha256sum -c checks. The
+ * MFTs of the NTFS partitions are copied on the way to the local files $MFT<n>, marked in
+ * acquisition->mftCopied, so they need not be read again. Unreadable regions of the device
+ * are zero filled in the image and added to errors.
+ * Returns 0, or -1 if the image could not be written.
+ */
+int acquireImage(int source, const char *imagePath, Acquisition *acquisition, ErrorMap *errors) {
+	ImageTee tee;
+	SHA256_CTX hash;
+	char *block = memAlloc( MEM_IO, IMAGE_BLOCK );
+	char hex[2*SHA256_DIGEST_LENGTH+1];
+	ssize_t readStatus = 0;
+	int p;
+	uint64_t startNs = traceStart();
+
+	memset(acquisition, 0, sizeof(Acquisition));
+	for(p = 0; p < IMAGE_PARTITIONS; p++) {
+		acquisition->copyFds[p] = -1;
+	}
+	memset(&tee, 0, sizeof(ImageTee));
+	tee.acquisition = acquisition;
+	if((tee.image = open(imagePath, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+		int errsv = errno;
+		printf("Failed to create image %s: %s.\n", imagePath, strerror(errsv));
+		memFree(block);
+		return -1;
+	}
+	sha256Init(&hash);
+	addRegion(&tee, REGION_MBR, 0, 0, IMAGE_SECTOR);
+
+	printf("Imaging to %s...\n", imagePath);
+	while(!tee.failed) {
+		uint64_t traceStartNs = traceStart();
+		if((readStatus = readTolerant(source, block, IMAGE_BLOCK, tee.streamed, errors)) == -1) {
+			int errsv = errno;
+			printf("Failed to read the device at offset %" PRIu64 ": %s.\n", tee.streamed, strerror(errsv));
+			tee.failed = -1;
+			break;
+		}
+		uint64_t length = readStatus;
+		if(length == 0) {
+			break;	/*End of the device */
+		}
+		STAT_INC(STAT_DEVICE_READS);
+		STAT_ADD(STAT_DEVICE_BYTES, length);
+		STAT_HIST(HIST_READ_BYTES, length);
+		traceSpan("read", "io", traceStartNs, "offset", tee.streamed, "length", length);
+
+		if(pwrite(tee.image, block, length, tee.streamed) != (ssize_t)length) {
+			int errsv = errno;
+			printf("Failed to write image %s: %s.\n", imagePath, strerror(errsv));
+			tee.failed = -1;
+			break;
+		}
+		sha256Update(&hash, block, length);
+
+		/*Regions added on the way are captured as they are added */
+		ImageRegion *region, **p_region;
+		for(region = tee.regions; region && !tee.failed; region = region->p_next) {
+			if(region->offset + region->captured < tee.streamed + length) {
+				captureRegion(&tee, region, block, tee.streamed, length);
+			}
+		}
+		tee.streamed += length;
+		for(p_region = &tee.regions; *p_region; ) {	/*Drop those complete */
+			region = *p_region;
+			if(region->captured == region->length) {
+				*p_region = region->p_next;
+				memFree(region->buffer);
+				memFree(region);
+			} else {
+				p_region = &region->p_next;
+			}
+		}
+	}
+	acquisition->bytes = tee.streamed;
+	if(errors && errors->bytesSkipped > 0 && !tee.failed) {
+		printf("%" PRIu64 " bytes of the device could not be read, zero filled in the image.\n", errors->bytesSkipped);
+	}
+	sha256Final(&hash, acquisition->digest);
+	digestToHex(hex, acquisition->digest, SHA256_DIGEST_LENGTH);
+
+	/*Whatever is left lies past the end of the device */
+	while(tee.regions) {
+		ImageRegion *region = tee.regions;
+		if(!tee.failed) {
+			printf("Metadata at offset %" PRIu64 " lies past the end of the device.\n", region->offset);
+		}
+		tee.regions = region->p_next;
+		memFree(region->buffer);
+		memFree(region);
+	}
+	for(p = 0; p < IMAGE_PARTITIONS; p++) {
+		if(acquisition->copyFds[p] != -1) {
+			close(acquisition->copyFds[p]);
+		}
+	}
+	if(close(tee.image) == -1 && !tee.failed) {
+		int errsv = errno;
+		printf("Failed to close image %s: %s.\n", imagePath, strerror(errsv));
+		tee.failed = -1;
+	}
+	memFree(block);
+	if(tee.failed) {
+		return -1;
+	}
+
+	if(writeImageHash(imagePath, acquisition->digest) != 0) {
+		return -1;
+	}
+	traceSpan("acquire", "imaging", startNs, "offset", 0, "length", acquisition->bytes);
+	printf("Imaged %" PRIu64 " bytes, SHA-256 %s\n", acquisition->bytes, hex);
+	for(p = 0; p < acquisition->nPartitions; p++) {
+		printf("\tMFT of partition %d %s.\n", p, acquisition->mftCopied[p] ? "copied on the way" : "not found");
+	}
+	printf("\t%" PRIu64 " bytes of metadata behind the stream read back from the image.\n", acquisition->bytesReadBack);
+	return 0;
+}
+
+/**
+ * Retries the regions of errors on the device open at source as retryBadRegions(..), writing
+ * the sectors read into the image at imagePath, then hashes the image again into
+ * acquisition->digest and imagePath.sha256. The sectors written are added to recovered.
+ * Returns the bytes recovered, or -1 if the image could not be patched or hashed.
+ */
+int64_t patchImage(int source, const char *imagePath, Acquisition *acquisition, ErrorMap *errors, uint32_t attempts,
+				   ErrorMap *recovered) {
+	char hex[2*SHA256_DIGEST_LENGTH+1];
+	int64_t bytesRecovered;
+	int image;
+	if((image = open(imagePath, O_RDWR)) == -1) {
+		int errsv = errno;
+		printf("Failed to open image %s to patch it: %s.\n", imagePath, strerror(errsv));
+		return -1;
+	}
+	if((bytesRecovered = retryBadRegions(source, errors, attempts, image, recovered)) > 0 && recovered->nRegions > 0) {
+		/*The digest cannot be updated in place, the whole image is read again */
+		SHA256_CTX hash;
+		char *block = memAlloc( MEM_IO, IMAGE_BLOCK );
+		uint64_t offset = 0;
+		ssize_t n;
+		sha256Init(&hash);
+		while((n = pread(image, block, IMAGE_BLOCK, offset)) > 0) {
+			sha256Update(&hash, block, n);
+			offset += n;
+		}
+		if(n < 0) {
+			int errsv = errno;
+			printf("Failed to read image %s at offset %" PRIu64 ": %s.\n", imagePath, offset, strerror(errsv));
+			bytesRecovered = -1;
+		} else {
+			sha256Final(&hash, acquisition->digest);
+			digestToHex(hex, acquisition->digest, SHA256_DIGEST_LENGTH);
+			printf("Patched %" PRIu64 " regions of image %s, SHA-256 now %s\n", recovered->nRegions, imagePath, hex);
+			if(writeImageHash(imagePath, acquisition->digest) != 0) {
+				bytesRecovered = -1;
+			}
+		}
+		memFree(block);
+	}
+	if(close(image) == -1 && bytesRecovered >= 0) {
+		int errsv = errno;
+		printf("Failed to close image %s: %s.\n", imagePath, strerror(errsv));
+		bytesRecovered = -1;
+	}
+	return bytesRecovered;
+}
+
+#endif /* IMAGING_H_ */
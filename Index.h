@@ -0,0 +1,392 @@
+/*
+ * Index.h
+ *
+ * Reading of an index: the $I30 of a directory, which holds an entry, with a copy of its
+ * $FILE_NAME, for each name in the directory, or a view index of a metafile such as the
+ * $SII of $Secure, whose entries carry data after their key. The entries of the root node are kept with
+ * the directory from its $INDEX_ROOT; the INDX blocks of $INDEX_ALLOCATION are read off
+ * the volume in one go, and those in use per $BITMAP are checked (signature, fixups) and
+ * visited in the order they are stored rather than by walking the B-tree down from the
+ * root. So every entry is seen once, whatever the shape of the tree, but in no particular
+ * order.
+ *
+ * A name is looked up the other way, one node at a time down the B-tree from the root,
+ * comparing names as NTFS collates them: by UTF-16 unit, upper-cased through the $UpCase
+ * of the volume (or as ASCII, without one). Each INDX block on the way is read by itself,
+ * asynchronously, so that many lookups can wait on the device at once.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "Volume.h"
+#include "BlockReader.h"
+#include "Sink.h"
+#include "Memory.h"
+
+#ifndef INDEX_H_
+#define INDEX_H_
+
+#define UPCASE_RECORD 10			/*MFT record number of $UpCase */
+#define UPCASE_LENGTH 65536			/*UTF-16 units in the table of $UpCase */
+#define FILE_NAME_DOS 2				/*Namespace of a $FILE_NAME holding only the 8.3 name */
+#define INDEX_VCN_SIZE 512			/*VCNs of index blocks smaller than a cluster count in these */
+
+/* A read of an INDX block, whose runs may take several reads */
+typedef struct _IndexBlockRead {
+	char *block;
+	uint32_t blockSize;
+	int pending;		/*Reads not yet complete */
+	int error;			/*errno of the first one failing, 0 if none */
+	ReadDone done;		/*Called once the block is read and checked */
+	void *arg;
+} IndexBlockRead;
+
+/* Called for every entry of an index, whose key is already checked to lie within it */
+typedef void (*IndexEntryFound)(void *ctx, File *file, INDEX_ENTRY_HEADER *entry);
+
+/**
+ * Calls found(ctx, ..) for each entry of the index node at node, of at most length bytes
+ * from its header. Returns 0, or -1 if the node is malformed.
+ */
+int visitIndexNode(File *file, char *node, uint32_t length, IndexEntryFound found, void *ctx) {
+	INDEX_NODE_HEADER *header = (INDEX_NODE_HEADER *)node;
+	uint32_t end = header->indexLength < length ? header->indexLength : length;
+	uint32_t offs = header->entriesOffset;
+	if(length < sizeof(INDEX_NODE_HEADER)) {
+		return -1;
+	}
+	while(offs + sizeof(INDEX_ENTRY_HEADER) <= end) {
+		INDEX_ENTRY_HEADER *entry = (INDEX_ENTRY_HEADER *)(node + offs);
+		if(entry->flags & INDEX_ENTRY_LAST) {
+			return 0;
+		}
+		if(entry->entryLength < sizeof(INDEX_ENTRY_HEADER) || offs + entry->entryLength > end ||
+		   sizeof(INDEX_ENTRY_HEADER) + entry->keyLength > entry->entryLength) {
+			return -1;
+		}
+		found(ctx, file, entry);
+		offs += entry->entryLength;
+	}
+	return -1;	/*No last entry */
+}
+
+/**
+ * Returns true if index block b is in use per the bitmap of index. Blocks past the end
+ * of the bitmap, or of an index without one (it was non-resident), count as in use.
+ */
+bool indexBlockInUse(DirectoryIndex *index, uint64_t b) {
+	return !index->bitmap || b/8 >= index->bitmapLength || (index->bitmap[b/8] >> b%8) & 1;
+}
+
+/**
+ * Returns the $FILE_NAME kept as the key of entry of a directory index, or NULL if the key
+ * is too short to hold one.
+ */
+FILE_NAME_ATTR *indexedFileName(INDEX_ENTRY_HEADER *entry) {
+	if(entry->keyLength < offsetof(FILE_NAME_ATTR, arrUnicodeFileName)) {
+		return NULL;
+	}
+	return (FILE_NAME_ATTR *)((char *)entry + sizeof(INDEX_ENTRY_HEADER));
+}
+
+/**
+ * Calls found(ctx, file, ..) for every entry of index, an index of file, reading its INDX
+ * blocks off volume.
+ * Returns the number of nodes which are damaged (bad signature, fixups or entries), or -1
+ * if there is no index or its blocks cannot be read.
+ */
+int visitIndex(Volume *volume, File *file, DirectoryIndex *index, IndexEntryFound found, void *ctx) {
+	uint64_t b;
+	int bad = 0;
+	if(!index || !index->root || index->rootLength < sizeof(INDEX_ROOT_HEADER)) {
+		return -1;
+	}
+	INDEX_ROOT_HEADER *root = (INDEX_ROOT_HEADER *)index->root;
+	if(visitIndexNode(file, (char *)&root->node, index->rootLength - offsetof(INDEX_ROOT_HEADER, node),
+					  found, ctx) != 0) {
+		bad++;
+	}
+	if(!index->runs || index->size == 0) {
+		return bad;
+	}
+	uint32_t blockSize = root->indexBlockSize;
+	if(blockSize < FIXUP_STRIDE || blockSize % FIXUP_STRIDE) {
+		return -1;
+	}
+
+	/*The blocks are streamed as the content of a file */
+	File allocation;
+	memset(&allocation, 0, sizeof(allocation));
+	allocation.recordNumber = file->recordNumber;
+	allocation.runs = index->runs;
+	allocation.realSize = index->size;
+	char *blocks = memAlloc( MEM_METADATA, index->size );
+	char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+	Sink sink = createMemorySink(blocks, index->size);
+	int ret = streamFile(volume, &allocation, &sink, buffer);
+	free(sink.ctx);
+	memFree(buffer);
+	if(ret != 0) {
+		memFree(blocks);
+		return -1;
+	}
+
+	for(b = 0; b < index->size / blockSize; b++) {
+		char *block = blocks + b*blockSize;
+		bool valid = memcmp(block, "INDX", 4) == 0;
+		if(!indexBlockInUse(index, b) || (!valid && (!index->bitmap || b/8 >= index->bitmapLength))) {
+			continue;	/*Free, or not known to be in use and never written */
+		}
+		if(!valid || applyFixup(block, blockSize) != 0 ||
+		   visitIndexNode(file, block + INDX_NODE_OFFSET, blockSize - INDX_NODE_OFFSET, found, ctx) != 0) {
+			bad++;
+		}
+	}
+	memFree(blocks);
+	return bad;
+}
+
+/**
+ * Calls found(ctx, directory, ..) for every entry of the $I30 index of directory.
+ * Returns as visitIndex.
+ */
+int visitDirectoryIndex(Volume *volume, File *directory, IndexEntryFound found, void *ctx) {
+	return visitIndex(volume, directory, directory->index, found, ctx);
+}
+
+/*------------------------------------ Lookups ------------------------------------*/
+
+/**
+ * Reads the table of $UpCase off volume, for the collation of names.
+ * Returns it, or NULL if the volume has none of the right size.
+ *
+ * WARNING: Memory is allocated for the table, need to memFree(..) it.
+ */
+uint16_t *readUpcase(Volume *volume, File **byRecord, uint32_t nRecords) {
+	File *upcase = UPCASE_RECORD < nRecords ? byRecord[UPCASE_RECORD] : NULL;
+	if(!upcase || upcase->realSize != UPCASE_LENGTH*sizeof(uint16_t)) {
+		return NULL;
+	}
+	uint16_t *table = memAlloc( MEM_METADATA, UPCASE_LENGTH*sizeof(uint16_t) );
+	char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+	Sink sink = createMemorySink((char *)table, UPCASE_LENGTH*sizeof(uint16_t));
+	int ret = streamFile(volume, upcase, &sink, buffer);
+	free(sink.ctx);
+	memFree(buffer);
+	if(ret != 0) {
+		memFree(table);
+		return NULL;
+	}
+	return table;
+}
+
+/**
+ * Widens name, one byte per character as the catalog keeps them, into the UTF-16 units of
+ * wide (255 at most). Returns their number, or -1 if name is too long.
+ */
+int widenName(const char *name, uint16_t *wide) {
+	int n;
+	for(n = 0; name[n]; n++) {
+		if(n == 255) {
+			return -1;
+		}
+		wide[n] = (uint8_t)name[n];
+	}
+	return n;
+}
+
+/**
+ * Returns c upper-cased through upcase, or as ASCII if it is NULL.
+ */
+uint16_t upcaseUnit(const uint16_t *upcase, uint16_t c) {
+	if(upcase) {
+		return upcase[c];
+	}
+	return c >= 'a' && c <= 'z' ? c - 'a' + 'A' : c;
+}
+
+/**
+ * Compares the names a and b, of aLength and bLength UTF-16 units, as the $I30 of a
+ * directory is ordered. Returns less than, equal to or more than 0 as strcmp(..).
+ */
+int collateNames(const uint16_t *upcase, const uint16_t *a, uint32_t aLength, const uint16_t *b, uint32_t bLength) {
+	uint32_t k;
+	for(k = 0; k < aLength && k < bLength; k++) {
+		uint16_t ua = upcaseUnit(upcase, a[k]), ub = upcaseUnit(upcase, b[k]);
+		if(ua != ub) {
+			return ua < ub ? -1 : 1;
+		}
+	}
+	return aLength < bLength ? -1 : aLength > bLength;
+}
+
+/**
+ * Returns the VCN of the sub-node of entry, or -1 if it has none.
+ */
+int64_t entrySubnode(INDEX_ENTRY_HEADER *entry) {
+	int64_t vcn;
+	if(!(entry->flags & INDEX_ENTRY_SUBNODE) || entry->entryLength < sizeof(INDEX_ENTRY_HEADER) + sizeof(vcn)) {
+		return -1;
+	}
+	memcpy(&vcn, (char *)entry + entry->entryLength - sizeof(vcn), sizeof(vcn));
+	return vcn;
+}
+
+/**
+ * Searches the directory index node at node, of at most length bytes from its header, for
+ * name (of nameLength UTF-16 units). Sets *fileReference to the file of the entry found;
+ * otherwise sets *subnode to the VCN of the node to search next, or -1 if there is none.
+ * Returns 1 if name was found, 0 if not, -1 if the node is malformed.
+ */
+int searchIndexNode(char *node, uint32_t length, const uint16_t *upcase, const uint16_t *name, uint32_t nameLength,
+					uint64_t *fileReference, int64_t *subnode) {
+	INDEX_NODE_HEADER *header = (INDEX_NODE_HEADER *)node;
+	if(length < sizeof(INDEX_NODE_HEADER)) {
+		return -1;
+	}
+	uint32_t end = header->indexLength < length ? header->indexLength : length;
+	uint32_t offs = header->entriesOffset;
+	while(offs + sizeof(INDEX_ENTRY_HEADER) <= end) {
+		INDEX_ENTRY_HEADER *entry = (INDEX_ENTRY_HEADER *)(node + offs);
+		if(entry->entryLength < sizeof(INDEX_ENTRY_HEADER) || offs + entry->entryLength > end) {
+			return -1;
+		}
+		if(entry->flags & INDEX_ENTRY_LAST) {
+			*subnode = entrySubnode(entry);	/*Past every name of the node */
+			return 0;
+		}
+		if(sizeof(INDEX_ENTRY_HEADER) + entry->keyLength > entry->entryLength) {
+			return -1;
+		}
+		FILE_NAME_ATTR *key = indexedFileName(entry);
+		if(!key || offsetof(FILE_NAME_ATTR, arrUnicodeFileName) + 2*key->bFileNameLength > entry->keyLength) {
+			return -1;
+		}
+		int cmp = collateNames(upcase, name, nameLength, key->arrUnicodeFileName, key->bFileNameLength);
+		if(cmp == 0) {
+			*fileReference = entry->fileReference;
+			return 1;
+		}
+		if(cmp < 0) {
+			*subnode = entrySubnode(entry);
+			return 0;
+		}
+		offs += entry->entryLength;
+	}
+	return -1;	/*No last entry */
+}
+
+/**
+ * Returns the size of the INDX blocks of index, or 0 if it has none or it is not valid.
+ */
+uint32_t indexBlockSize(DirectoryIndex *index) {
+	if(!index || !index->root || index->rootLength < sizeof(INDEX_ROOT_HEADER) || !index->runs) {
+		return 0;
+	}
+	uint32_t blockSize = ((INDEX_ROOT_HEADER *)index->root)->indexBlockSize;
+	return blockSize < FIXUP_STRIDE || blockSize % FIXUP_STRIDE ? 0 : blockSize;
+}
+
+/**
+ * Returns the offset in $INDEX_ALLOCATION of the INDX block of index at vcn.
+ */
+uint64_t indexBlockOffset(Volume *volume, DirectoryIndex *index, int64_t vcn) {
+	uint32_t vcnSize = indexBlockSize(index) >= volume->bytesPerCluster ? volume->bytesPerCluster : INDEX_VCN_SIZE;
+	return (uint64_t)vcn*vcnSize;
+}
+
+/**
+ * Returns where the INDX block of index at vcn starts on the device, for reads to be
+ * ordered by, or UINT64_MAX if it is sparse or past the runs.
+ */
+uint64_t indexBlockLocation(Volume *volume, DirectoryIndex *index, int64_t vcn) {
+	uint64_t offset = indexBlockOffset(volume, index, vcn), runStart = 0;
+	int64_t lcn = 0;
+	DataRun *run;
+	for(run = index->runs; run; run = run->p_next) {
+		uint64_t runBytes = *run->length * volume->bytesPerCluster;
+		if(run->offset) {
+			lcn += *run->offset;
+		}
+		if(offset < runStart + runBytes) {
+			return run->offset ? volume->partitionOffset + lcn*volume->bytesPerCluster + offset - runStart : UINT64_MAX;
+		}
+		runStart += runBytes;
+	}
+	return UINT64_MAX;
+}
+
+void indexBlockRead(void *arg, int error) {
+	IndexBlockRead *read = arg;
+	if(error) {
+		__sync_bool_compare_and_swap(&read->error, 0, error);
+	}
+	if(__sync_sub_and_fetch(&read->pending, 1) > 0) {
+		return;
+	}
+	if(!read->error && (memcmp(read->block, "INDX", 4) != 0 || applyFixup(read->block, read->blockSize) != 0)) {
+		read->error = EIO;	/*Never written, or torn */
+	}
+	read->done(read->arg, read->error);
+	free(read);
+}
+
+/**
+ * Submits the reads of the INDX block of index at vcn into block (as many bytes as the
+ * blocks of index), and returns without waiting. done(arg, error) is called once it is
+ * read and its signature and fixups are checked, as readBlocksAsync(..) calls back.
+ * Returns 0, or -1 with errno set (and done not called) if there is no such block.
+ */
+int readIndexBlockAsync(Volume *volume, DirectoryIndex *index, int64_t vcn, char *block, ReadDone done, void *arg) {
+	uint32_t blockSize = indexBlockSize(index);
+	uint64_t offset = indexBlockOffset(volume, index, vcn), runStart = 0, filled = 0;
+	int64_t lcn = 0;
+	DataRun *run;
+	if(blockSize == 0 || vcn < 0 || offset + blockSize > index->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	IndexBlockRead *read = malloc( sizeof(IndexBlockRead) );
+	read->block = block;
+	read->blockSize = blockSize;
+	read->pending = 1;		/*Held until every read is submitted */
+	read->error = 0;
+	read->done = done;
+	read->arg = arg;
+
+	/*The block is read run by run, so it may lie across runs */
+	for(run = index->runs; run && filled < blockSize; run = run->p_next) {
+		uint64_t runBytes = *run->length * volume->bytesPerCluster;
+		if(run->offset) {
+			lcn += *run->offset;
+		}
+		if(offset + filled < runStart + runBytes) {
+			uint64_t within = offset + filled - runStart;
+			uint64_t length = runBytes - within < blockSize - filled ? runBytes - within : blockSize - filled;
+			if(!run->offset) {	/*Sparse */
+				memset(block + filled, 0, length);
+			} else {
+				__sync_fetch_and_add(&read->pending, 1);
+				readBlocksAsync(volume->reader, volume->partitionOffset + lcn*volume->bytesPerCluster + within,
+								length, block + filled, indexBlockRead, read);
+			}
+			filled += length;
+		}
+		runStart += runBytes;
+	}
+	if(filled < blockSize) {
+		memset(block + filled, 0, blockSize - filled);	/*Past the runs */
+	}
+	indexBlockRead(read, 0);
+	return 0;
+}
+
+#endif /* INDEX_H_ */
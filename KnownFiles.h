@@ -0,0 +1,480 @@
+/*
+ * KnownFiles.h
+ *
+ * Filtering of known files, such as those of the operating system, by the SHA-256 of
+ * their content. A hash set of tens of millions of digests is sorted once into a binary
+ * table saved beside it, which later runs map into memory as it is. A blocked Bloom filter
+ * built over the table answers most lookups from one cache line: a digest picks a block
+ * of 512 bits and one bit in each of its 8 words. Digests the filter passes are confirmed
+ * by a binary search of the table, so the filter's false positives cost only time.
+ * Lookups are counted by each sink and added to the set once it is closed. The hash sink
+ * looks up the digests of its files in batches, each full one timed as a whole, so the
+ * time per lookup reported is that of the filter, not of the clock.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "FileLUT.h"
+#include "Sink.h"
+#include "Hash.h"
+#include "Memory.h"
+#include "Trace.h"
+
+#ifndef KNOWNFILES_H_
+#define KNOWNFILES_H_
+
+#define KNOWN_TABLE_MAGIC "NTFSKNW1"
+#define KNOWN_TABLE_SUFFIX ".sorted"	/*Appended to the name of the hash set */
+#define KNOWN_BLOCK_WORDS 8				/*Words of a filter block, 512 bits, a cache line */
+#define KNOWN_BITS_PER_DIGEST 12		/*Filter bits per digest, for about 0.3% false positives */
+#define KNOWN_SPOOL_BYTES (1024*1024)	/*Held back by the extract sink until a file is known */
+#define KNOWN_LOOKUP_BATCH 64			/*Digests the hash sink looks up at once */
+
+/* Precedes the sorted digests of a saved table */
+typedef struct _KnownTableHeader {
+	char magic[8];
+	uint64_t nDigests;
+	uint64_t sourceSize;		/*Of the hash set the table was sorted from */
+	uint64_t sourceModified;
+} KnownTableHeader;
+
+/* Lookups of a set, counted by one sink */
+typedef struct _KnownCounts {
+	uint64_t lookups;
+	uint64_t filterPassed;
+	uint64_t known;
+	uint64_t knownBytes;		/*Content of the known files dropped */
+	uint64_t timedLookups;		/*Those looked up in timed batches */
+	uint64_t lookupNs;			/*Time of the batches */
+} KnownCounts;
+
+typedef struct _KnownSet {
+	uint8_t *digests;			/*nDigests sorted SHA-256 digests */
+	uint64_t nDigests;
+	void *mapping;				/*The mapped table, NULL when the digests were not saved */
+	size_t mappingLength;
+	uint64_t *blocks;			/*The filter, KNOWN_BLOCK_WORDS words per block */
+	uint64_t nBlocks;
+
+	KnownCounts totals;			/*Of every sink closed, added atomically */
+} KnownSet;
+
+int compareDigests(const void *a, const void *b) {
+	return memcmp(a, b, SHA256_DIGEST_LENGTH);
+}
+
+/**
+ * Returns the filter block of digest, from its first 8 bytes.
+ */
+uint64_t *knownBlock(KnownSet *set, const uint8_t *digest) {
+	uint64_t h;
+	memcpy(&h, digest, sizeof(h));
+	return set->blocks + (uint64_t)(((unsigned __int128)h * set->nBlocks) >> 64)*KNOWN_BLOCK_WORDS;
+}
+
+/**
+ * Builds the filter over the digests of set.
+ *
+ * WARNING: Memory is allocated for the filter, need to freeKnownSet(..)
+ */
+void buildKnownFilter(KnownSet *set) {
+	uint64_t i;
+	int w;
+	set->nBlocks = (set->nDigests*KNOWN_BITS_PER_DIGEST + 64*KNOWN_BLOCK_WORDS - 1) / (64*KNOWN_BLOCK_WORDS);
+	if(set->nBlocks == 0) {
+		set->nBlocks = 1;
+	}
+	set->blocks = memCalloc( MEM_SEARCH, set->nBlocks*KNOWN_BLOCK_WORDS, sizeof(uint64_t) );
+	for(i = 0; i < set->nDigests; i++) {
+		const uint8_t *digest = set->digests + i*SHA256_DIGEST_LENGTH;
+		uint64_t *block = knownBlock(set, digest);
+		for(w = 0; w < KNOWN_BLOCK_WORDS; w++) {
+			block[w] |= 1ULL << (digest[8+w] & 63);
+		}
+	}
+}
+
+/**
+ * Returns whether digest is in set, counting the lookup in counts.
+ */
+bool isKnownDigest(KnownSet *set, const uint8_t *digest, KnownCounts *counts) {
+	uint64_t missing = 0;
+	bool known = false;
+	uint64_t *block = knownBlock(set, digest);
+	int w;
+	for(w = 0; w < KNOWN_BLOCK_WORDS; w++) {	/*Without branches, so it vectorizes */
+		missing |= ~block[w] & (1ULL << (digest[8+w] & 63));
+	}
+	if(missing == 0) {
+		counts->filterPassed++;
+		known = bsearch(digest, set->digests, set->nDigests, SHA256_DIGEST_LENGTH, compareDigests) != NULL;
+	}
+	counts->known += known;
+	counts->lookups++;
+	return known;
+}
+
+/**
+ * Looks up the n digests in set at once, setting known[i] for digest i, and times them
+ * as a whole in counts.
+ */
+void lookupKnownDigests(KnownSet *set, const uint8_t (*digests)[SHA256_DIGEST_LENGTH], uint32_t n, bool *known,
+						KnownCounts *counts) {
+	uint64_t startNs = traceClock();
+	uint32_t i;
+	for(i = 0; i < n; i++) {
+		known[i] = isKnownDigest(set, digests[i], counts);
+	}
+	counts->lookupNs += traceClock() - startNs;
+	counts->timedLookups += n;
+}
+
+/**
+ * Adds the counts of a sink to the totals of set, once the sink is closed.
+ */
+void addKnownCounts(KnownSet *set, KnownCounts *counts) {
+	__sync_fetch_and_add(&set->totals.lookups, counts->lookups);
+	__sync_fetch_and_add(&set->totals.filterPassed, counts->filterPassed);
+	__sync_fetch_and_add(&set->totals.known, counts->known);
+	__sync_fetch_and_add(&set->totals.knownBytes, counts->knownBytes);
+	__sync_fetch_and_add(&set->totals.timedLookups, counts->timedLookups);
+	__sync_fetch_and_add(&set->totals.lookupNs, counts->lookupNs);
+}
+
+/**
+ * Reads the digest which leads line, in hex and perhaps quoted, as in sha256sum output or
+ * a CSV hash set. Returns false if there is none.
+ */
+bool parseDigestLine(const char *line, uint8_t *digest) {
+	int i;
+	while(*line == ' ' || *line == '\t' || *line == '"') {
+		line++;
+	}
+	for(i = 0; i < 2*SHA256_DIGEST_LENGTH; i++) {
+		char c = line[i] | 0x20;
+		int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+		if(value < 0) {
+			return false;
+		}
+		digest[i/2] = i % 2 ? digest[i/2] | value : value << 4;
+	}
+	return !((line[i] >= '0' && line[i] <= '9') || ((line[i] | 0x20) >= 'a' && (line[i] | 0x20) <= 'f'));
+}
+
+/**
+ * Maps the table saved at tablePath if it was sorted from a hash set of size bytes last
+ * modified at modified. Returns 0, or -1 if there is no such table.
+ */
+int mapKnownTable(char *tablePath, uint64_t size, uint64_t modified, KnownSet *set) {
+	KnownTableHeader header;
+	struct stat st;
+	int fd;
+	if((fd = open(tablePath, O_RDONLY)) == -1) {
+		return -1;
+	}
+	if(fstat(fd, &st) == -1 || read(fd, &header, sizeof(header)) != sizeof(header) ||
+	   memcmp(header.magic, KNOWN_TABLE_MAGIC, sizeof(header.magic)) != 0 ||
+	   header.sourceSize != size || header.sourceModified != modified ||
+	   (uint64_t)st.st_size != sizeof(header) + header.nDigests*SHA256_DIGEST_LENGTH) {
+		close(fd);
+		return -1;
+	}
+	set->mappingLength = st.st_size;
+	if((set->mapping = mmap(NULL, set->mappingLength, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		set->mapping = NULL;
+		close(fd);
+		return -1;
+	}
+	close(fd);	/*The mapping stays valid */
+	set->digests = (uint8_t *)set->mapping + sizeof(header);
+	set->nDigests = header.nDigests;
+	return 0;
+}
+
+/**
+ * Loads the hash set at path, a SHA-256 digest in hex leading each line, into set with
+ * its filter. The first time, the digests are sorted and saved as a table at
+ * <path>.sorted, which later runs map instead while the hash set is unchanged.
+ * Returns 0, or -1 if the hash set cannot be read.
+ *
+ * WARNING: Memory is allocated for the set, need to freeKnownSet(..)
+ */
+int loadKnownSet(char *path, KnownSet *set) {
+	char tablePath[BUFSIZ], line[BUFSIZ];
+	struct stat st;
+	uint64_t i, capacity = 0, nSkipped = 0;
+	FILE *in;
+
+	memset(set, 0, sizeof(KnownSet));
+	if(stat(path, &st) == -1 || (in = fopen(path, "r")) == NULL) {
+		int errsv = errno;
+		printf("Failed to open hash set %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	snprintf(tablePath, sizeof(tablePath), "%s%s", path, KNOWN_TABLE_SUFFIX);
+	if(mapKnownTable(tablePath, st.st_size, st.st_mtime, set) == 0) {
+		fclose(in);
+		printf("Mapped %" PRIu64 " known digests from %s.\n", set->nDigests, tablePath);
+		buildKnownFilter(set);
+		return 0;
+	}
+
+	/*Parse and sort the hash set, then save it sorted */
+	while(fgets(line, sizeof(line), in)) {
+		if(set->nDigests == capacity) {
+			capacity = capacity ? 2*capacity : 65536;
+			set->digests = memRealloc( MEM_SEARCH, set->digests, capacity*SHA256_DIGEST_LENGTH );
+		}
+		if(parseDigestLine(line, set->digests + set->nDigests*SHA256_DIGEST_LENGTH)) {
+			set->nDigests++;
+		} else {
+			nSkipped++;	/*A header or comment */
+		}
+	}
+	fclose(in);
+	qsort(set->digests, set->nDigests, SHA256_DIGEST_LENGTH, compareDigests);
+	uint64_t nUnique = set->nDigests ? 1 : 0;
+	for(i = 1; i < set->nDigests; i++) {
+		uint8_t *digest = set->digests + i*SHA256_DIGEST_LENGTH;
+		if(memcmp(digest, set->digests + (nUnique-1)*SHA256_DIGEST_LENGTH, SHA256_DIGEST_LENGTH) != 0) {
+			memmove(set->digests + nUnique*SHA256_DIGEST_LENGTH, digest, SHA256_DIGEST_LENGTH);
+			nUnique++;
+		}
+	}
+	printf("Read %" PRIu64 " known digests (%" PRIu64 " distinct) from %s, %" PRIu64 " other lines skipped.\n",
+		   set->nDigests, nUnique, path, nSkipped);
+	set->nDigests = nUnique;
+
+	KnownTableHeader header;
+	FILE *out = fopen(tablePath, "w");
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KNOWN_TABLE_MAGIC, sizeof(header.magic));
+	header.nDigests = set->nDigests;
+	header.sourceSize = st.st_size;
+	header.sourceModified = st.st_mtime;
+	bool saved = out && fwrite(&header, sizeof(header), 1, out) == 1 &&
+				 (!set->nDigests || fwrite(set->digests, SHA256_DIGEST_LENGTH, set->nDigests, out) == set->nDigests);
+	if(out && fclose(out) != 0) {
+		saved = false;
+	}
+	if(!saved) {
+		int errsv = errno;
+		printf("Failed to save sorted hash set %s: %s.\n", tablePath, strerror(errsv));
+		unlink(tablePath);
+	} else {
+		printf("Saved sorted hash set %s.\n", tablePath);
+	}
+	buildKnownFilter(set);
+	return 0;
+}
+
+void freeKnownSet(KnownSet *set) {
+	if(set->mapping) {
+		munmap(set->mapping, set->mappingLength);
+	} else {
+		memFree(set->digests);
+	}
+	memFree(set->blocks);
+	memset(set, 0, sizeof(KnownSet));
+}
+
+/**
+ * Prints the size of the filter and table of set and how its lookups went.
+ */
+void printKnownSetReport(KnownSet *set) {
+	uint64_t filterBytes = set->nBlocks*KNOWN_BLOCK_WORDS*sizeof(uint64_t);
+	KnownCounts *totals = &set->totals;
+	printf("Known files: %" PRIu64 " dropped, %" PRIu64 " bytes. Filter %.1f MB (%.1f bits per digest), "
+		   "table %.1f MB %s.\n", totals->known, totals->knownBytes, filterBytes/1048576.0,
+		   set->nDigests ? 8.0*filterBytes/set->nDigests : 0.0,
+		   (double)set->nDigests*SHA256_DIGEST_LENGTH/1048576.0, set->mapping ? "mapped" : "in memory");
+	printf("%" PRIu64 " lookups, %" PRIu64 " passed the filter (%" PRIu64 " false positives)", totals->lookups,
+		   totals->filterPassed, totals->filterPassed - totals->known);
+	if(totals->timedLookups) {	/*Only full batches of the hash sink are timed */
+		printf(", %.0f ns per lookup, %.2f M lookups/s per thread over %" PRIu64 " timed in batches",
+			   (double)totals->lookupNs/totals->timedLookups,
+			   totals->lookupNs ? 1000.0*totals->timedLookups/totals->lookupNs : 0.0, totals->timedLookups);
+	}
+	printf(".\n");
+}
+
+/*------------------------------- Known hash sink --------------------------------*/
+
+/* The hash sink, leaving out files of a known set. The digests of its files are held and
+ * looked up KNOWN_LOOKUP_BATCH at a time, then those not known are printed. */
+typedef struct _KnownHashCtx {
+	SHA256_CTX hash;
+	KnownSet *known;
+	uint64_t length;
+	KnownCounts counts;
+	uint32_t nPending;
+	uint8_t digests[KNOWN_LOOKUP_BATCH][SHA256_DIGEST_LENGTH];
+	File *files[KNOWN_LOOKUP_BATCH];
+	uint64_t lengths[KNOWN_LOOKUP_BATCH];
+} KnownHashCtx;
+
+/**
+ * Looks up the digests held by hash, timing them if they are a full batch, and prints
+ * those of files not known.
+ */
+void flushKnownHashes(KnownHashCtx *hash) {
+	bool known[KNOWN_LOOKUP_BATCH];
+	uint32_t i;
+	if(hash->nPending == KNOWN_LOOKUP_BATCH) {
+		lookupKnownDigests(hash->known, (const uint8_t (*)[SHA256_DIGEST_LENGTH])hash->digests, hash->nPending, known,
+						   &hash->counts);
+	} else {
+		for(i = 0; i < hash->nPending; i++) {	/*The last few, or the one file of a sweep sink */
+			known[i] = isKnownDigest(hash->known, hash->digests[i], &hash->counts);
+		}
+	}
+	for(i = 0; i < hash->nPending; i++) {
+		if(known[i]) {
+			hash->counts.knownBytes += hash->lengths[i];
+		} else {
+			printDigest(hash->digests[i], hash->files[i]);
+		}
+	}
+	hash->nPending = 0;
+}
+
+int knownHashBegin(void *ctx, File *file) {
+	KnownHashCtx *hash = ctx;
+	sha256Init(&hash->hash);
+	hash->length = 0;
+	return 0;
+}
+
+int knownHashWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	KnownHashCtx *hash = ctx;
+	sha256Update(&hash->hash, data, length);
+	hash->length += length;
+	return 0;
+}
+
+int knownHashEnd(void *ctx, File *file) {
+	KnownHashCtx *hash = ctx;
+	sha256Final(&hash->hash, hash->digests[hash->nPending]);
+	hash->files[hash->nPending] = file;
+	hash->lengths[hash->nPending++] = hash->length;
+	if(hash->nPending == KNOWN_LOOKUP_BATCH) {
+		flushKnownHashes(hash);
+	}
+	return 0;
+}
+
+void knownHashClose(void *ctx) {
+	KnownHashCtx *hash = ctx;
+	flushKnownHashes(hash);
+	addKnownCounts(hash->known, &hash->counts);
+}
+
+Sink createKnownHashSink(KnownSet *known) {
+	KnownHashCtx *hash = malloc( sizeof(KnownHashCtx) );
+	hash->known = known;
+	hash->nPending = 0;
+	memset(&hash->counts, 0, sizeof(KnownCounts));
+	Sink sink = { knownHashBegin, knownHashWrite, knownHashEnd, hash, 0, knownHashClose };
+	return sink;
+}
+
+/*------------------------------- Known extract sink -------------------------------*/
+
+/* The extract sink, leaving out files of a known set. The first KNOWN_SPOOL_BYTES of a file
+ * are held until its end, so a small known file is never written; a larger one is written
+ * as it comes and removed at its end if it turns out to be known. */
+typedef struct _KnownExtractCtx {
+	ExtractCtx extract;
+	SHA256_CTX hash;
+	KnownSet *known;
+	KnownCounts counts;
+	uint64_t length;
+	bool writing;		/*The file was too large to hold, its output file is open */
+	int error;
+	char spool[KNOWN_SPOOL_BYTES];
+} KnownExtractCtx;
+
+int knownExtractBegin(void *ctx, File *file) {
+	KnownExtractCtx *extract = ctx;
+	sha256Init(&extract->hash);
+	extract->length = 0;
+	extract->writing = false;
+	extract->error = 0;
+	return 0;
+}
+
+int knownExtractWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	KnownExtractCtx *extract = ctx;
+	sha256Update(&extract->hash, data, length);
+	if(!extract->writing && extract->length + length <= KNOWN_SPOOL_BYTES) {
+		memcpy(extract->spool + extract->length, data, length);
+		extract->length += length;
+		return 0;
+	}
+	if(!extract->writing) {	/*Too large to hold, write out what was held */
+		extract->writing = true;
+		if((extract->error = extractBegin(&extract->extract, file)) == 0 && extract->length) {
+			extract->error = extractWrite(&extract->extract, file, 0, extract->spool, extract->length);
+		}
+	}
+	extract->length += length;
+	if(extract->error == 0) {
+		extract->error = extractWrite(&extract->extract, file, fileOffset, data, length);
+	}
+	return extract->error;
+}
+
+int knownExtractEnd(void *ctx, File *file) {
+	KnownExtractCtx *extract = ctx;
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	char path[MAX_PATH_LENGTH];
+	sha256Final(&extract->hash, digest);
+	bool known = isKnownDigest(extract->known, digest, &extract->counts);
+	if(known) {
+		extract->counts.knownBytes += extract->length;
+	}
+	if(extract->writing) {
+		int ret = extractEnd(&extract->extract, file);
+		if(known) {
+			extractPath(extract->extract.outputDir, file, path);
+			unlink(path);
+			return 0;
+		}
+		return extract->error ? extract->error : ret;
+	}
+	if(known) {
+		return 0;
+	}
+	if(extractBegin(&extract->extract, file) != 0 ||
+	   (extract->length && extractWrite(&extract->extract, file, 0, extract->spool, extract->length) != 0)) {
+		extractEnd(&extract->extract, file);
+		return -1;
+	}
+	return extractEnd(&extract->extract, file);
+}
+
+void knownExtractClose(void *ctx) {
+	KnownExtractCtx *extract = ctx;
+	addKnownCounts(extract->known, &extract->counts);
+}
+
+Sink createKnownExtractSink(char *outputDir, KnownSet *known) {
+	KnownExtractCtx *extract = malloc( sizeof(KnownExtractCtx) );
+	extract->extract.outputDir = outputDir;
+	extract->extract.out = NULL;
+	extract->known = known;
+	memset(&extract->counts, 0, sizeof(KnownCounts));
+	Sink sink = { knownExtractBegin, knownExtractWrite, knownExtractEnd, extract, 0, knownExtractClose };
+	return sink;
+}
+
+#endif /* KNOWNFILES_H_ */
@@ -0,0 +1,480 @@
+/*
+ * MFTRecord.h
+ *
+ * Parsing of FILE records from a local copy of the MFT into the list of files.
+ */
+
+#include <pthread.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "RunList.h"
+#include "FileLUT.h"
+#include "Debug.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef MFTRECORD_H_
+#define MFTRECORD_H_
+
+/* Running totals kept while processing the FILE records of an MFT */
+typedef struct _ScanCounters {
+	int countRecords;
+	int countFiles;
+	int countDir;
+	int countDelEntity;
+	int countOther;
+	int countBadAttr;
+	int countBadFixup;
+	int countFileNames;
+	int countFrags;
+	int countCorrupt;	/*Records with neither a FILE nor a FRAG signature */
+} ScanCounters;
+
+/* A local copy of the MFT, as written while extracting it, mapped into memory */
+typedef struct _MFTCopy {
+	char *records;		/*FILE and FRAG records, MFT_RECORD_LENGTH bytes each */
+	uint64_t nSlots;	/*Number of records in the copy, FRAG records included */
+	size_t length;
+} MFTCopy;
+
+/**
+ * Returns true if the record in mftBuffer is a fragment record written while copying the MFT.
+ */
+bool isFragRecord(char *mftBuffer) {
+	return mftBuffer[0] == 'F' && mftBuffer[1] == 'R' && mftBuffer[2] == 'A' && mftBuffer[3] == 'G';
+}
+
+/**
+ * Returns true if the record in mftBuffer starts with signature 'FILE0'.
+ */
+bool isFileRecord(char *mftBuffer) {
+	return strncmp(mftBuffer, "FILE0", 5) == 0;
+}
+
+/**
+ * Returns true if attr is named name, which is plain ASCII.
+ */
+bool isAttributeNamed(NTFS_ATTRIBUTE *attr, const char *name) {
+	size_t i, length = strlen(name);
+	uint16_t *attrName = (uint16_t *)((char *)attr + attr->wNameOffset);
+	if(attr->uchNameLength != length || attr->wNameOffset + 2*length > attr->dwFullLength) {
+		return false;
+	}
+	for(i = 0; i < length; i++) {
+		if(attrName[i] != (uint8_t)name[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Keeps in *index (allocated when first needed) the part of an index found in attr, at
+ * attrOffset in the record in mftBuffer: the $INDEX_ROOT, the first extent of the
+ * $INDEX_ALLOCATION or a resident $BITMAP. Repeats of a part already kept are ignored.
+ * Returns true if attr was one of them.
+ *
+ * WARNING: Memory is allocated for *index, need to freeDirectoryIndex(..)
+ */
+bool keepIndexAttribute(DirectoryIndex **index, NTFS_ATTRIBUTE *attr, char *mftBuffer, uint16_t attrOffset) {
+	DirectoryIndex *kept = *index;
+
+	/*Resident, the root node */
+	if(attr->dwType == INDEX_ROOT && attr->uchNonResFlag == false && !(kept && kept->root)) {
+		uint32_t length = (attr->Attr.Resident).dwLength;
+		if(length <= attr->dwFullLength - (attr->Attr.Resident).wAttrOffset) {
+			kept = kept ? kept : memCalloc( MEM_CATALOG, 1, sizeof(DirectoryIndex) );
+			kept->root = memAlloc( MEM_CATALOG, length ? length : 1 );
+			kept->rootLength = length;
+			memcpy(kept->root, mftBuffer+attrOffset+(attr->Attr.Resident).wAttrOffset, length);
+		}
+	}
+
+	/*Always non-resident, the INDX blocks */
+	else if(attr->dwType == INDEX_ALLOCATION && attr->uchNonResFlag == true &&
+			(attr->Attr).NonResident.n64StartVCN == 0 && !(kept && kept->runs)) {
+		uint32_t countRuns;
+		uint16_t dataRunOffset = (attr->Attr).NonResident.wDatarunOffset;
+		if(dataRunOffset < attr->dwFullLength) {
+			kept = kept ? kept : memCalloc( MEM_CATALOG, 1, sizeof(DirectoryIndex) );
+			kept->runs = decodeRunList(mftBuffer+attrOffset+dataRunOffset,
+									   attr->dwFullLength-dataRunOffset, &countRuns);
+			kept->size = (attr->Attr).NonResident.n64RealSize;
+		}
+	}
+
+	/*Which index blocks are in use */
+	else if(attr->dwType == BITMAP && attr->uchNonResFlag == false && !(kept && kept->bitmap)) {
+		uint32_t length = (attr->Attr.Resident).dwLength;
+		if(length > 0 && length <= attr->dwFullLength - (attr->Attr.Resident).wAttrOffset) {
+			kept = kept ? kept : memCalloc( MEM_CATALOG, 1, sizeof(DirectoryIndex) );
+			kept->bitmap = memAlloc( MEM_CATALOG, length );
+			kept->bitmapLength = length;
+			memcpy(kept->bitmap, mftBuffer+attrOffset+(attr->Attr.Resident).wAttrOffset, length);
+		}
+	}
+
+	else {
+		return false;
+	}
+	*index = kept;
+	return true;
+}
+
+/**
+ * Decodes the value of a $REPARSE_POINT, of length bytes at data. The substitute name of
+ * a symbolic link or mount point is kept as its target, "\??\C:\Users" becoming
+ * "C:/Users"; other tags are kept alone.
+ * Returns NULL if the value is malformed.
+ *
+ * WARNING: Memory is allocated for the reparse point and its target, need to memFree(..) both.
+ */
+ReparsePoint *decodeReparsePoint(char *data, uint32_t length) {
+	REPARSE_POINT_HEADER *header = (REPARSE_POINT_HEADER *)data;
+	if(length < sizeof(REPARSE_POINT_HEADER) || sizeof(REPARSE_POINT_HEADER) + header->dataLength > length) {
+		return NULL;
+	}
+	ReparsePoint *reparse = memCalloc( MEM_CATALOG, 1, sizeof(ReparsePoint) );
+	reparse->tag = header->tag;
+	if(header->tag != IO_REPARSE_TAG_MOUNT_POINT && header->tag != IO_REPARSE_TAG_SYMLINK) {
+		return reparse;
+	}
+
+	/*Mount points lack the flags before the path buffer */
+	LINK_REPARSE_DATA *link = (LINK_REPARSE_DATA *)(data + sizeof(REPARSE_POINT_HEADER));
+	uint32_t pathOffset = header->tag == IO_REPARSE_TAG_SYMLINK ? sizeof(LINK_REPARSE_DATA) :
+																 offsetof(LINK_REPARSE_DATA, flags);
+	if(header->dataLength < pathOffset ||
+	   pathOffset + link->substituteNameOffset + link->substituteNameLength > header->dataLength) {
+		memFree(reparse);
+		return NULL;
+	}
+	reparse->relative = header->tag == IO_REPARSE_TAG_SYMLINK && (link->flags & SYMLINK_FLAG_RELATIVE);
+	uint16_t *name = (uint16_t *)((char *)link + pathOffset + link->substituteNameOffset);
+	uint32_t k, n = 0, nameLength = link->substituteNameLength/2;
+	if(nameLength >= 4 && name[0] == '\\' && name[1] == '?' && name[2] == '?' && name[3] == '\\') {
+		name += 4;
+		nameLength -= 4;
+	}
+	reparse->target = memAlloc( MEM_NAMES, nameLength + 1 );
+	for(k = 0; k < nameLength; k++) {
+		uint16_t c;
+		memcpy(&c, name + k, sizeof(c));	/*The path buffer need not be aligned */
+		if((c & 0xFF) > 20) {
+			reparse->target[n++] = (c & 0xFF) == '\\' ? '/' : c & 0xFF;
+		}
+	}
+	reparse->target[n] = '\0';
+	return reparse;
+}
+
+/**
+ * Keeps the parts of the index named name found among the attributes of record, a FILE
+ * record of a scanned MFT copy. Returns the index, or NULL if the record has none.
+ *
+ * WARNING: Memory is allocated for the index, need to freeDirectoryIndex(..)
+ */
+DirectoryIndex *readCopiedIndex(char *record, const char *name) {
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	DirectoryIndex *index = NULL;
+	uint16_t attrOffset = header->wAttribOffset;
+	while(attrOffset+8 < header->dwRecLength && attrOffset+8 < MFT_RECORD_LENGTH) {
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+attrOffset);
+		if(attr->dwType == 0xFFFFFFFF || attr->dwFullLength > MFT_RECORD_LENGTH-attrOffset || attr->dwFullLength == 0) {
+			break;
+		}
+		if(isAttributeNamed(attr, name)) {
+			keepIndexAttribute(&index, attr, record, attrOffset);
+		}
+		attrOffset += attr->dwFullLength;
+	}
+	return index;
+}
+
+/**
+ * Processes the attributes of one FILE record held in mftBuffer (fixups already applied),
+ * and adds the file it describes to the head of files.
+ * fragOffset is the offset on disk of the MFT fragment the record was copied from.
+ *
+ * Returns the new head of the list of files.
+ */
+File *parseFileRecord(File *files, char *mftBuffer, uint64_t fragOffset, ScanCounters *counters) {
+	STAT_SCOPE(TIMER_PARSE);
+	NTFS_MFT_FILE_ENTRY_HEADER *mftFileH = (NTFS_MFT_FILE_ENTRY_HEADER *)mftBuffer;
+	NTFS_ATTRIBUTE *mftRecAttr;
+	char * aFileName = NULL;
+	uint64_t realSize = 0;
+	DataRun *runs = NULL;
+	char *residentData = NULL;
+	DirectoryIndex *index = NULL;
+	uint32_t securityId = 0;
+	ReparsePoint *reparse = NULL;
+	uint8_t *objectId = NULL;
+
+	/*Check file flags on record, determine record type */
+	uint16_t mftFlags = mftFileH->wFlags;
+	uint64_t parentReference = 0;
+	if(!(mftFlags & IN_USE)) {
+		counters->countDelEntity++;
+	} else if(mftFlags == IN_USE) {
+		counters->countFiles++;
+	} else if(mftFlags == (IN_USE|DIRECTORY)) {
+		counters->countDir++;
+	} else {
+		counters->countOther++;
+		DEBUG_PRINT("%u\t", mftFlags);
+	}
+
+	/*---------------------------- Get MFT Record attributes ---------------------------*/
+	uint16_t attrOffset = mftFileH->wAttribOffset; 	 	    /*Offset to first attribute */
+	do {
+		mftRecAttr = (NTFS_ATTRIBUTE *)(mftBuffer+attrOffset);
+
+		/*- NOTE: Some attributes have impossible record lengths > 1024, this breaks things -*/
+		if(mftRecAttr->dwFullLength > MFT_RECORD_LENGTH-attrOffset || mftRecAttr->dwFullLength == 0) {
+			if(DEBUG) {
+				printf("Bad record attribute of type %u and length %u in record %u\n",
+						mftRecAttr->dwType, mftRecAttr->dwFullLength, mftFileH->dwMFTRecNumber);
+			}
+			counters->countBadAttr++;
+			break;
+		}
+
+		if(mftRecAttr->dwType == STANDARD_INFORMATION) {
+			/*The security ID is there from NTFS 3.0 on */
+			if(mftRecAttr->uchNonResFlag == false &&
+			   mftRecAttr->Attr.Resident.dwLength >= offsetof(STD_INFORMATION, quota2KONLY) &&
+			   mftRecAttr->Attr.Resident.wAttrOffset + offsetof(STD_INFORMATION, quota2KONLY) <= mftRecAttr->dwFullLength) {
+				memcpy(&securityId, mftBuffer+attrOffset+mftRecAttr->Attr.Resident.wAttrOffset+
+					   offsetof(STD_INFORMATION, securityID2KONLY), sizeof(uint32_t));
+			}
+			if(DEBUG) {
+				STD_INFORMATION *stdInfo = (STD_INFORMATION *)(mftBuffer+attrOffset+mftRecAttr->Attr.Resident.wAttrOffset);
+				uint32_t fileP = getFilePermissions(stdInfo);
+				printf("%" PRIu32 " ", fileP);
+			}
+		}
+
+		/*---------------------------- Get file name from record ---------------------------*/
+		/*------------------ Generally have more than one per actual file ------------------*/
+		else if(mftRecAttr->dwType == FILE_NAME) { 					/*If is FILE_NAME attribute */
+			memFree(aFileName);	/*The last name is kept */
+			aFileName = getFileName(mftRecAttr, mftBuffer, attrOffset);
+			if(mftRecAttr->uchNonResFlag == false && mftRecAttr->Attr.Resident.dwLength >= sizeof(uint64_t) &&
+			   mftRecAttr->Attr.Resident.wAttrOffset + sizeof(uint64_t) <= mftRecAttr->dwFullLength) {
+				memcpy(&parentReference, mftBuffer+attrOffset+mftRecAttr->Attr.Resident.wAttrOffset, sizeof(uint64_t));
+			}
+			counters->countFileNames++;
+		}
+
+		/*Parts of the $I30 index of a directory */
+		else if((mftRecAttr->dwType == INDEX_ROOT || mftRecAttr->dwType == INDEX_ALLOCATION ||
+				 mftRecAttr->dwType == BITMAP) && isAttributeNamed(mftRecAttr, "$I30")) {
+			keepIndexAttribute(&index, mftRecAttr, mftBuffer, attrOffset);
+		}
+
+		/*The GUID by which link tracking finds the file */
+		else if(mftRecAttr->dwType == OBJECT_ID && mftRecAttr->uchNonResFlag == false && !objectId &&
+				(mftRecAttr->Attr.Resident).dwLength >= GUID_LENGTH &&
+				(mftRecAttr->Attr.Resident).wAttrOffset + GUID_LENGTH <= mftRecAttr->dwFullLength) {
+			objectId = memAlloc( MEM_CATALOG, GUID_LENGTH );
+			memcpy(objectId, mftBuffer+attrOffset+(mftRecAttr->Attr.Resident).wAttrOffset, GUID_LENGTH);
+		}
+
+		/*Junctions, symbolic links and the like; their data is small enough to stay resident */
+		else if(mftRecAttr->dwType == REPARSE_POINT && mftRecAttr->uchNonResFlag == false && !reparse &&
+				(mftRecAttr->Attr.Resident).dwLength <= mftRecAttr->dwFullLength - (mftRecAttr->Attr.Resident).wAttrOffset) {
+			reparse = decodeReparsePoint(mftBuffer+attrOffset+(mftRecAttr->Attr.Resident).wAttrOffset,
+										 (mftRecAttr->Attr.Resident).dwLength);
+		}
+
+		/*-------------- Keep the location of the unnamed $DATA stream (not ADS) -------------*/
+		else if(mftRecAttr->dwType == DATA && mftRecAttr->uchNameLength == 0 && !runs && !residentData) {
+			if(mftRecAttr->uchNonResFlag==false) { /*Is resident */
+				realSize = (mftRecAttr->Attr.Resident).dwLength;
+				if(realSize <= mftRecAttr->dwFullLength - (mftRecAttr->Attr.Resident).wAttrOffset) {
+					residentData = memAlloc( MEM_CATALOG, realSize + 1 );
+					memcpy(residentData, mftBuffer+attrOffset+(mftRecAttr->Attr.Resident).wAttrOffset, realSize);
+				}
+			} else if((mftRecAttr->Attr).NonResident.n64StartVCN == 0) { /*First extent of the stream */
+				uint32_t countRuns;
+				uint16_t dataRunOffset = (mftRecAttr->Attr).NonResident.wDatarunOffset;
+				realSize = (mftRecAttr->Attr).NonResident.n64RealSize;
+				if(dataRunOffset < mftRecAttr->dwFullLength) {
+					runs = decodeRunList(mftBuffer+attrOffset+dataRunOffset,
+										 mftRecAttr->dwFullLength-dataRunOffset, &countRuns);
+				}
+			}
+		}
+
+		attrOffset += mftRecAttr->dwFullLength; /*Increment the offset by the length of this attribute */
+	} while(attrOffset+8 < mftFileH->dwRecLength); /*While there are attributes left to inspect */
+	counters->countRecords++;
+	STAT_INC(STAT_RECORDS_PARSED);
+
+	{
+		STAT_SCOPE(TIMER_CATALOG);
+		files = addFile(files, aFileName, fragOffset, mftFileH->dwMFTRecNumber);
+	}
+	files->recordFlags = mftFlags;
+	files->sequence = mftFileH->wSequence;
+	files->parentReference = parentReference;
+	files->realSize = realSize;
+	files->runs = runs;
+	files->residentData = residentData;
+	files->index = index;
+	files->securityId = securityId;
+	files->reparse = reparse;
+	files->objectId = objectId;
+	return files;
+}
+
+/**
+ * Maps the local MFT copy at path into memory. The mapping is private, so fixups can be
+ * applied in place without touching the copy on disk.
+ * Returns 0, or -1 if the copy cannot be opened or mapped.
+ */
+int openMFTCopy(char *path, MFTCopy *copy) {
+	struct stat st;
+	int fd;
+	if((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+		int errsv = errno;
+		printf("Failed to open MFT copy %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	copy->nSlots = st.st_size / MFT_RECORD_LENGTH;
+	copy->length = copy->nSlots*MFT_RECORD_LENGTH;
+	copy->records = NULL;
+	if(copy->length > 0 &&
+	   (copy->records = mmap(NULL, copy->length, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		int errsv = errno;
+		printf("Failed to map MFT copy %s: %s.\n", path, strerror(errsv));
+		close(fd);
+		return -1;
+	}
+	close(fd);	/*The mapping stays valid */
+	return 0;
+}
+
+void closeMFTCopy(MFTCopy *copy) {
+	if(copy->records) {
+		munmap(copy->records, copy->length);
+	}
+	copy->records = NULL;
+}
+
+/**
+ * Returns the base FILE record in use for recordNumber in copy, once it has been scanned
+ * (so its fixups are applied), or NULL if there is none.
+ */
+char *findCopiedRecord(MFTCopy *copy, uint32_t recordNumber) {
+	uint64_t slot;
+	for(slot = 0; slot < copy->nSlots; slot++) {
+		char *record = copy->records + slot*MFT_RECORD_LENGTH;
+		NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+		if(isFileRecord(record) && header->dwMFTRecNumber == recordNumber &&
+		   (header->wFlags & IN_USE) && header->n64BaseMftRec == 0) {
+			return record;
+		}
+	}
+	return NULL;
+}
+
+/* A range of the slots of an MFT copy, scanned by one thread */
+typedef struct _ScanRange {
+	MFTCopy *copy;
+	uint64_t first, last;	/*Slots first to last-1 */
+	File *head, *tail;		/*Files found, head is the last record scanned */
+	ScanCounters counters;
+} ScanRange;
+
+void *scanRange(void *arg) {
+	ScanRange *range = arg;
+	uint64_t fragOffset = 0, slot;
+	traceThreadName("scan");
+
+	/*The records of the range follow the nearest FRAG record before it */
+	for(slot = range->first; slot-- > 0; ) {
+		char *record = range->copy->records + slot*MFT_RECORD_LENGTH;
+		if(isFragRecord(record)) {
+			fragOffset = ((FRAG *)record)->u64fragOffset;
+			break;
+		}
+	}
+
+	/*Parsing is traced in batches of records, a span per record would swamp the trace */
+	uint64_t batchFirst = range->first, traceStartNs = traceStart();
+	for(slot = range->first; slot < range->last; slot++) {
+		char *mftBuffer = range->copy->records + slot*MFT_RECORD_LENGTH;
+		/*Fragment records keep track of the MFT fragment from which records originated */
+		if(isFragRecord(mftBuffer)) {
+			fragOffset = ((FRAG *)mftBuffer)->u64fragOffset;
+			DEBUG_PRINT("MFT Fragment record found, offset for the records that follow: %" PRIu64 "\n", fragOffset);
+			range->counters.countFrags++;
+		} else if(isFileRecord(mftBuffer)) {
+			bool badFixup = applyFixup(mftBuffer, MFT_RECORD_LENGTH) != 0;
+			if(badFixup) {
+				range->counters.countBadFixup++;
+			}
+			range->head = parseFileRecord(range->head, mftBuffer, fragOffset, &range->counters);
+			range->head->badFixup = badFixup;
+			if(!range->tail) {
+				range->tail = range->head;
+			}
+		} else {
+			range->counters.countCorrupt++;
+		}
+		if(slot+1 - batchFirst == TRACE_BATCH_RECORDS || slot+1 == range->last) {
+			traceSpan("parse", "scan", traceStartNs, "first", batchFirst, "records", slot+1 - batchFirst);
+			batchFirst = slot+1;
+			traceStartNs = traceStart();
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Parses every FILE record of copy into *files, sharing the slots out among nThreads
+ * threads in contiguous ranges. As when scanning sequentially, the head of the list is
+ * the last record of the copy. Totals are added to counters.
+ *
+ * Returns the number of records which were neither FILE nor FRAG records.
+ */
+int scanMFTCopy(MFTCopy *copy, int nThreads, File **files, ScanCounters *counters) {
+	ScanRange *ranges = calloc( nThreads, sizeof(ScanRange) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	int t;
+	for(t = 0; t < nThreads; t++) {
+		ranges[t].copy = copy;
+		ranges[t].first = copy->nSlots*t/nThreads;
+		ranges[t].last = copy->nSlots*(t+1)/nThreads;
+		pthread_create(&threads[t], NULL, scanRange, &ranges[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		/*Chain the earlier ranges after this one */
+		if(ranges[t].head) {
+			ranges[t].tail->p_next = *files;
+			*files = ranges[t].head;
+		}
+		counters->countRecords += ranges[t].counters.countRecords;
+		counters->countFiles += ranges[t].counters.countFiles;
+		counters->countDir += ranges[t].counters.countDir;
+		counters->countDelEntity += ranges[t].counters.countDelEntity;
+		counters->countOther += ranges[t].counters.countOther;
+		counters->countBadAttr += ranges[t].counters.countBadAttr;
+		counters->countBadFixup += ranges[t].counters.countBadFixup;
+		counters->countFileNames += ranges[t].counters.countFileNames;
+		counters->countFrags += ranges[t].counters.countFrags;
+		counters->countCorrupt += ranges[t].counters.countCorrupt;
+	}
+	free(threads);
+	free(ranges);
+	return counters->countCorrupt;
+}
+
+#endif /* MFTRECORD_H_ */
@@ -0,0 +1,207 @@
+/*
+ * Matcher.h
+ *
+ * Search of a buffer for many byte strings at once with an Aho-Corasick automaton, its
+ * failure links folded into a complete transition table so that each byte costs one
+ * lookup. While the automaton is at its root, positions at which no pattern can start
+ * are skipped 16 at a time with SSE2, comparing against the distinct two byte prefixes of
+ * the patterns (or through a table of those prefixes without SSE2).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "Memory.h"
+
+#ifndef MATCHER_H_
+#define MATCHER_H_
+
+#define MATCHER_MAX_PATTERNS 64		/*One bit each in a state's matches */
+
+typedef struct _Matcher {
+	uint32_t (*next)[256];			/*Complete transition table */
+	uint64_t *matches;				/*Patterns ending on entering each state */
+	uint32_t nStates;
+	const uint8_t *patterns[MATCHER_MAX_PATTERNS];
+	uint32_t lengths[MATCHER_MAX_PATTERNS];
+	uint32_t nPatterns;
+	uint32_t maxLength;
+	bool prefilter;					/*False when a pattern is a single byte */
+	uint8_t pairFirst[MATCHER_MAX_PATTERNS], pairSecond[MATCHER_MAX_PATTERNS];	/*Distinct two byte prefixes */
+	uint32_t nPairs;
+	uint8_t pairSet[65536/8];		/*Bit per two byte prefix of a pattern */
+#ifdef __SSE2__
+	__m128i vecFirst[MATCHER_MAX_PATTERNS], vecSecond[MATCHER_MAX_PATTERNS];	/*The prefixes, broadcast */
+#endif
+} Matcher;
+
+/* Called for every match, with the index of the pattern and where in the buffer it starts */
+typedef void (*MatchFound)(void *ctx, uint32_t pattern, size_t start);
+
+/**
+ * Builds the automaton matching the nPatterns patterns, which must outlive it.
+ * Returns NULL if there are none, more than MATCHER_MAX_PATTERNS, or one is empty.
+ *
+ * WARNING: Memory is allocated for the matcher, need to freeMatcher(..) it.
+ */
+Matcher *createMatcher(const uint8_t **patterns, const uint32_t *lengths, uint32_t nPatterns) {
+	uint32_t p, i, c, head = 0, tail = 0, maxStates = 1;
+	if(nPatterns == 0 || nPatterns > MATCHER_MAX_PATTERNS) {
+		return NULL;
+	}
+	for(p = 0; p < nPatterns; p++) {
+		if(lengths[p] == 0) {
+			return NULL;
+		}
+		maxStates += lengths[p];
+	}
+
+	Matcher *matcher = memCalloc( MEM_SEARCH, 1, sizeof(Matcher) );
+	int32_t (*trie)[256] = memAlloc( MEM_SEARCH, maxStates*sizeof(*trie) );
+	uint32_t *fail = memAlloc( MEM_SEARCH, maxStates*sizeof(uint32_t) );
+	uint32_t *queue = memAlloc( MEM_SEARCH, maxStates*sizeof(uint32_t) );
+	matcher->next = memAlloc( MEM_SEARCH, maxStates*sizeof(*matcher->next) );
+	matcher->matches = memCalloc( MEM_SEARCH, maxStates, sizeof(uint64_t) );
+	matcher->nPatterns = nPatterns;
+	matcher->prefilter = true;
+
+	/*The trie of the patterns */
+	memset(trie, 0xFF, maxStates*sizeof(*trie));
+	matcher->nStates = 1;
+	for(p = 0; p < nPatterns; p++) {
+		uint32_t state = 0;
+		matcher->patterns[p] = patterns[p];
+		matcher->lengths[p] = lengths[p];
+		for(i = 0; i < lengths[p]; i++) {
+			uint8_t byte = patterns[p][i];
+			if(trie[state][byte] < 0) {
+				trie[state][byte] = matcher->nStates++;
+			}
+			state = trie[state][byte];
+		}
+		matcher->matches[state] |= 1ULL << p;
+		if(lengths[p] > matcher->maxLength) {
+			matcher->maxLength = lengths[p];
+		}
+
+		if(lengths[p] < 2) {
+			matcher->prefilter = false;	/*Any byte may start a match */
+			continue;
+		}
+		uint16_t pair = patterns[p][0] << 8 | patterns[p][1];
+		if(!(matcher->pairSet[pair/8] & (1 << pair%8))) {
+			matcher->pairSet[pair/8] |= 1 << pair%8;
+			matcher->pairFirst[matcher->nPairs] = patterns[p][0];
+			matcher->pairSecond[matcher->nPairs++] = patterns[p][1];
+		}
+	}
+
+#ifdef __SSE2__
+	for(p = 0; p < matcher->nPairs; p++) {
+		matcher->vecFirst[p] = _mm_set1_epi8(matcher->pairFirst[p]);
+		matcher->vecSecond[p] = _mm_set1_epi8(matcher->pairSecond[p]);
+	}
+#endif
+
+	/*Failure links, breadth first, folded into a complete transition table */
+	for(c = 0; c < 256; c++) {
+		if(trie[0][c] < 0) {
+			matcher->next[0][c] = 0;
+		} else {
+			matcher->next[0][c] = trie[0][c];
+			fail[trie[0][c]] = 0;
+			queue[tail++] = trie[0][c];
+		}
+	}
+	while(head < tail) {
+		uint32_t r = queue[head++];
+		matcher->matches[r] |= matcher->matches[fail[r]];
+		for(c = 0; c < 256; c++) {
+			if(trie[r][c] < 0) {
+				matcher->next[r][c] = matcher->next[fail[r]][c];
+			} else {
+				uint32_t s = trie[r][c];
+				fail[s] = matcher->next[fail[r]][c];
+				matcher->next[r][c] = s;
+				queue[tail++] = s;
+			}
+		}
+	}
+	memFree(queue);
+	memFree(fail);
+	memFree(trie);
+	return matcher;
+}
+
+void freeMatcher(Matcher *matcher) {
+	if(matcher) {
+		memFree(matcher->next);
+		memFree(matcher->matches);
+		memFree(matcher);
+	}
+}
+
+/**
+ * Returns the first position from i at which the two byte prefix of some pattern starts,
+ * or length if there is none.
+ */
+size_t nextCandidate(Matcher *matcher, const uint8_t *data, size_t i, size_t length) {
+	if(!matcher->prefilter) {
+		return i;
+	}
+#ifdef __SSE2__
+	uint32_t p;
+	while(i + 17 <= length) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(data+i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(data+i+1));
+		__m128i hit = _mm_setzero_si128();
+		for(p = 0; p < matcher->nPairs; p++) {
+			hit = _mm_or_si128(hit, _mm_and_si128(_mm_cmpeq_epi8(v0, matcher->vecFirst[p]),
+												  _mm_cmpeq_epi8(v1, matcher->vecSecond[p])));
+		}
+		int mask = _mm_movemask_epi8(hit);
+		if(mask) {
+			return i + __builtin_ctz(mask);
+		}
+		i += 16;
+	}
+#endif
+	for(; i+1 < length; i++) {
+		uint16_t pair = data[i] << 8 | data[i+1];
+		if(matcher->pairSet[pair/8] & (1 << pair%8)) {
+			return i;
+		}
+	}
+	return length;
+}
+
+/**
+ * Searches length bytes of data for every pattern, calling found(ctx, ..) for each match
+ * lying wholly inside it, in the order the matches end.
+ */
+void matcherScan(Matcher *matcher, const uint8_t *data, size_t length, MatchFound found, void *ctx) {
+	uint32_t state = 0;
+	size_t i = 0;
+	while(i < length) {
+		if(state == 0 && (i = nextCandidate(matcher, data, i, length)) >= length) {
+			break;
+		}
+		state = matcher->next[state][data[i]];
+		if(matcher->matches[state]) {
+			uint64_t matches = matcher->matches[state];
+			while(matches) {
+				uint32_t p = __builtin_ctzll(matches);
+				found(ctx, p, i+1 - matcher->lengths[p]);
+				matches &= matches - 1;
+			}
+		}
+		i++;
+	}
+}
+
+#endif /* MATCHER_H_ */
@@ -0,0 +1,187 @@
+/*
+ * Memory.h
+ *
+ * Allocation accounting by subsystem. Memory owned by run lists, names, the catalog of
+ * files, the block cache, I/O buffers and volume metadata is taken with memAlloc(..)
+ * under its tag and given back with memFree(..).
+ * Built with -DNTFS_STATS=1, each block carries a small header recording its tag and
+ * size, and current bytes, peak bytes and allocation counts are kept per tag for the
+ * stats report. Otherwise these are plain malloc(..) and free(..).
+ * Large tables are mapped with memMap(..) instead, zero filled and paged in on use.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#ifndef MEMORY_H_
+#define MEMORY_H_
+
+#ifndef NTFS_STATS
+#define NTFS_STATS 0
+#endif
+
+typedef enum _MemTag {
+	MEM_RUNLISTS,		/*DataRun lists and their lengths and offsets */
+	MEM_NAMES,			/*File names converted from FILE_NAME attributes */
+	MEM_CATALOG,		/*File entries, their resident data and indexes over them */
+	MEM_CACHE,			/*Block cache */
+	MEM_IO,				/*Read and stream buffers */
+	MEM_METADATA,		/*Partition tables, boot sectors, attribute copies, bitmaps */
+	MEM_SEARCH,			/*Search automata, carving and grep hits */
+	MEM_TAGS
+} MemTag;
+
+#if NTFS_STATS
+
+static const char *memTagNames[MEM_TAGS] = {
+	"runlists", "names", "catalog", "cache", "io buffers", "metadata", "search"
+};
+
+/* Totals of one tag, updated atomically by every thread */
+typedef struct _MemUsage {
+	int64_t currentBytes;
+	int64_t peakBytes;
+	uint64_t allocs;
+	uint64_t frees;
+} MemUsage;
+
+/* Precedes every accounted block, 16 bytes to keep the block aligned */
+typedef struct _MemHeader {
+	uint64_t size;
+	uint64_t tag;
+} MemHeader;
+
+MemUsage memUsage[MEM_TAGS];
+
+/**
+ * Adds bytes to the current bytes of tag, raising its peak, and counts an allocation
+ * when blocks is 1 or a free when it is -1 (0 for a resize).
+ */
+void memAccount(MemTag tag, int64_t bytes, int blocks) {
+	MemUsage *usage = &memUsage[tag];
+	int64_t current = __sync_add_and_fetch(&usage->currentBytes, bytes);
+	int64_t peak;
+	while(current > (peak = usage->peakBytes) &&
+		  !__sync_bool_compare_and_swap(&usage->peakBytes, peak, current)) {
+	}
+	if(blocks > 0) {
+		__sync_fetch_and_add(&usage->allocs, 1);
+	} else if(blocks < 0) {
+		__sync_fetch_and_add(&usage->frees, 1);
+	}
+}
+
+void *memAlloc(MemTag tag, size_t size) {
+	MemHeader *header = malloc( sizeof(MemHeader) + size );
+	if(!header) {
+		return NULL;
+	}
+	header->size = size;
+	header->tag = tag;
+	memAccount(tag, size, 1);
+	return header + 1;
+}
+
+void *memCalloc(MemTag tag, size_t count, size_t size) {
+	void *p = memAlloc(tag, count*size);
+	if(p) {
+		memset(p, 0, count*size);
+	}
+	return p;
+}
+
+/**
+ * Resizes p, allocated under tag, to size bytes. p may be NULL.
+ */
+void *memRealloc(MemTag tag, void *p, size_t size) {
+	MemHeader *header = p ? (MemHeader *)p - 1 : NULL;
+	int64_t oldSize = header ? header->size : 0;
+	if(!(header = realloc( header, sizeof(MemHeader) + size ))) {
+		return NULL;
+	}
+	header->size = size;
+	header->tag = tag;
+	memAccount(tag, (int64_t)size - oldSize, p ? 0 : 1);
+	return header + 1;
+}
+
+void memFree(void *p) {
+	if(p) {
+		MemHeader *header = (MemHeader *)p - 1;
+		memAccount(header->tag, -(int64_t)header->size, -1);
+		free(header);
+	}
+}
+
+/**
+ * Maps size bytes of zeroed anonymous memory under tag, or returns NULL.
+ * Give it back with memUnmap(..) and the same size.
+ */
+void *memMap(MemTag tag, size_t size) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(p == MAP_FAILED) {
+		return NULL;
+	}
+	memAccount(tag, size, 1);
+	return p;
+}
+
+void memUnmap(MemTag tag, void *p, size_t size) {
+	if(p) {
+		memAccount(tag, -(int64_t)size, -1);
+		munmap(p, size);
+	}
+}
+
+/**
+ * Prints the current and peak bytes and allocation counts of every tag to out.
+ */
+void printMemoryStats(FILE *out) {
+	int64_t current = 0, peak = 0;
+	int i;
+	fprintf(out, "Memory:\t%-13s %14s %14s %12s %12s\n", "", "current bytes", "peak bytes", "allocs", "frees");
+	for(i = 0; i < MEM_TAGS; i++) {
+		fprintf(out, "\t%-20s %14" PRId64 " %14" PRId64 " %12" PRIu64 " %12" PRIu64 "\n", memTagNames[i],
+				memUsage[i].currentBytes, memUsage[i].peakBytes, memUsage[i].allocs, memUsage[i].frees);
+		current += memUsage[i].currentBytes;
+		peak += memUsage[i].peakBytes;
+	}
+	fprintf(out, "\t%-20s %14" PRId64 " %14" PRId64 " (sum of the peaks)\n", "total", current, peak);
+}
+
+#else
+
+static inline void *memAlloc(MemTag tag, size_t size) {
+	return malloc(size);
+}
+
+static inline void *memCalloc(MemTag tag, size_t count, size_t size) {
+	return calloc(count, size);
+}
+
+static inline void *memRealloc(MemTag tag, void *p, size_t size) {
+	return realloc(p, size);
+}
+
+static inline void memFree(void *p) {
+	free(p);
+}
+
+static inline void *memMap(MemTag tag, size_t size) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static inline void memUnmap(MemTag tag, void *p, size_t size) {
+	if(p) {
+		munmap(p, size);
+	}
+}
+
+#endif /* NTFS_STATS */
+
+#endif /* MEMORY_H_ */
@@ -1,4 +1,9 @@
 #include "Debug.h"
+#include "Stats.h"
+#include "Memory.h"
+
+#ifndef NTFSATTRIBUTES_H_
+#define NTFSATTRIBUTES_H_
 
 /*NTFS Attribute types */
 #define STANDARD_INFORMATION 0x10	/*MFT Record attribute constants */
@@ -32,6 +37,20 @@
 #define	NOTINDEXED 	0x2000
 #define ENCRYPTED	0X4000
 
+/*Reparse points */
+#define IO_REPARSE_TAG_MOUNT_POINT	0xA0000003	/*Junctions and volume mount points */
+#define IO_REPARSE_TAG_SYMLINK		0xA000000C
+#define SYMLINK_FLAG_RELATIVE		0x0001
+
+#define GUID_LENGTH 16	/*Bytes of an object ID */
+
+/*Security descriptors */
+#define SE_DACL_PRESENT		0x0004	/*Control flags */
+#define SE_SELF_RELATIVE	0x8000
+#define ACE_ACCESS_ALLOWED	0		/*ACE types */
+#define ACE_ACCESS_DENIED	1
+#define SDS_ALIGNMENT		16		/*Entries of $Secure:$SDS start on it */
+
 #pragma pack(push, 1) /*Pack structures to a one byte alignment */
 
 	typedef struct _STD_INFORMATION {
@@ -44,7 +63,7 @@
 		uint32_t	versionNum;
 		uint32_t	classID;
 		uint32_t	ownerID2KONLY;		//Unused beyond win2k
-		uint32_t	securityID2KONLY;	//Unused beyond win2k
+		uint32_t	securityID2KONLY;	//Key into $Secure:$SII, from NTFS 3.0
 		uint64_t	quota2KONLY;		//Unused beyond win2k
 		uint64_t	updSeqNum2KONLY;	//Unused beyond win2k
 	} STD_INFORMATION;
@@ -69,6 +88,81 @@
 		char	arrUnicodeVolumeName[255];
 	} VOLUME_NAME_ATTR;
 
+	/*Value of $OBJECT_ID; the birth and domain IDs are often left out */
+	typedef struct _OBJECT_ID_ATTR {
+		uint8_t		objectId[GUID_LENGTH];
+		uint8_t		birthVolumeId[GUID_LENGTH];
+		uint8_t		birthObjectId[GUID_LENGTH];
+		uint8_t		domainId[GUID_LENGTH];
+	} OBJECT_ID_ATTR;
+
+	/*Data of an entry of $Extend\$ObjId:$O, whose key is the object ID */
+	typedef struct _OBJECT_ID_INDEX_DATA {
+		uint64_t	fileReference;
+		uint8_t		birthVolumeId[GUID_LENGTH];
+		uint8_t		birthObjectId[GUID_LENGTH];
+		uint8_t		domainId[GUID_LENGTH];
+	} OBJECT_ID_INDEX_DATA;
+
+	/*Value of $REPARSE_POINT, followed by dataLength bytes particular to the tag */
+	typedef struct _REPARSE_POINT_HEADER {
+		uint32_t	tag;
+		uint16_t	dataLength;
+		uint16_t	reserved;
+	} REPARSE_POINT_HEADER;
+
+	/*Data of a mount point or symbolic link: the names are found in the path buffer which
+	  follows, after the flags of a symbolic link. Offsets and lengths are in bytes */
+	typedef struct _LINK_REPARSE_DATA {
+		uint16_t	substituteNameOffset;
+		uint16_t	substituteNameLength;
+		uint16_t	printNameOffset;
+		uint16_t	printNameLength;
+		uint32_t	flags;				/*SYMLINK_FLAG_RELATIVE, symbolic links only */
+	} LINK_REPARSE_DATA;
+
+	/*Header of each security descriptor in $Secure:$SDS, and the data of an entry of $SII */
+	typedef struct _SDS_ENTRY_HEADER {
+		uint32_t	hash;
+		uint32_t	securityId;
+		uint64_t	offset;				/*Of the entry in $SDS */
+		uint32_t	length;				/*Of the entry, header and descriptor */
+	} SDS_ENTRY_HEADER;
+
+	/*A self-relative security descriptor. Offsets are from its start, 0 for a part it lacks */
+	typedef struct _SECURITY_DESCRIPTOR_HEADER {
+		BYTE		revision;
+		BYTE		padding;
+		uint16_t	control;			/*SE_DACL_PRESENT, SE_SELF_RELATIVE */
+		uint32_t	ownerOffset;
+		uint32_t	groupOffset;
+		uint32_t	saclOffset;
+		uint32_t	daclOffset;
+	} SECURITY_DESCRIPTOR_HEADER;
+
+	/*A SID, followed by subAuthorityCount 32 bit sub-authorities */
+	typedef struct _SID_HEADER {
+		BYTE		revision;
+		BYTE		subAuthorityCount;
+		BYTE		authority[6];		/*Big endian */
+	} SID_HEADER;
+
+	/*An access control list, followed by aceCount ACEs */
+	typedef struct _ACL_HEADER {
+		BYTE		revision;
+		BYTE		padding;
+		uint16_t	size;				/*Of the list, ACEs included */
+		uint16_t	aceCount;
+		uint16_t	padding2;
+	} ACL_HEADER;
+
+	/*Header of an ACE. An allowed or denied ACE follows it with an access mask, then the SID */
+	typedef struct _ACE_HEADER {
+		BYTE		type;				/*ACE_ACCESS_ALLOWED, ACE_ACCESS_DENIED */
+		BYTE		flags;
+		uint16_t	size;
+	} ACE_HEADER;
+
 #pragma pack(pop)
 
 /**
@@ -88,19 +182,22 @@ uint32_t getFilePermissions(STD_INFORMATION *stdInfo) {
  * 	WARNING: Memory is allocated for asciiFileName, need to free the returned pointer.
  */
 char * getFileName(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs ) {
+	STAT_SCOPE(TIMER_NAME);
 	char * asciiFileName;
 
-	if(!mftRecAttr->dwType == FILE_NAME) { /*Make sure this is a FILE_NAME attribute */
+	if(mftRecAttr->dwType != FILE_NAME) { /*Make sure this is a FILE_NAME attribute */
 		return NULL;
 	}
 
-	FILE_NAME_ATTR *fileNameAttr = malloc( mftRecAttr->Attr.Resident.dwLength + 1 );
+	FILE_NAME_ATTR *fileNameAttr = memAlloc( MEM_NAMES, mftRecAttr->Attr.Resident.dwLength + 1 );
 	memcpy(fileNameAttr, mftBuffer+offs+(mftRecAttr->Attr).Resident.wAttrOffset,
 										(mftRecAttr->Attr).Resident.dwLength);
 
 	uint16_t* wFileName = fileNameAttr->arrUnicodeFileName;
 
-	asciiFileName = malloc( fileNameAttr->bFileNameLength + 1 );
+	asciiFileName = memAlloc( MEM_NAMES, fileNameAttr->bFileNameLength + 1 );
+	STAT_INC(STAT_NAMES_CONVERTED);
+	STAT_HIST(HIST_NAME_LENGTH, fileNameAttr->bFileNameLength);
 	*asciiFileName = '\0';
 
 	int  k;
@@ -125,6 +222,37 @@ char * getFileName(NTFS_ATTRIBUTE *mftRecAttr, char *mftBuffer, uint16_t offs )
 		printf("\n");
 	}
 
-	free(fileNameAttr);
+	memFree(fileNameAttr);
 	return asciiFileName;
 }
+
+/**
+ * Walks the attribute headers of the FILE record in mftBuffer, starting with the attribute
+ * at offs, and returns the offset of the first one of type attrType (0 matches any type).
+ * Pass the offset of the previous match plus its length to continue the walk.
+ *
+ * Returns 0 when the end marker or the used size of the record is reached, or an
+ * attribute length is implausible.
+ */
+uint16_t findAttribute(char *mftBuffer, uint16_t offs, uint32_t attrType) {
+	uint32_t recLength = ((NTFS_MFT_FILE_ENTRY_HEADER *)mftBuffer)->dwRecLength;
+	if(recLength > MFT_RECORD_LENGTH) {
+		recLength = MFT_RECORD_LENGTH;
+	}
+	while(offs+8 < recLength) {
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(mftBuffer+offs);
+		if(attr->dwType == 0xFFFFFFFF) { /*End of attributes marker */
+			return 0;
+		}
+		if(attr->dwFullLength < 16 || attr->dwFullLength > recLength-offs) {
+			return 0;
+		}
+		if(attrType == 0 || attr->dwType == attrType) {
+			return offs;
+		}
+		offs += attr->dwFullLength;
+	}
+	return 0;
+}
+
+#endif /* NTFSATTRIBUTES_H_ */
@@ -1,6 +1,18 @@
+#ifndef NTFSSTRUCT_H_
+#define NTFSSTRUCT_H_
+
+#include "Stats.h"
+#include "Memory.h"
+
 typedef unsigned char BYTE; /*Define byte symbolic abbreviation */
 
 #define FRAG_PADDING 1008
+#define MFT_RECORD_LENGTH 1024 	/*MFT entries are 1024 bytes long */
+#define FIXUP_STRIDE 512		/*Update sequence numbers protect the end of every 512 bytes */
+#define IN_USE		0x01		/*MFT FILE0 record flags */
+#define DIRECTORY	0x02
+#define MFT_RECORD 0			/*MFT record number of $MFT */
+#define BITMAP_RECORD 6			/*MFT record number of $Bitmap */
 
 #pragma pack(push, 1) /*Pack structures to a one byte alignment */
 	typedef struct _PARTITION { 	/*NTFS partition table struct */
@@ -176,17 +188,57 @@ typedef unsigned char BYTE; /*Define byte symbolic abbreviation */
 		uint16_t fileNameNamespace;
 	} NTATTR_INDEX_RECORD_ENTRY;
 	/*Unicode file name string is found directly after the end of the index record entry structure */
+
+	/*Header of a node of an index, after the $INDEX_ROOT header or at INDX_NODE_OFFSET in an INDX block */
+	typedef struct _INDEX_NODE_HEADER {
+		uint32_t entriesOffset;		/*Offset to the first entry, from the start of this header */
+		uint32_t indexLength;		/*Bytes in use, from the start of this header */
+		uint32_t allocatedLength;
+		uint8_t flags;				/*INDEX_NODE_LARGE: the entries have sub-nodes */
+		uint8_t padding[3];
+	} INDEX_NODE_HEADER;
+
+	/*Value of an $INDEX_ROOT attribute, the root node follows */
+	typedef struct _INDEX_ROOT_HEADER {
+		uint32_t attrType;			/*Attribute indexed, FILE_NAME for a directory */
+		uint32_t collationRule;
+		uint32_t indexBlockSize;	/*Bytes per INDX block in $INDEX_ALLOCATION */
+		uint8_t clustersPerIndexBlock;
+		uint8_t padding[3];
+		INDEX_NODE_HEADER node;
+	} INDEX_ROOT_HEADER;
+
+	/*Header of every index entry, followed by its key: a $FILE_NAME in a directory. The VCN of
+	  the sub-node ends the entry when it has one */
+	typedef struct _INDEX_ENTRY_HEADER {
+		union {
+			uint64_t fileReference;		/*In a directory index */
+			struct {
+				uint16_t dataOffset;	/*From the start of the entry */
+				uint16_t dataLength;
+				uint32_t reserved;
+			} data;						/*In a view index, such as $Secure:$SII */
+		};
+		uint16_t entryLength;
+		uint16_t keyLength;
+		uint32_t flags;				/*INDEX_ENTRY_SUBNODE, INDEX_ENTRY_LAST */
+	} INDEX_ENTRY_HEADER;
 #pragma pack(pop)
 
+#define INDX_NODE_OFFSET 0x18		/*The node header of an INDX block */
+#define INDEX_NODE_LARGE 0x01
+#define INDEX_ENTRY_SUBNODE 0x01
+#define INDEX_ENTRY_LAST 0x02
+
 /**
  *	Create a Fragment record which contains the offset from which the MFT records
  *	which follow were copied. This is necessary to determine the absolute offset
  *	to resident attributes (i.e. files < ~900B
  *
- *	WARNING: Memory is allocated but not free()'d.
+ *	WARNING: Memory is allocated, need to memFree(..) the returned pointer.
  */
 FRAG *createFragRecord(uint64_t fragOffset) {
-	FRAG *fragRec = malloc( sizeof(FRAG) );
+	FRAG *fragRec = memAlloc( MEM_METADATA, sizeof(FRAG) );
 	if(fragRec != NULL) {
 		fragRec->fileSignature[0] = 'F';
 		fragRec->fileSignature[1] = 'R';
@@ -199,3 +251,42 @@ FRAG *createFragRecord(uint64_t fragOffset) {
 	}
 	return fragRec;
 }
+
+/**
+ * Applies the update sequence (fixup) array of a multi-sector record in place, for FILE
+ * and INDX records alike. On disk the last two bytes of every 512 byte stride are replaced
+ * by the update sequence number, the original bytes are kept in the fixup array which
+ * follows it.
+ *
+ * Returns 0 on success, or -1 if the fixup array is malformed or a stride does not end in
+ * the update sequence number, i.e. the record was torn by an interrupted write.
+ */
+int applyFixup(char *record, uint32_t recordLength) {
+	STAT_SCOPE(TIMER_FIXUP);
+	uint16_t fixupOffset, fixupSize;
+	memcpy(&fixupOffset, record+4, sizeof(uint16_t)); /*Same position in FILE and INDX headers */
+	memcpy(&fixupSize, record+6, sizeof(uint16_t));
+
+	/*One entry for the sequence number, then one per stride */
+	if(fixupSize < 2 || (uint32_t)(fixupSize-1)*FIXUP_STRIDE > recordLength ||
+	   fixupOffset + 2*fixupSize > recordLength) {
+		STAT_INC(STAT_FIXUPS_FAILED);
+		return -1;
+	}
+
+	uint16_t *fixupArray = (uint16_t *)(record+fixupOffset);
+	int i, ret = 0;
+	for(i = 1; i < fixupSize; i++) {
+		uint16_t *strideEnd = (uint16_t *)(record + i*FIXUP_STRIDE - sizeof(uint16_t));
+		if(*strideEnd != fixupArray[0]) {
+			ret = -1;	/*Torn write, restore what we can */
+		}
+		*strideEnd = fixupArray[i];
+	}
+	if(ret != 0) {
+		STAT_INC(STAT_FIXUPS_FAILED);
+	}
+	return ret;
+}
+
+#endif /* NTFSSTRUCT_H_ */
@@ -0,0 +1,234 @@
+/*
+ * ObjectId.h
+ *
+ * Lookup of files by object ID, the GUID link tracking keeps in the $OBJECT_ID of a file
+ * to find it again after it is moved. $Extend\$ObjId holds the object IDs of the volume
+ * in its $O index, each entry keyed by a GUID with the file reference as its data. The
+ * entries are read once into an array sorted by GUID, so a lookup is a binary search,
+ * and checked against the object IDs kept in the catalog from the files themselves.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "MFTRecord.h"
+#include "Volume.h"
+#include "Sink.h"
+#include "Index.h"
+#include "Memory.h"
+
+#ifndef OBJECTID_H_
+#define OBJECTID_H_
+
+#define GUID_STRING_LENGTH 39	/*{xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx} */
+
+/* An entry of $ObjId:$O */
+typedef struct _ObjectIdEntry {
+	uint8_t guid[GUID_LENGTH];
+	uint64_t fileReference;
+} ObjectIdEntry;
+
+/* The object IDs of a volume, sorted by GUID */
+typedef struct _ObjectIdTable {
+	ObjectIdEntry *entries;
+	uint64_t nEntries, capacity;
+	uint64_t nBad;				/*Entries too short to hold a GUID and file reference */
+} ObjectIdTable;
+
+/**
+ * Writes guid to string (GUID_STRING_LENGTH bytes) in registry form: the first three
+ * groups are little endian.
+ */
+void guidString(const uint8_t *guid, char *string) {
+	snprintf(string, GUID_STRING_LENGTH, "{%02x%02x%02x%02x-%02x%02x-%02x%02x-%02x%02x-%02x%02x%02x%02x%02x%02x}",
+			 guid[3], guid[2], guid[1], guid[0], guid[5], guid[4], guid[7], guid[6],
+			 guid[8], guid[9], guid[10], guid[11], guid[12], guid[13], guid[14], guid[15]);
+}
+
+/**
+ * Reads string, a GUID in registry form with or without its braces, into guid.
+ * Returns false if it is not one.
+ */
+bool parseGuid(const char *string, uint8_t *guid) {
+	static const int order[GUID_LENGTH] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+	int k = 0, nibbles = 0;
+	uint8_t byte = 0;
+	const char *c = string;
+	if(*c == '{') {
+		c++;
+	}
+	for(; *c && *c != '}' && k < GUID_LENGTH; c++) {
+		int value;
+		if(*c == '-') {
+			continue;
+		}
+		if(*c >= '0' && *c <= '9') {
+			value = *c - '0';
+		} else if((*c | 0x20) >= 'a' && (*c | 0x20) <= 'f') {
+			value = (*c | 0x20) - 'a' + 10;
+		} else {
+			return false;
+		}
+		byte = byte << 4 | value;
+		if(++nibbles == 2) {
+			guid[order[k++]] = byte;
+			nibbles = 0;
+		}
+	}
+	return k == GUID_LENGTH && (*c == '\0' || (*c == '}' && c[1] == '\0' && *string == '{'));
+}
+
+/**
+ * Called for each entry of $O: the key is the GUID, the data starts with the file reference.
+ */
+void loadObjectIdEntry(void *ctx, File *objIds, INDEX_ENTRY_HEADER *entry) {
+	ObjectIdTable *table = ctx;
+	if(entry->keyLength < GUID_LENGTH || entry->data.dataLength < sizeof(uint64_t) ||
+	   entry->data.dataOffset + entry->data.dataLength > entry->entryLength) {
+		table->nBad++;
+		return;
+	}
+	if(table->nEntries == table->capacity) {
+		table->capacity = table->capacity ? 2*table->capacity : 256;
+		table->entries = memRealloc( MEM_METADATA, table->entries, table->capacity*sizeof(ObjectIdEntry) );
+	}
+	ObjectIdEntry *loaded = &table->entries[table->nEntries++];
+	memcpy(loaded->guid, (char *)entry + sizeof(INDEX_ENTRY_HEADER), GUID_LENGTH);
+	memcpy(&loaded->fileReference, (char *)entry + entry->data.dataOffset, sizeof(uint64_t));
+}
+
+int compareObjectIds(const void *a, const void *b) {
+	return memcmp(a, b, GUID_LENGTH);	/*The GUID leads each entry */
+}
+
+/**
+ * Loads the entries of $Extend\$ObjId:$O into table, sorted by GUID. The record of
+ * $ObjId is parsed again from copy for its $O index, which the catalog does not keep.
+ * Returns 0, or -1 if $ObjId or its index is missing or cannot be read.
+ *
+ * WARNING: Memory is allocated for the table, need to freeObjectIdTable(..)
+ */
+int loadObjectIdTable(Volume *volume, File *files, MFTCopy *copy, ObjectIdTable *table) {
+	File *objIds = findExtendFile(files, "$ObjId");
+	char *record = objIds && !objIds->badFixup ? findCopiedRecord(copy, objIds->recordNumber) : NULL;
+	memset(table, 0, sizeof(ObjectIdTable));
+	if(!record) {
+		printf("No $Extend\\$ObjId found.\n");
+		return -1;
+	}
+	DirectoryIndex *index = readCopiedIndex(record, "$O");
+	int bad = visitIndex(volume, objIds, index, loadObjectIdEntry, table);
+	freeDirectoryIndex(index);
+	if(bad < 0) {
+		printf("$ObjId:$O is missing or cannot be read.\n");
+		memFree(table->entries);
+		table->entries = NULL;
+		return -1;
+	}
+	if(bad > 0) {
+		printf("$ObjId:$O has %d damaged index nodes.\n", bad);
+	}
+	qsort(table->entries, table->nEntries, sizeof(ObjectIdEntry), compareObjectIds);
+	return 0;
+}
+
+void freeObjectIdTable(ObjectIdTable *table) {
+	memFree(table->entries);
+	memset(table, 0, sizeof(ObjectIdTable));
+}
+
+/**
+ * Returns the entry of table for guid, or NULL.
+ */
+ObjectIdEntry *findObjectId(ObjectIdTable *table, const uint8_t *guid) {
+	return bsearch(guid, table->entries, table->nEntries, sizeof(ObjectIdEntry), compareObjectIds);
+}
+
+/**
+ * Writes where entry of $O leads into description (size bytes): the path of the file in
+ * use it references, or why there is none. Returns the file, or NULL.
+ */
+File *describeObjectId(ObjectIdEntry *entry, File **byRecord, uint32_t nRecords, char *description, size_t size) {
+	uint64_t record = entry->fileReference & FILE_REFERENCE_RECORD;
+	uint16_t sequence = entry->fileReference >> 48;
+	File *file = record < nRecords ? byRecord[record] : NULL;
+	if(!file || !(file->recordFlags & IN_USE) || (sequence && file->sequence && sequence != file->sequence)) {
+		snprintf(description, size, "record %" PRIu64 " (no longer in use)", record);
+		return NULL;
+	}
+	if(filePath(byRecord, nRecords, file, description, size) == 0) {
+		snprintf(description, size, "/");	/*The root directory */
+	}
+	if(!file->objectId || memcmp(file->objectId, entry->guid, GUID_LENGTH) != 0) {
+		size_t length = strlen(description);
+		snprintf(description + length, size - length, " (its $OBJECT_ID differs)");
+	}
+	return file;
+}
+
+/**
+ * Loads $ObjId:$O, then prints the file each GUID of guids leads to, or without guids,
+ * every entry of $O and the files whose $OBJECT_ID it lacks.
+ * Returns 0, or -1 if $O cannot be loaded or a GUID is not valid.
+ */
+int objectIdReport(Volume *volume, File *files, MFTCopy *copy, char **guids, int nGuids) {
+	ObjectIdTable table;
+	uint32_t nRecords, r, nUnindexed = 0;
+	uint64_t i;
+	int g, ret = 0;
+	char guid[GUID_STRING_LENGTH], description[MAX_PATH_LENGTH];
+	if(loadObjectIdTable(volume, files, copy, &table) != 0) {
+		return -1;
+	}
+	File **byRecord = indexRecords(files, &nRecords);
+
+	for(g = 0; g < nGuids; g++) {
+		uint8_t wanted[GUID_LENGTH];
+		if(!parseGuid(guids[g], wanted)) {
+			printf("%s: not a GUID.\n", guids[g]);
+			ret = -1;
+			continue;
+		}
+		ObjectIdEntry *entry = findObjectId(&table, wanted);
+		guidString(wanted, guid);
+		if(!entry) {
+			printf("%s not in $ObjId.\n", guid);
+			continue;
+		}
+		describeObjectId(entry, byRecord, nRecords, description, sizeof(description));
+		printf("%s %s\n", guid, description);
+	}
+
+	if(nGuids == 0) {
+		for(i = 0; i < table.nEntries; i++) {
+			guidString(table.entries[i].guid, guid);
+			describeObjectId(&table.entries[i], byRecord, nRecords, description, sizeof(description));
+			printf("%s %s\n", guid, description);
+		}
+		for(r = 0; r < nRecords; r++) {
+			File *file = byRecord[r];
+			if(!file || !(file->recordFlags & IN_USE) || !file->objectId || findObjectId(&table, file->objectId)) {
+				continue;
+			}
+			guidString(file->objectId, guid);
+			if(filePath(byRecord, nRecords, file, description, sizeof(description)) == 0) {
+				snprintf(description, sizeof(description), "/");
+			}
+			printf("%s %s (not in $ObjId)\n", guid, description);
+			nUnindexed++;
+		}
+		printf("%" PRIu64 " object IDs in $ObjId:$O (%" PRIu64 " damaged), %u more in files only.\n",
+			   table.nEntries, table.nBad, nUnindexed);
+	}
+	memFree(byRecord);
+	freeObjectIdTable(&table);
+	return ret;
+}
+
+#endif /* OBJECTID_H_ */
@@ -0,0 +1,216 @@
+/*
+ * Partition.h
+ *
+ * Finding the NTFS partitions of a device in its MBR, their geometry in their boot
+ * sectors, and reading the MFT of one into a copy in memory: each run of $MFT as a FRAG
+ * record carrying its offset on the device, then its records, as the MFT copy on disk is.
+ * Nothing is kept here between calls, so several devices can be open at once.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "RunList.h"
+#include "MFTRecord.h"
+#include "ErrorMap.h"
+#include "Memory.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef PARTITION_H_
+#define PARTITION_H_
+
+#define P_PARTITIONS 4			/*Number of primary partitions */
+#define SECTOR_SIZE 512			/*Size of one sector */
+#define P_OFFSET 0x1BE			/*Partition information begins at offset 0x1BE */
+#define NTFS_TYPE 0x07			/*NTFS partitions are represented by 0x07 in the partition table */
+
+/* Where an NTFS partition and its MFT are on the device, from its boot sector */
+typedef struct _NTFSGeometry {
+	uint64_t partitionOffset;	/*Bytes from the start of the device to the partition */
+	uint32_t bytesPerCluster;
+	uint64_t totalClusters;		/*Clusters in the partition */
+	uint64_t mftOffset;			/*Bytes from the start of the device to record 0 of the MFT */
+} NTFSGeometry;
+
+/**
+ * Reads the P_PARTITIONS primary partitions of the MBR of fd into partitions.
+ * Returns 0, or -1 if the MBR cannot be read.
+ */
+int readPartitionTable(int fd, PARTITION *partitions) {
+	ssize_t n = pread(fd, partitions, P_PARTITIONS*sizeof(PARTITION), P_OFFSET);
+	if(n != P_PARTITIONS*sizeof(PARTITION)) {
+		int errsv = n == -1 ? errno : EIO;
+		printf("Failed to open partition table with error: %s.\n", strerror(errsv));
+		errno = errsv;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Reads the boot sector of partition on fd into boot and works out its geometry.
+ * Returns 0, or -1 if it cannot be read or does not describe an NTFS volume.
+ */
+int readNTFSGeometry(int fd, PARTITION *partition, NTFS_BOOT_SECTOR *boot, NTFSGeometry *geometry) {
+	uint64_t offset = (uint64_t)partition->dwRelativeSector*SECTOR_SIZE;
+	ssize_t n = pread(fd, boot, sizeof(NTFS_BOOT_SECTOR), offset);
+	if(n != sizeof(NTFS_BOOT_SECTOR)) {
+		int errsv = n == -1 ? errno : EIO;
+		printf("Failed to open NTFS Boot sector at offset %" PRIu64 " with error: %s.\n", offset, strerror(errsv));
+		errno = errsv;
+		return -1;
+	}
+	if(boot->bpb.uchSecPerClust == 0 || boot->bpb.wBytesPerSec == 0 || boot->bpb.n64MFTLogicalClustNum < 0) {
+		printf("The boot sector at offset %" PRIu64 " is not that of an NTFS volume.\n", offset);
+		errno = EINVAL;
+		return -1;
+	}
+	geometry->partitionOffset = offset;
+	geometry->bytesPerCluster = boot->bpb.uchSecPerClust * boot->bpb.wBytesPerSec;
+	geometry->totalClusters = boot->bpb.n64TotalSec / boot->bpb.uchSecPerClust;
+	geometry->mftOffset = offset + (uint64_t)geometry->bytesPerCluster*boot->bpb.n64MFTLogicalClustNum;
+	return 0;
+}
+
+/**
+ * Returns the unnamed, non-resident $DATA attribute of record, whose fixups are applied,
+ * or NULL if it has none.
+ */
+NTFS_ATTRIBUTE *findMFTData(char *record) {
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	uint32_t attrOffset = header->wAttribOffset;
+	while(attrOffset+8 < header->dwRecLength && attrOffset + sizeof(NTFS_ATTRIBUTE) <= MFT_RECORD_LENGTH) {
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record + attrOffset);
+		if(attr->dwType == 0xFFFFFFFF || attr->dwFullLength == 0 || attr->dwFullLength > MFT_RECORD_LENGTH-attrOffset) {
+			return NULL;
+		}
+		if(attr->dwType == DATA && attr->uchNonResFlag && attr->uchNameLength == 0) {
+			return attr;
+		}
+		attrOffset += attr->dwFullLength;
+	}
+	return NULL;
+}
+
+/**
+ * Reads the MFT of the partition described by geometry into copy, following the runs of
+ * the $DATA of its record 0. Unreadable regions are zero filled and added to errors.
+ * Sets *nFragments to the runs of $MFT on disk.
+ * Returns 0, or -1 if record 0 cannot be read or has no $DATA.
+ *
+ * WARNING: Memory is mapped for the copy, need to closeMFTCopy(..) it.
+ */
+int readMFT(int fd, NTFSGeometry *geometry, MFTCopy *copy, ErrorMap *errors, uint32_t *nFragments) {
+	char *record0 = memAlloc( MEM_IO, MFT_RECORD_LENGTH );
+	uint32_t countRuns = 0;
+	uint64_t length = 0, slot = 0;
+	int64_t lcn = 0;
+	DataRun *runs, *run;
+
+	if(pread(fd, record0, MFT_RECORD_LENGTH, geometry->mftOffset) != MFT_RECORD_LENGTH) {
+		int errsv = errno;
+		printf("Failed to read MFT at offset: %" PRIu64 ", with error %s.\n", geometry->mftOffset, strerror(errsv));
+		memFree(record0);
+		errno = errsv;
+		return -1;
+	}
+	if(applyFixup(record0, MFT_RECORD_LENGTH) != 0) {
+		printf("MFT record 0 failed its fixup check, it may be corrupted.\n");
+	}
+	NTFS_ATTRIBUTE *data = findMFTData(record0);
+	if(!isFileRecord(record0) || !data) {
+		printf("MFT record 0 at offset %" PRIu64 " has no $DATA attribute.\n", geometry->mftOffset);
+		memFree(record0);
+		errno = EINVAL;
+		return -1;
+	}
+	uint16_t runOffset = data->Attr.NonResident.wDatarunOffset;
+	runs = decodeRunList((char *)data + runOffset, data->dwFullLength - runOffset, &countRuns);
+	memFree(record0);
+
+	/*A FRAG record ahead of the records of each run */
+	*nFragments = 0;
+	for(run = runs; run; run = run->p_next) {
+		if(run->offset && *run->length) {
+			length += sizeof(FRAG) + *run->length*geometry->bytesPerCluster;
+			(*nFragments)++;
+		}
+	}
+	copy->nSlots = length / MFT_RECORD_LENGTH;
+	copy->length = length;
+	copy->records = NULL;
+	if(length > 0 &&
+	   (copy->records = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+		int errsv = errno;
+		printf("Failed to allocate %" PRIu64 " bytes for the MFT: %s.\n", length, strerror(errsv));
+		copy->records = NULL;
+		freeList(runs);
+		errno = errsv;
+		return -1;
+	}
+
+	for(run = runs; run; run = run->p_next) {
+		if(!run->offset || !*run->length) {
+			continue;	/*Sparse */
+		}
+		lcn += *run->offset;	/*Run offsets are relative to the run before */
+		uint64_t runOffsetOnDevice = geometry->partitionOffset + (uint64_t)lcn*geometry->bytesPerCluster;
+		size_t readLength = *run->length*geometry->bytesPerCluster;
+		char *dst = copy->records + slot*MFT_RECORD_LENGTH + sizeof(FRAG);
+		FRAG *frag = createFragRecord(runOffsetOnDevice);
+		memcpy(copy->records + slot*MFT_RECORD_LENGTH, frag, sizeof(FRAG));
+		memFree(frag);
+
+		/*Zero filling what cannot be read */
+		uint64_t traceStartNs = traceStart();
+		ssize_t readStatus = readTolerant(fd, dst, readLength, runOffsetOnDevice, errors);
+		if(readStatus == -1) {
+			int errsv = errno;
+			printf("Failed to open read MFT from disk with error: %s.\n", strerror(errsv));
+			readStatus = 0;
+		} else {
+			STAT_INC(STAT_DEVICE_READS);
+			STAT_ADD(STAT_DEVICE_BYTES, readStatus);
+			STAT_HIST(HIST_READ_BYTES, readLength);
+			traceSpan("read", "io", traceStartNs, "offset", runOffsetOnDevice, "length", readLength);
+		}
+		memset(dst + readStatus, 0, readLength - readStatus);
+		slot += (sizeof(FRAG) + readLength) / MFT_RECORD_LENGTH;
+	}
+	freeList(runs);
+	return 0;
+}
+
+/**
+ * Writes copy to path, as the local MFT copy later opened with openMFTCopy(..).
+ * Returns 0, or -1 if it cannot be written.
+ */
+int saveMFTCopy(MFTCopy *copy, char *path) {
+	FILE *out;
+	if((out = fopen(path, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create local file for storing %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	bool written = copy->length == 0 || fwrite(copy->records, copy->length, 1, out) == 1;
+	int errsv = errno;
+	if(fclose(out) != 0 && written) {
+		errsv = errno;
+		written = false;
+	}
+	if(!written) {
+		printf("Write MFT to local file with error: %s.\n", strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+#endif /* PARTITION_H_ */
@@ -0,0 +1,528 @@
+/*
+ * RawNTFS.c
+ *
+ * The raw NTFS library behind RawNTFS.h: the modules RawNTFSExtraction is built from,
+ * with the state main keeps in globals held in each volume instead. Build it with
+ *
+ *	gcc -std=gnu99 -O2 -pthread -fPIC -fvisibility=hidden -shared -o libRawNTFS.so RawNTFS.c -lm
+ *
+ * so that only the functions of RawNTFS.h are exported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include "RawNTFS.h"
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "RunList.h"
+#include "FileLUT.h"
+#include "MFTRecord.h"
+#include "BlockReader.h"
+#include "Volume.h"
+#include "Sink.h"
+#include "Partition.h"
+#include "ErrorMap.h"
+#include "Diff.h"
+#include "Index.h"
+#include "Resolve.h"
+#include "Memory.h"
+
+struct _NTFSVolume {
+	int fd;
+	MFTCopy copy;		/*The MFT, in memory */
+	RecordSlots slots;	/*Its records by record number, for their times */
+	File *files;
+	File **byRecord;
+	uint32_t nRecords;
+	Volume volume;
+	ErrorMap errors;	/*Unreadable regions of the device, zero filled */
+	uint16_t *upcase;	/*The table of $UpCase, NULL to collate names as ASCII */
+};
+
+struct _NTFSRecordIterator {
+	NTFSVolume *volume;
+	uint32_t next;
+};
+
+/* A run of a stream, in clusters */
+typedef struct _StreamRun {
+	uint64_t vcn;
+	uint64_t length;
+	int64_t lcn;		/*-1 for a sparse run */
+} StreamRun;
+
+struct _NTFSStream {
+	NTFSVolume *volume;
+	File *file;
+	StreamRun *runs;
+	uint32_t nRuns;
+	uint64_t position;
+};
+
+struct _NTFSIndexNode {
+	NTFSVolume *volume;
+	File *directory;
+	char *node;			/*Its header, in the root or in block */
+	uint32_t length;
+	char *block;		/*The INDX block read, NULL for the root */
+	NTFSIndexNodeCallback callback;
+	void *arg;
+};
+
+/* Files are handed out as the File of the catalog itself */
+static File *fileOf(NTFSFile *file) {
+	return (File *)file;
+}
+
+void ntfsDefaultOptions(NTFSOpenOptions *options) {
+	options->partition = -1;
+	options->threads = 1;
+	options->queueDepth = 1;
+	options->cacheMB = 0;
+}
+
+NTFSVolume *ntfsOpenVolume(const char *device, const NTFSOpenOptions *options) {
+	NTFSOpenOptions defaults;
+	PARTITION partitions[P_PARTITIONS];
+	NTFS_BOOT_SECTOR boot;
+	NTFSGeometry geometry;
+	ScanCounters counters = { 0 };
+	uint32_t nFragments;
+	int i, nNTFS = 0, chosen = -1;
+
+	if(!options) {
+		ntfsDefaultOptions(&defaults);
+		options = &defaults;
+	}
+	if(options->threads < 1 || options->queueDepth < 1 || options->cacheMB < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	NTFSVolume *volume = calloc( 1, sizeof(NTFSVolume) );
+	if(!volume) {
+		return NULL;
+	}
+	if((volume->fd = open(device, O_RDONLY)) == -1) {
+		int errsv = errno;
+		printf("Failed to open block device %s with error: %s.\n", device, strerror(errsv));
+		free(volume);
+		errno = errsv;
+		return NULL;
+	}
+	if(readPartitionTable(volume->fd, partitions) != 0) {
+		goto failed;
+	}
+	for(i = 0; i < P_PARTITIONS; i++) {
+		if(partitions[i].chType == NTFS_TYPE && (options->partition < 0 || nNTFS++ == options->partition)) {
+			chosen = i;
+		}
+	}
+	if(chosen == -1) {
+		printf("No NTFS partition %d found on %s.\n", options->partition, device);
+		errno = ENOENT;
+		goto failed;
+	}
+	if(readNTFSGeometry(volume->fd, &partitions[chosen], &boot, &geometry) != 0) {
+		goto failed;
+	}
+	initErrorMap(&volume->errors);
+	if(readMFT(volume->fd, &geometry, &volume->copy, &volume->errors, &nFragments) != 0) {
+		freeErrorMap(&volume->errors);
+		goto failed;
+	}
+	scanMFTCopy(&volume->copy, options->threads, &volume->files, &counters);
+	volume->byRecord = indexRecords(volume->files, &volume->nRecords);
+	indexCopiedRecords(&volume->copy, &volume->slots);
+	volume->volume.reader = openBlockReader(volume->fd, options->queueDepth, (uint64_t)options->cacheMB*1024*1024);
+	volume->volume.reader->errors = &volume->errors;
+	volume->volume.partitionOffset = geometry.partitionOffset;
+	volume->volume.bytesPerCluster = geometry.bytesPerCluster;
+	volume->volume.totalClusters = geometry.totalClusters;
+	volume->upcase = readUpcase(&volume->volume, volume->byRecord, volume->nRecords);
+	return volume;
+
+failed: ;
+	int errsv = errno;
+	close(volume->fd);
+	free(volume);
+	errno = errsv;
+	return NULL;
+}
+
+void ntfsCloseVolume(NTFSVolume *volume) {
+	if(!volume) {
+		return;
+	}
+	closeBlockReader(volume->volume.reader);
+	memFree(volume->upcase);
+	freeFiles(volume->files);
+	memFree(volume->byRecord);
+	memFree(volume->slots.records);
+	closeMFTCopy(&volume->copy);
+	freeErrorMap(&volume->errors);
+	close(volume->fd);
+	free(volume);
+}
+
+uint32_t ntfsRecordCount(NTFSVolume *volume) {
+	return volume->nRecords;
+}
+
+NTFSFile *ntfsFileByRecord(NTFSVolume *volume, uint32_t recordNumber) {
+	return recordNumber < volume->nRecords ? (NTFSFile *)volume->byRecord[recordNumber] : NULL;
+}
+
+void ntfsFileInfo(NTFSVolume *volume, NTFSFile *handle, NTFSFileInfo *info) {
+	File *file = fileOf(handle);
+	char *record = slotRecord(&volume->slots, file->recordNumber);
+	memset(info, 0, sizeof(NTFSFileInfo));
+	info->name = file->fileName;
+	info->recordNumber = file->recordNumber;
+	info->sequence = file->sequence;
+	info->parentRecord = file->parentReference & FILE_REFERENCE_RECORD;
+	info->size = file->realSize;
+	info->inUse = (file->recordFlags & IN_USE) != 0;
+	info->isDirectory = (file->recordFlags & DIRECTORY) != 0;
+	info->hasTimes = record && readStandardTimes(record, info->times);
+}
+
+size_t ntfsFilePath(NTFSVolume *volume, NTFSFile *file, char *path, size_t size) {
+	return filePath(volume->byRecord, volume->nRecords, fileOf(file), path, size);
+}
+
+NTFSRecordIterator *ntfsIterateRecords(NTFSVolume *volume) {
+	NTFSRecordIterator *iterator = malloc( sizeof(NTFSRecordIterator) );
+	if(iterator) {
+		iterator->volume = volume;
+		iterator->next = 0;
+	}
+	return iterator;
+}
+
+NTFSFile *ntfsNextRecord(NTFSRecordIterator *iterator) {
+	NTFSVolume *volume = iterator->volume;
+	while(iterator->next < volume->nRecords) {
+		File *file = volume->byRecord[iterator->next++];
+		if(file) {
+			return (NTFSFile *)file;
+		}
+	}
+	return NULL;
+}
+
+void ntfsFreeIterator(NTFSRecordIterator *iterator) {
+	free(iterator);
+}
+
+int ntfsScanRecords(NTFSVolume *volume, NTFSRecordCallback callback, void *arg) {
+	uint32_t r;
+	int ret;
+	for(r = 0; r < volume->nRecords; r++) {
+		if(volume->byRecord[r] && (ret = callback(arg, (NTFSFile *)volume->byRecord[r])) != 0) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/*---------------------------------- Callback sink ----------------------------------*/
+
+/* Hands the content of each file to the callback of ntfsScanContent(..) */
+typedef struct _CallbackCtx {
+	NTFSContentCallback callback;
+	void *arg;
+	uint64_t delivered;
+} CallbackCtx;
+
+static int callbackBegin(void *ctx, File *file) {
+	((CallbackCtx *)ctx)->delivered = 0;
+	return 0;
+}
+
+static int callbackWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	CallbackCtx *callback = ctx;
+	callback->delivered = fileOffset + length;
+	return callback->callback(callback->arg, (NTFSFile *)file, fileOffset, data, length);
+}
+
+static int callbackEnd(void *ctx, File *file) {
+	CallbackCtx *callback = ctx;
+	return callback->callback(callback->arg, (NTFSFile *)file, callback->delivered, NULL, 0);
+}
+
+int ntfsScanContent(NTFSVolume *volume, NTFSContentCallback callback, void *arg, int nThreads) {
+	uint32_t nFiles;
+	int t, failures;
+	if(nThreads < 1) {
+		nThreads = 1;
+	}
+	Sink *sinks = malloc( nThreads*sizeof(Sink) );
+	CallbackCtx *contexts = malloc( nThreads*sizeof(CallbackCtx) );
+	for(t = 0; t < nThreads; t++) {
+		contexts[t].callback = callback;
+		contexts[t].arg = arg;
+		Sink sink = { callbackBegin, callbackWrite, callbackEnd, &contexts[t] };
+		sinks[t] = sink;
+	}
+	File **fileArray = indexFiles(volume->files, &nFiles);
+	failures = streamFiles(&volume->volume, fileArray, nFiles, sinks, nThreads);
+	memFree(fileArray);
+	free(contexts);
+	free(sinks);
+	return failures;
+}
+
+/*------------------------------------- Streams -------------------------------------*/
+
+NTFSStream *ntfsOpenStream(NTFSVolume *volume, NTFSFile *handle) {
+	File *file = fileOf(handle);
+	DataRun *run;
+	uint64_t vcn = 0;
+	int64_t lcn = 0;
+	NTFSStream *stream = calloc( 1, sizeof(NTFSStream) );
+	if(!stream) {
+		return NULL;
+	}
+	stream->volume = volume;
+	stream->file = file;
+	for(run = file->runs; run; run = run->p_next) {
+		stream->nRuns++;
+	}
+	stream->runs = malloc( (stream->nRuns ? stream->nRuns : 1)*sizeof(StreamRun) );
+	if(!stream->runs) {
+		free(stream);
+		return NULL;
+	}
+	stream->nRuns = 0;
+	for(run = file->runs; run; run = run->p_next) {
+		StreamRun *streamRun = &stream->runs[stream->nRuns++];
+		if(run->offset) {
+			lcn += *run->offset;	/*Run offsets are relative to the run before */
+		}
+		streamRun->vcn = vcn;
+		streamRun->length = *run->length;
+		streamRun->lcn = run->offset ? lcn : -1;
+		vcn += *run->length;
+	}
+	return stream;
+}
+
+/*
+ * Returns the first run of stream ending after cluster vcn, NULL if there is none.
+ */
+static StreamRun *findStreamRun(NTFSStream *stream, uint64_t vcn) {
+	uint32_t low = 0, high = stream->nRuns;
+	while(low < high) {
+		uint32_t middle = low + (high - low)/2;
+		if(stream->runs[middle].vcn + stream->runs[middle].length <= vcn) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	return low < stream->nRuns ? &stream->runs[low] : NULL;
+}
+
+ssize_t ntfsReadStream(NTFSStream *stream, void *buffer, size_t length) {
+	File *file = stream->file;
+	Volume *volume = &stream->volume->volume;
+	char *dst = buffer;
+	size_t done = 0;
+
+	if(stream->position >= file->realSize) {
+		return 0;
+	}
+	if(length > file->realSize - stream->position) {
+		length = file->realSize - stream->position;
+	}
+	if(!file->runs) {	/*Resident, already in memory */
+		if(file->residentData) {
+			memcpy(dst, file->residentData + stream->position, length);
+		} else {
+			memset(dst, 0, length);
+		}
+		stream->position += length;
+		return length;
+	}
+	while(done < length) {
+		uint64_t vcn = stream->position / volume->bytesPerCluster;
+		StreamRun *run = findStreamRun(stream, vcn);
+		uint64_t runStart = run ? run->vcn*volume->bytesPerCluster : UINT64_MAX;
+		size_t n = length - done;
+		if(!run || runStart > stream->position) {
+			/*Past the runs, or between them: not written, so zeros */
+			if(run && n > runStart - stream->position) {
+				n = runStart - stream->position;
+			}
+			memset(dst + done, 0, n);
+		} else {
+			uint64_t runEnd = (run->vcn + run->length)*volume->bytesPerCluster;
+			if(n > runEnd - stream->position) {
+				n = runEnd - stream->position;
+			}
+			if(run->lcn < 0) {
+				memset(dst + done, 0, n);
+			} else if(readBlocks(volume->reader, volume->partitionOffset + run->lcn*volume->bytesPerCluster +
+								 (stream->position - runStart), n, dst + done) != 0) {
+				return done > 0 ? (ssize_t)done : -1;
+			}
+		}
+		done += n;
+		stream->position += n;
+	}
+	return done;
+}
+
+int ntfsSeekStream(NTFSStream *stream, uint64_t offset) {
+	if(offset > stream->file->realSize) {
+		errno = EINVAL;
+		return -1;
+	}
+	stream->position = offset;
+	return 0;
+}
+
+void ntfsCloseStream(NTFSStream *stream) {
+	if(stream) {
+		free(stream->runs);
+		free(stream);
+	}
+}
+
+/*---------------------------------- Index nodes ----------------------------------*/
+
+NTFSIndexNode *ntfsIndexRoot(NTFSVolume *volume, NTFSFile *handle) {
+	File *directory = fileOf(handle);
+	DirectoryIndex *index = directory->index;
+	if(!(directory->recordFlags & DIRECTORY) || !index || !index->root || index->rootLength < sizeof(INDEX_ROOT_HEADER)) {
+		errno = ENOTDIR;
+		return NULL;
+	}
+	NTFSIndexNode *node = calloc( 1, sizeof(NTFSIndexNode) );
+	if(!node) {
+		return NULL;
+	}
+	node->volume = volume;
+	node->directory = directory;
+	node->node = (char *)&((INDEX_ROOT_HEADER *)index->root)->node;
+	node->length = index->rootLength - offsetof(INDEX_ROOT_HEADER, node);
+	return node;
+}
+
+static void indexNodeRead(void *arg, int error) {
+	NTFSIndexNode *node = arg;
+	if(error) {
+		node->callback(node->arg, NULL, error);
+		ntfsFreeIndexNode(node);
+		return;
+	}
+	node->callback(node->arg, node, 0);
+}
+
+int ntfsReadIndexNode(NTFSVolume *volume, NTFSFile *handle, int64_t vcn, NTFSIndexNodeCallback callback, void *arg) {
+	File *directory = fileOf(handle);
+	uint32_t blockSize = indexBlockSize(directory->index);
+	if(blockSize == 0) {
+		errno = (directory->recordFlags & DIRECTORY) ? EINVAL : ENOTDIR;
+		return -1;
+	}
+	NTFSIndexNode *node = calloc( 1, sizeof(NTFSIndexNode) );
+	if(!node) {
+		return -1;
+	}
+	node->volume = volume;
+	node->directory = directory;
+	node->block = memAlloc( MEM_METADATA, blockSize );
+	node->node = node->block + INDX_NODE_OFFSET;
+	node->length = blockSize - INDX_NODE_OFFSET;
+	node->callback = callback;
+	node->arg = arg;
+	if(readIndexBlockAsync(&volume->volume, directory->index, vcn, node->block, indexNodeRead, node) != 0) {
+		int errsv = errno;
+		ntfsFreeIndexNode(node);
+		errno = errsv;
+		return -1;
+	}
+	return 0;
+}
+
+int ntfsSearchIndexNode(NTFSIndexNode *node, const char *name, NTFSFile **file, int64_t *subnode) {
+	NTFSVolume *volume = node->volume;
+	uint16_t wide[255];
+	uint64_t fileReference;
+	int length = widenName(name, wide);
+	*file = NULL;
+	*subnode = -1;
+	if(length < 0) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	switch(searchIndexNode(node->node, node->length, volume->upcase, wide, length, &fileReference, subnode)) {
+		case 1 :
+			*file = (NTFSFile *)referencedFile(volume->byRecord, volume->nRecords, fileReference);
+			return 0;
+		case 0 :
+			return 0;
+		default :
+			errno = EIO;
+			return -1;
+	}
+}
+
+int ntfsIndexNodeEntries(NTFSIndexNode *node, NTFSIndexEntry *entries, int max) {
+	NTFSVolume *volume = node->volume;
+	INDEX_NODE_HEADER *header = (INDEX_NODE_HEADER *)node->node;
+	int n = 0;
+	if(node->length < sizeof(INDEX_NODE_HEADER)) {
+		errno = EIO;
+		return -1;
+	}
+	uint32_t end = header->indexLength < node->length ? header->indexLength : node->length;
+	uint32_t offs = header->entriesOffset;
+	while(offs + sizeof(INDEX_ENTRY_HEADER) <= end) {
+		INDEX_ENTRY_HEADER *entry = (INDEX_ENTRY_HEADER *)(node->node + offs);
+		bool last = entry->flags & INDEX_ENTRY_LAST;
+		if(entry->entryLength < sizeof(INDEX_ENTRY_HEADER) || offs + entry->entryLength > end ||
+		   (!last && sizeof(INDEX_ENTRY_HEADER) + entry->keyLength > entry->entryLength)) {
+			break;
+		}
+		if(n < max) {
+			FILE_NAME_ATTR *key = last ? NULL : indexedFileName(entry);
+			entries[n].file = last ? NULL : (NTFSFile *)referencedFile(volume->byRecord, volume->nRecords, entry->fileReference);
+			entries[n].subnode = entrySubnode(entry);
+			entries[n].dosName = key && key->bFilenameNamespace == FILE_NAME_DOS;
+			entries[n].last = last;
+		}
+		n++;
+		if(last) {
+			return n;
+		}
+		offs += entry->entryLength;
+	}
+	errno = EIO;	/*Malformed, or no last entry */
+	return -1;
+}
+
+void ntfsFreeIndexNode(NTFSIndexNode *node) {
+	if(node) {
+		memFree(node->block);
+		free(node);
+	}
+}
+
+size_t ntfsResolvePaths(NTFSVolume *volume, const char *const *paths, size_t nPaths, NTFSFile **files) {
+	ResolveCounters counters = { 0 };
+	if(nPaths > UINT32_MAX) {
+		errno = EINVAL;
+		return 0;
+	}
+	return resolvePaths(&volume->volume, volume->byRecord, volume->nRecords, volume->upcase, paths, nPaths,
+						(File **)files, &counters);
+}
@@ -0,0 +1,217 @@
+/*
+ * RawNTFS.h
+ *
+ * The C interface of the raw NTFS library, built from RawNTFS.c, for ingestion services
+ * to read volumes in process instead of running RawNTFSExtraction per image and parsing
+ * its output. Volumes, record iterators, files and streams are opaque handles.
+ *
+ * A volume is read only once it is open, so it can be shared among threads: files and
+ * their information can be had from any thread. Each iterator and stream is used by one
+ * thread at a time, and any number of them can be open on a volume at once.
+ *
+ * Names are kept one byte per character, the low byte of each UTF-16 unit, as
+ * RawNTFSExtraction prints them, and are given to lookups the same way.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifndef RAWNTFS_H_
+#define RAWNTFS_H_
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Only the functions here are exported when built with -fvisibility=hidden */
+#define NTFS_API __attribute__((visibility("default")))
+
+#define NTFS_TIMES 4	/*Of $STANDARD_INFORMATION: created, modified, MFT changed, accessed */
+#define NTFS_ROOT_RECORD 5	/*Record of the root directory */
+
+typedef struct _NTFSVolume NTFSVolume;					/*An NTFS partition of a device or image, scanned */
+typedef struct _NTFSRecordIterator NTFSRecordIterator;	/*The records of a volume in record order */
+typedef struct _NTFSFile NTFSFile;						/*A record of a volume, valid while it is open */
+typedef struct _NTFSStream NTFSStream;					/*The content of a file, read from the volume */
+typedef struct _NTFSIndexNode NTFSIndexNode;			/*A node of the $I30 index of a directory */
+
+typedef struct _NTFSOpenOptions {
+	int partition;		/*Among the NTFS partitions of the MBR from 0, -1 for the last as RawNTFSExtraction */
+	int threads;		/*Threads scanning the MFT */
+	int queueDepth;		/*Reads in flight at once on the device */
+	int cacheMB;		/*Size of the block cache, 0 disables it */
+} NTFSOpenOptions;
+
+typedef struct _NTFSFileInfo {
+	const char *name;		/*NULL without a $FILE_NAME, valid while the volume is open */
+	uint32_t recordNumber;
+	uint16_t sequence;
+	uint32_t parentRecord;
+	uint64_t size;			/*Of the unnamed $DATA stream */
+	bool inUse;
+	bool isDirectory;
+	bool hasTimes;			/*False without a $STANDARD_INFORMATION */
+	uint64_t times[NTFS_TIMES];	/*As FILETIMEs, 100ns since 1601 */
+} NTFSFileInfo;
+
+/* Called for each record, a non-zero return stops the scan and is returned by it */
+typedef int (*NTFSRecordCallback)(void *arg, NTFSFile *file);
+
+/*
+ * Called with the content of a file in order, then with length 0 at its end. A non-zero
+ * return stops that file, which is then counted as failed.
+ */
+typedef int (*NTFSContentCallback)(void *arg, NTFSFile *file, uint64_t offset, const void *data, size_t length);
+
+/* An entry of an index node, in the order of the names of the directory */
+typedef struct _NTFSIndexEntry {
+	NTFSFile *file;		/*NULL if the record it names is not in use, or was reused since */
+	int64_t subnode;	/*VCN of the node of the names before it, -1 if there is none */
+	bool dosName;		/*It holds the 8.3 name of a file also listed under its long name */
+	bool last;			/*It ends the node and names no file */
+} NTFSIndexEntry;
+
+/*
+ * Called once an index node is read, with the node, or NULL and the errno of the failure.
+ * It is called from an I/O thread, so it should hand the node on rather than work on it.
+ */
+typedef void (*NTFSIndexNodeCallback)(void *arg, NTFSIndexNode *node, int error);
+
+/**
+ * Fills options with the defaults: the last NTFS partition, one thread, one read in
+ * flight and no cache.
+ */
+NTFS_API void ntfsDefaultOptions(NTFSOpenOptions *options);
+
+/**
+ * Opens device (or an image of one), reads the MFT of one of its NTFS partitions into
+ * memory and scans it, with the default options if options is NULL.
+ * Returns the volume, or NULL with errno set if it cannot be opened.
+ *
+ * WARNING: Memory is allocated for the volume, need to ntfsCloseVolume(..) it.
+ */
+NTFS_API NTFSVolume *ntfsOpenVolume(const char *device, const NTFSOpenOptions *options);
+
+NTFS_API void ntfsCloseVolume(NTFSVolume *volume);
+
+/**
+ * Returns one more than the highest record number of volume.
+ */
+NTFS_API uint32_t ntfsRecordCount(NTFSVolume *volume);
+
+/**
+ * Returns record recordNumber of volume, or NULL if the MFT has no such record.
+ */
+NTFS_API NTFSFile *ntfsFileByRecord(NTFSVolume *volume, uint32_t recordNumber);
+
+NTFS_API void ntfsFileInfo(NTFSVolume *volume, NTFSFile *file, NTFSFileInfo *info);
+
+/**
+ * Writes the path of file from the root directory into path (size bytes).
+ * Returns its length, which is cut short if it does not fit.
+ */
+NTFS_API size_t ntfsFilePath(NTFSVolume *volume, NTFSFile *file, char *path, size_t size);
+
+/**
+ * Returns an iterator over the records of volume, deleted ones included, or NULL with
+ * errno set.
+ *
+ * WARNING: Memory is allocated for the iterator, need to ntfsFreeIterator(..) it.
+ */
+NTFS_API NTFSRecordIterator *ntfsIterateRecords(NTFSVolume *volume);
+
+/**
+ * Returns the next record of iterator, or NULL once they are all returned.
+ */
+NTFS_API NTFSFile *ntfsNextRecord(NTFSRecordIterator *iterator);
+
+NTFS_API void ntfsFreeIterator(NTFSRecordIterator *iterator);
+
+/**
+ * Calls callback(arg, file) for each record of volume in record order.
+ * Returns 0, or the first non-zero return of callback.
+ */
+NTFS_API int ntfsScanRecords(NTFSVolume *volume, NTFSRecordCallback callback, void *arg);
+
+/**
+ * Streams the content of every regular file in use on volume through callback, with
+ * nThreads threads each taking a file at a time, so callback must be thread-safe.
+ * Returns the number of files which could not be read in full.
+ */
+NTFS_API int ntfsScanContent(NTFSVolume *volume, NTFSContentCallback callback, void *arg, int nThreads);
+
+/**
+ * Opens the unnamed $DATA stream of file for reading from its start.
+ * Returns the stream, or NULL with errno set.
+ *
+ * WARNING: Memory is allocated for the stream, need to ntfsCloseStream(..) it.
+ */
+NTFS_API NTFSStream *ntfsOpenStream(NTFSVolume *volume, NTFSFile *file);
+
+/**
+ * Reads up to length bytes of stream into buffer, sparse runs as zeros.
+ * Returns the bytes read, 0 at the end, or -1 with errno set if the device fails.
+ */
+NTFS_API ssize_t ntfsReadStream(NTFSStream *stream, void *buffer, size_t length);
+
+/**
+ * Moves the position of stream to offset. Returns 0, or -1 past its end.
+ */
+NTFS_API int ntfsSeekStream(NTFSStream *stream, uint64_t offset);
+
+NTFS_API void ntfsCloseStream(NTFSStream *stream);
+
+/**
+ * Returns the root node of the $I30 index of directory, kept with it in memory, or NULL
+ * with errno set if it is not a directory.
+ *
+ * WARNING: Memory is allocated for the node, need to ntfsFreeIndexNode(..) it.
+ */
+NTFS_API NTFSIndexNode *ntfsIndexRoot(NTFSVolume *volume, NTFSFile *directory);
+
+/**
+ * Submits the read of the node of the $I30 index of directory at vcn (a sub-node of an
+ * entry), and returns without waiting for it: callback(arg, node, error) is called once it
+ * is read. Any number of reads can be in flight, up to the queue depth of the volume at
+ * once on the device. Every read must be called back before the volume is closed.
+ * Returns 0, or -1 with errno set (and callback not called) if there is no such node.
+ *
+ * WARNING: Memory is allocated for the node, need to ntfsFreeIndexNode(..) it.
+ */
+NTFS_API int ntfsReadIndexNode(NTFSVolume *volume, NTFSFile *directory, int64_t vcn, NTFSIndexNodeCallback callback,
+							   void *arg);
+
+/**
+ * Searches node for name, compared as NTFS does without case. Sets *file to the file named
+ * so, or else to NULL and *subnode to the VCN of the node to search next, -1 if there is
+ * none (name is not in the directory).
+ * Returns 0, or -1 with errno set if the node is damaged.
+ */
+NTFS_API int ntfsSearchIndexNode(NTFSIndexNode *node, const char *name, NTFSFile **file, int64_t *subnode);
+
+/**
+ * Fills entries with up to max entries of node, in order.
+ * Returns the number of entries of node, or -1 with errno set if it is damaged.
+ */
+NTFS_API int ntfsIndexNodeEntries(NTFSIndexNode *node, NTFSIndexEntry *entries, int max);
+
+NTFS_API void ntfsFreeIndexNode(NTFSIndexNode *node);
+
+/**
+ * Resolves the nPaths paths from the root directory of volume, names separated by '/' or
+ * '\', and sets files[i] to the file in use path i leads to, or NULL. The paths are
+ * gathered by the directories they share, so the index of each directory is searched once
+ * for all of them, its nodes read in the order they are on the device: many paths cost
+ * little more than the directories they go through. Names are compared as NTFS does,
+ * without case; links are not followed.
+ * Returns the number of paths resolved.
+ */
+NTFS_API size_t ntfsResolvePaths(NTFSVolume *volume, const char *const *paths, size_t nPaths, NTFSFile **files);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RAWNTFS_H_ */
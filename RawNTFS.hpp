@@ -0,0 +1,279 @@
+/*
+ * RawNTFS.hpp
+ *
+ * A header-only C++ wrapper of RawNTFS.h: volumes and streams close themselves, records
+ * are walked with a range for loop, and failures are thrown as exceptions. The rules of
+ * RawNTFS.h on threads hold as they are. For example
+ *
+ *	rawntfs::Volume volume("/dev/sda");
+ *	for(rawntfs::File file : volume.records()) {
+ *		std::cout << file.path() << ' ' << file.info().size << '\n';
+ *	}
+ */
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "RawNTFS.h"
+
+#ifndef RAWNTFS_HPP_
+#define RAWNTFS_HPP_
+
+namespace rawntfs {
+
+/* A failure of the library, with the errno it set */
+class Error : public std::runtime_error {
+public:
+	Error(const std::string &what, int error)
+		: std::runtime_error(what + ": " + std::strerror(error)), error_(error) {}
+
+	int error() const { return error_; }
+
+private:
+	int error_;
+};
+
+/* A record of a volume, valid while the volume is open */
+class File {
+public:
+	File(NTFSVolume *volume, NTFSFile *file) : volume_(volume), file_(file) {}
+
+	NTFSFileInfo info() const {
+		NTFSFileInfo info;
+		ntfsFileInfo(volume_, file_, &info);
+		return info;
+	}
+
+	std::string path() const {
+		char path[4096];
+		size_t length = ntfsFilePath(volume_, file_, path, sizeof(path));
+		return std::string(path, length < sizeof(path) ? length : sizeof(path) - 1);
+	}
+
+	NTFSFile *handle() const { return file_; }
+
+private:
+	NTFSVolume *volume_;
+	NTFSFile *file_;
+};
+
+/* The content of a file, read from the volume */
+class Stream {
+public:
+	explicit Stream(NTFSStream *stream) : stream_(stream) {}
+	Stream(Stream &&other) noexcept : stream_(std::exchange(other.stream_, nullptr)) {}
+	Stream &operator=(Stream &&other) noexcept {
+		std::swap(stream_, other.stream_);
+		return *this;
+	}
+	Stream(const Stream &) = delete;
+	Stream &operator=(const Stream &) = delete;
+	~Stream() { ntfsCloseStream(stream_); }
+
+	/* Returns the bytes read into buffer, 0 at the end */
+	size_t read(void *buffer, size_t length) {
+		ssize_t n = ntfsReadStream(stream_, buffer, length);
+		if(n < 0) {
+			throw Error("Failed to read stream", errno);
+		}
+		return n;
+	}
+
+	void seek(uint64_t offset) {
+		if(ntfsSeekStream(stream_, offset) != 0) {
+			throw Error("Failed to seek stream", errno);
+		}
+	}
+
+private:
+	NTFSStream *stream_;
+};
+
+/* An input iterator over the records of a volume */
+class RecordIterator {
+public:
+	using value_type = File;
+	using difference_type = std::ptrdiff_t;
+	using pointer = const File *;
+	using reference = const File &;
+	using iterator_category = std::input_iterator_tag;
+
+	RecordIterator() : volume_(nullptr), file_(nullptr, nullptr) {}
+	explicit RecordIterator(NTFSVolume *volume)
+		: volume_(volume), iterator_(ntfsIterateRecords(volume), ntfsFreeIterator), file_(volume, nullptr) {
+		if(!iterator_) {
+			throw Error("Failed to iterate records", errno);
+		}
+		++*this;
+	}
+
+	reference operator*() const { return file_; }
+	pointer operator->() const { return &file_; }
+
+	RecordIterator &operator++() {
+		file_ = File(volume_, ntfsNextRecord(iterator_.get()));
+		if(!file_.handle()) {
+			iterator_.reset();
+		}
+		return *this;
+	}
+
+	/* Iterators are equal once both are at the end */
+	bool operator==(const RecordIterator &other) const { return file_.handle() == other.file_.handle(); }
+	bool operator!=(const RecordIterator &other) const { return !(*this == other); }
+
+private:
+	NTFSVolume *volume_;
+	std::shared_ptr<NTFSRecordIterator> iterator_;
+	File file_;
+};
+
+/* The records of a volume, for a range for loop */
+class Records {
+public:
+	explicit Records(NTFSVolume *volume) : volume_(volume) {}
+	RecordIterator begin() const { return RecordIterator(volume_); }
+	RecordIterator end() const { return RecordIterator(); }
+
+private:
+	NTFSVolume *volume_;
+};
+
+/* An NTFS partition of a device or image, scanned */
+class Volume {
+public:
+	explicit Volume(const std::string &device, const NTFSOpenOptions *options = nullptr)
+		: volume_(ntfsOpenVolume(device.c_str(), options)) {
+		if(!volume_) {
+			throw Error("Failed to open " + device, errno);
+		}
+	}
+	Volume(Volume &&other) noexcept : volume_(std::exchange(other.volume_, nullptr)) {}
+	Volume &operator=(Volume &&other) noexcept {
+		std::swap(volume_, other.volume_);
+		return *this;
+	}
+	Volume(const Volume &) = delete;
+	Volume &operator=(const Volume &) = delete;
+	~Volume() { ntfsCloseVolume(volume_); }
+
+	uint32_t recordCount() const { return ntfsRecordCount(volume_); }
+
+	Records records() const { return Records(volume_); }
+
+	File file(uint32_t recordNumber) const {
+		NTFSFile *file = ntfsFileByRecord(volume_, recordNumber);
+		if(!file) {
+			throw std::out_of_range("No record " + std::to_string(recordNumber));
+		}
+		return File(volume_, file);
+	}
+
+	Stream open(const File &file) const {
+		NTFSStream *stream = ntfsOpenStream(volume_, file.handle());
+		if(!stream) {
+			throw Error("Failed to open stream", errno);
+		}
+		return Stream(stream);
+	}
+
+	/*
+	 * Resolves paths from the root directory all at once, as ntfsResolvePaths(..): the file
+	 * each leads to, or nothing.
+	 */
+	std::vector<std::optional<File>> resolve(const std::vector<std::string> &paths) const {
+		std::vector<const char *> names;
+		std::vector<NTFSFile *> handles(paths.size());
+		for(const std::string &path : paths) {
+			names.push_back(path.c_str());
+		}
+		ntfsResolvePaths(volume_, names.data(), names.size(), handles.data());
+		std::vector<std::optional<File>> files;
+		for(NTFSFile *handle : handles) {
+			files.push_back(handle ? std::optional<File>(File(volume_, handle)) : std::nullopt);
+		}
+		return files;
+	}
+
+	/*
+	 * Calls f(file) for each record in record order, until it returns true. An exception
+	 * thrown by f stops the scan and is thrown on.
+	 */
+	template <typename F>
+	void scanRecords(F f) const {
+		struct Scan {
+			NTFSVolume *volume;
+			F &f;
+			std::exception_ptr error;
+		} scan = { volume_, f, nullptr };
+		ntfsScanRecords(volume_, [](void *arg, NTFSFile *handle) -> int {
+			Scan *scan = static_cast<Scan *>(arg);
+			try {
+				return scan->f(File(scan->volume, handle)) ? 1 : 0;
+			} catch(...) {
+				scan->error = std::current_exception();
+				return -1;
+			}
+		}, &scan);
+		if(scan.error) {
+			std::rethrow_exception(scan.error);
+		}
+	}
+
+	/*
+	 * Calls f(file, offset, data, length) from nThreads threads with the content of every
+	 * regular file in use, then with length 0 at the end of each, as ntfsScanContent(..).
+	 * f returning true stops that file. The first exception thrown by f stops every file
+	 * after it and is thrown on. Returns the number of files which could not be read.
+	 */
+	template <typename F>
+	int scanContent(F f, int nThreads = 1) const {
+		struct Scan {
+			NTFSVolume *volume;
+			F &f;
+			std::mutex lock;
+			std::exception_ptr error;
+		} scan { volume_, f, {}, nullptr };
+		int failures = ntfsScanContent(volume_, [](void *arg, NTFSFile *handle, uint64_t offset, const void *data,
+												   size_t length) -> int {
+			Scan *scan = static_cast<Scan *>(arg);
+			{
+				std::lock_guard<std::mutex> guard(scan->lock);
+				if(scan->error) {
+					return -1;
+				}
+			}
+			try {
+				return scan->f(File(scan->volume, handle), offset, data, length) ? 1 : 0;
+			} catch(...) {
+				std::lock_guard<std::mutex> guard(scan->lock);
+				if(!scan->error) {
+					scan->error = std::current_exception();
+				}
+				return -1;
+			}
+		}, &scan, nThreads);
+		if(scan.error) {
+			std::rethrow_exception(scan.error);
+		}
+		return failures;
+	}
+
+	NTFSVolume *handle() const { return volume_; }
+
+private:
+	NTFSVolume *volume_;
+};
+
+} /* namespace rawntfs */
+
+#endif /* RAWNTFS_HPP_ */
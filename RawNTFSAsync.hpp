@@ -0,0 +1,413 @@
+/*
+ * RawNTFSAsync.hpp
+ *
+ * Asynchronous lookups and directory listings over RawNTFS.hpp, as C++20 coroutines. A
+ * lookup is a chain of dependent reads, each INDX block down the B-tree of a directory
+ * naming the next; each read suspends its coroutine instead of its thread, and the block
+ * reader calls it back onto a small pool of threads once the block is in. So thousands of
+ * lookups can be under way on a few threads, keeping the queue of the device full (open
+ * the volume with a queue depth to match). Records need no reads: the MFT is in memory
+ * once the volume is open. For example
+ *
+ *	rawntfs::ThreadPool pool(4);
+ *	std::vector<rawntfs::Task<std::optional<rawntfs::File>>> lookups;
+ *	for(const std::string &path : paths) {
+ *		lookups.push_back(rawntfs::lookup(volume, pool, path));
+ *	}
+ *	for(std::optional<rawntfs::File> &file : rawntfs::syncWaitAll(pool, std::move(lookups))) {
+ *		...
+ *	}
+ */
+
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <latch>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "RawNTFS.hpp"
+
+#ifndef RAWNTFSASYNC_HPP_
+#define RAWNTFSASYNC_HPP_
+
+namespace rawntfs {
+
+/* Threads resuming the coroutines whose reads are complete */
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned nThreads) {
+		for(unsigned t = 0; t < (nThreads ? nThreads : 1); t++) {
+			threads_.emplace_back([this] { run(); });
+		}
+	}
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			stopping_ = true;
+		}
+		ready_.notify_all();
+		for(std::thread &thread : threads_) {
+			thread.join();
+		}
+	}
+
+	/*
+	 * Resumes handle on one of the threads. Notified holding the lock, as the last handle
+	 * posted may finish the work of the pool, and the pool with it, before this returns.
+	 */
+	void post(std::coroutine_handle<> handle) {
+		std::lock_guard<std::mutex> guard(lock_);
+		queue_.push_back(handle);
+		ready_.notify_one();
+	}
+
+	/* Awaited to carry on on one of the threads */
+	auto schedule() {
+		struct Schedule {
+			ThreadPool &pool;
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { pool.post(handle); }
+			void await_resume() const noexcept {}
+		};
+		return Schedule{ *this };
+	}
+
+private:
+	void run() {
+		std::unique_lock<std::mutex> guard(lock_);
+		for(;;) {
+			ready_.wait(guard, [this] { return stopping_ || !queue_.empty(); });
+			if(queue_.empty()) {
+				return;		/*Stopping, with nothing left to resume */
+			}
+			std::coroutine_handle<> handle = queue_.front();
+			queue_.pop_front();
+			guard.unlock();
+			handle.resume();
+			guard.lock();
+		}
+	}
+
+	std::mutex lock_;
+	std::condition_variable ready_;
+	std::deque<std::coroutine_handle<>> queue_;
+	std::vector<std::thread> threads_;
+	bool stopping_ = false;
+};
+
+template <typename T>
+class Task;
+
+namespace detail {
+
+/* Where a Task finishes: on to its awaiter */
+struct ResumeAwaiter {
+	bool await_ready() const noexcept { return false; }
+	template <typename P>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept {
+		std::coroutine_handle<> continuation = handle.promise().continuation;
+		return continuation ? continuation : std::noop_coroutine();
+	}
+	void await_resume() const noexcept {}
+};
+
+/* What the promises of every Task have */
+struct TaskPromiseBase {
+	std::exception_ptr error;
+	std::coroutine_handle<> continuation;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	ResumeAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+	void rethrow() {
+		if(error) {
+			std::rethrow_exception(error);
+		}
+	}
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase {
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+	template <typename V>
+	void return_value(V &&value) { this->value.emplace(std::forward<V>(value)); }
+	T result() {
+		rethrow();
+		return std::move(*value);
+	}
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase {
+	Task<void> get_return_object();
+	void return_void() noexcept {}
+	void result() { rethrow(); }
+};
+
+} /* namespace detail */
+
+/*
+ * A coroutine returning a T, which starts once it is awaited and then resumes its awaiter
+ * where it finishes.
+ */
+template <typename T>
+class [[nodiscard]] Task {
+public:
+	using promise_type = detail::TaskPromise<T>;
+
+	Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+	Task &operator=(Task &&other) noexcept {
+		std::swap(handle_, other.handle_);
+		return *this;
+	}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	~Task() {
+		if(handle_) {
+			handle_.destroy();
+		}
+	}
+
+	auto operator co_await() && noexcept {
+		struct Start {
+			std::coroutine_handle<promise_type> handle;
+			bool await_ready() const noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept {
+				handle.promise().continuation = awaiter;
+				return handle;
+			}
+			T await_resume() { return handle.promise().result(); }
+		};
+		return Start{ handle_ };
+	}
+
+private:
+	friend promise_type;
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+namespace detail {
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/* A coroutine which starts at once and frees itself where it finishes */
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+template <typename T>
+Detached runInto(ThreadPool &pool, Task<T> task, std::optional<T> &result, std::exception_ptr &error,
+				 std::latch &done) {
+	co_await pool.schedule();
+	{
+		Task<T> running = std::move(task);	/*Freed before the waiter is woken */
+		try {
+			result.emplace(co_await std::move(running));
+		} catch(...) {
+			error = std::current_exception();
+		}
+	}
+	done.count_down();
+}
+
+} /* namespace detail */
+
+/*
+ * Runs every task on pool at once and waits for all of them. Returns their results in
+ * order, or throws the exception of the first task (in order) which threw one.
+ */
+template <typename T>
+std::vector<T> syncWaitAll(ThreadPool &pool, std::vector<Task<T>> tasks) {
+	std::vector<std::optional<T>> results(tasks.size());
+	std::vector<std::exception_ptr> errors(tasks.size());
+	std::latch done(tasks.size());
+	for(size_t i = 0; i < tasks.size(); i++) {
+		detail::runInto(pool, std::move(tasks[i]), results[i], errors[i], done);
+	}
+	done.wait();
+	std::vector<T> values;
+	values.reserve(tasks.size());
+	for(size_t i = 0; i < tasks.size(); i++) {
+		if(errors[i]) {
+			std::rethrow_exception(errors[i]);
+		}
+		values.push_back(std::move(*results[i]));
+	}
+	return values;
+}
+
+template <typename T>
+T syncWait(ThreadPool &pool, Task<T> task) {
+	std::vector<Task<T>> tasks;
+	tasks.push_back(std::move(task));
+	return std::move(syncWaitAll(pool, std::move(tasks)).front());
+}
+
+/* A node of the $I30 index of a directory */
+class IndexNode {
+public:
+	explicit IndexNode(NTFSIndexNode *node) : node_(node, ntfsFreeIndexNode) {}
+
+	/* Returns the file named name, or else the VCN of the node to search next (-1 if none) */
+	std::pair<std::optional<File>, int64_t> search(NTFSVolume *volume, const std::string &name) const {
+		NTFSFile *file;
+		int64_t subnode;
+		if(ntfsSearchIndexNode(node_.get(), name.c_str(), &file, &subnode) != 0) {
+			throw Error("Failed to search index node", errno);
+		}
+		return { file ? std::optional<File>(File(volume, file)) : std::nullopt, subnode };
+	}
+
+	std::vector<NTFSIndexEntry> entries() const {
+		int n = ntfsIndexNodeEntries(node_.get(), nullptr, 0);
+		if(n < 0) {
+			throw Error("Failed to read index node", errno);
+		}
+		std::vector<NTFSIndexEntry> entries(n);
+		ntfsIndexNodeEntries(node_.get(), entries.data(), n);
+		return entries;
+	}
+
+private:
+	std::unique_ptr<NTFSIndexNode, void (*)(NTFSIndexNode *)> node_;
+};
+
+/* Awaited to read the node of the index of directory at vcn, resuming on pool */
+class IndexNodeRead {
+public:
+	IndexNodeRead(ThreadPool &pool, NTFSVolume *volume, const File &directory, int64_t vcn)
+		: pool_(pool), volume_(volume), directory_(directory.handle()), vcn_(vcn) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle) {
+		handle_ = handle;
+		if(ntfsReadIndexNode(volume_, directory_, vcn_, done, this) != 0) {
+			error_ = errno;
+			return false;	/*Not submitted, carry on at once */
+		}
+		return true;	/*this may be gone by now, if the read was done here */
+	}
+
+	IndexNode await_resume() {
+		if(!node_) {
+			throw Error("Failed to read index node", error_);
+		}
+		return IndexNode(node_);
+	}
+
+private:
+	static void done(void *arg, NTFSIndexNode *node, int error) {
+		IndexNodeRead *read = static_cast<IndexNodeRead *>(arg);
+		read->node_ = node;
+		read->error_ = error;
+		read->pool_.post(read->handle_);
+	}
+
+	ThreadPool &pool_;
+	NTFSVolume *volume_;
+	NTFSFile *directory_;
+	int64_t vcn_;
+	std::coroutine_handle<> handle_;
+	NTFSIndexNode *node_ = nullptr;
+	int error_ = 0;
+};
+
+namespace detail {
+
+/* Appends the files named by the subtree of the index of directory under node, in order */
+inline Task<void> listNode(ThreadPool &pool, NTFSVolume *volume, File directory, IndexNode node,
+						   std::vector<File> &files) {
+	for(const NTFSIndexEntry &entry : node.entries()) {
+		if(entry.subnode >= 0) {
+			IndexNode subnode = co_await IndexNodeRead(pool, volume, directory, entry.subnode);
+			co_await listNode(pool, volume, directory, std::move(subnode), files);
+		}
+		if(!entry.last && !entry.dosName && entry.file && entry.file != directory.handle()) {	/*The root lists itself */
+			files.emplace_back(volume, entry.file);
+		}
+	}
+}
+
+} /* namespace detail */
+
+/*
+ * Returns the file path leads to from the root, names separated by '/' or '\\', or nothing
+ * if there is no such file. Names are compared without case; links are not followed.
+ */
+inline Task<std::optional<File>> lookup(const Volume &volume, ThreadPool &pool, std::string path) {
+	NTFSVolume *handle = volume.handle();
+	File current = volume.file(NTFS_ROOT_RECORD);
+	size_t start = path.size() >= 2 && path[1] == ':' ? 2 : 0;	/*A drive letter */
+	while(start < path.size()) {
+		size_t end = path.find_first_of("/\\", start);
+		std::string name = path.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		start = end == std::string::npos ? path.size() : end + 1;
+		if(name.empty() || name == ".") {
+			continue;
+		}
+		if(name == "..") {
+			current = volume.file(current.info().parentRecord);
+			continue;
+		}
+		NTFSIndexNode *root = ntfsIndexRoot(handle, current.handle());
+		if(!root) {
+			co_return std::nullopt;		/*Not a directory */
+		}
+		IndexNode node(root);
+		for(;;) {
+			auto [file, subnode] = node.search(handle, name);
+			if(file) {
+				current = *file;
+				break;
+			}
+			if(subnode < 0) {
+				co_return std::nullopt;
+			}
+			node = co_await IndexNodeRead(pool, handle, current, subnode);
+		}
+	}
+	co_return current;
+}
+
+/*
+ * Returns the files of directory in the order of its index, each listed once (under its
+ * long name).
+ */
+inline Task<std::vector<File>> listDirectory(const Volume &volume, ThreadPool &pool, File directory) {
+	std::vector<File> files;
+	NTFSIndexNode *root = ntfsIndexRoot(volume.handle(), directory.handle());
+	if(!root) {
+		throw Error("Failed to list directory", errno);
+	}
+	co_await detail::listNode(pool, volume.handle(), directory, IndexNode(root), files);
+	co_return files;
+}
+
+} /* namespace rawntfs */
+
+#endif /* RAWNTFSASYNC_HPP_ */
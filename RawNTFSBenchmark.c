@@ -0,0 +1,319 @@
+/*
+ ============================================================================
+ Name        : RawNTFSBenchmark.c
+ Copyright   : GPL
+ Description : Microbenchmarks for the MFT record parsing hot paths.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Every allocation made by the parsing code is counted, with the bytes asked for, by
+ * routing malloc through countedMalloc(..) for the headers included below.
+ */
+static uint64_t countAllocs = 0;
+static uint64_t countAllocBytes = 0;
+static void *countedMalloc(size_t size) {
+	countAllocs++;
+	countAllocBytes += size;
+	return malloc(size);
+}
+#define malloc(size) countedMalloc(size)
+
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "RunList.h"
+#include "Debug.h"
+#include "Utility.h"
+#include "FileLUT.h"
+#include "MFTRecord.h"
+#include "Synthetic.h"
+
+#define DEFAULT_RECORDS 20000		/*Records in the synthetic corpus */
+#define DEFAULT_SEED 0x5EEDULL		/*Fixed seed, keeps runs comparable across commits */
+#define DEFAULT_REPEATS 5			/*Each benchmark reports the fastest of its repeats */
+
+/* A set of FILE records in on-disk form, benchmarked as one unit */
+typedef struct _Corpus {
+	char *name;
+	char *records;		/*Raw records, fixups not applied */
+	char *fixed;		/*The same records with fixups applied */
+	uint32_t nRecords;
+} Corpus;
+
+/* One hot path, run over every record of a corpus per repeat */
+typedef struct _Benchmark {
+	char *name;
+	uint64_t (*run)(Corpus *corpus);	/*Returns the number of operations performed */
+} Benchmark;
+
+static volatile uint64_t sink;	/*Defeats dead code elimination of results */
+
+uint64_t nowNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/*------------------------------------ Hot paths ------------------------------------*/
+
+uint64_t benchFixup(Corpus *corpus) {
+	char record[MFT_RECORD_LENGTH];
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		memcpy(record, corpus->records + (uint64_t)i*MFT_RECORD_LENGTH, MFT_RECORD_LENGTH);
+		sink += applyFixup(record, MFT_RECORD_LENGTH);
+	}
+	return corpus->nRecords;
+}
+
+uint64_t benchAttributeWalk(Corpus *corpus) {
+	uint64_t ops = 0;
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		char *record = corpus->fixed + (uint64_t)i*MFT_RECORD_LENGTH;
+		uint16_t offs = ((NTFS_MFT_FILE_ENTRY_HEADER *)record)->wAttribOffset;
+		while((offs = findAttribute(record, offs, 0)) != 0) {
+			sink += ((NTFS_ATTRIBUTE *)(record+offs))->dwType;
+			offs += ((NTFS_ATTRIBUTE *)(record+offs))->dwFullLength;
+			ops++;
+		}
+	}
+	return ops;
+}
+
+uint64_t benchRunListDecode(Corpus *corpus) {
+	uint64_t ops = 0;
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		char *record = corpus->fixed + (uint64_t)i*MFT_RECORD_LENGTH;
+		uint16_t offs = findAttribute(record, ((NTFS_MFT_FILE_ENTRY_HEADER *)record)->wAttribOffset, DATA);
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+offs);
+		if(offs == 0 || !attr->uchNonResFlag) {
+			continue;
+		}
+		uint32_t countRuns;
+		DataRun *runs = decodeRunList(record+offs+attr->Attr.NonResident.wDatarunOffset,
+									  attr->dwFullLength-attr->Attr.NonResident.wDatarunOffset, &countRuns);
+		sink += freeList(runs);
+		ops++;
+	}
+	return ops;
+}
+
+uint64_t benchFileName(Corpus *corpus) {
+	uint64_t ops = 0;
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		char *record = corpus->fixed + (uint64_t)i*MFT_RECORD_LENGTH;
+		uint16_t offs = findAttribute(record, ((NTFS_MFT_FILE_ENTRY_HEADER *)record)->wAttribOffset, FILE_NAME);
+		if(offs == 0) {
+			continue;
+		}
+		char *fileName = getFileName((NTFS_ATTRIBUTE *)(record+offs), record, offs);
+		sink += fileName[0];
+		memFree(fileName);
+		ops++;
+	}
+	return ops;
+}
+
+uint64_t benchCompare(Corpus *corpus) {
+	uint64_t ops = 0;
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		char *record = corpus->fixed + (uint64_t)i*MFT_RECORD_LENGTH;
+		uint16_t offs = findAttribute(record, ((NTFS_MFT_FILE_ENTRY_HEADER *)record)->wAttribOffset, FILE_NAME);
+		if(offs == 0) {
+			continue;
+		}
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+offs);
+		FILE_NAME_ATTR *fileNameAttr = (FILE_NAME_ATTR *)(record+offs+attr->Attr.Resident.wAttrOffset);
+		uint8_t length = fileNameAttr->bFileNameLength < 4 ? fileNameAttr->bFileNameLength : 4;
+		sink += aSCIIcmpuni("$MFT", fileNameAttr->arrUnicodeFileName, length);
+		ops++;
+	}
+	return ops;
+}
+
+uint64_t benchCatalogInsert(Corpus *corpus) {
+	File *files = NULL;
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		char *record = corpus->fixed + (uint64_t)i*MFT_RECORD_LENGTH;
+		files = addFile(files, NULL, 0, ((NTFS_MFT_FILE_ENTRY_HEADER *)record)->dwMFTRecNumber);
+	}
+	freeFiles(files);
+	return corpus->nRecords;
+}
+
+uint64_t benchRecordParse(Corpus *corpus) {
+	char record[MFT_RECORD_LENGTH];
+	ScanCounters counters = { 0 };
+	File *files = NULL;
+	uint32_t i;
+	for(i = 0; i < corpus->nRecords; i++) {
+		memcpy(record, corpus->records + (uint64_t)i*MFT_RECORD_LENGTH, MFT_RECORD_LENGTH);
+		applyFixup(record, MFT_RECORD_LENGTH);
+		files = parseFileRecord(files, record, 0, &counters);
+	}
+	freeFiles(files);
+	return corpus->nRecords;
+}
+
+static Benchmark benchmarks[] = {
+	{ "fixup_apply",		benchFixup },
+	{ "attribute_walk",		benchAttributeWalk },
+	{ "runlist_decode",		benchRunListDecode },
+	{ "filename_convert",	benchFileName },
+	{ "ascii_compare",		benchCompare },
+	{ "catalog_insert",		benchCatalogInsert },
+	{ "record_parse",		benchRecordParse },
+};
+
+/*------------------------------------- Corpora -------------------------------------*/
+
+/**
+ * Prepares the fixed up copy of the records of corpus.
+ */
+void fixCorpus(Corpus *corpus) {
+	uint32_t i;
+	corpus->fixed = malloc( (uint64_t)corpus->nRecords*MFT_RECORD_LENGTH );
+	memcpy(corpus->fixed, corpus->records, (uint64_t)corpus->nRecords*MFT_RECORD_LENGTH);
+	for(i = 0; i < corpus->nRecords; i++) {
+		applyFixup(corpus->fixed + (uint64_t)i*MFT_RECORD_LENGTH, MFT_RECORD_LENGTH);
+	}
+}
+
+/**
+ * Loads the FILE records of a local MFT copy, as written by RawNTFSExtraction, skipping its
+ * fragment records. Returns -1 if the copy cannot be read or holds no records.
+ */
+int loadRecordedCorpus(Corpus *corpus, char *path) {
+	FILE *mftCopy;
+	char record[MFT_RECORD_LENGTH];
+	uint32_t capacity = 1024;
+
+	if((mftCopy = fopen(path, "r")) == NULL) {
+		int errsv = errno;
+		printf("Failed to open MFT copy %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	corpus->name = path;
+	corpus->nRecords = 0;
+	corpus->records = malloc( (uint64_t)capacity*MFT_RECORD_LENGTH );
+	while(fread(record, MFT_RECORD_LENGTH, 1, mftCopy) == 1) {
+		if(!isFileRecord(record)) {
+			continue;
+		}
+		if(corpus->nRecords == capacity) {
+			capacity *= 2;
+			corpus->records = realloc(corpus->records, (uint64_t)capacity*MFT_RECORD_LENGTH);
+		}
+		memcpy(corpus->records + (uint64_t)corpus->nRecords++*MFT_RECORD_LENGTH, record, MFT_RECORD_LENGTH);
+	}
+	fclose(mftCopy);
+	if(corpus->nRecords == 0) {
+		printf("No FILE records in MFT copy %s.\n", path);
+		return -1;
+	}
+	fixCorpus(corpus);
+	return 0;
+}
+
+void buildCorpus(Corpus *corpus, uint32_t nRecords, uint64_t seed) {
+	corpus->name = "synthetic";
+	corpus->nRecords = nRecords;
+	corpus->records = malloc( (uint64_t)nRecords*MFT_RECORD_LENGTH );
+	buildSyntheticCorpus(corpus->records, nRecords, seed);
+	fixCorpus(corpus);
+}
+
+/**
+ * Runs every benchmark over corpus and prints one line per benchmark.
+ * The fastest repeat is reported, allocations are counted over the last one.
+ */
+void runBenchmarks(Corpus *corpus, int repeats) {
+	int b, r;
+	for(b = 0; b < sizeof(benchmarks)/sizeof(Benchmark); b++) {
+		uint64_t best = UINT64_MAX, ops = 0, allocs = 0, allocBytes = 0;
+		for(r = 0; r < repeats; r++) {
+			countAllocs = 0;
+			countAllocBytes = 0;
+			uint64_t start = nowNanos();
+			ops = benchmarks[b].run(corpus);
+			uint64_t elapsed = nowNanos() - start;
+			allocs = countAllocs;
+			allocBytes = countAllocBytes;
+			if(elapsed < best) {
+				best = elapsed;
+			}
+		}
+		if(best == 0) {
+			best = 1;
+		}
+		printf("%-12s %-18s %10" PRIu64 " %10.1f %14.0f %10.2f %10.1f\n",
+			   corpus->name, benchmarks[b].name, ops,
+			   ops ? (double)best/ops : 0.0,
+			   corpus->nRecords*1e9/best,
+			   (double)allocs/corpus->nRecords,
+			   (double)allocBytes/corpus->nRecords);
+	}
+}
+
+int main(int argc, char* argv[]) {
+	uint32_t nRecords = DEFAULT_RECORDS;
+	uint64_t seed = DEFAULT_SEED;
+	int repeats = DEFAULT_REPEATS;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:r:s:h")) != -1) {
+		switch(opt) {
+			case 'n' : nRecords = strtoul(optarg, NULL, 0); break;
+			case 'r' : repeats = atoi(optarg); break;
+			case 's' : seed = strtoull(optarg, NULL, 0); break;
+			default :
+				printf("Usage: %s [-n records] [-r repeats] [-s seed] [MFT copy ...]\n"
+					   "Benchmarks the record parsing hot paths over a synthetic corpus,\n"
+					   "and over the FILE records of each local MFT copy given.\n", argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if(nRecords == 0 || repeats < 1) {
+		printf("Need at least one record and one repeat.\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("%-12s %-18s %10s %10s %14s %10s %10s\n",
+		   "corpus", "benchmark", "ops", "ns/op", "records/s", "allocs/rec", "bytes/rec");
+
+	Corpus corpus;
+	buildCorpus(&corpus, nRecords, seed);
+	runBenchmarks(&corpus, repeats);
+	free(corpus.records);
+	free(corpus.fixed);
+
+	for(; optind < argc; optind++) {
+		if(loadRecordedCorpus(&corpus, argv[optind]) != 0) {
+			return EXIT_FAILURE;
+		}
+		runBenchmarks(&corpus, repeats);
+		free(corpus.records);
+		free(corpus.fixed);
+	}
+	if(NTFS_STATS) {
+		printStats(stdout);	/*Memory still held here is leaked by a benchmark */
+	}
+	return EXIT_SUCCESS;
+}
@@ -28,15 +28,32 @@
 #include "Utility.h"
 #include "FileLUT.h"
 #include "UserInterface.h"
+#include "MFTRecord.h"
+#include "Volume.h"
+#include "Sink.h"
+#include "Bitmap.h"
+#include "Carve.h"
+#include "ClusterMap.h"
+#include "Recovery.h"
+#include "Grep.h"
+#include "Check.h"
+#include "Security.h"
+#include "Reparse.h"
+#include "ObjectId.h"
+#include "Partition.h"
+#include "Imaging.h"
+#include "Sweep.h"
+#include "ErrorMap.h"
+#include "Diff.h"
+#include "KnownFiles.h"
+#include "Entropy.h"
+#include "TopK.h"
+#include "Resolve.h"
+#include "Stats.h"
+#include "Trace.h"
+#include "Memory.h"
 
 #define BUFFSIZE 1024			/*Generic data buffer size */
-#define P_PARTITIONS 4			/*Number of primary partitions */
-#define SECTOR_SIZE 512			/*Size of one sector */
-#define P_OFFSET 0x1BE			/*Partition information begins at offset 0x1BE */
-#define NTFS_TYPE 0x07			/*NTFS partitions are represented by 0x07 in the partition table */
-#define MFT_RECORD_LENGTH 1024 	/*MFT entries are 1024 bytes long */
-#define IN_USE		0x01		/*MFT FILE0 record flags */
-#define DIRECTORY	0x02
 
 static const char BLOCK_DEVICE[] = "/dev/mechastriessand/windows7";
 
@@ -46,53 +63,92 @@ int getBootSectInfo(char* buff, NTFS_BOOT_SECTOR *bootSec);
 int getFILE0Attrib(char* buff, NTFS_MFT_FILE_ENTRY_HEADER *mftFileEntry);
 int getMFTAttribMembers(char * buff, NTFS_ATTRIBUTE* attrib);
 
-int lseekAbs(int fileDescriptor, off_t offset);
-int lseekRel(int fileDescriptor, off_t offset);
-
-uint16_t blkDevDescriptor = 0;		/*File descriptor for block device */
-off_t blk_offset = 0;
-uint32_t dwBytesPerCluster = -1;  	/*Bytes per cluster on the disk */
-uint64_t relativePartSector = -1; 	/*Relative offset in bytes of the NTFS partition table */
-
-FILE * MFT_file_copy;
+int runCommand(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName);
+int printOwners(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName);
+int recoverFiles(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName, Sink *sinks);
+int checkFiles(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName);
+void openClusterMap(Options *options, File *files, MFTCopy *mftCopy, char *mftCopyName, ClusterMap *map);
+void reportBadRegions(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName, ErrorMap *errors);
+int restreamRecovered(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName, ErrorMap *recovered);
+Sink newHashSink(void *arg);
+Sink newExtractSink(void *outputDir);
+Sink newEntropySink(void *run);
+void saveEntropy(File *files, MFTCopy *mftCopy, char *mftCopyName, uint64_t limit);
+
+ErrorMap errorMap;					/*Unreadable regions of the device */
+KnownSet *knownFiles = NULL;		/*Files left out of hashing and extraction, NULL for none */
 
 int main(int argc, char* argv[]) {
-	ssize_t readStatus;
+	Options options;
+	int blkDevDescriptor;		/*File descriptor for block device */
 	int workingPartition = -1;
-	uint64_t u64bytesAbsoluteMFT = -1;
-	char* buff = malloc( BUFFSIZE );	/*Used for getPartitionInfo(...), getBootSectinfo(...) et al*/
-	char* mftBuffer = malloc( MFT_RECORD_LENGTH ); /*Buffer an entire MFT Record here*/
+	char* buff = memAlloc( MEM_METADATA, BUFFSIZE );	/*Used for getPartitionInfo(...), getBootSectinfo(...) et al*/
 
-	system("clear"); /*Clear terminal window */
-	printf("Launching raw NTFS extraction engine for %s\n", BLOCK_DEVICE);
+	char mftCopyName[CMD_BUFF] = "";	/*Local copy of the MFT of the last NTFS partition */
+	char errorMapPath[CMD_BUFF + sizeof(ERROR_MAP_SUFFIX)];
+	uint64_t u64bytesMFTRead = 0;		/*Bytes read imaging the device or extracting MFTs */
+
+	if(parseOptions(argc, argv, &options, BLOCK_DEVICE) != 0) {
+		return EXIT_FAILURE;
+	}
+	if(NTFS_STATS) {
+		atexit(printStatsAtExit);
+	}
+	if(options.tracePath) {
+		startTrace();
+		traceThreadName("main");
+	}
+	if(!options.command) {
+		system("clear"); /*Clear terminal window */
+	}
+	printf("Launching raw NTFS extraction engine for %s\n", options.device);
+
+	/*Regions found unreadable by earlier runs are not read again */
+	initErrorMap(&errorMap);
+	if(options.errorMapPath) {
+		snprintf(errorMapPath, sizeof(errorMapPath), "%s", options.errorMapPath);
+	} else {
+		char *deviceName = strrchr(options.device, '/');
+		snprintf(errorMapPath, sizeof(errorMapPath), "%s%s", deviceName ? deviceName+1 : options.device, ERROR_MAP_SUFFIX);
+	}
+	if(loadErrorMap(errorMapPath, &errorMap) == 0) {
+		printf("Loaded error map %s, %" PRIu64 " regions known to be unreadable.\n", errorMapPath, errorMap.nRegions);
+	}
 
 	/*Open block device in read-only mode */
-	if((blkDevDescriptor = open(BLOCK_DEVICE, O_RDONLY)) == -1 ) {
+	if((blkDevDescriptor = open(options.device, O_RDONLY)) == -1 ) {
 		int errsv = errno;
-		printf("Failed to open block device %s with error: %s.\n", BLOCK_DEVICE, strerror(errsv));
+		printf("Failed to open block device %s with error: %s.\n", options.device, strerror(errsv));
 		return EXIT_FAILURE;
 	}
 
-	/*Seek partition table  */
-	lseekAbs(blkDevDescriptor, P_OFFSET);
+	/*Image the device in one pass, copying its MFTs on the way, and read the image from then on */
+	Acquisition acquisition = { 0 };
+	int sourceDescriptor = -1;
+	if(options.imagePath) {
+		if(acquireImage(blkDevDescriptor, options.imagePath, &acquisition, &errorMap) != 0) {
+			return EXIT_FAILURE;
+		}
+		sourceDescriptor = blkDevDescriptor;	/*Kept for the retry pass */
+		if((blkDevDescriptor = open(options.imagePath, O_RDONLY)) == -1 ) {
+			int errsv = errno;
+			printf("Failed to open image %s with error: %s.\n", options.imagePath, strerror(errsv));
+			return EXIT_FAILURE;
+		}
+		u64bytesMFTRead += acquisition.bytes;
+	}
 
 	/*--------------------- Read in primary partitions from MBR ---------------------*/
 	printf("Reading primary partition data: ");
-	PARTITION **priParts = malloc( P_PARTITIONS*sizeof(PARTITION) );
-	PARTITION **nTFSParts = malloc( P_PARTITIONS*sizeof(PARTITION) );
-	int i, nNTFS = 0;
+	PARTITION priParts[P_PARTITIONS];
+	int i, nNTFS = 0, nTFSParts[P_PARTITIONS];
 	/*Iterate the primary partitions in MBR to look for NTFS partitions */
-	for(i = 0; i < P_PARTITIONS; i++) {
-		priParts[i] = malloc( sizeof(PARTITION) );
-		if((readStatus = read( blkDevDescriptor, priParts[i], sizeof(PARTITION))) == -1){
-			int errsv = errno;
-			printf("Failed to open partition table with error: %s.\n", strerror(errsv));
-		} else {
-			if(priParts[i]->chType == NTFS_TYPE) {	/*If this partition is an NTFS entity */
-				nTFSParts[nNTFS] = malloc( sizeof(PARTITION) );
-				nTFSParts[nNTFS++] = priParts[i]; 	/*Increment the NTFS parts counter */
+	if(readPartitionTable(blkDevDescriptor, priParts) == 0) {
+		for(i = 0; i < P_PARTITIONS; i++) {
+			if(priParts[i].chType == NTFS_TYPE) {	/*If this partition is an NTFS entity */
+				nTFSParts[nNTFS++] = i; 			/*Increment the NTFS parts counter */
 				if(DEBUG) {
-					getPartitionInfo(buff, priParts[i]);
+					getPartitionInfo(buff, &priParts[i]);
 					printf("\nPartition %d:\n%s\n",i, buff);
 				}
 			}
@@ -106,538 +162,648 @@ int main(int argc, char* argv[]) {
 		printf("%u NTFS partitions located.\n", nNTFS);
 	}
 
-
 	/*-------------- Follow relative sector offset of NTFS partitions ---------------*/
+	NTFSGeometry geometry = { 0 };
 	for(workingPartition = 0; workingPartition < nNTFS; workingPartition++) {
-		NTFS_BOOT_SECTOR *nTFS_Boot = malloc( sizeof(NTFS_BOOT_SECTOR) );
-		relativePartSector = nTFSParts[workingPartition]->dwRelativeSector*SECTOR_SIZE;
-
-		/*Set offset pointer to partition table */
-		lseekAbs(blkDevDescriptor, relativePartSector);
-
-		if((readStatus = read(blkDevDescriptor, nTFS_Boot, sizeof(NTFS_BOOT_SECTOR))) == -1) {
-			int errsv = errno;
-			printf("Failed to open NTFS Boot sector for partition %d with error: %s.\n",i , strerror(errsv));
-		} else {
-			printf("\nExtracting MFT from partition %d\n", workingPartition);
+		PARTITION *partition = &priParts[nTFSParts[workingPartition]];
+		NTFS_BOOT_SECTOR nTFS_Boot;
+		if(readNTFSGeometry(blkDevDescriptor, partition, &nTFS_Boot, &geometry) != 0) {
+			continue;
 		}
-		if(nTFSParts[workingPartition]->chBootInd == 0x08) { /*If this is a Bootable NTFS partition -0x80*/
+		printf("\nExtracting MFT from partition %d\n", workingPartition);
+		if(partition->chBootInd == 0x08) { /*If this is a Bootable NTFS partition -0x80*/
 			printf("\tThis is the boot partition.\n");
 		}
-
-		/*------ If NTFS boot sector found then use it to find Master File Table -----*/
 		if (DEBUG) {
-			getBootSectInfo(buff, nTFS_Boot);
+			getBootSectInfo(buff, &nTFS_Boot);
 			printf("\nNTFS boot sector data\n%s\n", buff);
 		}
-		/*Calculate the number of bytes per sector = sectors per cluster * bytes per sector */
-		dwBytesPerCluster = (nTFS_Boot->bpb.uchSecPerClust) * (nTFS_Boot->bpb.wBytesPerSec);
-		if (DEBUG) printf("Filesystem Bytes Per Cluster: %d\n", dwBytesPerCluster);
-		/*Calculate the number of bytes by which the boot sector is offset on disk */
-		uint64_t u64bytesAbsoluteSector = (nTFS_Boot->bpb.wBytesPerSec) * (nTFSParts[workingPartition]->dwRelativeSector);
-		if (DEBUG) printf("Bootsector offset in bytes: %" PRIu64 "\n", u64bytesAbsoluteSector );
-		/*Calculate the relative bytes location of the MFT on the partition */
-		uint64_t u64bytesRelativeMFT = dwBytesPerCluster * (nTFS_Boot->bpb.n64MFTLogicalClustNum);
-		if (DEBUG) printf("Relative bytes location of MFT: %" PRIu64 "\n", u64bytesRelativeMFT);
-		/*Absolute MFT offset in bytes*/
-		u64bytesAbsoluteMFT = u64bytesAbsoluteSector + u64bytesRelativeMFT;
-		if (DEBUG) printf("Absolute MFT location in bytes: %" PRIu64 "\n", u64bytesAbsoluteMFT);
-
-		/*Find the root directory metafile entry in the MFT, and extract its index allocation attributes */
-		/*$MFT is always the first MFT record, and it's mirror the second */
-		NTFS_MFT_FILE_ENTRY_HEADER *mftMetaMFT;
-		//mftMetaMFT = malloc( MFT_META_HEADERS*sizeof(NTFS_MFT_FILE_ENTRY_HEADER) );
-
-		/*Move file pointer to the absolute MFT location */
-		if(u64bytesAbsoluteMFT > 0) {
-			lseekAbs(blkDevDescriptor, u64bytesAbsoluteMFT);
-		}
-
-		//for(i = 0; i < MFT_META_HEADERS; i++) { /*For each of the MFT entries */
-		bool isMFTFile = false;	/*Set true only for the MFT entry */
-		char * ascFileName = NULL;
-		mftMetaMFT = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) ); /*Allocate for the file header */
-		/* Read the MFT entry */
-		if((readStatus = read( blkDevDescriptor, mftBuffer, MFT_RECORD_LENGTH)) == -1) { /*Read the next record */
-			int errsv = errno;
-			printf("Failed to read MFT at offset: %" PRIu64 ", with error %s.\n",
-													 u64bytesAbsoluteMFT, strerror(errsv));
-			return EXIT_FAILURE;
+		DEBUG_PRINT("Filesystem Bytes Per Cluster: %d\n", geometry.bytesPerCluster);
+		DEBUG_PRINT("Absolute MFT location in bytes: %" PRIu64 "\n", geometry.mftOffset);
+
+		/*Copied while imaging */
+		if(workingPartition < IMAGE_PARTITIONS && acquisition.mftCopied[workingPartition]) {
+			snprintf(mftCopyName, CMD_BUFF, "$MFT%d", workingPartition);
+			printf("\t$MFT copied to local %s while imaging.\n", mftCopyName);
+			continue;
 		}
-		/* Copy MFT record header*/
-		memcpy(mftMetaMFT, mftBuffer, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
-		if(DEBUG) printf("\nRead MFT record %d into buffer.\n", i);
 
-		/*------------------------- Get MFT Record attributes ------------------------*/
-		if(DEBUG) {
-			getFILE0Attrib(buff, mftMetaMFT);
+		/*$MFT is always the first MFT record, its $DATA gives the runs of the MFT */
+		MFTCopy partitionCopy;
+		uint32_t nFragments;
+		if(readMFT(blkDevDescriptor, &geometry, &partitionCopy, &errorMap, &nFragments) != 0) {
+			return EXIT_FAILURE;
+		}
+		printf("\t$MFT meta file found.\n");
+		if(DEBUG && partitionCopy.nSlots > 1) {
+			getFILE0Attrib(buff, (NTFS_MFT_FILE_ENTRY_HEADER *)(partitionCopy.records + MFT_RECORD_LENGTH));
 			printf("%s\n", buff);
 		}
+		snprintf(mftCopyName, CMD_BUFF, "$MFT%d", workingPartition);
+		if(nFragments > 1) {
+			printf("\t$MFT is fragmented on disk, located %u fragments.\n", nFragments);
+		}
+		printf("\tWriting DATA attribute to local %s file\n", mftCopyName);
+		if(saveMFTCopy(&partitionCopy, mftCopyName) != 0) {
+			closeMFTCopy(&partitionCopy);
+			return EXIT_FAILURE;
+		}
+		uint64_t sizeofMFT = partitionCopy.length - (uint64_t)nFragments*sizeof(FRAG);
+		printf("\tSize of MFT extracted from partition %u: %" PRIu64 " bytes\n", workingPartition, sizeofMFT);
+		u64bytesMFTRead += sizeofMFT;
+		closeMFTCopy(&partitionCopy);
+	}
+	if(mftCopyName[0] == '\0') {
+		printf("No MFT could be read, can't continue.\n");
+		return EXIT_FAILURE;
+	}
 
-		NTFS_ATTRIBUTE *mftRecAttrib, *mftRecAttribTemp = malloc( sizeof(NTFS_ATTRIBUTE) );
-		uint16_t attribOffset = mftMetaMFT->wAttribOffset; /*Offset to attributes */
+	/*------------------- Process FILE records from extracted MFT  ------------------*/
+	printf("\nProcessing MFT %s...\n", mftCopyName);
 
-		/*---------------------- Follow attribute(s) offset position(s) ---------------------*/
-		do {
-			memcpy(mftRecAttribTemp, mftBuffer+attribOffset, sizeof(NTFS_ATTRIBUTE));
-			/*Determine actual attribute length and use to copy full attribute */
-			mftRecAttrib = malloc(mftRecAttribTemp->dwFullLength);
-			memcpy(mftRecAttrib, mftBuffer+attribOffset, mftRecAttribTemp->dwFullLength);
-			if (VERBOSE & DEBUG) {
-				getMFTAttribMembers(buff, mftRecAttrib);
-				printf("%s\n", buff);
-			}
+	MFTCopy mftCopy;
+	if(openMFTCopy(mftCopyName, &mftCopy) != 0) {
+		return EXIT_FAILURE;
+	}
 
-			if(DEBUG && mftRecAttrib->dwType == STANDARD_INFORMATION) { /*if is STANDATRD_INFORMATION attribute */
-				printf("STANDARD_INFORMATION attribute\n");
-			}
-			else if(DEBUG && mftRecAttrib->dwType == ATTRIBUTE_LIST) {
-				printf("ATTRIBUTE_LIST attribute\n");
-			}
-			else if(mftRecAttrib->dwType == FILE_NAME) { /*If is FILE_NAME attribute */
-				ascFileName = getFileName(mftRecAttrib, mftBuffer, attribOffset);
-				/* Check if fileName == $MFT, set toggle */
-				if( strcmp(ascFileName, "$MFT" ) == 0 ) {
-					isMFTFile = true;
-				} else {
-					isMFTFile = false;
-				}
-			} else if(DEBUG && mftRecAttrib->dwType == OBJECT_ID ) {
-				printf("OBJECT_ID attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == SECURITY_DESCRIPTOR) {
-				printf("SECURITY_DESCRIPTOR attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == VOLUME_NAME) {
-				/*This attribute simply contains the name of the volume. (In UNICODE!) */
-				printf("VOLUME_NAME attribute\n");
-				VOLUME_NAME_ATTR *vNameAttr = malloc( mftRecAttrib->Attr.Resident.dwLength + 1);
-				memcpy(vNameAttr, mftBuffer + attribOffset + (mftRecAttrib->Attr).Resident.wAttrOffset,
-														 	 (mftRecAttrib->Attr).Resident.dwLength);
-				printf("\tVolume Name: %s\n", vNameAttr->arrUnicodeVolumeName);
-				free(vNameAttr);
-			} else if(DEBUG && mftRecAttrib->dwType == VOLUME_INFORMATION) {
-				printf("VOLUME_INFORMATION attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == DATA) {
-				printf("DATA attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == INDEX_ROOT) {
-				/*This is the root node of the B+ tree that implements an index (e.g. a directory).
-			  This file attribute is always resident. */
-				printf("INDEX_ROOT attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == INDEX_ALLOCATION) {
-				printf("INDEX_ALLOCATION attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == BITMAP) {
-				/*This file attribute is a sequence of bits, each of which represents the status of an entity. */
-				printf("BITMAP attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == REPARSE_POINT) {
-				printf("REPARSE_POINT attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == EA_INFORMATION) {
-				printf("EA_INFORMATION attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == EA) {
-				printf("EA attribute\n");
-			} else if(DEBUG && mftRecAttrib->dwType == LOGGED_UTILITY_STREAM) {
-				printf("LOGGED_UTILITY_STREAM attribute\n");
-			} else {
-				if(DEBUG) printf("Unknown attribute of type: %d.\n", mftRecAttrib->dwType);
+	ScanCounters counters = { 0 };
+	File *files = NULL; /* Init the list of files to be constructed */
+	scanMFTCopy(&mftCopy, options.threads, &files, &counters);
+
+	printf("\n%d MFT fragments\n", counters.countFrags);
+	printf("files: %d\tdirectories: %d\n"
+			"deleted entities: %d\tOther entities: %d\n",
+			counters.countFiles, counters.countDir,
+			counters.countDelEntity, counters.countOther);
+	printf("Bad record attributes: %d\n", counters.countBadAttr);
+	printf("Records failing fixup: %d\n", counters.countBadFixup);
+	printf("File names: %d\n", counters.countFileNames);
+	if(counters.countCorrupt > 0) {
+		printf("MFT file corrupted, %d records with an unknown signature skipped.\n", counters.countCorrupt);
+	}
+
+	/*Reads of file content go through the block reader, at the last NTFS partition */
+	Volume volume = { openBlockReader(blkDevDescriptor, options.queueDepth, (uint64_t)options.cacheMB*1024*1024),
+					  geometry.partitionOffset, geometry.bytesPerCluster, geometry.totalClusters };
+	volume.reader->errors = &errorMap;
+	int ret = EXIT_SUCCESS;
+
+	if(options.command) {
+		ret = runCommand(&options, &volume, files, &mftCopy, mftCopyName);
+		/*Totals on one line, for the throughput harness */
+		printf("RESULT records=%d bytes_read=%" PRIu64 " read_calls=%" PRIu64 " cache_hits=%" PRIu64 "\n",
+			   counters.countRecords, u64bytesMFTRead + volume.reader->bytesRead,
+			   volume.reader->readCalls, volume.reader->cacheHits);
+	} else {
+		/*------------------------------ User interface to the program ------------------------------*/
+		char cmd[CMD_BUFF];
+		int8_t pRet = -1;
+		do {
+			printf("What do you want to do? \n");
+			if(fgets(cmd, CMD_BUFF-1, stdin) == NULL) {
+				break;	/*End of input */
 			}
-			/* Is attribute resident? */
-			if(DEBUG) printf("\t%s ", mftRecAttrib->uchNonResFlag==true?"Non-Resident.":"Resident.");
-			if(mftRecAttrib->uchNonResFlag==false) { /*Is resident */
-				uint32_t attribDataSize = (mftRecAttrib->Attr.Resident).dwLength;
-				if(DEBUG && VERBOSE) {
-					printf("\tData size: %d Bytes.\n", attribDataSize);
-					size_t attribDataOffset = (mftRecAttrib->Attr.Resident).wAttrOffset;
-					uint16_t * residentData = malloc( attribDataSize );
-					/* Dump raw resident-attribute data for debugging purposes. */
-					memcpy(residentData, mftBuffer+attribOffset+attribDataOffset, attribDataSize);
-					int  k = 0;
-					printf("\tSize of data: %lu Raw attribute data: ", attribDataSize/sizeof(uint16_t));
-					for(; k<attribDataSize/sizeof(uint16_t); k++) {
-						printf("%04x: ", residentData[k]);
-						printf("%c ", residentData[k]&0xFF);
+			switch(pRet = parseUserInput(cmd)) {
+				case PRINT_HELP :
+					printf(HELP);
+					break;
+				case PRINT_FILES :
+					printAllFiles(files);
+					break;
+				case PRINT_STATS :
+					printStats(stdout);
+					break;
+				case TOP_FILES : {
+					char *topArgs[4];
+					int nTopArgs = 0;
+					char *token = strtok(cmd + strlen(TOP_CMD), " \t");
+					for(; token && nTopArgs < 4; token = strtok(NULL, " \t")) {
+						topArgs[nTopArgs++] = token;
 					}
-					printf("\n");
-					free(residentData);
+					topFiles(files, &mftCopy, mftCopyName, topArgs, nTopArgs, options.threads);
+					break;
 				}
+				case UNKNOWN :
+					printf("Command not recognised, try \'help\'\n");
+					break;
 			}
-			/*--------- If the attribute data is non-resident then... ---------*/
-			else if(mftRecAttrib->uchNonResFlag==true) {
-				uint8_t countRuns = 0;
-				OFFS_LEN_BITFIELD *offs_len_bitField = malloc( sizeof(OFFS_LEN_BITFIELD) );
-				uint64_t realSize = (mftRecAttrib->Attr).NonResident.n64RealSize;
-
-				/*Offset to data runs */
-				uint16_t dataRunOffset = (mftRecAttrib->Attr).NonResident.wDatarunOffset;
-				if(DEBUG) {
-					printf("\tReal file size: %" PRId64 " bytes.\n", realSize);
-					printf("\tData run offset in attribute header: %u out of %u\n", dataRunOffset, mftRecAttrib->dwFullLength);
-					printf("\tProcessing run list...\n");
-				}
-
-				DataRun *p_head = NULL; /*Allocate for runlist */
-				do {
-					uint64_t *length = malloc( sizeof(uint64_t) ); /*The length and offset data run fields are always 8 or less bytes */
-					int64_t *offset = malloc( sizeof(int64_t) ); /* Offset is signed */
-					/*Follow offset to data runs, read first data run. */
-					/*First read it's offset and length nibbles using the bitfield */
-					/*Top four bits represent a length, and the last four bits represent an offset. */
-					if(countRuns == 0) {
-						memcpy(offs_len_bitField, mftBuffer+attribOffset+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-					}
-					if(DEBUG && VERBOSE) {
-						printf("\tlength of length field of datarun: %u ", offs_len_bitField->bitfield.lengthSize);
-						printf("\tlength of offset field of datarun: %u\n", offs_len_bitField->bitfield.offsetSize);
-					}
-
-					*length = 0; /*Initialise to zero since values may be less than 8 bytes long */
-					*offset = 0;
-					dataRunOffset++; /*Move offset past offset_length_union */
+		} while( pRet != EXIT );
+	}
 
-					/*Copy length field from run list */
-					memcpy(length, mftBuffer+attribOffset+dataRunOffset, offs_len_bitField->bitfield.lengthSize);
-					dataRunOffset+=offs_len_bitField->bitfield.lengthSize; /*Move offset past length field */
+	printf("%d FILE records processed.\n", counters.countRecords);
+
+	/*Flag what was zero filled, then revisit it on the device, patching the image with what is
+	  read and streaming again the files which held it */
+	if(errorMap.nRegions > 0) {
+		reportBadRegions(&options, &volume, files, &mftCopy, mftCopyName, &errorMap);
+		if(options.retries > 0) {
+			ErrorMap recovered;
+			initErrorMap(&recovered);
+			if(options.imagePath) {
+				patchImage(sourceDescriptor, options.imagePath, &acquisition, &errorMap, options.retries, &recovered);
+			} else {
+				retryBadRegions(blkDevDescriptor, &errorMap, options.retries, -1, &recovered);
+			}
+			if(recovered.nRegions > 0 && options.command &&
+			   restreamRecovered(&options, &volume, files, &mftCopy, mftCopyName, &recovered) > 0) {
+				ret = EXIT_FAILURE;
+			}
+			freeErrorMap(&recovered);
+		}
+	}
+	/*Without -I, regions unpatched come from the map of the image being read, and stay */
+	int64_t nSaved;
+	if((errorMap.nRegions > 0 || errorMap.nLoaded > 0) &&
+	   (nSaved = saveErrorMap(&errorMap, errorMapPath, !options.imagePath)) >= 0) {
+		printf("Saved error map %s, %" PRId64 " regions unreadable.\n", errorMapPath, nSaved);
+	}
+	/*The image has a map of its own, of where it still holds zeros, found by runs reading it */
+	if(options.imagePath) {
+		char imageMapPath[CMD_BUFF + sizeof(ERROR_MAP_SUFFIX)];
+		char *imageName = strrchr(options.imagePath, '/');
+		snprintf(imageMapPath, sizeof(imageMapPath), "%s%s", imageName ? imageName+1 : options.imagePath, ERROR_MAP_SUFFIX);
+		if(errorMap.nRegions == 0) {
+			unlink(imageMapPath);	/*Left from an earlier image */
+		} else if((nSaved = saveErrorMap(&errorMap, imageMapPath, true)) >= 0) {
+			printf("Saved error map %s, %" PRId64 " regions zero filled in the image.\n", imageMapPath, nSaved);
+		}
+	}
 
-					/*Copy offset field from run list */
-					memcpy(offset, mftBuffer+attribOffset+dataRunOffset, offs_len_bitField->bitfield.offsetSize);
-					dataRunOffset+=offs_len_bitField->bitfield.offsetSize; /*Move offset past offset field */
+	closeBlockReader(volume.reader);
+	if(options.tracePath && writeTrace(options.tracePath) != 0) {
+		ret = EXIT_FAILURE;
+	}
+	freeFiles(files);
+	closeMFTCopy(&mftCopy);
+	freeErrorMap(&errorMap);
 
-					p_head = addRun(p_head, length, offset);
-					if(DEBUG && VERBOSE) {
-						printf("\tLength of datarun: %" PRIu64 " clusters\t", *length);
-						printf("\tVCN offset to datarun: %" PRId64 " clusters\n", *offset);
-					}
-					countRuns++;
+	// Need to build a LUT of write offset versus file name, something like that.
 
-					/*Copy next bitfield header, check if == 0 for loop termination */
-					memcpy(offs_len_bitField, mftBuffer+attribOffset+dataRunOffset, sizeof(OFFS_LEN_BITFIELD));
-				} while(offs_len_bitField->val != 0);
+	/*---------------------------------- Tidy up ----------------------------------*/
+	//for(i = 0; i < MFT_META_HEADERS; i++) {
+	//	free(mftMetaHeaders[i]);
+	//}free(mftMetaHeaders);/*Free the memory allocated for the NTFS metadata files*/
 
-				p_head = reverseList(p_head);
-				if(DEBUG) {
-					printRuns(buff, p_head);
-					printf("%s", buff);
-					printf("\tFinished processing %u data runs from runlist\n", countRuns);
-				}
+	memFree(buff); 			/*Used for buffering various texts */
 
-				/*Now.. I need the DATA attribute from the MFT, so check */
-				/*If this is it, then extract it to a local file*/
-				if(isMFTFile && (mftRecAttrib->dwType == DATA)) {
-					printf("\t$MFT meta file found.\n");
-					uint8_t fileNameLen = snprintf(NULL, 0, "%s%d", ascFileName , workingPartition) + 1; // \0 terminated
-					char * fileName = malloc( fileNameLen );
-
-					snprintf(fileName, fileNameLen, "%s%d.data", ascFileName, workingPartition);
-					if((MFT_file_copy = fopen(fileName, "w+")) == NULL) {/*Open/create file, r/w pointer at start */
-						int errsv = errno;
-						printf("Failed to create local file for storing %s: %s.\n", ascFileName, strerror(errsv));
-						return EXIT_FAILURE;
-					}
-					if(countRuns > 1) {
-						printf("\t%s is fragmented on disk, located %u fragments.\n", ascFileName, countRuns);
-					}
-					printf("\tWriting DATA attribute to local %s file\n", fileName);
-					free(fileName);
+	if(sourceDescriptor != -1) {
+		close(sourceDescriptor);
+	}
+	if((close(blkDevDescriptor)) == -1) { /*close block device and check if failed */
+		int errsv = errno;
+		printf("Failed to close block device %s with error: %s.\n", options.device, strerror(errsv));
+		return EXIT_FAILURE;
+	}
 
-					off_t offset_restore = blk_offset; /*Backup the current read offset */
+	return ret;
+} //end of main method.
 
-					/* Move file pointer to start of partition */
-					if((blk_offset = lseek( blkDevDescriptor, relativePartSector, SEEK_SET )) == -1) {
-						int errsv = errno;
-						printf("Failed to set file pointer with error: %s.\n", strerror(errsv));
-						return EXIT_FAILURE;
-					}
+/**
+ * Runs the workload named by options->command over the files found on volume, catalogued
+ * in the MFT copy mftCopy at mftCopyName, with options->threads worker threads.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE.
+ */
+int runCommand(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName) {
+	uint32_t nFiles;
+	int t, failures = 0;
 
-					/*Iterate through the runlist and extract data*/
-					DataRun *p_current_item = p_head;
-					uint64_t sizeofMFT = 0;
-					while (p_current_item) {
-						if (p_current_item->offset && p_current_item->length) {
-							off_t nonResReadFrom =  dwBytesPerCluster*(*p_current_item->offset);
-							if(DEBUG) {
-								printf("\t%" PRIu64 "\t%" PRId64 "\n", *p_current_item->offset, *p_current_item->length);
-								printf("\tnonResReadFrom: %" PRId64 "\n", nonResReadFrom);
-							}
-
-							/* Move file pointer to the cluster */
-							lseekRel(blkDevDescriptor, nonResReadFrom);
-							if(DEBUG && VERBOSE) printf("\tblk_offset = %" PRId64 "\n", blk_offset);
-
-							size_t readLength = dwBytesPerCluster*(*p_current_item->length);
-							char * dataRun = malloc( readLength );
-
-							/*Read for length specified in dataRun */
-							if((readStatus = read(blkDevDescriptor, dataRun, readLength)) == -1 ){
-								int errsv = errno;
-								printf("Failed to open read MFT from disk with error: %s.\n", strerror(errsv));
-							} else {
-								FRAG *frag = createFragRecord(blk_offset);
-
-								/*Write special fragment header to local file */
-								if( fwrite( frag, sizeof(FRAG), 1, MFT_file_copy ) != 1) {
-									int errsv = errno;
-									printf("Write MFT to local file with error: %s.\n", strerror(errsv));
-									return EXIT_FAILURE;
-								}
-								/*Copy the memory to the local file */
-								if( fwrite( dataRun, readLength, 1, MFT_file_copy ) != 1) {
-									int errsv = errno;
-									printf("Write MFT to local file with error: %s.\n", strerror(errsv));
-									return EXIT_FAILURE;
-								}
-								sizeofMFT += readLength;
-								free(frag);
-							}
-							free(dataRun);
-						} else {
-							if(DEBUG) printf("\tNo data.\n");
-						}
-						/*Rewind position (-1) by length of the data run */
-						lseekRel(blkDevDescriptor, (-1)*(*p_current_item->length)*dwBytesPerCluster);
-						p_current_item = p_current_item->p_next; /*Advance position in list */
-					} // while (p_current_item)
-					printf("\tSize of MFT extracted from partition %u: %" PRId64 " bytes\n", workingPartition, sizeofMFT);
-
-					/*Restore read position on block device */
-					lseekAbs(blkDevDescriptor, offset_restore);
-
-				}// end of if(isMFTFile && (mftRecAttrib->dwType == DATA))
-
-				freeList(p_head);
-				free(offs_len_bitField);
-				//free(p_head); Can't free this yet.
-			}
-			attribOffset += mftRecAttrib->dwFullLength; /*Increment the offset by the length of this attribute */
-		} while(attribOffset+8 < mftMetaMFT->dwRecLength); /*While there are attributes left to inspect */
-		free(mftRecAttrib);
-		free(mftRecAttribTemp);
-		if(ascFileName != NULL) {
-			free(ascFileName);
+	if(strcmp(options->command, SCAN_CMD) == 0) {
+		return EXIT_SUCCESS;	/*Scanning is done by now */
+	}
+	if(strcmp(options->command, LIST_CMD) == 0) {
+		printAllFiles(files);
+		return EXIT_SUCCESS;
+	}
+	if(strcmp(options->command, OWNER_CMD) == 0) {
+		return printOwners(options, volume, files, mftCopy, mftCopyName);
+	}
+	if(strcmp(options->command, CHECK_CMD) == 0) {
+		return checkFiles(options, volume, files, mftCopy, mftCopyName);
+	}
+	if(strcmp(options->command, SECURITY_CMD) == 0) {
+		return securityReport(volume, files, mftCopy, options->args, options->nArgs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if(strcmp(options->command, LINKS_CMD) == 0) {
+		return linksReport(files, options->args, options->nArgs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if(strcmp(options->command, OBJID_CMD) == 0) {
+		return objectIdReport(volume, files, mftCopy, options->args, options->nArgs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if(strcmp(options->command, DIFF_CMD) == 0) {
+		if(options->nArgs != 1) {
+			printf("diff takes the MFT copy to compare with.\n");
+			return EXIT_FAILURE;
 		}
-		free(nTFS_Boot);		/*Free Boot sector memory */
-
-	} //for(workingPartition = 0; workingPartition < nNTFS; workingPartition++) {
-
-	/*Close local file copy of MFT if open */
-	if(MFT_file_copy!=NULL) {
-		fclose(MFT_file_copy);
+		return diffMFTCopies(files, mftCopy, options->args[0], options->threads) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if(strcmp(options->command, RESOLVE_CMD) == 0) {
+		if(options->nArgs > 1) {
+			printf("resolve takes the file listing the paths, or nothing to read them from stdin.\n");
+			return EXIT_FAILURE;
+		}
+		return resolveReport(volume, files, options->args, options->nArgs) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if(strcmp(options->command, TOP_CMD) == 0) {
+		return topFiles(files, mftCopy, mftCopyName, options->args, options->nArgs, options->threads) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	if(strcmp(options->command, GREP_CMD) == 0) {
+		return grepFiles(volume, files, options->args, options->nArgs, options->threads) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 
-	/*------------------- Process FILE records from extracted MFT  ------------------*/
-	printf("\nProcessing MFT...\n");
-	int countRecords = 0;
-
-	/*Open file, r pointer at start */
-	if((MFT_file_copy = fopen("$MFT1", "r+")) == NULL) {
-		int errsv = errno;
-		printf("Failed to open file: %s.\n", strerror(errsv));
-		return EXIT_FAILURE;
+	/*Entropy is measured over the first KB given of each file, or all of it */
+	EntropyRun entropyRun = { 0 };
+	if(strcmp(options->command, ENTROPY_CMD) == 0) {
+		if(options->nArgs > 1 || (options->nArgs == 1 && atoi(options->args[0]) < 1)) {
+			printf("entropy takes the KB measured from the start of each file, or nothing for all of it.\n");
+			return EXIT_FAILURE;
+		}
+		entropyRun.limit = options->nArgs ? (uint64_t)atoi(options->args[0])*1024 : 0;
 	}
 
-	/*Set fp to beginning of file */
-	if((fseek(MFT_file_copy, 0, SEEK_SET)) != 0) {
+	/*Every other workload but hashing and measuring entropy writes files */
+	if(strcmp(options->command, HASH_CMD) != 0 && strcmp(options->command, ENTROPY_CMD) != 0 && mkdir(options->outputDir, 0755) == -1 && errno != EEXIST) {
 		int errsv = errno;
-		printf("Error handing local MFT file copy: %s.\n", strerror(errsv));
+		printf("Failed to create output directory %s: %s.\n", options->outputDir, strerror(errsv));
 		return EXIT_FAILURE;
 	}
 
-	NTFS_MFT_FILE_ENTRY_HEADER *mftFileH = malloc( sizeof(NTFS_MFT_FILE_ENTRY_HEADER) ); /*Allocate for the FILE0 header */
-	NTFS_ATTRIBUTE *mftRecAttrTmp = malloc( sizeof(NTFS_ATTRIBUTE) ); /*Attribute header size */
-	NTFS_ATTRIBUTE *mftRecAttr = malloc( MFT_RECORD_LENGTH ); /*Attribute size << record size */
-
-	int countFiles = 0, countDelEntity = 0, countDir = 0, countOther = 0;
-	int countBadAttr = 0;
-	int countFileNames = 0;
-	int countFrags = 0;
-
-	File *files = NULL; /* Init the list of files to be constructed */
-	uint64_t u64bytesAbsMFTOffset = 0;
-
-	while((readStatus = fread(mftBuffer, MFT_RECORD_LENGTH, 1, MFT_file_copy)) != 0) {
-		/*Read in one whole MFT record to mftBuffer, each time loop iterates */
-		/*Extract MFT header */
-		memcpy(mftFileH, mftBuffer, sizeof(NTFS_MFT_FILE_ENTRY_HEADER));
-		if(VERBOSE && DEBUG) {
-			getFILE0Attrib(buff, mftFileH);
-			printf("%s\n", buff);
+	/*Known files are left out of hashing and extraction */
+	KnownSet known;
+	if(options->knownPath && (strcmp(options->command, HASH_CMD) == 0 || strcmp(options->command, EXTRACT_CMD) == 0)) {
+		if(loadKnownSet(options->knownPath, &known) != 0) {
+			return EXIT_FAILURE;
 		}
-		/*Fragment records keep track of the MFT fragment from which records originated */
-		/*Each fragment record starts with signature 'FRAG', check this */
-		if(mftFileH->fileSignature[0] == 'F' &&
-		   mftFileH->fileSignature[1] == 'R' &&
-		   mftFileH->fileSignature[2] == 'A' &&
-		   mftFileH->fileSignature[3] == 'G') {
-				printf("MFT Fragment record found\n");
-				FRAG *frag = malloc( sizeof(FRAG) );
-				memcpy(frag, mftBuffer, sizeof(FRAG));
-				printf("\tOffset for the records that follow: %" PRIu64 "\n", frag->u64fragOffset);
-				u64bytesAbsMFTOffset = frag->u64fragOffset;
-				free(frag);
-				countFrags++;
-		}
-
-		/*Each subsequent file record should  start with signature 'FILE0', check this. */
-		else if(strcmp(mftFileH->fileSignature, "FILE0") == 0) {
-
-			char * aFileName = NULL;
-
-			/*Check file flags on record, determine record type */
-			uint16_t mftFlags = mftFileH->wFlags;
-			if(mftFlags==IN_USE) {
-				countFiles++;
-			} else if (mftFlags==!IN_USE) {
-				countDelEntity++;
-			} else if (mftFlags==IN_USE||DIRECTORY) {
-				countDir++;
-			} else {
-				countOther++;
-				if(DEBUG)printf("%u\t", mftFlags);
-			}
-
-			/*---------------------------- Get MFT Record attributes ---------------------------*/
-			uint16_t attrOffset = mftFileH->wAttribOffset; 	 	    /*Offset to first attribute */
-			do {
-				/*------- Attribute size if unknown, so get header first which contains size -------*/
-				memcpy(mftRecAttrTmp, mftBuffer+attrOffset, sizeof(NTFS_ATTRIBUTE));
-
-				/*- NOTE: Some attributes have impossible record lengths > 1024, this breaks things -*/
-				if(mftRecAttrTmp->dwFullLength > MFT_RECORD_LENGTH-attrOffset) {
-					if(DEBUG) {
-						printf("Bad record attribute:\n");
-						getMFTAttribMembers(buff,mftRecAttrTmp);
-						printf("%s\n", buff);
-					}
-					countBadAttr++;
-					break;
-				}
-				/*-------- Determine actual attribute length and use to copy full attribute --------*/
-				memcpy(mftRecAttr, mftBuffer+attrOffset, mftRecAttrTmp->dwFullLength);
-
-				if(mftRecAttr->dwType == STANDARD_INFORMATION) {
-					if(DEBUG) {
-						STD_INFORMATION *stdInfo = malloc( sizeof(STANDARD_INFORMATION) );
-						uint32_t fileP = getFilePermissions(stdInfo);
-						printf("%" PRIu32 " ", fileP);
-						free(stdInfo);
-					}
-				}
-
-				/*---------------------------- Get file name from record ---------------------------*/
-				/*------------------ Generally have more than one per actual file ------------------*/
-				else if(mftRecAttr->dwType == FILE_NAME) { 					/*If is FILE_NAME attribute */
-					aFileName = getFileName(mftRecAttr, mftBuffer, attrOffset);
-					//printf("%s\n", aFileName);
-					//free(aFileName);
-					countFileNames++;
-				}
-
-				/*Get Directory information, resident.  */
-				else if(mftRecAttr->dwType == INDEX_ROOT) {
+		knownFiles = &known;
+	}
 
-				}
+	Sink *sinks = malloc( options->threads*sizeof(Sink) );
+	for(t = 0; t < options->threads; t++) {
+		if(strcmp(options->command, HASH_CMD) == 0) {
+			sinks[t] = newHashSink(NULL);
+		} else if(strcmp(options->command, ENTROPY_CMD) == 0) {
+			sinks[t] = newEntropySink(&entropyRun);
+		} else {
+			sinks[t] = newExtractSink(options->outputDir);
+		}
+	}
+	File **fileArray = NULL;
+	if(strcmp(options->command, CARVE_CMD) == 0) {
+		ClusterBitmap bitmap;
+		uint64_t nExtents;
+		if(loadClusterBitmap(volume, files, &bitmap) != 0) {
+			failures = 1;
+		} else {
+			Extent *extents = freeExtents(&bitmap, &nExtents);
+			printf("%" PRIu64 " of %" PRIu64 " clusters in use, %" PRIu64 " free runs.\n",
+				   usedClusters(&bitmap), bitmap.nClusters, nExtents);
+			failures = carveVolume(volume, extents, nExtents, sinks, options->threads);
+			memFree(extents);
+			freeClusterBitmap(&bitmap);
+		}
+	} else if(strcmp(options->command, RECOVER_CMD) == 0) {
+		failures = recoverFiles(options, volume, files, mftCopy, mftCopyName, sinks);
+	} else if(options->sweep) {
+		ClusterMap map;
+		openClusterMap(options, files, mftCopy, mftCopyName, &map);
+		if(strcmp(options->command, HASH_CMD) == 0) {
+			failures = sweepFiles(volume, files, &map, newHashSink, NULL, options->threads);
+		} else if(strcmp(options->command, ENTROPY_CMD) == 0) {
+			failures = sweepFiles(volume, files, &map, newEntropySink, &entropyRun, options->threads);
+		} else {
+			failures = sweepFiles(volume, files, &map, newExtractSink, options->outputDir, options->threads);
+		}
+		freeClusterMap(&map);
+		if(failures > 0) {
+			printf("%d files could not be read in full.\n", failures);
+		}
+	} else {
+		fileArray = indexFiles(files, &nFiles);
+		failures = streamFiles(volume, fileArray, nFiles, sinks, options->threads);
+		if(failures > 0) {
+			printf("%d files could not be read in full.\n", failures);
+		}
+	}
 
-				/* Get Directory information, always non-resident (INDEX_ROOT is resident) */
-				else if(mftRecAttr->dwType == INDEX_ALLOCATION) {
+	for(t = 0; t < options->threads; t++) {
+		closeSink(&sinks[t]);
+	}
+	free(sinks);
+	memFree(fileArray);
+	if(strcmp(options->command, ENTROPY_CMD) == 0) {
+		printEntropyReport(&entropyRun);
+		saveEntropy(files, mftCopy, mftCopyName, entropyRun.limit);
+	}
+	if(knownFiles) {
+		printKnownSetReport(knownFiles);
+		freeKnownSet(knownFiles);
+		knownFiles = NULL;
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 
-				}
+/* Sinks of hash and extract, also of one file each for sweepFiles(..), leaving out known files */
+Sink newHashSink(void *arg) {
+	return knownFiles ? createKnownHashSink(knownFiles) : createHashSink();
+}
 
-				else if(mftRecAttr->dwType == DATA) {
-					if(mftRecAttr->uchNonResFlag==false) { /*Is resident */
-						uint32_t attrDataSize = (mftRecAttr->Attr.Resident).dwLength;
-						size_t attrDataOffset = (mftRecAttr->Attr.Resident).wAttrOffset;
-						//uint16_t * residentData = malloc( attrDataSize );
-						char * residentData = malloc( attrDataSize );
-						/* Dump raw resident-attribute data for debugging purposes. */
-						memcpy(residentData, mftBuffer+attrOffset+attrDataOffset, attrDataSize);
-						int  k = 0;
-						//printf("\tSize of data: %lu Raw attribute data:\n", attrDataSize/sizeof(uint16_t));
-						//if(aFileName != NULL) printf("%s\n", aFileName);
-						//for(k = 0; k<attrDataSize/sizeof(uint16_t); k++) {
-						for(k = 0; k < attrDataSize; k++) {
-							//printf("%04x: ", residentData[k]);
-							//printf("%c", residentData[k]);
-						}
-						//printf("\n");
-						free(residentData);
-					} else { /*non-resident */
-						//printf("non-res data");
-					}
-				}
+Sink newExtractSink(void *outputDir) {
+	return knownFiles ? createKnownExtractSink(outputDir, knownFiles) : createExtractSink(outputDir);
+}
 
-				attrOffset += mftRecAttr->dwFullLength; /*Increment the offset by the length of this attribute */
-			} while(attrOffset+8 < mftFileH->dwRecLength); /*While there are attributes left to inspect */
-				//free(aFileName);
-				countRecords++;
-				//if(countRecords > 48) break; //Debug break out.
+Sink newEntropySink(void *run) {
+	return createEntropySink(run);
+}
 
-			files = addFile(files, aFileName, u64bytesAbsMFTOffset, mftFileH->dwMFTRecNumber);
+/**
+ * Saves the entropy columns of files, measured over the first limit bytes of each, next
+ * to the MFT copy at mftCopyName for top to rank by.
+ */
+void saveEntropy(File *files, MFTCopy *mftCopy, char *mftCopyName, uint64_t limit) {
+	char columnsPath[CMD_BUFF + sizeof(ENTROPY_COLUMNS_SUFFIX)];
+	uint32_t nRecords;
+	snprintf(columnsPath, sizeof(columnsPath), "%s%s", mftCopyName, ENTROPY_COLUMNS_SUFFIX);
+	File **byRecord = indexRecords(files, &nRecords);
+	if(saveEntropyColumns(byRecord, nRecords, mftCopyKey(mftCopy), limit, columnsPath) == 0) {
+		printf("Saved entropy columns %s.\n", columnsPath);
+	}
+	memFree(byRecord);
+}
 
-		} else {
-			printf("MFT file corrupted.\n");
-			return EXIT_FAILURE;
+/**
+ * Loads the cluster map saved with the MFT copy into map, or builds and saves it if the
+ * copy has changed.
+ *
+ * WARNING: Memory is allocated for the runs, need to freeClusterMap(..) the map.
+ */
+void openClusterMap(Options *options, File *files, MFTCopy *mftCopy, char *mftCopyName, ClusterMap *map) {
+	char mapPath[CMD_BUFF + sizeof(CLUSTER_MAP_SUFFIX)];
+	snprintf(mapPath, sizeof(mapPath), "%s%s", mftCopyName, CLUSTER_MAP_SUFFIX);
+	uint64_t key = mftCopyKey(mftCopy);
+	if(loadClusterMap(mapPath, key, map) == 0) {
+		printf("Loaded cluster map %s.\n", mapPath);
+	} else {
+		buildClusterMap(files, options->threads, map);
+		map->key = key;
+		if(saveClusterMap(map, mapPath) == 0) {
+			printf("Saved cluster map %s.\n", mapPath);
 		}
+	}
+	printf("%" PRIu64 " runs owned by files in use, %" PRIu64 " starting inside another.\n",
+		   map->nRuns, map->crossLinked);
+}
 
-	} //while((readStatus = fread(mftBuffer, MFT_RECORD_LENGTH, 1, MFT_file_copy)) != 0) {
+/**
+ * Prints what each region of errors held, through the cluster map: the MFT records, or
+ * the bytes of the data of each file, zero filled in its place, so the records and files
+ * affected are known. Bytes outside the partition or owned by no file in use are counted.
+ */
+void reportBadRegions(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName, ErrorMap *errors) {
+	ClusterMap map;
+	uint64_t i, j, nOwners, bytesOutside = 0, bytesUnowned = 0, nFiles = 0;
+	uint32_t nRecords;
+	char path[MAX_PATH_LENGTH];
+	uint64_t partitionEnd = volume->partitionOffset + volume->totalClusters*volume->bytesPerCluster;
+
+	printf("\n%" PRIu64 " regions unreadable, %" PRIu64 " bytes zero filled by this run.\n",
+		   errors->nRegions, errors->bytesSkipped);
+	openClusterMap(options, files, mftCopy, mftCopyName, &map);
+	File **byRecord = indexRecords(files, &nRecords);
+	bool *affected = memCalloc( MEM_CATALOG, nRecords ? nRecords : 1, sizeof(bool) );
+	for(i = 0; i < errors->nRegions; i++) {
+		BadRegion *region = &errors->regions[i];
+		uint64_t start = region->offset, end = region->offset + region->length, owned = 0;
+		printf("0x%" PRIx64 "-0x%" PRIx64 " (%s):\n", start, end - 1, badStateNames[region->state]);
+		if(start < volume->partitionOffset) {
+			bytesOutside += (end < volume->partitionOffset ? end : volume->partitionOffset) - start;
+			start = volume->partitionOffset;
+		}
+		if(end > partitionEnd) {
+			bytesOutside += end - (start > partitionEnd ? start : partitionEnd);
+			end = partitionEnd;
+		}
+		if(start >= end) {
+			continue;
+		}
+		uint64_t lcn = (start - volume->partitionOffset) / volume->bytesPerCluster;
+		uint64_t count = (end - volume->partitionOffset - 1) / volume->bytesPerCluster - lcn + 1;
+		OwnerRun *runs = findClusterOwners(&map, lcn, count, &nOwners);
+		for(j = 0; j < nOwners; j++) {
+			OwnerRun *run = &runs[j];
+			uint64_t runStart = volume->partitionOffset + run->lcn*volume->bytesPerCluster;
+			uint64_t runEnd = runStart + run->length*volume->bytesPerCluster;
+			uint64_t badStart = start > runStart ? start : runStart;
+			uint64_t badEnd = end < runEnd ? end : runEnd;
+			if(badStart >= badEnd) {
+				continue;	/*A cross-linked run ending before the region */
+			}
+			uint64_t from = run->vcn*volume->bytesPerCluster + (badStart - runStart);
+			uint64_t to = from + (badEnd - badStart);
+			owned += badEnd - badStart;
+			if(run->recordNumber == MFT_RECORD && run->stream == DATA) {
+				printf("\tMFT records %" PRIu64 "-%" PRIu64 "\n", from / MFT_RECORD_LENGTH, (to - 1) / MFT_RECORD_LENGTH);
+				continue;
+			}
+			File *file = run->recordNumber < nRecords ? byRecord[run->recordNumber] : NULL;
+			if(!file || filePath(byRecord, nRecords, file, path, sizeof(path)) == 0) {
+				snprintf(path, sizeof(path), "%s", file && file->fileName ? file->fileName : "no name");
+			}
+			printf("\trecord %u %s, bytes %" PRIu64 "-%" PRIu64 " of its %s\n", run->recordNumber, path, from, to - 1,
+				   ownedStreamName(run->stream));
+			if(run->recordNumber < nRecords && !affected[run->recordNumber]) {
+				affected[run->recordNumber] = true;
+				nFiles++;
+			}
+		}
+		bytesUnowned += (end - start) - (owned < end - start ? owned : end - start);
+	}
+	printf("%" PRIu64 " files affected, %" PRIu64 " bytes owned by no file in use, %" PRIu64 " bytes outside "
+		   "the partition.\n", nFiles, bytesUnowned, bytesOutside);
+	memFree(affected);
+	memFree(byRecord);
+	freeClusterMap(&map);
+}
 
+/**
+ * Streams again the files holding any of the regions of recovered, which a retry pass has
+ * now read where they were zero filled before, through the sinks of options->command, so
+ * their digests are printed again or their copies written again with what was recovered.
+ * Only hash and extract are streamed again, and MFT records or index blocks recovered are
+ * not parsed again.
+ * Returns the number of files which could not be read in full.
+ */
+int restreamRecovered(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName, ErrorMap *recovered) {
+	ClusterMap map;
+	KnownSet known;
+	uint64_t i, j, nOwners;
+	uint32_t nRecords, nAffected = 0;
+	int t, failures;
+	bool hash = strcmp(options->command, HASH_CMD) == 0;
+	uint64_t partitionEnd = volume->partitionOffset + volume->totalClusters*volume->bytesPerCluster;
+
+	if(!hash && strcmp(options->command, EXTRACT_CMD) != 0) {
+		return 0;
+	}
+	openClusterMap(options, files, mftCopy, mftCopyName, &map);
+	File **byRecord = indexRecords(files, &nRecords);
+	File **affected = memAlloc( MEM_CATALOG, (nRecords ? nRecords : 1)*sizeof(File *) );
+	bool *marked = memCalloc( MEM_CATALOG, nRecords ? nRecords : 1, sizeof(bool) );
+	for(i = 0; i < recovered->nRegions; i++) {
+		BadRegion *region = &recovered->regions[i];
+		uint64_t start = region->offset, end = region->offset + region->length;
+		cacheDrop(volume->reader, start, end - start);	/*Cached zero filled */
+		start = start > volume->partitionOffset ? start : volume->partitionOffset;
+		end = end < partitionEnd ? end : partitionEnd;
+		if(start >= end) {
+			continue;
+		}
+		uint64_t lcn = (start - volume->partitionOffset) / volume->bytesPerCluster;
+		uint64_t count = (end - volume->partitionOffset - 1) / volume->bytesPerCluster - lcn + 1;
+		OwnerRun *runs = findClusterOwners(&map, lcn, count, &nOwners);
+		for(j = 0; j < nOwners; j++) {
+			OwnerRun *run = &runs[j];
+			uint64_t runStart = volume->partitionOffset + run->lcn*volume->bytesPerCluster;
+			uint64_t runEnd = runStart + run->length*volume->bytesPerCluster;
+			if(start >= runEnd || end <= runStart || run->stream != DATA || run->recordNumber == MFT_RECORD ||
+			   run->recordNumber >= nRecords || !byRecord[run->recordNumber] || marked[run->recordNumber]) {
+				continue;
+			}
+			marked[run->recordNumber] = true;
+			affected[nAffected++] = byRecord[run->recordNumber];
+		}
+	}
+	freeClusterMap(&map);
+	memFree(marked);
+	memFree(byRecord);
+	if(nAffected == 0) {
+		memFree(affected);
+		return 0;
+	}
 
-	printf("\n%d MFT fragments\n", countFrags);
-	printf("files: %d\tdirectories: %d\n"
-			"deleted entities: %d\tOther entities: %d\n",
-			countFiles, countDir,
-			countDelEntity, countOther);
-	printf("Bad record attributes: %d\n", countBadAttr);
-	printf("File names: %d\n", countFileNames);
-
-	/*------------------------------ User interface to the program ------------------------------*/
-	char cmd[CMD_BUFF];
-	int8_t pRet = -1;
-	do {
-		printf("What do you want to do? \n");
-		fgets(cmd, CMD_BUFF-1, stdin);
-		switch(pRet = parseUserInput(cmd)) {
-			case PRINT_HELP :
-				printf(HELP);
-				break;
-			case PRINT_FILES :
-				printAllFiles(files);
-				break;
-			case UNKNOWN :
-				printf("Command not recognised, try \'help\'\n");
-				break;
-		}
-	} while( pRet != EXIT );
-
-	free(mftFileH);
-	free(mftRecAttr);
-	free(mftRecAttrTmp);
-	printf("%d FILE records processed.\n", countRecords);
-
-
-	if(MFT_file_copy != NULL) {
-		fclose(MFT_file_copy);
+	printf("\n%s again %u files holding recovered bytes:\n", hash ? "Hashing" : "Extracting", nAffected);
+	if(options->knownPath && loadKnownSet(options->knownPath, &known) == 0) {
+		knownFiles = &known;
+	}
+	Sink *sinks = malloc( options->threads*sizeof(Sink) );
+	for(t = 0; t < options->threads; t++) {
+		sinks[t] = hash ? newHashSink(NULL) : newExtractSink(options->outputDir);
+	}
+	failures = streamFiles(volume, affected, nAffected, sinks, options->threads);
+	if(failures > 0) {
+		printf("%d files could not be read in full.\n", failures);
 	}
+	for(t = 0; t < options->threads; t++) {
+		closeSink(&sinks[t]);
+	}
+	free(sinks);
+	if(knownFiles) {
+		freeKnownSet(knownFiles);
+		knownFiles = NULL;
+	}
+	memFree(affected);
+	return failures;
+}
 
-	// Need to build a LUT of write offset versus file name, something like that.
+/**
+ * Prints the file owning each byte offset in options->args, through the cluster map.
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE if an offset is not a number.
+ */
+int printOwners(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName) {
+	ClusterMap map;
+	int i, ret = EXIT_SUCCESS;
+
+	openClusterMap(options, files, mftCopy, mftCopyName, &map);
+
+	for(i = 0; i < options->nArgs; i++) {
+		char *end;
+		uint64_t offset = strtoull(options->args[i], &end, 0);
+		if(*options->args[i] == 0 || *end != 0) {
+			printf("%s: not a byte offset.\n", options->args[i]);
+			ret = EXIT_FAILURE;
+			continue;
+		}
+		uint64_t lcn = offset / volume->bytesPerCluster, nOwners, j;
+		if(!findClusterOwner(&map, lcn)) {
+			printf("%" PRIu64 ": cluster %" PRIu64 " is not owned by a file in use.\n", offset, lcn);
+			continue;
+		}
+		/*A cross-linked cluster is printed with each of its owners */
+		OwnerRun *runs = findClusterOwners(&map, lcn, 1, &nOwners);
+		for(j = 0; j < nOwners; j++) {
+			OwnerRun *run = &runs[j];
+			if(lcn - run->lcn >= run->length) {
+				continue;
+			}
+			File *file = findFileRecord(files, run->recordNumber);
+			printf("%" PRIu64 ": cluster %" PRIu64 " is cluster %" PRIu64 " of record %u (%s), byte %" PRIu64 " of its %s.\n",
+				   offset, lcn, run->vcn + (lcn - run->lcn), run->recordNumber,
+				   file && file->fileName ? file->fileName : "no name",
+				   (run->vcn + (lcn - run->lcn))*volume->bytesPerCluster + offset%volume->bytesPerCluster,
+				   ownedStreamName(run->stream));
+		}
+	}
+	freeClusterMap(&map);
+	return ret;
+}
 
-	/*---------------------------------- Tidy up ----------------------------------*/
-	for(i = 0; i < P_PARTITIONS; i++) {
-		free(priParts[i]);	/*Free the memory allocated for primary partition structs */
-	} free(priParts);
-	for(i=0; i < nNTFS; i++) {
-		free(nTFSParts[i]); /*Free the memory allocated for NTFS partition structs */
-	} free(nTFSParts);
-	//for(i = 0; i < MFT_META_HEADERS; i++) {
-	//	free(mftMetaHeaders[i]);
-	//}free(mftMetaHeaders);/*Free the memory allocated for the NTFS metadata files*/
+/**
+ * Scores every deleted file by how much of its content is left, prints the scores, and
+ * streams those fully recoverable through the sinks (those partially recoverable too,
+ * given the argument "partial").
+ * Returns the number of files which could not be recovered in full, or 1 if $Bitmap
+ * cannot be read.
+ */
+int recoverFiles(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName, Sink *sinks) {
+	ClusterBitmap bitmap;
+	ClusterMap map;
+	uint64_t nDeleted, i;
+	uint32_t nRecords, nWanted = 0;
+	bool partial = options->nArgs > 0 && strcmp(options->args[0], "partial") == 0;
+	int failures;
+
+	if(loadClusterBitmap(volume, files, &bitmap) != 0) {
+		return 1;
+	}
+	openClusterMap(options, files, mftCopy, mftCopyName, &map);
+	DeletedFile *deleted = scoreDeletedFiles(files, &bitmap, &map, volume->bytesPerCluster,
+											 options->threads, &nDeleted);
+	File **byRecord = indexRecords(files, &nRecords);
+	printDeletedFiles(deleted, nDeleted, byRecord, nRecords);
+
+	File **wanted = memAlloc( MEM_CATALOG, (nDeleted ? nDeleted : 1)*sizeof(File *) );
+	for(i = 0; i < nDeleted; i++) {
+		if(deleted[i].score == RECOVERABLE_FULLY || (partial && deleted[i].score == RECOVERABLE_PARTIALLY)) {
+			wanted[nWanted++] = deleted[i].file;
+		}
+	}
+	printf("Recovering %u files into %s.\n", nWanted, options->outputDir);
+	failures = streamSelectedFiles(volume, wanted, nWanted, sinks, options->threads, hasDeletedContent);
+
+	memFree(wanted);
+	memFree(byRecord);
+	memFree(deleted);
+	freeClusterMap(&map);
+	freeClusterBitmap(&bitmap);
+	return failures;
+}
 
-	free(buff); 			/*Used for buffering various texts */
-	free(mftBuffer);		/*Used for buffering one MFT record, 1kb*/
+/**
+ * Checks the consistency of the catalog with $Bitmap and the cluster map, and prints the
+ * problems found. Returns EXIT_SUCCESS if there are none.
+ */
+int checkFiles(Options *options, Volume *volume, File *files, MFTCopy *mftCopy, char *mftCopyName) {
+	ClusterBitmap bitmap;
+	ClusterMap map;
+	uint64_t nProblems;
 
-	if((close(blkDevDescriptor)) == -1) { /*close block device and check if failed */
-		int errsv = errno;
-		printf("Failed to close block device %s with error: %s.\n", BLOCK_DEVICE, strerror(errsv));
+	if(loadClusterBitmap(volume, files, &bitmap) != 0) {
 		return EXIT_FAILURE;
 	}
-
-	return EXIT_SUCCESS;
-} //end of main method.
+	openClusterMap(options, files, mftCopy, mftCopyName, &map);
+	nProblems = checkVolume(volume, files, &bitmap, &map, options->threads);
+	freeClusterMap(&map);
+	freeClusterBitmap(&bitmap);
+	return nProblems == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
 /**
  * Prints the members of *part into *buff, plus some extra derived info.
@@ -787,29 +953,6 @@ int getMFTAttribMembers(char * buff, NTFS_ATTRIBUTE* attrib) {
 				(attrib->Attr).Resident.uchIndexedTag,
 				(attrib->Attr).Resident.uchPadding);
 	}
+	free(tempBuff);
 	return 0;
 }
-
-/**
- * Calls lseek(.. with error checking, absolute position mode.
- */
-int lseekAbs(int fileDescriptor, off_t offset) {
-	if((blk_offset = lseek(blkDevDescriptor, offset, SEEK_SET)) == -1) {
-		int errsv = errno;
-		printf("Failed to position file pointer with error: %s.\n", strerror(errsv));
-		return EXIT_FAILURE;
-	}
-	return EXIT_SUCCESS;
-}
-
-/**
- * Calls lseek(.. with error checking, relative position mode.
- */
-int lseekRel(int fileDescriptor, off_t offset) {
-	if((blk_offset = lseek(blkDevDescriptor, offset, SEEK_CUR)) == -1) {
-		int errsv = errno;
-		printf("Failed to position file pointer with error: %s.\n", strerror(errsv));
-		return EXIT_FAILURE;
-	}
-	return EXIT_SUCCESS;
-}
@@ -0,0 +1,308 @@
+/*
+ ============================================================================
+ Name        : RawNTFSThroughput.c
+ Copyright   : GPL
+ Description : End-to-end throughput harness for RawNTFSExtraction. Runs its
+               workloads over images for every combination of thread count,
+               queue depth and cache size, and reports each run as JSON.
+ ============================================================================
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <time.h>
+#include <ftw.h>
+
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "Synthetic.h"
+
+#define MAX_SWEEP 16			/*Most values swept per setting */
+#define MAX_IMAGES 16
+#define OUTPUT_BUFF 65536
+
+/* Values swept for one setting, parsed from a comma separated list */
+typedef struct _Sweep {
+	int values[MAX_SWEEP];
+	int count;
+} Sweep;
+
+/* What one run of the tool measured */
+typedef struct _RunResult {
+	int exitStatus;
+	double wall, user, sys;		/*Seconds */
+	long peakRSS;				/*KB */
+	uint64_t bytesRead;
+	uint64_t records;
+	bool haveResult;			/*The tool printed its RESULT line */
+} RunResult;
+
+static const char *defaultWorkloads[] = { "scan", "list", "hash", "extract" };
+
+double nowSeconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+/**
+ * Parses a comma separated list of integers into sweep. Returns -1 if it is not valid.
+ */
+int parseSweep(char *list, Sweep *sweep) {
+	char *end;
+	sweep->count = 0;
+	while(*list && sweep->count < MAX_SWEEP) {
+		sweep->values[sweep->count++] = strtol(list, &end, 10);
+		if(end == list || (*end && *end != ',')) {
+			printf("Not a list of numbers: %s\n", list);
+			return -1;
+		}
+		list = *end ? end+1 : end;
+	}
+	return sweep->count > 0 ? 0 : -1;
+}
+
+int removeEntry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+	return remove(path);
+}
+
+/**
+ * Asks the kernel to drop clean page cache pages, so runs read from the device.
+ * Needs root, failure is reported once and otherwise ignored.
+ */
+void dropCaches() {
+	static bool warned = false;
+	int fd;
+	sync();
+	if((fd = open("/proc/sys/vm/drop_caches", O_WRONLY)) == -1 || write(fd, "3", 1) != 1) {
+		if(!warned) {
+			fprintf(stderr, "Cannot drop page cache, runs may be served from memory: %s.\n", strerror(errno));
+			warned = true;
+		}
+	}
+	if(fd != -1) {
+		close(fd);
+	}
+}
+
+/**
+ * Runs the tool once in a fresh working directory, with its output piped back here.
+ * Resource usage comes from wait4(..), so it covers only this run.
+ */
+int runTool(char *tool, char *image, const char *workload, int threads, int queueDepth, int cacheMB,
+			RunResult *result) {
+	char workDir[] = "/tmp/ntfsthroughput.XXXXXX";
+	char threadsArg[16], depthArg[16], cacheArg[16];
+	char buff[OUTPUT_BUFF+1];
+	char line[1024];
+	size_t lineLength = 0;
+	int pipeFds[2], status;
+	struct rusage usage;
+	pid_t pid;
+
+	memset(result, 0, sizeof(RunResult));
+	if(mkdtemp(workDir) == NULL || pipe(pipeFds) == -1) {
+		printf("Failed to set up run: %s.\n", strerror(errno));
+		return -1;
+	}
+	snprintf(threadsArg, sizeof(threadsArg), "%d", threads);
+	snprintf(depthArg, sizeof(depthArg), "%d", queueDepth);
+	snprintf(cacheArg, sizeof(cacheArg), "%d", cacheMB);
+
+	double start = nowSeconds();
+	if((pid = fork()) == 0) {
+		dup2(pipeFds[1], STDOUT_FILENO);
+		close(pipeFds[0]);
+		close(pipeFds[1]);
+		if(chdir(workDir) == -1) {
+			_exit(127);
+		}
+		execl(tool, tool, "-d", image, "-t", threadsArg, "-q", depthArg, "-c", cacheArg,
+			  "-o", "extracted", workload, (char *)NULL);
+		_exit(127);
+	}
+	close(pipeFds[1]);
+
+	/*Keep only the RESULT line of the output */
+	ssize_t n;
+	while((n = read(pipeFds[0], buff, OUTPUT_BUFF)) > 0) {
+		ssize_t k;
+		for(k = 0; k < n; k++) {
+			if(buff[k] != '\n') {
+				if(lineLength < sizeof(line)-1) {
+					line[lineLength++] = buff[k];
+				}
+				continue;
+			}
+			line[lineLength] = '\0';
+			if(strncmp(line, "RESULT ", 7) == 0 &&
+			   sscanf(line, "RESULT records=%" SCNu64 " bytes_read=%" SCNu64, &result->records, &result->bytesRead) == 2) {
+				result->haveResult = true;
+			}
+			lineLength = 0;
+		}
+	}
+	close(pipeFds[0]);
+
+	if(pid == -1 || wait4(pid, &status, 0, &usage) == -1) {
+		printf("Failed to run %s: %s.\n", tool, strerror(errno));
+		nftw(workDir, removeEntry, 16, FTW_DEPTH|FTW_PHYS);
+		return -1;
+	}
+	result->wall = nowSeconds() - start;
+	result->user = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec/1e6;
+	result->sys = usage.ru_stime.tv_sec + usage.ru_stime.tv_usec/1e6;
+	result->peakRSS = usage.ru_maxrss;
+	result->exitStatus = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+	nftw(workDir, removeEntry, 16, FTW_DEPTH|FTW_PHYS);
+	return 0;
+}
+
+void printRunJSON(FILE *report, bool first, char *image, const char *workload, int threads,
+				  int queueDepth, int cacheMB, RunResult *r) {
+	fprintf(report, "%s\n    {\"image\": \"%s\", \"workload\": \"%s\", \"threads\": %d, \"queue_depth\": %d, "
+			"\"cache_mb\": %d, \"exit_status\": %d, \"wall_s\": %.6f, \"user_s\": %.6f, \"sys_s\": %.6f, "
+			"\"cpu_util\": %.3f, \"peak_rss_kb\": %ld, \"bytes_read\": %" PRIu64 ", \"records\": %" PRIu64 ", "
+			"\"mb_per_s\": %.3f, \"records_per_s\": %.1f}",
+			first ? "" : ",", image, workload, threads, queueDepth, cacheMB, r->exitStatus,
+			r->wall, r->user, r->sys, (r->user + r->sys)/r->wall, r->peakRSS, r->bytesRead, r->records,
+			r->bytesRead/1048576.0/r->wall, r->records/r->wall);
+}
+
+int main(int argc, char* argv[]) {
+	char *tool = "./RawNTFSExtraction";
+	char *reportPath = NULL, *syntheticPath = NULL;
+	char *images[MAX_IMAGES];
+	const char *workloads[MAX_SWEEP];
+	int nImages = 0, nWorkloads = 4, repeats = 1, opt;
+	uint32_t nFiles = 2000, clustersPerFile = 64, fragmentsPerFile = 4;
+	bool drop = false;
+	Sweep threads = { { 1, 2, 4, 8 }, 4 };
+	Sweep depths = { { 1, 4, 16 }, 3 };
+	Sweep caches = { { 0, 64 }, 2 };
+	char resolved[PATH_MAX];
+	int i;
+
+	memcpy(workloads, defaultWorkloads, sizeof(defaultWorkloads));
+	while((opt = getopt(argc, argv, "x:g:n:s:f:w:t:q:c:r:Do:h")) != -1) {
+		switch(opt) {
+			case 'x' : tool = optarg; break;
+			case 'g' : syntheticPath = optarg; break;
+			case 'n' : nFiles = strtoul(optarg, NULL, 0); break;
+			case 's' : clustersPerFile = strtoul(optarg, NULL, 0); break;
+			case 'f' : fragmentsPerFile = strtoul(optarg, NULL, 0); break;
+			case 'r' : repeats = atoi(optarg); break;
+			case 'D' : drop = true; break;
+			case 'o' : reportPath = optarg; break;
+			case 'w' : {
+				char *workload = strtok(optarg, ",");
+				for(nWorkloads = 0; workload && nWorkloads < MAX_SWEEP; workload = strtok(NULL, ",")) {
+					workloads[nWorkloads++] = workload;
+				}
+				break;
+			}
+			case 't' : if(parseSweep(optarg, &threads) != 0) return EXIT_FAILURE; break;
+			case 'q' : if(parseSweep(optarg, &depths) != 0) return EXIT_FAILURE; break;
+			case 'c' : if(parseSweep(optarg, &caches) != 0) return EXIT_FAILURE; break;
+			default :
+				printf("Usage: %s [-x tool] [-g synthetic image [-n files] [-s clusters per file] [-f fragments]]\n"
+					   "          [-w workloads] [-t threads] [-q queue depths] [-c cache MBs] [-r repeats] [-D]\n"
+					   "          [-o report.json] [image ...]\n"
+					   "Runs each workload (scan,list,hash,extract) over each image for every combination of\n"
+					   "the comma separated thread counts, queue depths and cache sizes. -D drops the page\n"
+					   "cache before each run (needs root). The fastest of the repeats is reported.\n", argv[0]);
+				return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if(syntheticPath) {
+		fprintf(stderr, "Writing synthetic image %s with %u files...\n", syntheticPath, nFiles);
+		if(writeSyntheticImage(syntheticPath, nFiles, clustersPerFile, fragmentsPerFile, 0x5EED) != 0) {
+			return EXIT_FAILURE;
+		}
+		images[nImages++] = syntheticPath;
+	}
+	for(; optind < argc && nImages < MAX_IMAGES; optind++) {
+		images[nImages++] = argv[optind];
+	}
+	if(nImages == 0) {
+		printf("Nothing to run, give an image or -g to generate one.\n");
+		return EXIT_FAILURE;
+	}
+	/*Runs happen in their own directories, so paths must be absolute */
+	if(realpath(tool, resolved) == NULL) {
+		printf("Cannot find tool %s: %s.\n", tool, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	tool = strdup(resolved);
+	for(i = 0; i < nImages; i++) {
+		if(realpath(images[i], resolved) == NULL) {
+			printf("Cannot find image %s: %s.\n", images[i], strerror(errno));
+			return EXIT_FAILURE;
+		}
+		images[i] = strdup(resolved);
+	}
+
+	FILE *report = stdout;
+	if(reportPath && (report = fopen(reportPath, "w")) == NULL) {
+		printf("Failed to create report %s: %s.\n", reportPath, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	fprintf(report, "{\n  \"tool\": \"%s\",\n  \"cpus\": %ld,\n  \"timestamp\": %ld,\n  \"runs\": [",
+			tool, sysconf(_SC_NPROCESSORS_ONLN), (long)time(NULL));
+
+	bool first = true;
+	int w, t, q, c, r, failures = 0;
+	for(i = 0; i < nImages; i++)
+	for(w = 0; w < nWorkloads; w++)
+	for(t = 0; t < threads.count; t++)
+	for(q = 0; q < depths.count; q++)
+	for(c = 0; c < caches.count; c++) {
+		RunResult best, result;
+		best.wall = -1;
+		for(r = 0; r < repeats; r++) {
+			if(drop) {
+				dropCaches();
+			}
+			if(runTool(tool, images[i], workloads[w], threads.values[t], depths.values[q],
+					   caches.values[c], &result) != 0) {
+				return EXIT_FAILURE;
+			}
+			if(best.wall < 0 || result.wall < best.wall) {
+				best = result;
+			}
+		}
+		if(best.exitStatus != 0 || !best.haveResult) {
+			failures++;
+		}
+		fprintf(stderr, "%s %s threads=%d qd=%d cache=%dMB: %.3fs %.1fMB/s exit %d\n",
+				images[i], workloads[w], threads.values[t], depths.values[q], caches.values[c],
+				best.wall, best.bytesRead/1048576.0/best.wall, best.exitStatus);
+		printRunJSON(report, first, images[i], workloads[w], threads.values[t], depths.values[q],
+					 caches.values[c], &best);
+		first = false;
+	}
+	fprintf(report, "\n  ]\n}\n");
+	if(report != stdout) {
+		fclose(report);
+	}
+	if(failures > 0) {
+		fprintf(stderr, "%d configurations failed.\n", failures);
+	}
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,199 @@
+/*
+ * Recovery.h
+ *
+ * Scoring of deleted files by how much of their content can still be recovered.
+ * A deleted FILE record keeps its names, parent reference and run list; what is lost is
+ * the allocation of its clusters, which may since have been given to other files.
+ * Each run of each deleted file is checked against $Bitmap (clusters in use, counted
+ * through its rank summary) and the cluster map of the files in use (which of those
+ * clusters a live file has taken over), with the deleted files shared out among threads.
+ * A file is fully recoverable when none of the clusters holding its content are in use,
+ * partially when some are, and not recoverable when all are, or its runs are gone.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "FileLUT.h"
+#include "Bitmap.h"
+#include "ClusterMap.h"
+#include "Sink.h"
+#include "Memory.h"
+
+#ifndef RECOVERY_H_
+#define RECOVERY_H_
+
+typedef enum _Recoverability {
+	RECOVERABLE_FULLY,
+	RECOVERABLE_PARTIALLY,
+	NOT_RECOVERABLE,
+	RECOVERABILITY_SCORES
+} Recoverability;
+
+static const char *recoverabilityNames[RECOVERABILITY_SCORES] = {
+	"full", "partial", "none"
+};
+
+typedef struct _DeletedFile {
+	File *file;
+	Recoverability score;
+	uint64_t clusters;			/*Holding content, up to the real size */
+	uint64_t usedClusters;		/*Of those, in use per $Bitmap */
+	uint64_t ownedClusters;		/*Of those, owned by a file in use */
+	uint32_t owner;				/*Record of the first file in use found on them */
+} DeletedFile;
+
+/**
+ * Returns true if file is a deleted record, other than a directory.
+ */
+bool isDeletedFile(File *file) {
+	return !(file->recordFlags & IN_USE) && !(file->recordFlags & DIRECTORY);
+}
+
+/**
+ * Returns true if file is a deleted file with content left to stream.
+ */
+bool hasDeletedContent(File *file) {
+	return isDeletedFile(file) && (file->runs != NULL || file->residentData != NULL);
+}
+
+/**
+ * Checks the clusters of deleted->file against bitmap and map, and scores it.
+ */
+void scoreDeletedFile(DeletedFile *deleted, ClusterBitmap *bitmap, ClusterMap *map, uint32_t bytesPerCluster) {
+	File *file = deleted->file;
+	uint64_t needed = (file->realSize + bytesPerCluster-1) / bytesPerCluster;
+	uint64_t lcn = 0, length, vcn = 0, k, nOwners;
+
+	deleted->clusters = deleted->usedClusters = deleted->ownedClusters = 0;
+	deleted->owner = 0;
+	if(file->runs == NULL) {
+		/*Resident content survives in the record, unless the run list was lost */
+		deleted->score = file->residentData || file->realSize == 0 ? RECOVERABLE_FULLY : NOT_RECOVERABLE;
+		return;
+	}
+	FOR_EACH_OWNED_RUN(file->runs, lcn, length, vcn) {
+		if(vcn >= needed) {
+			break;
+		}
+		if(length > needed - vcn) {
+			length = needed - vcn;	/*Clusters past the real size hold no content */
+		}
+		deleted->clusters += length;
+		deleted->usedClusters += clustersInUse(bitmap, lcn, length);
+		OwnerRun *owners = findClusterOwners(map, lcn, length, &nOwners);
+		for(k = 0; k < nOwners; k++) {
+			uint64_t start = owners[k].lcn > lcn ? owners[k].lcn : lcn;
+			uint64_t end = owners[k].lcn + owners[k].length < lcn + length ?
+						   owners[k].lcn + owners[k].length : lcn + length;
+			if(end > start) {
+				if(deleted->ownedClusters == 0) {
+					deleted->owner = owners[k].recordNumber;
+				}
+				deleted->ownedClusters += end - start;
+			}
+		}
+	}
+	if(deleted->clusters < needed) {
+		deleted->score = deleted->clusters > deleted->usedClusters ? RECOVERABLE_PARTIALLY : NOT_RECOVERABLE;
+	} else if(deleted->usedClusters == 0) {
+		deleted->score = RECOVERABLE_FULLY;
+	} else if(deleted->usedClusters < deleted->clusters) {
+		deleted->score = RECOVERABLE_PARTIALLY;
+	} else {
+		deleted->score = NOT_RECOVERABLE;
+	}
+}
+
+/* A slice of the deleted files, scored by one thread */
+typedef struct _RecoverySlice {
+	DeletedFile *deleted;
+	uint64_t first, last;
+	ClusterBitmap *bitmap;
+	ClusterMap *map;
+	uint32_t bytesPerCluster;
+} RecoverySlice;
+
+void *scoreDeletedRange(void *arg) {
+	RecoverySlice *slice = arg;
+	uint64_t i;
+	for(i = slice->first; i < slice->last; i++) {
+		scoreDeletedFile(&slice->deleted[i], slice->bitmap, slice->map, slice->bytesPerCluster);
+	}
+	return NULL;
+}
+
+/**
+ * Scores every deleted file among files with nThreads threads. Returns them in catalog
+ * order, setting *nDeleted to their number.
+ *
+ * WARNING: Memory is allocated for the array, need to memFree(..) the returned pointer.
+ */
+DeletedFile *scoreDeletedFiles(File *files, ClusterBitmap *bitmap, ClusterMap *map, uint32_t bytesPerCluster,
+							   int nThreads, uint64_t *nDeleted) {
+	File *p_current_item;
+	uint64_t n = 0;
+	int t;
+	for(p_current_item = files; p_current_item; p_current_item = p_current_item->p_next) {
+		n += isDeletedFile(p_current_item);
+	}
+	DeletedFile *deleted = memCalloc( MEM_CATALOG, n ? n : 1, sizeof(DeletedFile) );
+	n = 0;
+	for(p_current_item = files; p_current_item; p_current_item = p_current_item->p_next) {
+		if(isDeletedFile(p_current_item)) {
+			deleted[n++].file = p_current_item;
+		}
+	}
+
+	RecoverySlice *slices = malloc( nThreads*sizeof(RecoverySlice) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	for(t = 0; t < nThreads; t++) {
+		slices[t].deleted = deleted;
+		slices[t].first = n*t/nThreads;
+		slices[t].last = n*(t+1)/nThreads;
+		slices[t].bitmap = bitmap;
+		slices[t].map = map;
+		slices[t].bytesPerCluster = bytesPerCluster;
+		pthread_create(&threads[t], NULL, scoreDeletedRange, &slices[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+	free(slices);
+	*nDeleted = n;
+	return deleted;
+}
+
+/**
+ * Prints the score, share of clusters free, size and path of each deleted file,
+ * then the number of each score.
+ */
+void printDeletedFiles(DeletedFile *deleted, uint64_t nDeleted, File **byRecord, uint32_t nRecords) {
+	uint64_t totals[RECOVERABILITY_SCORES] = { 0 }, i;
+	char path[MAX_PATH_LENGTH];
+	int s;
+	printf("%-8s %-8s %6s %14s  %s\n", "record", "score", "free", "bytes", "path");
+	for(i = 0; i < nDeleted; i++) {
+		File *file = deleted[i].file;
+		uint64_t freeClusters = deleted[i].clusters - deleted[i].usedClusters;
+		filePath(byRecord, nRecords, file, path, sizeof(path));
+		printf("%-8u %-8s %5.1f%% %14" PRIu64 "  %s", file->recordNumber, recoverabilityNames[deleted[i].score],
+			   deleted[i].clusters ? 100.0*freeClusters/deleted[i].clusters : 100.0, file->realSize, path);
+		if(deleted[i].ownedClusters) {
+			printf(" (%" PRIu64 " clusters taken by record %u)", deleted[i].ownedClusters, deleted[i].owner);
+		}
+		printf("\n");
+		totals[deleted[i].score]++;
+	}
+	printf("%" PRIu64 " deleted files:", nDeleted);
+	for(s = 0; s < RECOVERABILITY_SCORES; s++) {
+		printf(" %" PRIu64 " %s%s", totals[s], recoverabilityNames[s], s+1 < RECOVERABILITY_SCORES ? "," : ".\n");
+	}
+}
+
+#endif /* RECOVERY_H_ */
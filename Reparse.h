@@ -0,0 +1,338 @@
+/*
+ * Reparse.h
+ *
+ * Resolution of paths on a volume, following the symbolic links and mount points
+ * (junctions) kept with the files. The catalog is turned into a table of the children of
+ * each directory, sorted by name, so a path is walked from the root one binary search per
+ * name. Each link is resolved once: its target is kept in a cache by record number, and a
+ * link met again while its own resolution is under way is a cycle. Walking everything
+ * reachable under a directory expands each directory once, however many links lead to
+ * it, so links into the same tree cost no more than the tree itself.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "Sink.h"
+#include "Memory.h"
+
+#ifndef REPARSE_H_
+#define REPARSE_H_
+
+#define MAX_LINK_DEPTH 63				/*Links followed to reach a target, as Windows allows */
+#define LINK_UNRESOLVED UINT32_MAX		/*States of the resolution of a link, or its target */
+#define LINK_RESOLVING (UINT32_MAX-1)
+#define LINK_DANGLING (UINT32_MAX-2)	/*Its target is missing, or on another volume */
+#define LINK_CYCLE (UINT32_MAX-3)		/*It leads back to itself */
+
+/* The files of a volume by directory and name, and the targets of its links */
+typedef struct _PathResolver {
+	File **byRecord;		/*As returned by indexRecords(..) */
+	uint32_t nRecords;
+	File **children;		/*Files in use, by parent record then name */
+	uint32_t *firstChild;	/*The children of record r run from firstChild[r] to firstChild[r+1] */
+	uint32_t *links;		/*Target record of each link once resolved, or a LINK_ state */
+} PathResolver;
+
+/**
+ * Returns true if file is a symbolic link or mount point, whose target can be followed.
+ */
+bool isLink(File *file) {
+	return file->reparse && file->reparse->target &&
+		   (file->reparse->tag == IO_REPARSE_TAG_SYMLINK || file->reparse->tag == IO_REPARSE_TAG_MOUNT_POINT);
+}
+
+/**
+ * Returns the parent directory of file in use, or NULL if it has none.
+ */
+File *parentDirectory(PathResolver *resolver, File *file) {
+	uint64_t parent = file->parentReference & FILE_REFERENCE_RECORD;
+	File *directory = parent < resolver->nRecords ? resolver->byRecord[parent] : NULL;
+	if(!directory || !(directory->recordFlags & IN_USE) || !(directory->recordFlags & DIRECTORY)) {
+		return NULL;
+	}
+	return directory;
+}
+
+int compareChildren(const void *a, const void *b) {
+	File *x = *(File * const *)a, *y = *(File * const *)b;
+	return strcasecmp(x->fileName, y->fileName);
+}
+
+/**
+ * Builds resolver over files: the children of each directory sorted by name, and an
+ * empty cache of link targets.
+ *
+ * WARNING: Memory is allocated for the resolver, need to freePathResolver(..)
+ */
+void buildPathResolver(File *files, PathResolver *resolver) {
+	uint32_t r, nChildren = 0;
+	resolver->byRecord = indexRecords(files, &resolver->nRecords);
+	resolver->firstChild = memCalloc( MEM_CATALOG, resolver->nRecords + 2, sizeof(uint32_t) );
+	resolver->links = memAlloc( MEM_CATALOG, (resolver->nRecords ? resolver->nRecords : 1)*sizeof(uint32_t) );
+
+	/*Counted by parent, then placed after the children of the directories before it */
+	for(r = 0; r < resolver->nRecords; r++) {
+		File *file = resolver->byRecord[r];
+		File *parent = file && (file->recordFlags & IN_USE) && file->fileName ? parentDirectory(resolver, file) : NULL;
+		resolver->links[r] = LINK_UNRESOLVED;
+		if(parent && parent != file) {
+			resolver->firstChild[parent->recordNumber + 2]++;
+			nChildren++;
+		}
+	}
+	for(r = 0; r < resolver->nRecords; r++) {
+		resolver->firstChild[r+2] += resolver->firstChild[r+1];
+	}
+	resolver->children = memAlloc( MEM_CATALOG, (nChildren ? nChildren : 1)*sizeof(File *) );
+	for(r = 0; r < resolver->nRecords; r++) {
+		File *file = resolver->byRecord[r];
+		File *parent = file && (file->recordFlags & IN_USE) && file->fileName ? parentDirectory(resolver, file) : NULL;
+		if(parent && parent != file) {
+			resolver->children[resolver->firstChild[parent->recordNumber + 1]++] = file;
+		}
+	}
+	for(r = 0; r < resolver->nRecords; r++) {
+		qsort(resolver->children + resolver->firstChild[r], resolver->firstChild[r+1] - resolver->firstChild[r],
+			  sizeof(File *), compareChildren);
+	}
+}
+
+void freePathResolver(PathResolver *resolver) {
+	memFree(resolver->byRecord);
+	memFree(resolver->firstChild);
+	memFree(resolver->children);
+	memFree(resolver->links);
+}
+
+/**
+ * Returns the child of directory named name (compared without case), or NULL.
+ */
+File *findChild(PathResolver *resolver, File *directory, const char *name) {
+	uint32_t lo = resolver->firstChild[directory->recordNumber], hi = resolver->firstChild[directory->recordNumber + 1];
+	while(lo < hi) {
+		uint32_t mid = lo + (hi - lo)/2;
+		int cmp = strcasecmp(name, resolver->children[mid]->fileName);
+		if(cmp == 0) {
+			return resolver->children[mid];
+		}
+		if(cmp < 0) {
+			hi = mid;
+		} else {
+			lo = mid+1;
+		}
+	}
+	return NULL;
+}
+
+uint32_t resolveLink(PathResolver *resolver, File *link, int depth);
+
+/**
+ * Walks path, names separated by '/', from directory start, following the links on the
+ * way (the last one too, if followLast). ".." is the parent of the directory reached.
+ * Returns the record reached, or LINK_DANGLING or LINK_CYCLE.
+ */
+uint32_t walkPath(PathResolver *resolver, File *start, const char *path, bool followLast, int depth) {
+	char names[MAX_PATH_LENGTH], *name, *save;
+	File *current = start;
+	snprintf(names, sizeof(names), "%s", path);
+	for(name = strtok_r(names, "/", &save); name; name = strtok_r(NULL, "/", &save)) {
+		bool last = true;
+		char *rest;
+		for(rest = save; rest && *rest; rest++) {
+			if(*rest != '/') {
+				last = false;
+				break;
+			}
+		}
+		if(strcmp(name, ".") == 0) {
+			continue;
+		}
+		if(strcmp(name, "..") == 0) {
+			File *parent = current->recordNumber == ROOT_RECORD ? current : parentDirectory(resolver, current);
+			if(!parent) {
+				return LINK_DANGLING;
+			}
+			current = parent;
+			continue;
+		}
+		File *child = findChild(resolver, current, name);
+		if(!child) {
+			return LINK_DANGLING;
+		}
+		if(isLink(child) && (!last || followLast)) {
+			uint32_t target = resolveLink(resolver, child, depth+1);
+			if(target >= LINK_CYCLE) {
+				return target;
+			}
+			child = resolver->byRecord[target];
+		}
+		current = child;
+	}
+	return current->recordNumber;
+}
+
+/**
+ * Returns the record link leads to, resolving it the first time it is asked for and
+ * keeping the answer, or LINK_DANGLING or LINK_CYCLE. Absolute targets ("C:/..") are
+ * taken to be on this volume, whatever its drive letter; those naming a volume ("Volume{..}")
+ * are not followed.
+ */
+uint32_t resolveLink(PathResolver *resolver, File *link, int depth) {
+	uint32_t *state = &resolver->links[link->recordNumber];
+	char *target = link->reparse->target;
+	File *start = NULL;
+	if(*state == LINK_RESOLVING || depth > MAX_LINK_DEPTH) {
+		return LINK_CYCLE;
+	}
+	if(*state != LINK_UNRESOLVED) {
+		return *state;
+	}
+
+	*state = LINK_RESOLVING;
+	if(link->reparse->relative) {
+		start = parentDirectory(resolver, link);
+	} else if(target[0] && target[1] == ':') {
+		start = ROOT_RECORD < resolver->nRecords ? resolver->byRecord[ROOT_RECORD] : NULL;
+		target += 2;
+	}
+	*state = start ? walkPath(resolver, start, target, true, depth) : LINK_DANGLING;
+	return *state;
+}
+
+/**
+ * Returns the record path leads to from the root, following every link on the way.
+ * Backslashes and a leading drive letter are accepted, as in C:\Users\x.
+ */
+uint32_t resolvePath(PathResolver *resolver, const char *path) {
+	char normalised[MAX_PATH_LENGTH], *c;
+	File *root = ROOT_RECORD < resolver->nRecords ? resolver->byRecord[ROOT_RECORD] : NULL;
+	if(!root) {
+		return LINK_DANGLING;
+	}
+	snprintf(normalised, sizeof(normalised), "%s", path[0] && path[1] == ':' ? path+2 : path);
+	for(c = normalised; *c; c++) {
+		if(*c == '\\') {
+			*c = '/';
+		}
+	}
+	return walkPath(resolver, root, normalised, true, 0);
+}
+
+/**
+ * Writes what the resolution of a link came to into description (size bytes).
+ */
+void describeTarget(PathResolver *resolver, uint32_t target, char *description, size_t size) {
+	if(target == LINK_DANGLING) {
+		snprintf(description, size, "(dangling)");
+	} else if(target == LINK_CYCLE) {
+		snprintf(description, size, "(cycle)");
+	} else if(filePath(resolver->byRecord, resolver->nRecords, resolver->byRecord[target], description, size) == 0) {
+		snprintf(description, size, "/");	/*The root directory */
+	}
+}
+
+/**
+ * Prints every file reachable under the directory at path, following links, each once
+ * by its own path; links are printed with what they lead to. Returns 0, or -1 if path
+ * does not lead to a directory.
+ */
+int printReachable(PathResolver *resolver, const char *path) {
+	uint8_t *visited = memCalloc( MEM_CATALOG, resolver->nRecords + 1, 1 );
+	uint32_t *stack = memAlloc( MEM_CATALOG, (resolver->nRecords + 1)*sizeof(uint32_t) );
+	uint32_t top = 0, i, start = resolvePath(resolver, path);
+	uint64_t nReached = 0, nLinks = 0, nBroken = 0;
+	char filePathBuffer[MAX_PATH_LENGTH], targetPath[MAX_PATH_LENGTH];
+
+	if(start >= LINK_CYCLE || !(resolver->byRecord[start]->recordFlags & DIRECTORY)) {
+		printf("%s: not a directory.\n", path);
+		memFree(stack);
+		memFree(visited);
+		return -1;
+	}
+	visited[start] = 1;
+	stack[top++] = start;
+	while(top > 0) {
+		uint32_t directory = stack[--top];
+		for(i = resolver->firstChild[directory]; i < resolver->firstChild[directory+1]; i++) {
+			File *child = resolver->children[i];
+			filePath(resolver->byRecord, resolver->nRecords, child, filePathBuffer, sizeof(filePathBuffer));
+			if(isLink(child)) {
+				uint32_t target = resolveLink(resolver, child, 0);
+				describeTarget(resolver, target, targetPath, sizeof(targetPath));
+				printf("%s -> %s\n", filePathBuffer, targetPath);
+				nLinks++;
+				if(target >= LINK_CYCLE) {
+					nBroken++;
+					continue;
+				}
+				child = resolver->byRecord[target];
+			}
+			if(visited[child->recordNumber]) {
+				continue;
+			}
+			visited[child->recordNumber] = 1;
+			if(!isLink(resolver->children[i])) {
+				printf("%s\n", filePathBuffer);
+			}
+			nReached++;
+			if(child->recordFlags & DIRECTORY) {
+				stack[top++] = child->recordNumber;
+			}
+		}
+	}
+	printf("%" PRIu64 " files reachable under %s, through %" PRIu64 " links (%" PRIu64 " dangling or cyclic).\n",
+		   nReached, path, nLinks, nBroken);
+	memFree(stack);
+	memFree(visited);
+	return 0;
+}
+
+/**
+ * Without paths, prints every reparse point in use with what it leads to; otherwise prints
+ * everything reachable under each of the nPaths directories given.
+ * Returns 0, or -1 if a path does not lead to a directory.
+ */
+int linksReport(File *files, char **paths, int nPaths) {
+	PathResolver resolver;
+	uint32_t r, nReparse = 0, nResolved = 0;
+	int i, ret = 0;
+	char linkPath[MAX_PATH_LENGTH], targetPath[MAX_PATH_LENGTH];
+
+	buildPathResolver(files, &resolver);
+	for(i = 0; i < nPaths; i++) {
+		ret |= printReachable(&resolver, paths[i]);
+	}
+	if(nPaths > 0) {
+		freePathResolver(&resolver);
+		return ret;
+	}
+	for(r = 0; r < resolver.nRecords; r++) {
+		File *file = resolver.byRecord[r];
+		if(!file || !(file->recordFlags & IN_USE) || !file->reparse) {
+			continue;
+		}
+		nReparse++;
+		filePath(resolver.byRecord, resolver.nRecords, file, linkPath, sizeof(linkPath));
+		if(!isLink(file)) {
+			printf("%s  tag 0x%08X\n", linkPath, file->reparse->tag);
+			continue;
+		}
+		uint32_t target = resolveLink(&resolver, file, 0);
+		describeTarget(&resolver, target, targetPath, sizeof(targetPath));
+		printf("%s  %s %s -> %s\n", linkPath, file->reparse->tag == IO_REPARSE_TAG_SYMLINK ? "symlink" : "junction",
+			   file->reparse->target, targetPath);
+		nResolved += target < LINK_CYCLE;
+	}
+	printf("%u reparse points, %u links resolved on this volume.\n", nReparse, nResolved);
+	freePathResolver(&resolver);
+	return 0;
+}
+
+#endif /* REPARSE_H_ */
@@ -0,0 +1,470 @@
+/*
+ * Resolve.h
+ *
+ * Resolution of many paths at once through the directory indexes on the volume. The paths
+ * are split into names, upper-cased as NTFS collates them, sorted and gathered into a
+ * trie, so a directory shared by any number of paths is one node of it. The $I30 of each
+ * directory in the trie is then searched once for all the names wanted under it: the
+ * sorted names are merged with the entries of each node down the B-tree, so each node is
+ * read at most once whatever the number of names. The INDX blocks needed are read in
+ * rounds, each submitted at once in the order of the blocks on the device. Resolving many
+ * paths then costs about as much as walking the directories they go through.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "Volume.h"
+#include "Index.h"
+#include "Memory.h"
+
+#ifndef RESOLVE_H_
+#define RESOLVE_H_
+
+/* A name under its parent, in the trie of the paths resolved */
+typedef struct _PathTrieNode {
+	const uint16_t *name;		/*Upper-cased, in the units of the first path with it */
+	uint32_t nameLength;
+	struct _PathTrieNode **children;	/*In the order of their names */
+	uint32_t nChildren;
+	uint32_t capacity;
+	File *file;					/*What it resolves to, NULL if it does not (yet) */
+} PathTrieNode;
+
+/* A path to resolve, split into its names */
+typedef struct _BatchPath {
+	uint16_t *units;		/*Its names one after the other, upper-cased */
+	uint32_t *starts;		/*Where each name starts in units, and where the last ends */
+	uint32_t nNames;
+	PathTrieNode *node;		/*Where it ends in the trie */
+} BatchPath;
+
+typedef struct _ResolveCounters {
+	uint32_t nDirectories;	/*Directories whose index was searched */
+	uint32_t nBlocks;		/*INDX blocks read */
+	uint32_t nRounds;		/*Rounds they were read in */
+	uint32_t nBad;			/*Index nodes damaged or unreadable */
+} ResolveCounters;
+
+struct _PathResolution;
+
+/* Names still sought under a node of the index of a directory, in an INDX block */
+typedef struct _IndexSearch {
+	struct _PathResolution *resolution;
+	PathTrieNode *parent;	/*Whose file is the directory */
+	uint32_t first;			/*The children of parent sought */
+	uint32_t count;
+	int64_t vcn;
+	uint64_t location;		/*Of the block on the device */
+	char *block;
+	int error;
+} IndexSearch;
+
+typedef struct _PathResolution {
+	Volume *volume;
+	File **byRecord;
+	uint32_t nRecords;
+	const uint16_t *upcase;
+	IndexSearch *pending;	/*Blocks to read in the next round */
+	uint32_t nPending;
+	uint32_t pendingCapacity;
+	pthread_mutex_t lock;	/*Guards inFlight */
+	pthread_cond_t done;	/*Signalled when the reads of a round are all in */
+	uint32_t inFlight;
+	ResolveCounters counters;
+} PathResolution;
+
+/**
+ * Splits path, names separated by '/' or '\', after a drive letter if any, into path:
+ * "." is left out and ".." takes the name before it off. Each name is upper-cased through
+ * upcase (or as ASCII if it is NULL).
+ * Returns 0, or -1 if a name is longer than NTFS allows.
+ *
+ * WARNING: Memory is allocated for the names, need to freeBatchPath(..)
+ */
+int splitBatchPath(const char *path, const uint16_t *upcase, BatchPath *batchPath) {
+	size_t length = strlen(path), i = path[0] && path[1] == ':' ? 2 : 0;
+	uint32_t unit = 0;
+	int ret = 0;
+	batchPath->units = memAlloc( MEM_SEARCH, (length+1)*sizeof(uint16_t) );
+	batchPath->starts = memAlloc( MEM_SEARCH, (length+2)*sizeof(uint32_t) );
+	batchPath->nNames = 0;
+	batchPath->starts[0] = 0;
+	batchPath->node = NULL;
+	while(i < length) {
+		size_t end = i;
+		while(end < length && path[end] != '/' && path[end] != '\\') {
+			end++;
+		}
+		if(end - i == 2 && path[i] == '.' && path[i+1] == '.') {
+			if(batchPath->nNames > 0) {
+				unit = batchPath->starts[--batchPath->nNames];
+			}
+		} else if(end > i && !(end - i == 1 && path[i] == '.')) {
+			if(end - i > 255) {
+				ret = -1;
+			}
+			for(; i < end; i++) {
+				batchPath->units[unit++] = upcaseUnit(upcase, (uint8_t)path[i]);
+			}
+			batchPath->starts[++batchPath->nNames] = unit;
+		}
+		i = end + 1;
+	}
+	return ret;
+}
+
+void freeBatchPath(BatchPath *batchPath) {
+	memFree(batchPath->units);
+	memFree(batchPath->starts);
+}
+
+/* Compares the names k of a and b, already upper-cased */
+int compareBatchNames(const BatchPath *a, uint32_t ka, const BatchPath *b, uint32_t kb) {
+	return collateNames(NULL, a->units + a->starts[ka], a->starts[ka+1] - a->starts[ka],
+						b->units + b->starts[kb], b->starts[kb+1] - b->starts[kb]);
+}
+
+/* Orders paths name by name, a path before those it leads to */
+int compareBatchPaths(const void *a, const void *b) {
+	const BatchPath *x = *(const BatchPath **)a, *y = *(const BatchPath **)b;
+	uint32_t k;
+	for(k = 0; k < x->nNames && k < y->nNames; k++) {
+		int cmp = compareBatchNames(x, k, y, k);
+		if(cmp != 0) {
+			return cmp;
+		}
+	}
+	return x->nNames < y->nNames ? -1 : x->nNames > y->nNames;
+}
+
+PathTrieNode *addTrieChild(PathTrieNode *parent, const uint16_t *name, uint32_t nameLength) {
+	PathTrieNode *child = memCalloc( MEM_SEARCH, 1, sizeof(PathTrieNode) );
+	child->name = name;
+	child->nameLength = nameLength;
+	if(parent->nChildren == parent->capacity) {
+		parent->capacity = parent->capacity ? 2*parent->capacity : 4;
+		parent->children = memRealloc( MEM_SEARCH, parent->children, parent->capacity*sizeof(PathTrieNode *) );
+	}
+	parent->children[parent->nChildren++] = child;
+	return child;
+}
+
+/**
+ * Gathers the nPaths paths into the trie under root, in the order of their names so the
+ * children of each node are sorted, and sets the node each path ends at.
+ */
+void buildPathTrie(PathTrieNode *root, BatchPath *paths, uint32_t nPaths) {
+	BatchPath **sorted = memAlloc( MEM_SEARCH, (nPaths ? nPaths : 1)*sizeof(BatchPath *) );
+	uint32_t i, k, maxNames = 0;
+	for(i = 0; i < nPaths; i++) {
+		sorted[i] = &paths[i];
+		if(paths[i].nNames > maxNames) {
+			maxNames = paths[i].nNames;
+		}
+	}
+	qsort(sorted, nPaths, sizeof(BatchPath *), compareBatchPaths);
+
+	/*The nodes of the path before, by depth, to share the names both start with */
+	PathTrieNode **stack = memAlloc( MEM_SEARCH, (maxNames+1)*sizeof(PathTrieNode *) );
+	stack[0] = root;
+	for(i = 0; i < nPaths; i++) {
+		BatchPath *path = sorted[i], *previous = i ? sorted[i-1] : NULL;
+		uint32_t shared = 0;
+		while(previous && shared < path->nNames && shared < previous->nNames &&
+			  compareBatchNames(path, shared, previous, shared) == 0) {
+			shared++;
+		}
+		for(k = shared; k < path->nNames; k++) {
+			stack[k+1] = addTrieChild(stack[k], path->units + path->starts[k], path->starts[k+1] - path->starts[k]);
+		}
+		path->node = stack[path->nNames];
+	}
+	memFree(stack);
+	memFree(sorted);
+}
+
+void freePathTrie(PathTrieNode *node) {
+	uint32_t c;
+	for(c = 0; c < node->nChildren; c++) {
+		freePathTrie(node->children[c]);
+		memFree(node->children[c]);
+	}
+	memFree(node->children);
+}
+
+/**
+ * Queues the read of the node at vcn of the index of the directory of parent, to search
+ * it for count of its children from first. Nothing is queued without a node (vcn -1):
+ * the names are not in the directory.
+ */
+void queueIndexSearch(PathResolution *resolution, PathTrieNode *parent, uint32_t first, uint32_t count, int64_t vcn) {
+	if(vcn < 0 || count == 0) {
+		return;
+	}
+	if(resolution->nPending == resolution->pendingCapacity) {
+		resolution->pendingCapacity = resolution->pendingCapacity ? 2*resolution->pendingCapacity : 64;
+		resolution->pending = memRealloc( MEM_SEARCH, resolution->pending,
+										  resolution->pendingCapacity*sizeof(IndexSearch) );
+	}
+	IndexSearch *search = &resolution->pending[resolution->nPending++];
+	memset(search, 0, sizeof(IndexSearch));
+	search->resolution = resolution;
+	search->parent = parent;
+	search->first = first;
+	search->count = count;
+	search->vcn = vcn;
+}
+
+void expandTrieNode(PathResolution *resolution, PathTrieNode *node);
+
+/**
+ * Merges count of the children of parent from first, in order, with the entries of the
+ * index node at node (of at most length bytes from its header). Those found are resolved
+ * and expanded in turn; those falling between entries are queued for the sub-node there.
+ */
+void searchTrieNode(PathResolution *resolution, PathTrieNode *parent, uint32_t first, uint32_t count, char *node,
+					uint32_t length) {
+	INDEX_NODE_HEADER *header = (INDEX_NODE_HEADER *)node;
+	uint32_t i = first, end = first + count;
+	if(length < sizeof(INDEX_NODE_HEADER)) {
+		resolution->counters.nBad++;
+		return;
+	}
+	uint32_t nodeEnd = header->indexLength < length ? header->indexLength : length;
+	uint32_t offs = header->entriesOffset;
+	while(offs + sizeof(INDEX_ENTRY_HEADER) <= nodeEnd && i < end) {
+		INDEX_ENTRY_HEADER *entry = (INDEX_ENTRY_HEADER *)(node + offs);
+		if(entry->entryLength < sizeof(INDEX_ENTRY_HEADER) || offs + entry->entryLength > nodeEnd) {
+			break;
+		}
+		if(entry->flags & INDEX_ENTRY_LAST) {
+			queueIndexSearch(resolution, parent, i, end - i, entrySubnode(entry));	/*Past every name of the node */
+			return;
+		}
+		FILE_NAME_ATTR *key = sizeof(INDEX_ENTRY_HEADER) + entry->keyLength <= entry->entryLength ? indexedFileName(entry) : NULL;
+		if(!key || offsetof(FILE_NAME_ATTR, arrUnicodeFileName) + 2*key->bFileNameLength > entry->keyLength) {
+			break;
+		}
+		uint32_t before = i;
+		while(i < end && collateNames(resolution->upcase, parent->children[i]->name, parent->children[i]->nameLength,
+									  key->arrUnicodeFileName, key->bFileNameLength) < 0) {
+			i++;
+		}
+		queueIndexSearch(resolution, parent, before, i - before, entrySubnode(entry));
+		while(i < end && collateNames(resolution->upcase, parent->children[i]->name, parent->children[i]->nameLength,
+									  key->arrUnicodeFileName, key->bFileNameLength) == 0) {
+			PathTrieNode *child = parent->children[i++];
+			child->file = referencedFile(resolution->byRecord, resolution->nRecords, entry->fileReference);
+			if(child->file && child->nChildren) {
+				expandTrieNode(resolution, child);
+			}
+		}
+		offs += entry->entryLength;
+	}
+	if(i < end) {
+		resolution->counters.nBad++;	/*Malformed, or no last entry */
+	}
+}
+
+/**
+ * Searches the index of the directory node resolved to for the children of node, from
+ * the root node kept with it.
+ */
+void expandTrieNode(PathResolution *resolution, PathTrieNode *node) {
+	File *directory = node->file;
+	DirectoryIndex *index = directory->index;
+	if(!(directory->recordFlags & DIRECTORY) || !index || !index->root || index->rootLength < sizeof(INDEX_ROOT_HEADER)) {
+		return;		/*Nothing can be under it */
+	}
+	resolution->counters.nDirectories++;
+	INDEX_ROOT_HEADER *root = (INDEX_ROOT_HEADER *)index->root;
+	searchTrieNode(resolution, node, 0, node->nChildren, (char *)&root->node,
+				   index->rootLength - offsetof(INDEX_ROOT_HEADER, node));
+}
+
+int compareIndexSearches(const void *a, const void *b) {
+	const IndexSearch *x = a, *y = b;
+	return x->location < y->location ? -1 : x->location > y->location;
+}
+
+void indexSearchRead(void *arg, int error) {
+	IndexSearch *search = arg;
+	PathResolution *resolution = search->resolution;
+	pthread_mutex_lock(&resolution->lock);
+	search->error = error;
+	if(--resolution->inFlight == 0) {
+		pthread_cond_signal(&resolution->done);
+	}
+	pthread_mutex_unlock(&resolution->lock);
+}
+
+/**
+ * Reads the blocks queued, all submitted at once in the order they are on the device,
+ * then searches them, which may queue the blocks of the next round.
+ */
+void readSearchRound(PathResolution *resolution) {
+	IndexSearch *round = resolution->pending;
+	uint32_t n = resolution->nPending, k;
+	resolution->pending = NULL;
+	resolution->nPending = resolution->pendingCapacity = 0;
+	resolution->counters.nRounds++;
+	for(k = 0; k < n; k++) {
+		round[k].location = indexBlockLocation(resolution->volume, round[k].parent->file->index, round[k].vcn);
+	}
+	qsort(round, n, sizeof(IndexSearch), compareIndexSearches);
+
+	resolution->inFlight = n;
+	for(k = 0; k < n; k++) {
+		DirectoryIndex *index = round[k].parent->file->index;
+		round[k].block = memAlloc( MEM_METADATA, indexBlockSize(index) ? indexBlockSize(index) : 1 );
+		if(readIndexBlockAsync(resolution->volume, index, round[k].vcn, round[k].block, indexSearchRead, &round[k]) != 0) {
+			indexSearchRead(&round[k], errno);
+		}
+	}
+	pthread_mutex_lock(&resolution->lock);
+	while(resolution->inFlight > 0) {
+		pthread_cond_wait(&resolution->done, &resolution->lock);
+	}
+	pthread_mutex_unlock(&resolution->lock);
+
+	for(k = 0; k < n; k++) {
+		uint32_t blockSize = indexBlockSize(round[k].parent->file->index);
+		if(round[k].error) {
+			resolution->counters.nBad++;
+		} else {
+			resolution->counters.nBlocks++;
+			searchTrieNode(resolution, round[k].parent, round[k].first, round[k].count,
+						   round[k].block + INDX_NODE_OFFSET, blockSize - INDX_NODE_OFFSET);
+		}
+		memFree(round[k].block);
+	}
+	memFree(round);
+}
+
+/**
+ * Resolves the nPaths paths from the root of volume through its directory indexes, and
+ * sets files[i] to the file in use path i leads to, or NULL. Names are compared as NTFS
+ * does, without case, through upcase (as ASCII if it is NULL); links are not followed.
+ * byRecord is as returned by indexRecords(..). Adds what it took to *counters.
+ * Returns the number of paths resolved.
+ */
+uint32_t resolvePaths(Volume *volume, File **byRecord, uint32_t nRecords, const uint16_t *upcase,
+					  const char *const *paths, uint32_t nPaths, File **files, ResolveCounters *counters) {
+	PathResolution resolution;
+	PathTrieNode root;
+	uint32_t i, nResolved = 0;
+	BatchPath *batchPaths = memAlloc( MEM_SEARCH, (nPaths ? nPaths : 1)*sizeof(BatchPath) );
+	bool *tooLong = memCalloc( MEM_SEARCH, nPaths ? nPaths : 1, sizeof(bool) );
+	for(i = 0; i < nPaths; i++) {
+		tooLong[i] = splitBatchPath(paths[i], upcase, &batchPaths[i]) != 0;
+	}
+	memset(&root, 0, sizeof(root));
+	buildPathTrie(&root, batchPaths, nPaths);
+
+	memset(&resolution, 0, sizeof(resolution));
+	resolution.volume = volume;
+	resolution.byRecord = byRecord;
+	resolution.nRecords = nRecords;
+	resolution.upcase = upcase;
+	pthread_mutex_init(&resolution.lock, NULL);
+	pthread_cond_init(&resolution.done, NULL);
+	root.file = referencedFile(byRecord, nRecords, ROOT_RECORD);
+	if(root.file) {
+		expandTrieNode(&resolution, &root);
+	}
+	while(resolution.nPending > 0) {
+		readSearchRound(&resolution);
+	}
+	pthread_mutex_destroy(&resolution.lock);
+	pthread_cond_destroy(&resolution.done);
+
+	for(i = 0; i < nPaths; i++) {
+		files[i] = tooLong[i] ? NULL : batchPaths[i].node->file;
+		if(files[i]) {
+			nResolved++;
+		}
+	}
+	counters->nDirectories += resolution.counters.nDirectories;
+	counters->nBlocks += resolution.counters.nBlocks;
+	counters->nRounds += resolution.counters.nRounds;
+	counters->nBad += resolution.counters.nBad;
+	freePathTrie(&root);
+	for(i = 0; i < nPaths; i++) {
+		freeBatchPath(&batchPaths[i]);
+	}
+	memFree(batchPaths);
+	memFree(tooLong);
+	return nResolved;
+}
+
+/**
+ * Resolves the paths listed in the file args[0], one per line (or on stdin without it, or
+ * with "-"), and prints the record each leads to, or "-", with the path in the order
+ * given, then what it took.
+ * Returns 0, or -1 if the list cannot be read.
+ */
+int resolveReport(Volume *volume, File *files, char **args, int nArgs) {
+	FILE *in = stdin;
+	char *line = NULL, **paths = NULL;
+	size_t lineCapacity = 0;
+	ssize_t length;
+	uint32_t nPaths = 0, capacity = 0, nRecords, i;
+	ResolveCounters counters = { 0 };
+
+	if(nArgs > 0 && strcmp(args[0], "-") != 0 && (in = fopen(args[0], "r")) == NULL) {
+		int errsv = errno;
+		printf("Failed to open path list %s: %s.\n", args[0], strerror(errsv));
+		return -1;
+	}
+	while((length = getline(&line, &lineCapacity, in)) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+		if(line[0] == '\0') {
+			continue;
+		}
+		if(nPaths == capacity) {
+			capacity = capacity ? 2*capacity : 1024;
+			paths = memRealloc( MEM_SEARCH, paths, capacity*sizeof(char *) );
+		}
+		paths[nPaths] = memAlloc( MEM_SEARCH, strlen(line) + 1 );
+		strcpy(paths[nPaths++], line);
+	}
+	free(line);
+	if(in != stdin) {
+		fclose(in);
+	}
+
+	File **byRecord = indexRecords(files, &nRecords);
+	uint16_t *upcase = readUpcase(volume, byRecord, nRecords);
+	File **resolved = memAlloc( MEM_SEARCH, (nPaths ? nPaths : 1)*sizeof(File *) );
+	uint32_t nResolved = resolvePaths(volume, byRecord, nRecords, upcase, (const char *const *)paths, nPaths,
+									  resolved, &counters);
+	for(i = 0; i < nPaths; i++) {
+		if(resolved[i]) {
+			printf("%u  %s\n", resolved[i]->recordNumber, paths[i]);
+		} else {
+			printf("-  %s\n", paths[i]);
+		}
+		memFree(paths[i]);
+	}
+	printf("%u of %u paths resolved: %u directories searched, %u index blocks read in %u rounds", nResolved, nPaths,
+		   counters.nDirectories, counters.nBlocks, counters.nRounds);
+	if(counters.nBad) {
+		printf(", %u index nodes damaged or unreadable", counters.nBad);
+	}
+	printf("%s.\n", upcase ? "" : " (names compared as ASCII, the volume has no $UpCase)");
+	memFree(resolved);
+	memFree(paths);
+	memFree(upcase);
+	memFree(byRecord);
+	return 0;
+}
+
+#endif /* RESOLVE_H_ */
@@ -1,5 +1,11 @@
 #include <inttypes.h>
+#include "NTFSStruct.h"
 #include "Debug.h"
+#include "Stats.h"
+#include "Memory.h"
+
+#ifndef RUNLIST_H_
+#define RUNLIST_H_
 
 /*
  * Non-resident attributes are stored in intervals of clusters called runs.
@@ -19,13 +25,14 @@ DataRun* addRun(DataRun *p_head, uint64_t *length, int64_t *offset);
 void printRuns(char * buff, DataRun *p_head);
 DataRun* reverseList(DataRun *p_head);
 int freeList(DataRun *p_head);
+DataRun* decodeRunList(char *runList, uint32_t maxLength, uint32_t *countRuns);
 
 /*
  * Adds a new data_run to the start of the list and returns it.
  */
 DataRun* addRun(DataRun *p_head, uint64_t *length, int64_t *offset) {
 
-	DataRun *p_new_run = malloc( sizeof(DataRun) );
+	DataRun *p_new_run = memAlloc( MEM_RUNLISTS, sizeof(DataRun) );
 	p_new_run->p_next = p_head;	// This item is now the head.
 	p_new_run->length = length;	// Set data pointers
 	p_new_run->offset = offset;
@@ -56,25 +63,25 @@ void printRuns(char * buff, DataRun *p_head) {
  */
 int freeList(DataRun *p_head)	{
 
-	if(DEBUG && VERBOSE) printf("\tFreeing RunList: ");
+	VERBOSE_PRINT("\tFreeing RunList: ");
 	DataRun *p_current_item = p_head;
 	int items_freed = 0;
 	while (p_current_item) {
 		DataRun *p_next = p_current_item->p_next; // Backup pointer to next list element.
 
 	    if (p_current_item->offset) {	// Free offset member.
-	    	free(p_current_item->offset);
+	    	memFree(p_current_item->offset);
 	    }
 
 	    if (p_current_item->length) {	// Free length member.
-	    	free(p_current_item->length);
+	    	memFree(p_current_item->length);
 	    }
 
-	    free(p_current_item);		//	Free data run structure
+	    memFree(p_current_item);		//	Free data run structure
 	    p_current_item = p_next;	// Move to the next item
 	    items_freed++;
 	}
-	if(DEBUG && VERBOSE) printf("Freed %d data runs in total\n", items_freed);
+	VERBOSE_PRINT("Freed %d data runs in total\n", items_freed);
 	//free(p_head); 					// Free the head data run structure.
 	return items_freed;
 }
@@ -92,3 +99,62 @@ DataRun* reverseList(DataRun *p_head) {
   }
   return p_new_head;
 }
+
+/*
+ * Decodes the mapping pairs at runList into a RunList, in the order found on disk.
+ * Each run starts with a header byte whose low nibble holds the size of the length field
+ * and high nibble the size of the offset field, the list ends with a zero header byte.
+ * maxLength bounds the bytes that may be read, i.e. the remainder of the attribute.
+ *
+ * The offset is relative to the previous run and signed, so it is sign extended here.
+ * Sparse runs carry no offset field, their offset member is left NULL.
+ * Sets *countRuns to the number of runs decoded. Returns NULL if there are none.
+ */
+DataRun* decodeRunList(char *runList, uint32_t maxLength, uint32_t *countRuns) {
+
+	STAT_SCOPE(TIMER_DECODE);
+	DataRun *p_head = NULL;
+	uint32_t pos = 0;
+	*countRuns = 0;
+	while (pos < maxLength && runList[pos] != 0) {
+		OFFS_LEN_BITFIELD header;
+		header.val = runList[pos++];
+		uint8_t lengthSize = header.bitfield.lengthSize;
+		uint8_t offsetSize = header.bitfield.offsetSize;
+
+		/*The length and offset fields are always 8 or less bytes */
+		if (lengthSize == 0 || lengthSize > 8 || offsetSize > 8 || pos+lengthSize+offsetSize > maxLength) {
+			DEBUG_PRINT("\tMalformed data run at byte %u of run list\n", pos-1);
+			STAT_INC(STAT_RUNLISTS_MALFORMED);
+			break;
+		}
+
+		uint64_t *length = memAlloc( MEM_RUNLISTS, sizeof(uint64_t) );
+		*length = 0; /*Initialise to zero since values may be less than 8 bytes long */
+		memcpy(length, runList+pos, lengthSize);
+		pos += lengthSize;
+
+		int64_t *offset = NULL;
+		if (offsetSize > 0) {
+			offset = memAlloc( MEM_RUNLISTS, sizeof(int64_t) );
+			*offset = 0;
+			memcpy(offset, runList+pos, offsetSize);
+			if (offsetSize < 8 && (runList[pos+offsetSize-1] & 0x80)) { /*Negative, sign extend */
+				*offset |= (int64_t)(~0ULL << (8*offsetSize));
+			}
+			pos += offsetSize;
+		}
+
+		p_head = addRun(p_head, length, offset);
+		(*countRuns)++;
+		if(DEBUG && VERBOSE) {
+			printf("\tLength of datarun: %" PRIu64 " clusters\t", *length);
+			printf("\tVCN offset to datarun: %" PRId64 " clusters\n", offset ? *offset : 0);
+		}
+	}
+	STAT_ADD(STAT_RUNS_DECODED, *countRuns);
+	STAT_HIST(HIST_RUNS_PER_LIST, *countRuns);
+	return reverseList(p_head);
+}
+
+#endif /* RUNLIST_H_ */
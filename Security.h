@@ -0,0 +1,458 @@
+/*
+ * Security.h
+ *
+ * The security descriptors of $Secure, loaded once into a table keyed by security ID.
+ * Each file names its descriptor by the security ID in its $STANDARD_INFORMATION; $Secure
+ * keeps every descriptor once in its $SDS stream, and its $SII index maps each security ID
+ * to the entry of $SDS holding it. $SII is walked (which also skips the mirror copies
+ * $SDS keeps of itself), each descriptor is reduced to its owner, group and a summary of
+ * its DACL, and descriptors reduced alike, as are SIDs, are kept once. Finding the owner of
+ * a file is then two array lookups, and the files of an owner a scan of one column.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+#include "FileLUT.h"
+#include "MFTRecord.h"
+#include "Volume.h"
+#include "Sink.h"
+#include "Index.h"
+#include "Memory.h"
+
+#ifndef SECURITY_H_
+#define SECURITY_H_
+
+#define SECURE_RECORD 9				/*MFT record number of $Secure */
+#define MAX_SECURITY_ID (1 << 24)	/*Higher security IDs are taken to be damage */
+#define SID_STRING_LENGTH 192		/*S-1-<authority> and up to 15 sub-authorities */
+#define NO_DESCRIPTOR UINT32_MAX	/*Security ID without a descriptor */
+#define NO_SID UINT32_MAX			/*Descriptor without an owner or group */
+
+/* What is kept of a security descriptor */
+typedef struct _SecurityDescriptor {
+	uint32_t owner;			/*Of the SIDs of the table, or NO_SID */
+	uint32_t group;
+	bool dacl;				/*Without a DACL everyone has access */
+	uint16_t allowAces;		/*ACEs of the DACL, by type */
+	uint16_t denyAces;
+	uint16_t otherAces;
+} SecurityDescriptor;
+
+/* The descriptors of a volume, by security ID */
+typedef struct _SecurityTable {
+	uint32_t *byId;						/*Descriptor of each security ID, or NO_DESCRIPTOR */
+	uint32_t nIds;
+	SecurityDescriptor *descriptors;	/*Each distinct one once */
+	uint32_t nDescriptors;
+	char (*sids)[SID_STRING_LENGTH];	/*Each distinct SID once, sorted */
+	uint32_t nSids;
+	uint64_t nEntries;					/*Entries of $SII */
+	uint64_t nBad;						/*Those whose descriptor is damaged or missing */
+} SecurityTable;
+
+/* A descriptor read from $SDS, before SIDs and descriptors are made distinct */
+typedef struct _LoadedDescriptor {
+	uint32_t securityId;
+	char owner[SID_STRING_LENGTH];
+	char group[SID_STRING_LENGTH];
+	SecurityDescriptor summary;
+} LoadedDescriptor;
+
+/* State kept while $SII is walked */
+typedef struct _SecurityLoader {
+	char *sds;					/*The whole $SDS stream */
+	uint64_t sdsLength;
+	LoadedDescriptor *loaded;
+	uint64_t nLoaded, capacity;
+	uint64_t nEntries, nBad;
+} SecurityLoader;
+
+/**
+ * Writes the SID at offset in descriptor (length bytes) to sid (SID_STRING_LENGTH bytes)
+ * as S-1-5-21-..., or an empty string if offset is 0 (there is none).
+ * Returns false if the SID does not lie within the descriptor.
+ */
+bool sidString(char *descriptor, uint32_t length, uint32_t offset, char *sid) {
+	SID_HEADER *header = (SID_HEADER *)(descriptor + offset);
+	uint64_t authority = 0;
+	int k, n;
+	*sid = '\0';
+	if(offset == 0) {
+		return true;
+	}
+	if(offset + sizeof(SID_HEADER) > length || header->subAuthorityCount > 15 ||
+	   offset + sizeof(SID_HEADER) + 4*header->subAuthorityCount > length) {
+		return false;
+	}
+	for(k = 0; k < 6; k++) {
+		authority = authority << 8 | header->authority[k];
+	}
+	n = snprintf(sid, SID_STRING_LENGTH, "S-%u-%" PRIu64, header->revision, authority);
+	for(k = 0; k < header->subAuthorityCount; k++) {
+		uint32_t subAuthority;
+		memcpy(&subAuthority, descriptor + offset + sizeof(SID_HEADER) + 4*k, sizeof(subAuthority));
+		n += snprintf(sid + n, SID_STRING_LENGTH - n, "-%u", subAuthority);
+	}
+	return true;
+}
+
+/**
+ * Reads the self-relative security descriptor of length bytes at descriptor into loaded:
+ * owner and group as strings, and the ACEs of its DACL counted by type.
+ * Returns false if it is damaged.
+ */
+bool readDescriptor(char *descriptor, uint32_t length, LoadedDescriptor *loaded) {
+	SECURITY_DESCRIPTOR_HEADER *header = (SECURITY_DESCRIPTOR_HEADER *)descriptor;
+	uint32_t k;
+	memset(&loaded->summary, 0, sizeof(SecurityDescriptor));
+	if(length < sizeof(SECURITY_DESCRIPTOR_HEADER) || header->revision != 1 ||
+	   !sidString(descriptor, length, header->ownerOffset, loaded->owner) ||
+	   !sidString(descriptor, length, header->groupOffset, loaded->group)) {
+		return false;
+	}
+	loaded->summary.dacl = (header->control & SE_DACL_PRESENT) && header->daclOffset != 0;
+	if(!loaded->summary.dacl) {
+		return true;
+	}
+
+	ACL_HEADER *acl = (ACL_HEADER *)(descriptor + header->daclOffset);
+	if(header->daclOffset + sizeof(ACL_HEADER) > length || header->daclOffset + acl->size > length) {
+		return false;
+	}
+	uint32_t offs = sizeof(ACL_HEADER);
+	for(k = 0; k < acl->aceCount; k++) {
+		ACE_HEADER *ace = (ACE_HEADER *)((char *)acl + offs);
+		if(offs + sizeof(ACE_HEADER) > acl->size || ace->size < sizeof(ACE_HEADER) || offs + ace->size > acl->size) {
+			return false;
+		}
+		if(ace->type == ACE_ACCESS_ALLOWED) {
+			loaded->summary.allowAces++;
+		} else if(ace->type == ACE_ACCESS_DENIED) {
+			loaded->summary.denyAces++;
+		} else {
+			loaded->summary.otherAces++;
+		}
+		offs += ace->size;
+	}
+	return true;
+}
+
+/**
+ * Called for each entry of $SII: keyed by a security ID, its data is the header of the
+ * entry of $SDS holding the descriptor.
+ */
+void loadSecurityEntry(void *ctx, File *secure, INDEX_ENTRY_HEADER *entry) {
+	SecurityLoader *loader = ctx;
+	SDS_ENTRY_HEADER sii, sds;
+	uint32_t securityId;
+	loader->nEntries++;
+	if(entry->keyLength < sizeof(uint32_t) || entry->data.dataLength < sizeof(SDS_ENTRY_HEADER) ||
+	   entry->data.dataOffset + entry->data.dataLength > entry->entryLength) {
+		loader->nBad++;
+		return;
+	}
+	memcpy(&securityId, (char *)entry + sizeof(INDEX_ENTRY_HEADER), sizeof(securityId));
+	memcpy(&sii, (char *)entry + entry->data.dataOffset, sizeof(sii));
+
+	/*The entry of $SDS must be where $SII says, and say the same */
+	if(securityId >= MAX_SECURITY_ID || sii.length < sizeof(SDS_ENTRY_HEADER) ||
+	   sii.offset > loader->sdsLength || sii.length > loader->sdsLength - sii.offset) {
+		loader->nBad++;
+		return;
+	}
+	memcpy(&sds, loader->sds + sii.offset, sizeof(sds));
+	if(sds.securityId != securityId || sds.offset != sii.offset || sds.length != sii.length) {
+		loader->nBad++;
+		return;
+	}
+
+	if(loader->nLoaded == loader->capacity) {
+		loader->capacity = loader->capacity ? 2*loader->capacity : 256;
+		loader->loaded = memRealloc( MEM_METADATA, loader->loaded, loader->capacity*sizeof(LoadedDescriptor) );
+	}
+	LoadedDescriptor *loaded = &loader->loaded[loader->nLoaded];
+	loaded->securityId = securityId;
+	if(!readDescriptor(loader->sds + sii.offset + sizeof(SDS_ENTRY_HEADER), sii.length - sizeof(SDS_ENTRY_HEADER), loaded)) {
+		loader->nBad++;
+		return;
+	}
+	loader->nLoaded++;
+}
+
+int compareSidStrings(const void *a, const void *b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+int compareSids(const void *a, const void *b) {
+	return strcmp(a, b);
+}
+
+int compareSecurityDescriptors(const void *a, const void *b) {
+	const SecurityDescriptor *x = a, *y = b;
+	if(x->owner != y->owner) {
+		return x->owner < y->owner ? -1 : 1;
+	}
+	if(x->group != y->group) {
+		return x->group < y->group ? -1 : 1;
+	}
+	if(x->dacl != y->dacl) {
+		return x->dacl ? 1 : -1;
+	}
+	if(x->allowAces != y->allowAces) {
+		return x->allowAces < y->allowAces ? -1 : 1;
+	}
+	if(x->denyAces != y->denyAces) {
+		return x->denyAces < y->denyAces ? -1 : 1;
+	}
+	return x->otherAces < y->otherAces ? -1 : x->otherAces > y->otherAces;
+}
+
+/**
+ * Returns the index of sid among the SIDs of table, or NO_SID if it is not there (or empty).
+ */
+uint32_t findSid(SecurityTable *table, const char *sid) {
+	if(*sid == '\0' || table->nSids == 0) {
+		return NO_SID;
+	}
+	char (*found)[SID_STRING_LENGTH] = bsearch(sid, table->sids, table->nSids, SID_STRING_LENGTH, compareSids);
+	return found ? found - table->sids : NO_SID;
+}
+
+/**
+ * Makes the SIDs and descriptors read by loader distinct, and keys them by security ID
+ * in table.
+ */
+void buildSecurityTable(SecurityLoader *loader, SecurityTable *table) {
+	uint64_t i;
+	uint32_t n = 0;
+
+	/*Every SID once */
+	char **sids = memAlloc( MEM_METADATA, (2*loader->nLoaded + 1)*sizeof(char *) );
+	for(i = 0; i < loader->nLoaded; i++) {
+		sids[n++] = loader->loaded[i].owner;
+		sids[n++] = loader->loaded[i].group;
+	}
+	qsort(sids, n, sizeof(char *), compareSidStrings);
+	table->sids = memAlloc( MEM_METADATA, (n ? n : 1)*SID_STRING_LENGTH );
+	table->nSids = 0;
+	for(i = 0; i < n; i++) {
+		if(*sids[i] && (table->nSids == 0 || strcmp(table->sids[table->nSids-1], sids[i]) != 0)) {
+			snprintf(table->sids[table->nSids++], SID_STRING_LENGTH, "%s", sids[i]);
+		}
+	}
+	memFree(sids);
+
+	/*Every descriptor once, in order, then each security ID pointed at its own */
+	SecurityDescriptor *descriptors = memAlloc( MEM_METADATA, (loader->nLoaded ? loader->nLoaded : 1)*sizeof(SecurityDescriptor) );
+	table->nIds = 0;
+	for(i = 0; i < loader->nLoaded; i++) {
+		LoadedDescriptor *loaded = &loader->loaded[i];
+		loaded->summary.owner = findSid(table, loaded->owner);
+		loaded->summary.group = findSid(table, loaded->group);
+		descriptors[i] = loaded->summary;
+		if(loaded->securityId >= table->nIds) {
+			table->nIds = loaded->securityId + 1;
+		}
+	}
+	qsort(descriptors, loader->nLoaded, sizeof(SecurityDescriptor), compareSecurityDescriptors);
+	table->nDescriptors = 0;
+	for(i = 0; i < loader->nLoaded; i++) {
+		if(table->nDescriptors == 0 ||
+		   compareSecurityDescriptors(&descriptors[table->nDescriptors-1], &descriptors[i]) != 0) {
+			descriptors[table->nDescriptors++] = descriptors[i];
+		}
+	}
+	table->descriptors = descriptors;
+	table->byId = memAlloc( MEM_METADATA, (table->nIds ? table->nIds : 1)*sizeof(uint32_t) );
+	for(i = 0; i < table->nIds; i++) {
+		table->byId[i] = NO_DESCRIPTOR;
+	}
+	for(i = 0; i < loader->nLoaded; i++) {
+		SecurityDescriptor *found = bsearch(&loader->loaded[i].summary, descriptors, table->nDescriptors,
+											sizeof(SecurityDescriptor), compareSecurityDescriptors);
+		table->byId[loader->loaded[i].securityId] = found - descriptors;
+	}
+}
+
+/**
+ * Loads the security descriptors of $Secure, whose record is found in copy, into table.
+ * The record is parsed again for the named $SDS stream and $SII index, which the catalog
+ * does not keep.
+ * Returns 0, or -1 if $Secure is missing or $SDS cannot be read.
+ *
+ * WARNING: Memory is allocated for the table, need to freeSecurityTable(..)
+ */
+int loadSecurityTable(Volume *volume, File *files, MFTCopy *copy, SecurityTable *table) {
+	char *record = findCopiedRecord(copy, SECURE_RECORD);
+	File *secure = findFileRecord(files, SECURE_RECORD);
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	DirectoryIndex *index = NULL;
+	File sds;
+	memset(table, 0, sizeof(SecurityTable));
+	memset(&sds, 0, sizeof(sds));
+	if(!record || !secure || secure->badFixup) {
+		printf("No $Secure found in MFT record %d.\n", SECURE_RECORD);
+		return -1;
+	}
+
+	/*--------------------------------- The $SDS stream --------------------------------*/
+	uint16_t attrOffset = header->wAttribOffset;
+	while(attrOffset+8 < header->dwRecLength) {
+		NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+attrOffset);
+		if(attr->dwFullLength > MFT_RECORD_LENGTH-attrOffset || attr->dwFullLength == 0) {
+			break;
+		}
+		if(attr->dwType == DATA && isAttributeNamed(attr, "$SDS") && !sds.runs && !sds.residentData) {
+			if(attr->uchNonResFlag == false) {
+				sds.realSize = (attr->Attr.Resident).dwLength;
+				if(sds.realSize <= attr->dwFullLength - (attr->Attr.Resident).wAttrOffset) {
+					sds.residentData = memAlloc( MEM_METADATA, sds.realSize + 1 );
+					memcpy(sds.residentData, record+attrOffset+(attr->Attr.Resident).wAttrOffset, sds.realSize);
+				}
+			} else if((attr->Attr).NonResident.n64StartVCN == 0 && (attr->Attr).NonResident.wDatarunOffset < attr->dwFullLength) {
+				uint32_t countRuns;
+				uint16_t dataRunOffset = (attr->Attr).NonResident.wDatarunOffset;
+				sds.realSize = (attr->Attr).NonResident.n64RealSize;
+				sds.runs = decodeRunList(record+attrOffset+dataRunOffset, attr->dwFullLength-dataRunOffset, &countRuns);
+			}
+		}
+		attrOffset += attr->dwFullLength;
+	}
+	index = readCopiedIndex(record, "$SII");
+
+	SecurityLoader loader;
+	memset(&loader, 0, sizeof(loader));
+	int ret = -1;
+	if((!sds.runs && !sds.residentData) || !index) {
+		printf("No $SDS stream or $SII index in $Secure.\n");
+	} else {
+		loader.sdsLength = sds.realSize;
+		loader.sds = memAlloc( MEM_METADATA, sds.realSize ? sds.realSize : 1 );
+		char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+		Sink sink = createMemorySink(loader.sds, sds.realSize);
+		sds.recordNumber = SECURE_RECORD;
+		ret = streamFile(volume, &sds, &sink, buffer);
+		free(sink.ctx);
+		memFree(buffer);
+		if(ret != 0) {
+			printf("Failed to read $Secure:$SDS.\n");
+		} else {
+			int bad = visitIndex(volume, secure, index, loadSecurityEntry, &loader);
+			if(bad != 0) {
+				printf("$Secure:$SII has %s.\n", bad > 0 ? "damaged index nodes" : "an index which cannot be read");
+			}
+			buildSecurityTable(&loader, table);
+			table->nEntries = loader.nEntries;
+			table->nBad = loader.nBad;
+		}
+	}
+	memFree(loader.sds);
+	memFree(loader.loaded);
+	memFree(sds.residentData);
+	freeList(sds.runs);
+	freeDirectoryIndex(index);
+	return ret;
+}
+
+void freeSecurityTable(SecurityTable *table) {
+	memFree(table->byId);
+	memFree(table->descriptors);
+	memFree(table->sids);
+	memset(table, 0, sizeof(SecurityTable));
+}
+
+/**
+ * Returns the index of the descriptor of file among those of table, or NO_DESCRIPTOR if
+ * it has none.
+ */
+uint32_t fileDescriptor(SecurityTable *table, File *file) {
+	return file->securityId < table->nIds ? table->byId[file->securityId] : NO_DESCRIPTOR;
+}
+
+/**
+ * Writes a summary of the DACL of descriptor to summary (size bytes).
+ */
+void describeAcl(SecurityDescriptor *descriptor, char *summary, size_t size) {
+	if(!descriptor->dacl) {
+		snprintf(summary, size, "no DACL");
+		return;
+	}
+	snprintf(summary, size, "DACL of %u ACEs: %u allow, %u deny, %u other",
+			 descriptor->allowAces + descriptor->denyAces + descriptor->otherAces,
+			 descriptor->allowAces, descriptor->denyAces, descriptor->otherAces);
+}
+
+/**
+ * Loads the descriptors of volume, then, without sids, prints how many files in use each
+ * owner SID has, or else prints every file owned by one of the nSids SIDs with its
+ * security ID and DACL. The owner of each file is looked up once into a column scanned
+ * for either.
+ * Returns 0, or -1 if the descriptors cannot be loaded.
+ */
+int securityReport(Volume *volume, File *files, MFTCopy *copy, char **sids, int nSids) {
+	SecurityTable table;
+	uint32_t nRecords, r, nUnknown = 0, nInUse = 0;
+	int i;
+	if(loadSecurityTable(volume, files, copy, &table) != 0) {
+		return -1;
+	}
+	printf("%" PRIu64 " security IDs in $Secure:$SII (%" PRIu64 " damaged), %u distinct descriptors, %u SIDs.\n",
+		   table.nEntries, table.nBad, table.nDescriptors, table.nSids);
+
+	File **byRecord = indexRecords(files, &nRecords);
+	uint32_t *ownerOf = memAlloc( MEM_METADATA, (nRecords ? nRecords : 1)*sizeof(uint32_t) );
+	for(r = 0; r < nRecords; r++) {
+		File *file = byRecord[r];
+		uint32_t d = file && (file->recordFlags & IN_USE) ? fileDescriptor(&table, file) : NO_DESCRIPTOR;
+		ownerOf[r] = d == NO_DESCRIPTOR ? NO_SID : table.descriptors[d].owner;
+		if(file && (file->recordFlags & IN_USE)) {
+			nInUse++;
+			nUnknown += d == NO_DESCRIPTOR;
+		}
+	}
+
+	if(nSids == 0) {
+		uint64_t *counts = memCalloc( MEM_METADATA, table.nSids + 1, sizeof(uint64_t) );
+		for(r = 0; r < nRecords; r++) {
+			if(ownerOf[r] != NO_SID) {
+				counts[ownerOf[r]]++;
+			}
+		}
+		for(r = 0; r < table.nSids; r++) {
+			if(counts[r]) {
+				printf("%10" PRIu64 " files  %s\n", counts[r], table.sids[r]);
+			}
+		}
+		memFree(counts);
+	}
+	for(i = 0; i < nSids; i++) {
+		uint32_t sid = findSid(&table, sids[i]), nOwned = 0;
+		for(r = 0; r < nRecords; r++) {
+			if(ownerOf[r] != sid || sid == NO_SID) {
+				continue;
+			}
+			char path[MAX_PATH_LENGTH], acl[64];
+			if(filePath(byRecord, nRecords, byRecord[r], path, sizeof(path)) == 0) {
+				snprintf(path, sizeof(path), "/");	/*The root directory */
+			}
+			describeAcl(&table.descriptors[fileDescriptor(&table, byRecord[r])], acl, sizeof(acl));
+			printf("%s  security ID %u, %s\n", path, byRecord[r]->securityId, acl);
+			nOwned++;
+		}
+		printf("%s owns %u files.\n", sids[i], nOwned);
+	}
+	printf("%u files in use, %u without a known descriptor.\n", nInUse, nUnknown);
+
+	memFree(ownerOf);
+	memFree(byRecord);
+	freeSecurityTable(&table);
+	return 0;
+}
+
+#endif /* SECURITY_H_ */
@@ -0,0 +1,188 @@
+/*
+ * Sink.h
+ *
+ * Sinks receive the content of each file as it streams off the volume, in file order.
+ * Each worker thread is given its own sink, so a sink context is never shared.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include "FileLUT.h"
+#include "Hash.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef SINK_H_
+#define SINK_H_
+
+#define MAX_PATH_LENGTH 4096
+
+typedef struct _Sink {
+	int (*begin)(void *ctx, File *file);
+	int (*write)(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length);
+	int (*end)(void *ctx, File *file);
+	void *ctx;
+	uint64_t limit;		/*Bytes wanted from the start of each file, 0 for all of it */
+	void (*close)(void *ctx);	/*Called once the sink is done with, NULL if there is nothing to do */
+} Sink;
+
+/**
+ * Closes sink once it is done with, and frees its context.
+ */
+void closeSink(Sink *sink) {
+	if(sink->close) {
+		sink->close(sink->ctx);
+	}
+	free(sink->ctx);
+}
+
+/**
+ * Hands length bytes of file to sink, timing and counting them.
+ * Returns the result of the sink's write.
+ */
+int sinkWrite(Sink *sink, File *file, uint64_t fileOffset, char *data, size_t length) {
+	STAT_SCOPE(TIMER_SINK);
+	uint64_t traceStartNs = traceStart();
+	int ret = sink->write(sink->ctx, file, fileOffset, data, length);
+	traceSpan("write", "sink", traceStartNs, "record", file->recordNumber, "length", length);
+	STAT_ADD(STAT_SINK_BYTES, length);
+	if(ret != 0) {
+		STAT_INC(STAT_SINK_ERRORS);
+	}
+	return ret;
+}
+
+/*------------------------------------ Hash sink ------------------------------------*/
+
+int hashBegin(void *ctx, File *file) {
+	sha256Init(ctx);
+	return 0;
+}
+
+int hashWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	sha256Update(ctx, data, length);
+	return 0;
+}
+
+/**
+ * Prints digest, the SHA-256 of file, its MFT record number and its name.
+ */
+void printDigest(uint8_t *digest, File *file) {
+	char hex[2*SHA256_DIGEST_LENGTH+1];
+	digestToHex(hex, digest, SHA256_DIGEST_LENGTH);
+	printf("%s  %u  %s\n", hex, file->recordNumber, file->fileName ? file->fileName : "");
+}
+
+int hashEnd(void *ctx, File *file) {
+	uint8_t digest[SHA256_DIGEST_LENGTH];
+	sha256Final(ctx, digest);
+	printDigest(digest, file);
+	return 0;
+}
+
+Sink createHashSink() {
+	Sink sink = { hashBegin, hashWrite, hashEnd, malloc( sizeof(SHA256_CTX) ) };
+	return sink;
+}
+
+/*----------------------------------- Extract sink -----------------------------------*/
+
+/* Writes each file to <outputDir>/<record number>_<file name> */
+typedef struct _ExtractCtx {
+	char *outputDir;
+	FILE *out;
+} ExtractCtx;
+
+/**
+ * Writes where file is extracted to under outputDir into path (MAX_PATH_LENGTH bytes).
+ */
+void extractPath(char *outputDir, File *file, char *path) {
+	snprintf(path, MAX_PATH_LENGTH, "%s/%u_%s", outputDir, file->recordNumber,
+			 file->fileName ? file->fileName : "");
+}
+
+int extractBegin(void *ctx, File *file) {
+	ExtractCtx *extract = ctx;
+	char path[MAX_PATH_LENGTH];
+	extractPath(extract->outputDir, file, path);
+	if((extract->out = fopen(path, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create local file %s: %s.\n", path, strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+int extractWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	ExtractCtx *extract = ctx;
+	if(fwrite(data, length, 1, extract->out) != 1) {
+		int errsv = errno;
+		printf("Failed to write record %u to local file: %s.\n", file->recordNumber, strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+int extractEnd(void *ctx, File *file) {
+	ExtractCtx *extract = ctx;
+	int ret = 0;
+	if(extract->out && fclose(extract->out) != 0) {
+		ret = -1;
+	}
+	extract->out = NULL;
+	return ret;
+}
+
+Sink createExtractSink(char *outputDir) {
+	ExtractCtx *extract = malloc( sizeof(ExtractCtx) );
+	extract->outputDir = outputDir;
+	extract->out = NULL;
+	Sink sink = { extractBegin, extractWrite, extractEnd, extract };
+	return sink;
+}
+
+/*----------------------------------- Memory sink -----------------------------------*/
+
+/* Copies a file into a buffer of the caller's, for metafiles which are parsed whole */
+typedef struct _MemoryCtx {
+	char *data;
+	uint64_t capacity;
+} MemoryCtx;
+
+int memoryBegin(void *ctx, File *file) {
+	return 0;
+}
+
+int memoryWrite(void *ctx, File *file, uint64_t fileOffset, char *data, size_t length) {
+	MemoryCtx *memory = ctx;
+	if(fileOffset >= memory->capacity) {
+		return 0;
+	}
+	if(length > memory->capacity - fileOffset) {
+		length = memory->capacity - fileOffset;
+	}
+	memcpy(memory->data + fileOffset, data, length);
+	return 0;
+}
+
+int memoryEnd(void *ctx, File *file) {
+	return 0;
+}
+
+/**
+ * Creates a sink copying up to capacity bytes of a file into data.
+ * The context is held by the returned sink, free(..) it when done.
+ */
+Sink createMemorySink(char *data, uint64_t capacity) {
+	MemoryCtx *memory = malloc( sizeof(MemoryCtx) );
+	memory->data = data;
+	memory->capacity = capacity;
+	Sink sink = { memoryBegin, memoryWrite, memoryEnd, memory };
+	return sink;
+}
+
+#endif /* SINK_H_ */
@@ -0,0 +1,461 @@
+/*
+ * Stats.h
+ *
+ * Instrumentation: named counters, histograms and scoped timers.
+ * Built in with -DNTFS_STATS=1, otherwise every STAT_ macro compiles to nothing.
+ * Each thread updates a shard of its own, the shards are summed when a report is printed.
+ *
+ * Timers also read the cycles, instructions, cache misses and branch misses spent in user
+ * space by the calling thread, through perf_event_open(2), unless built with
+ * -DNTFS_STATS_HW=0. The counters are read with rdpmc from the pages the kernel maps for
+ * them, so a timer costs no system call. Where they are unavailable, or rdpmc is not allowed,
+ * timers fall back to wall-clock only.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+#include "Memory.h"
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#ifndef NTFS_STATS
+#define NTFS_STATS 0
+#endif
+#ifndef NTFS_STATS_HW
+#define NTFS_STATS_HW 1
+#endif
+
+#define STAT_BUCKETS 65		/*Bucket 0 counts zeros, bucket b values in [2^(b-1), 2^b) */
+#define STAT_HW_EVENTS 4	/*Cycles, instructions, cache misses, branch misses */
+#define STAT_SCOPE_DEPTH 8	/*Timers nested deeper are also charged to the one holding them */
+
+typedef enum _StatCounter {
+	STAT_DEVICE_READS,		/*Reads issued on the device */
+	STAT_DEVICE_BYTES,
+	STAT_CACHE_HITS,		/*Blocks served from the block cache */
+	STAT_CACHE_MISSES,
+	STAT_RECORDS_PARSED,
+	STAT_FIXUPS_FAILED,
+	STAT_RUNS_DECODED,
+	STAT_RUNLISTS_MALFORMED,
+	STAT_NAMES_CONVERTED,
+	STAT_SINK_FILES,
+	STAT_SINK_BYTES,
+	STAT_SINK_ERRORS,
+	STAT_CARVE_BYTES,		/*Free space searched for signatures */
+	STAT_CARVE_HITS,
+	STAT_GREP_BYTES,		/*File content searched for patterns */
+	STAT_GREP_HITS,
+	STAT_BAD_BYTES,			/*Unreadable bytes zero filled */
+	STAT_COUNTERS
+} StatCounter;
+
+/* Timers are exclusive, a record parse leaves out the run lists and names decoded for it */
+typedef enum _StatTimer {
+	TIMER_IO,
+	TIMER_FIXUP,
+	TIMER_PARSE,
+	TIMER_DECODE,
+	TIMER_NAME,
+	TIMER_CATALOG,
+	TIMER_SINK,
+	STAT_TIMERS
+} StatTimer;
+
+typedef enum _StatHistogram {
+	HIST_READ_BYTES,		/*Size of each read on the device */
+	HIST_RUNS_PER_LIST,
+	HIST_NAME_LENGTH,
+	HIST_FILE_BYTES,		/*Size of each file streamed to a sink */
+	STAT_HISTOGRAMS
+} StatHistogram;
+
+/* Totals of every thread, or of one thread when held in its shard */
+typedef struct _StatShard {
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t timerCalls[STAT_TIMERS];
+	uint64_t timerNanos[STAT_TIMERS];
+	uint64_t timerBuckets[STAT_TIMERS][STAT_BUCKETS];	/*Duration of each call, in ns */
+	uint64_t timerCounted[STAT_TIMERS];			/*Calls for which hardware counters were read */
+	uint64_t timerEvents[STAT_TIMERS][STAT_HW_EVENTS];
+	uint64_t histograms[STAT_HISTOGRAMS][STAT_BUCKETS];
+	volatile struct perf_event_mmap_page *perfPages[STAT_HW_EVENTS];	/*Read with rdpmc, NULL if unavailable */
+	int scopeDepth;								/*Timers running on the thread */
+	uint64_t childNanos[STAT_SCOPE_DEPTH];		/*Spent in the timers nested in each running one */
+	uint64_t childEvents[STAT_SCOPE_DEPTH][STAT_HW_EVENTS];
+	struct _StatShard *p_next;
+} StatShard;
+
+/**
+ * Returns the bucket counting value: 0 for 0, otherwise one more than the index of its top bit.
+ */
+static inline uint32_t statBucket(uint64_t value) {
+	return value == 0 ? 0 : 64 - __builtin_clzll(value);
+}
+
+#if NTFS_STATS
+
+static const char *statCounterNames[STAT_COUNTERS] = {
+	"device_reads", "device_bytes", "cache_hits", "cache_misses", "records_parsed", "fixups_failed",
+	"runs_decoded", "runlists_malformed", "names_converted", "sink_files", "sink_bytes", "sink_errors",
+	"carve_bytes", "carve_hits", "grep_bytes", "grep_hits", "bad_bytes"
+};
+static const char *statTimerNames[STAT_TIMERS] = {
+	"io", "fixup", "parse", "decode", "name", "catalog", "sink"
+};
+static const char *statHistogramNames[STAT_HISTOGRAMS] = {
+	"read_bytes", "runs_per_list", "name_length", "file_bytes"
+};
+
+static const char *statEventNames[STAT_HW_EVENTS] = {
+	"cycles", "instructions", "cache misses", "branch misses"
+};
+static const uint64_t statEventConfigs[STAT_HW_EVENTS] = {
+	PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* A timer running until the end of the enclosing block */
+typedef struct _StatScope {
+	StatTimer timer;
+	bool counted;		/*events holds the counters at the start */
+	int depth;			/*Timers running around it */
+	uint64_t events[STAT_HW_EVENTS];
+	uint64_t start;
+} StatScope;
+
+#define STAT_ADD(counter, n)		(statShard()->counters[counter] += (n))
+#define STAT_INC(counter)			STAT_ADD(counter, 1)
+#define STAT_HIST(histogram, value)	(statShard()->histograms[histogram][statBucket(value)]++)
+#define STAT_SCOPE(timer) \
+	StatScope statScope_##timer __attribute__((cleanup(statScopeEnd))) = statScopeBegin(timer)
+
+StatShard *statShards = NULL;			/*Every shard ever created, never freed so they outlive threads */
+pthread_mutex_t statLock = PTHREAD_MUTEX_INITIALIZER;
+__thread StatShard *statThreadShard = NULL;
+int statHardwareError = 0;				/*errno of the last failure to open counters */
+
+uint64_t statNanos() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Opens the hardware counters of the calling thread as one group, counting user space only,
+ * and maps the page of each into shard->perfPages. Leaves them NULL if any counter cannot be
+ * opened or read with rdpmc.
+ */
+void statOpenCounters(StatShard *shard) {
+	int fds[STAT_HW_EVENTS];
+	long pageSize = sysconf(_SC_PAGESIZE);
+	int i;
+	if(!NTFS_STATS_HW) {
+		return;
+	}
+#if !defined(__x86_64__) && !defined(__i386__)
+	statHardwareError = ENOTSUP;	/*No rdpmc */
+	return;
+#endif
+	for(i = 0; i < STAT_HW_EVENTS; i++) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HARDWARE;
+		attr.size = sizeof(attr);
+		attr.config = statEventConfigs[i];
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		if((fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0)) == -1) {
+			statHardwareError = errno;
+			break;
+		}
+		shard->perfPages[i] = mmap(NULL, pageSize, PROT_READ, MAP_SHARED, fds[i], 0);
+		if(shard->perfPages[i] == MAP_FAILED) {
+			statHardwareError = errno;
+			shard->perfPages[i] = NULL;
+			close(fds[i]);
+			break;
+		}
+		if(!shard->perfPages[i]->cap_user_rdpmc) {
+			statHardwareError = EACCES;	/*rdpmc disabled, see /sys/bus/event_source/devices/cpu/rdpmc */
+			munmap((void *)shard->perfPages[i], pageSize);
+			shard->perfPages[i] = NULL;
+			close(fds[i]);
+			break;
+		}
+	}
+	if(i < STAT_HW_EVENTS) {
+		while(i-- > 0) {
+			munmap((void *)shard->perfPages[i], pageSize);
+			shard->perfPages[i] = NULL;
+			close(fds[i]);
+		}
+	}
+	/*The fds stay open with the mappings */
+}
+
+/**
+ * Reads the hardware counter at index, as given by its page, less one.
+ */
+static inline uint64_t statRdpmc(uint32_t index) {
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t low, high;
+	__asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(index));
+	return (uint64_t)high << 32 | low;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Reads the hardware counters of the calling thread into events, without a system call:
+ * the count the kernel saved in each page plus what rdpmc reads, retried if the thread was
+ * moved meanwhile. Returns false if they are unavailable.
+ */
+bool statReadCounters(StatShard *shard, uint64_t *events) {
+	int i;
+	if(!shard->perfPages[0]) {
+		return false;
+	}
+	for(i = 0; i < STAT_HW_EVENTS; i++) {
+		volatile struct perf_event_mmap_page *page = shard->perfPages[i];
+		uint32_t seq, index;
+		int64_t count;
+		do {
+			seq = page->lock;
+			__asm__ volatile("" ::: "memory");
+			index = page->index;
+			count = page->offset;
+			if(page->cap_user_rdpmc && index) {
+				uint32_t shift = 64 - page->pmc_width;
+				count += (int64_t)(statRdpmc(index - 1) << shift) >> shift;	/*Sign extends the width read */
+			}
+			__asm__ volatile("" ::: "memory");
+		} while(page->lock != seq);
+		events[i] = count;
+	}
+	return true;
+}
+
+/**
+ * Returns the shard of the calling thread, creating it on first use.
+ */
+StatShard *statShard() {
+	if(!statThreadShard) {
+		statThreadShard = calloc( 1, sizeof(StatShard) );
+		statOpenCounters(statThreadShard);
+		pthread_mutex_lock(&statLock);
+		statThreadShard->p_next = statShards;
+		statShards = statThreadShard;
+		pthread_mutex_unlock(&statLock);
+	}
+	return statThreadShard;
+}
+
+/**
+ * Starts a timer, nested in the one running on the thread if any.
+ */
+StatScope statScopeBegin(StatTimer timer) {
+	StatShard *shard = statShard();
+	StatScope scope;
+	scope.timer = timer;
+	scope.depth = shard->scopeDepth++;
+	if(scope.depth < STAT_SCOPE_DEPTH) {
+		shard->childNanos[scope.depth] = 0;
+		memset(shard->childEvents[scope.depth], 0, sizeof(shard->childEvents[scope.depth]));
+	}
+	scope.counted = statReadCounters(shard, scope.events);
+	scope.start = statNanos();
+	return scope;
+}
+
+/**
+ * Stops a timer, charging it what was spent since it started less what the timers nested in
+ * it were charged, and charging the whole to the timer holding it.
+ */
+void statScopeEnd(StatScope *scope) {
+	uint64_t nanos = statNanos() - scope->start;
+	uint64_t events[STAT_HW_EVENTS];
+	StatShard *shard = statShard();
+	bool counted = scope->counted && statReadCounters(shard, events);
+	int parent = scope->depth - 1;
+	uint64_t own = nanos;
+	int i;
+	shard->scopeDepth--;
+	if(scope->depth < STAT_SCOPE_DEPTH) {
+		own -= shard->childNanos[scope->depth] < nanos ? shard->childNanos[scope->depth] : nanos;
+		if(parent >= 0) {
+			shard->childNanos[parent] += nanos;
+		}
+	}
+	shard->timerCalls[scope->timer]++;
+	shard->timerNanos[scope->timer] += own;
+	shard->timerBuckets[scope->timer][statBucket(own)]++;
+	if(counted) {
+		shard->timerCounted[scope->timer]++;
+		for(i = 0; i < STAT_HW_EVENTS; i++) {
+			uint64_t delta = events[i] - scope->events[i];
+			if(scope->depth < STAT_SCOPE_DEPTH) {
+				shard->timerEvents[scope->timer][i] += delta - shard->childEvents[scope->depth][i];
+				if(parent >= 0) {
+					shard->childEvents[parent][i] += delta;
+				}
+			} else {
+				shard->timerEvents[scope->timer][i] += delta;
+			}
+		}
+	}
+}
+
+/**
+ * Sums the shards of every thread into total. Threads still running may be a little ahead.
+ */
+void sumStats(StatShard *total) {
+	StatShard *shard;
+	int i, b;
+	memset(total, 0, sizeof(StatShard));
+	pthread_mutex_lock(&statLock);
+	for(shard = statShards; shard; shard = shard->p_next) {
+		for(i = 0; i < STAT_COUNTERS; i++) {
+			total->counters[i] += shard->counters[i];
+		}
+		for(i = 0; i < STAT_TIMERS; i++) {
+			total->timerCalls[i] += shard->timerCalls[i];
+			total->timerNanos[i] += shard->timerNanos[i];
+			for(b = 0; b < STAT_BUCKETS; b++) {
+				total->timerBuckets[i][b] += shard->timerBuckets[i][b];
+			}
+			total->timerCounted[i] += shard->timerCounted[i];
+			for(b = 0; b < STAT_HW_EVENTS; b++) {
+				total->timerEvents[i][b] += shard->timerEvents[i][b];
+			}
+		}
+		for(i = 0; i < STAT_HISTOGRAMS; i++) {
+			for(b = 0; b < STAT_BUCKETS; b++) {
+				total->histograms[i][b] += shard->histograms[i][b];
+			}
+		}
+	}
+	pthread_mutex_unlock(&statLock);
+}
+
+/**
+ * Returns the upper bound of the bucket holding the fraction q of the count in buckets.
+ */
+uint64_t statQuantile(uint64_t *buckets, uint64_t count, double q) {
+	uint64_t seen = 0;
+	int b;
+	for(b = 0; b < STAT_BUCKETS; b++) {
+		seen += buckets[b];
+		if(seen > 0 && seen >= q*count) {
+			return b == 0 ? 0 : (b == 64 ? UINT64_MAX : (1ULL << b) - 1);
+		}
+	}
+	return 0;
+}
+
+/**
+ * Prints the hardware counters per call of each timer, with IPC and cycles per record
+ * parsed, or why they are missing.
+ */
+void printHardwareStats(FILE *out, StatShard *total) {
+	uint64_t records = total->counters[STAT_RECORDS_PARSED];
+	bool any = false;
+	int i, e;
+	for(i = 0; i < STAT_TIMERS; i++) {
+		if(total->timerCounted[i] == 0) {
+			continue;
+		}
+		if(!any) {
+			fprintf(out, "Hardware (per call):\t");
+			for(e = 0; e < STAT_HW_EVENTS; e++) {
+				fprintf(out, " %13s", statEventNames[e]);
+			}
+			fprintf(out, " %6s %13s\n", "IPC", "cycles/record");
+			any = true;
+		}
+		fprintf(out, "\t%-20s", statTimerNames[i]);
+		for(e = 0; e < STAT_HW_EVENTS; e++) {
+			fprintf(out, " %13.1f", (double)total->timerEvents[i][e]/total->timerCounted[i]);
+		}
+		fprintf(out, " %6.2f", total->timerEvents[i][0] ? (double)total->timerEvents[i][1]/total->timerEvents[i][0] : 0);
+		if(records > 0) {
+			fprintf(out, " %13.1f", (double)total->timerEvents[i][0]/records);
+		}
+		fprintf(out, "\n");
+	}
+	if(!any) {
+		fprintf(out, "Hardware counters unavailable (%s), timers are wall-clock only.\n",
+				NTFS_STATS_HW ? strerror(statHardwareError) : "built with NTFS_STATS_HW=0");
+	}
+}
+
+/**
+ * Prints the counters, timers and histograms summed over every thread to out.
+ */
+void printStats(FILE *out) {
+	StatShard *total = malloc( sizeof(StatShard) );
+	int i, b;
+	sumStats(total);
+
+	fprintf(out, "Counters:\n");
+	for(i = 0; i < STAT_COUNTERS; i++) {
+		fprintf(out, "\t%-20s %" PRIu64 "\n", statCounterNames[i], total->counters[i]);
+	}
+	fprintf(out, "Timers:\t%-13s %12s %12s %10s %10s %10s\n", "", "calls", "total ms", "ns/call", "p50 ns", "p99 ns");
+	for(i = 0; i < STAT_TIMERS; i++) {
+		if(total->timerCalls[i] == 0) {
+			continue;
+		}
+		fprintf(out, "\t%-20s %12" PRIu64 " %12.3f %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n", statTimerNames[i],
+				total->timerCalls[i], total->timerNanos[i]/1e6, total->timerNanos[i]/total->timerCalls[i],
+				statQuantile(total->timerBuckets[i], total->timerCalls[i], 0.5),
+				statQuantile(total->timerBuckets[i], total->timerCalls[i], 0.99));
+	}
+	printHardwareStats(out, total);
+	printMemoryStats(out);
+	fprintf(out, "Histograms (values below each bound: count):\n");
+	for(i = 0; i < STAT_HISTOGRAMS; i++) {
+		fprintf(out, "\t%-20s", statHistogramNames[i]);
+		for(b = 0; b < STAT_BUCKETS; b++) {
+			if(total->histograms[i][b] > 0) {
+				fprintf(out, " <%" PRIu64 ":%" PRIu64, (uint64_t)(b == 0 ? 1 : (b == 64 ? UINT64_MAX : 1ULL << b)),
+						total->histograms[i][b]);
+			}
+		}
+		fprintf(out, "\n");
+	}
+	free(total);
+}
+
+#else
+
+#define STAT_ADD(counter, n)		((void)0)
+#define STAT_INC(counter)			((void)0)
+#define STAT_HIST(histogram, value)	((void)0)
+#define STAT_SCOPE(timer)			do { } while(0)
+
+void printStats(FILE *out) {
+	fprintf(out, "Statistics are not built in, rebuild with -DNTFS_STATS=1.\n");
+}
+
+#endif /* NTFS_STATS */
+
+/* Prints the report to stderr at exit, keeping it apart from the output of commands */
+void printStatsAtExit() {
+	fprintf(stderr, "\n---------------------------- Stats ----------------------------\n");
+	printStats(stderr);
+}
+
+#endif /* STATS_H_ */
@@ -0,0 +1,442 @@
+/*
+ * Sweep.h
+ *
+ * Streaming of the content of every file in one sweep of the volume in disk order, for
+ * devices where following the run lists of many fragmented files is bound by seeks.
+ * The runs of the cluster map, sorted by LCN, are cut into slices of at most SWEEP_CHUNK
+ * bytes, and slices close enough on disk are coalesced into reads of up to SWEEP_CHUNK
+ * bytes which worker threads take in turn, so the device is read front to back once.
+ * Each slice read is handed to the sink of its file. Sinks need their content in file
+ * order, so a slice arriving ahead of the one before it in its file (the file is laid out
+ * backwards, or another thread is slower) is held until the gap is filled; sparse runs
+ * fill their gap with zeros. What is held over the sweep is kept under SWEEP_HOLD_BUDGET:
+ * a file whose slice would go past it lets go of what it holds and takes nothing more
+ * out of order, and the rest of it is streamed along its runs once the sweep is over. A
+ * file gets its sink, made by a SinkFactory, when its first bytes arrive and gives it up
+ * at its last, so only the files in flight hold one. Sinks hold resources of their own (an
+ * open file to extract to, the spool of a known-file sink), so at most SWEEP_OPEN_SINKS
+ * are open at once, fewer under a low limit on open files; a file whose first bytes arrive
+ * past that is streamed after the sweep too.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include "NTFSStruct.h"
+#include "FileLUT.h"
+#include "Volume.h"
+#include "ClusterMap.h"
+#include "Sink.h"
+#include "Memory.h"
+#include "Stats.h"
+#include "Trace.h"
+
+#ifndef SWEEP_H_
+#define SWEEP_H_
+
+#define SWEEP_CHUNK (4*1024*1024)	/*Most bytes read at once */
+#define SWEEP_GAP (256*1024)		/*Largest gap between slices read over rather than skipped */
+#define SWEEP_HOLD_BUDGET (256*1024*1024)	/*Most bytes held for reordering at once */
+#define SWEEP_OPEN_SINKS 128		/*Most sinks of files in flight at once */
+
+/* Makes the sink of one file, whose ctx is freed with free(..) after its end */
+typedef Sink (*SinkFactory)(void *arg);
+
+/* A piece of content read ahead of its turn */
+typedef struct _SweepHeld {
+	uint64_t fileOffset;
+	uint64_t length;
+	char *data;
+	struct _SweepHeld *p_next;	/*In file order */
+} SweepHeld;
+
+/* A file being swept */
+typedef struct _SweepFile {
+	pthread_mutex_t lock;
+	File *file;
+	Sink sink;
+	bool begun, ended;
+	uint64_t delivered;		/*Bytes handed to the sink, all in file order */
+	SweepHeld *held;
+	bool deferred;			/*Went past the hold budget, the rest is streamed after the sweep */
+	int failed;
+} SweepFile;
+
+/* A slice of a file, contiguous both in the file and on disk */
+typedef struct _SweepSlice {
+	uint32_t file;			/*Among the files swept */
+	uint64_t fileOffset;
+	uint64_t diskOffset;	/*On the partition */
+	uint64_t length;
+} SweepSlice;
+
+/* Slices read at once */
+typedef struct _SweepRead {
+	uint64_t diskOffset;
+	uint64_t length;
+	uint64_t first, nSlices;
+} SweepRead;
+
+/* Work shared among the threads of sweepFiles(..) */
+typedef struct _SweepJob {
+	Volume *volume;
+	SinkFactory newSink;
+	void *sinkArg;
+	SweepFile *files;
+	SweepSlice *slices;
+	SweepRead *reads;
+	uint64_t nReads;
+	uint64_t next;				/*Next read to take, taken atomically */
+	char *zeros;				/*STREAM_BUFFER_SIZE bytes, for sparse runs */
+	uint64_t bytesHeld;			/*Read ahead of their turn, over the sweep */
+	uint64_t holding;			/*Held at the moment, within SWEEP_HOLD_BUDGET */
+	uint32_t openSinks;			/*Of files in flight, within maxSinks */
+	uint32_t maxSinks;
+	uint32_t nDeferred;			/*Files which went past either */
+	uint64_t bytesRead;
+	int failures;				/*Reads which failed */
+} SweepJob;
+
+/**
+ * Returns the bytes of the sparse run of file which follow fileOffset, 0 if fileOffset
+ * is not in one.
+ */
+uint64_t sparseBytesAt(File *file, uint64_t fileOffset, uint32_t bytesPerCluster) {
+	uint64_t runStart = 0;
+	DataRun *p_current_item;
+	for(p_current_item = file->runs; p_current_item; p_current_item = p_current_item->p_next) {
+		uint64_t runBytes = *p_current_item->length * bytesPerCluster;
+		if(fileOffset < runStart + runBytes) {
+			return p_current_item->offset ? 0 : runStart + runBytes - fileOffset;
+		}
+		runStart += runBytes;
+	}
+	return 0;
+}
+
+/**
+ * Makes and begins the sink of sweep, unless job->maxSinks are open already and force is
+ * false. Returns whether the sink was made. Called with the file locked.
+ */
+bool sweepBegin(SweepJob *job, SweepFile *sweep, bool force) {
+	if(__sync_add_and_fetch(&job->openSinks, 1) > job->maxSinks && !force) {
+		__sync_fetch_and_sub(&job->openSinks, 1);
+		return false;
+	}
+	sweep->begun = true;
+	sweep->sink = job->newSink(job->sinkArg);
+	if(sweep->sink.begin(sweep->sink.ctx, sweep->file) != 0) {
+		sweep->failed = -1;
+	}
+	STAT_INC(STAT_SINK_FILES);
+	STAT_HIST(HIST_FILE_BYTES, sweep->file->realSize);
+	return true;
+}
+
+/**
+ * Ends the sink of sweep and gives it up. Called with the file locked.
+ */
+void sweepEnd(SweepJob *job, SweepFile *sweep) {
+	if(sweep->sink.end(sweep->sink.ctx, sweep->file) != 0) {
+		sweep->failed = -1;
+	}
+	closeSink(&sweep->sink);
+	__sync_fetch_and_sub(&job->openSinks, 1);
+}
+
+/**
+ * Hands length bytes of data, at fileOffset of sweep, to its sink, which is begun, ending
+ * the sink with the last bytes. Called with the file locked.
+ */
+void sweepWrite(SweepJob *job, SweepFile *sweep, uint64_t fileOffset, char *data, uint64_t length) {
+	File *file = sweep->file;
+	if(length > 0 && !sweep->failed && sinkWrite(&sweep->sink, file, fileOffset, data, length) != 0) {
+		sweep->failed = -1;
+	}
+	sweep->delivered = fileOffset + length;
+	if(sweep->delivered >= file->realSize) {
+		sweepEnd(job, sweep);
+		sweep->ended = true;
+	}
+}
+
+/**
+ * Hands on what sweep holds, and the zeros of sparse runs, for as long as they carry on
+ * from what was delivered. Called with the file locked and its sink begun.
+ */
+void sweepDrain(SweepJob *job, SweepFile *sweep) {
+	while(!sweep->ended) {
+		SweepHeld *held = sweep->held;
+		uint64_t sparse;
+		if(held && held->fileOffset == sweep->delivered) {
+			sweep->held = held->p_next;
+			sweepWrite(job, sweep, held->fileOffset, held->data, held->length);
+			__sync_fetch_and_sub(&job->holding, held->length);
+			memFree(held->data);
+			memFree(held);
+		} else if((sparse = sparseBytesAt(sweep->file, sweep->delivered, job->volume->bytesPerCluster)) > 0) {
+			uint64_t length = sparse < STREAM_BUFFER_SIZE ? sparse : STREAM_BUFFER_SIZE;
+			if(length > sweep->file->realSize - sweep->delivered) {
+				length = sweep->file->realSize - sweep->delivered;
+			}
+			sweepWrite(job, sweep, sweep->delivered, job->zeros, length);
+		} else {
+			break;
+		}
+	}
+}
+
+/**
+ * Lets go of what sweep holds, which is streamed after the sweep instead. Called with the
+ * file locked.
+ */
+void sweepDefer(SweepJob *job, SweepFile *sweep) {
+	while(sweep->held) {
+		SweepHeld *held = sweep->held;
+		sweep->held = held->p_next;
+		__sync_fetch_and_sub(&job->holding, held->length);
+		memFree(held->data);
+		memFree(held);
+	}
+	sweep->deferred = true;
+	__sync_fetch_and_add(&job->nDeferred, 1);
+}
+
+/**
+ * Takes the length bytes of data read for fileOffset of sweep: hands them on if they
+ * carry on from what was delivered, or else holds a copy of them, within the hold budget.
+ * Past it, or past the sinks which may be open, the file is deferred, and what it would
+ * have held or begun with is read again after the sweep.
+ */
+void sweepDeliver(SweepJob *job, SweepFile *sweep, uint64_t fileOffset, char *data, uint64_t length) {
+	pthread_mutex_lock(&sweep->lock);
+	if(fileOffset == sweep->delivered && !sweep->begun && !sweep->deferred && !sweepBegin(job, sweep, false)) {
+		sweepDefer(job, sweep);
+	}
+	if(fileOffset == sweep->delivered && sweep->begun) {
+		sweepWrite(job, sweep, fileOffset, data, length);
+		sweepDrain(job, sweep);
+	} else if(sweep->deferred) {
+		/*Streamed after the sweep */
+	} else if(__sync_add_and_fetch(&job->holding, length) > SWEEP_HOLD_BUDGET) {
+		__sync_fetch_and_sub(&job->holding, length);
+		sweepDefer(job, sweep);
+	} else {
+		SweepHeld *held = memAlloc( MEM_IO, sizeof(SweepHeld) ), **p_held = &sweep->held;
+		held->fileOffset = fileOffset;
+		held->length = length;
+		held->data = memAlloc( MEM_IO, length );
+		memcpy(held->data, data, length);
+		while(*p_held && (*p_held)->fileOffset < fileOffset) {
+			p_held = &(*p_held)->p_next;
+		}
+		held->p_next = *p_held;
+		*p_held = held;
+		__sync_fetch_and_add(&job->bytesHeld, length);
+	}
+	pthread_mutex_unlock(&sweep->lock);
+}
+
+void *sweepWorker(void *arg) {
+	SweepJob *job = arg;
+	char *buffer = memAlloc( MEM_IO, SWEEP_CHUNK );
+	uint64_t i, k;
+	traceThreadName("sweep");
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nReads) {
+		SweepRead *read = &job->reads[i];
+		uint64_t traceStartNs = traceStart();
+		if(readBlocks(job->volume->reader, job->volume->partitionOffset + read->diskOffset, read->length, buffer) != 0) {
+			int errsv = errno;
+			printf("Failed to read file content at %" PRIu64 ": %s.\n", read->diskOffset, strerror(errsv));
+			__sync_fetch_and_add(&job->failures, 1);
+			continue;
+		}
+		__sync_fetch_and_add(&job->bytesRead, read->length);
+		for(k = read->first; k < read->first + read->nSlices; k++) {
+			SweepSlice *slice = &job->slices[k];
+			sweepDeliver(job, &job->files[slice->file], slice->fileOffset,
+						 buffer + (slice->diskOffset - read->diskOffset), slice->length);
+		}
+		traceSpan("sweep", "io", traceStartNs, "offset", read->diskOffset, "length", read->length);
+	}
+	memFree(buffer);
+	return NULL;
+}
+
+/**
+ * Streams every file with content among files through a sink of its own, made by
+ * newSink(sinkArg), in one sweep of the volume in disk order with nThreads threads.
+ * map is the cluster map of files, whose runs give the order. Resident files are handed
+ * on first, from memory.
+ *
+ * Returns the number of files which failed.
+ */
+int sweepFiles(Volume *volume, File *files, ClusterMap *map, SinkFactory newSink, void *sinkArg, int nThreads) {
+	SweepJob job;
+	uint32_t nRecords, nFiles = 0, f, r;
+	uint64_t i, nSlices = 0, capacity = 0, slicedBytes = 0;
+	int t, failures = 0;
+
+	memset(&job, 0, sizeof(job));
+	job.volume = volume;
+	job.newSink = newSink;
+	job.sinkArg = sinkArg;
+	job.zeros = memCalloc( MEM_IO, 1, STREAM_BUFFER_SIZE );
+
+	/*Leaving most of the open files allowed to the rest of the process */
+	struct rlimit openFiles;
+	job.maxSinks = SWEEP_OPEN_SINKS;
+	if(getrlimit(RLIMIT_NOFILE, &openFiles) == 0 && openFiles.rlim_cur != RLIM_INFINITY &&
+	   openFiles.rlim_cur/4 < job.maxSinks) {
+		job.maxSinks = openFiles.rlim_cur/4 > 0 ? openFiles.rlim_cur/4 : 1;
+	}
+
+	/*The files with content, and where each record number is among them */
+	File **byRecord = indexRecords(files, &nRecords);
+	uint32_t *fileOf = memAlloc( MEM_CATALOG, (nRecords ? nRecords : 1)*sizeof(uint32_t) );
+	job.files = memCalloc( MEM_CATALOG, nRecords ? nRecords : 1, sizeof(SweepFile) );
+	for(r = 0; r < nRecords; r++) {
+		fileOf[r] = UINT32_MAX;
+		if(byRecord[r] && hasContent(byRecord[r])) {
+			SweepFile *sweep = &job.files[nFiles];
+			pthread_mutex_init(&sweep->lock, NULL);
+			sweep->file = byRecord[r];
+			fileOf[r] = nFiles++;
+		}
+	}
+
+	/*Resident content is in memory already, as are empty files and leading sparse runs */
+	for(f = 0; f < nFiles; f++) {
+		SweepFile *sweep = &job.files[f];
+		if(sweep->file->runs == NULL || sweep->file->realSize == 0) {
+			sweepBegin(&job, sweep, true);
+			sweepWrite(&job, sweep, 0, sweep->file->residentData, sweep->file->runs ? 0 : sweep->file->realSize);
+		} else if(sparseBytesAt(sweep->file, 0, volume->bytesPerCluster) == 0) {
+			continue;	/*Begun by its first slice */
+		} else if(sweepBegin(&job, sweep, false)) {
+			sweepDrain(&job, sweep);
+		} else {
+			sweepDefer(&job, sweep);
+		}
+	}
+
+	/*The runs in disk order cut into slices, short of the real size of their files */
+	for(i = 0; i < map->nRuns; i++) {
+		OwnerRun *run = &map->runs[i];
+		uint64_t fileOffset = run->vcn*volume->bytesPerCluster, runOffset, length;
+		uint64_t runBytes = run->length*volume->bytesPerCluster;
+		if(run->recordNumber >= nRecords || fileOf[run->recordNumber] == UINT32_MAX || run->stream != DATA) {
+			continue;
+		}
+		File *file = job.files[fileOf[run->recordNumber]].file;
+		for(runOffset = 0; runOffset < runBytes && fileOffset + runOffset < file->realSize; runOffset += length) {
+			length = runBytes - runOffset < SWEEP_CHUNK ? runBytes - runOffset : SWEEP_CHUNK;
+			if(length > file->realSize - (fileOffset + runOffset)) {
+				length = file->realSize - (fileOffset + runOffset);
+			}
+			if(nSlices == capacity) {
+				capacity = capacity ? 2*capacity : 1024;
+				job.slices = memRealloc( MEM_METADATA, job.slices, capacity*sizeof(SweepSlice) );
+			}
+			SweepSlice *slice = &job.slices[nSlices++];
+			slice->file = fileOf[run->recordNumber];
+			slice->fileOffset = fileOffset + runOffset;
+			slice->diskOffset = run->lcn*volume->bytesPerCluster + runOffset;
+			slice->length = length;
+			slicedBytes += length;
+		}
+	}
+
+	/*Slices close enough on disk are read at once. The runs are sorted by LCN, but a slice
+	  of a cross-linked run may start before the end of the one before it */
+	job.reads = memAlloc( MEM_METADATA, (nSlices ? nSlices : 1)*sizeof(SweepRead) );
+	for(i = 0; i < nSlices; i++) {
+		SweepSlice *slice = &job.slices[i];
+		SweepRead *read = job.nReads ? &job.reads[job.nReads-1] : NULL;
+		uint64_t sliceEnd = slice->diskOffset + slice->length;
+		if(read && slice->diskOffset >= read->diskOffset && slice->diskOffset <= read->diskOffset + read->length + SWEEP_GAP &&
+		   (sliceEnd > read->diskOffset + read->length ? sliceEnd : read->diskOffset + read->length) - read->diskOffset <= SWEEP_CHUNK) {
+			if(sliceEnd > read->diskOffset + read->length) {
+				read->length = sliceEnd - read->diskOffset;
+			}
+			read->nSlices++;
+			continue;
+		}
+		read = &job.reads[job.nReads++];
+		read->diskOffset = slice->diskOffset;
+		read->length = slice->length;
+		read->first = i;
+		read->nSlices = 1;
+	}
+
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	for(t = 0; t < nThreads; t++) {
+		pthread_create(&threads[t], NULL, sweepWorker, &job);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+
+	/*Files which went past the hold budget, the rest of each along its runs */
+	if(job.nDeferred > 0) {
+		char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+		for(f = 0; f < nFiles; f++) {
+			SweepFile *sweep = &job.files[f];
+			if(!sweep->deferred || sweep->ended) {
+				continue;
+			}
+			if(!sweep->begun) {
+				sweepBegin(&job, sweep, true);
+			}
+			if(streamFileRange(volume, sweep->file, sweep->delivered, sweep->file->realSize, &sweep->sink, buffer) != 0) {
+				sweep->failed = -1;
+			}
+			sweepEnd(&job, sweep);
+			sweep->delivered = sweep->file->realSize;
+			sweep->ended = true;
+		}
+		memFree(buffer);
+	}
+
+	/*Files left short by a failed read, or whose runs do not cover their size */
+	for(f = 0; f < nFiles; f++) {
+		SweepFile *sweep = &job.files[f];
+		if(!sweep->ended) {
+			printf("Record %u could not be read in full, %" PRIu64 " of %" PRIu64 " bytes streamed.\n",
+				   sweep->file->recordNumber, sweep->delivered, sweep->file->realSize);
+			if(sweep->begun) {
+				sweepEnd(&job, sweep);
+			}
+			sweep->failed = -1;
+		}
+		while(sweep->held) {
+			SweepHeld *held = sweep->held;
+			sweep->held = held->p_next;
+			memFree(held->data);
+			memFree(held);
+		}
+		if(sweep->failed) {
+			failures++;
+		}
+		pthread_mutex_destroy(&sweep->lock);
+	}
+	printf("Swept %" PRIu64 " bytes of %u files in %" PRIu64 " reads of %" PRIu64 " bytes, %" PRIu64
+		   " bytes held for reordering, %u files past the hold budget or %u open sinks streamed after.\n", slicedBytes, nFiles,
+		   job.nReads, job.bytesRead, job.bytesHeld, job.nDeferred, job.maxSinks);
+
+	memFree(job.reads);
+	memFree(job.slices);
+	memFree(job.files);
+	memFree(job.zeros);
+	memFree(fileOf);
+	memFree(byRecord);
+	return failures;
+}
+
+#endif /* SWEEP_H_ */
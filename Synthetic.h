@@ -0,0 +1,1154 @@
+/*
+ * Synthetic.h
+ *
+ * Builds synthetic MFT FILE records in their on-disk form (fixups protected), for the
+ * benchmarks. All content derives from a caller supplied seed so corpora are reproducible.
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include "NTFSStruct.h"
+#include "NTFSAttributes.h"
+
+#ifndef SYNTHETIC_H_
+#define SYNTHETIC_H_
+
+#define SYN_MAX_RUNS 32			/*Most runs a synthetic $DATA attribute is given */
+#define SYN_ROOT_RECORD 5		/*MFT record number of the root directory */
+#define SYN_FIRST_USER_RECORD 16	/*First record not reserved for metafiles */
+
+/*Geometry of synthetic images */
+#define SYN_BYTES_PER_SECTOR 512
+#define SYN_SECTORS_PER_CLUSTER 8
+#define SYN_BYTES_PER_CLUSTER (SYN_BYTES_PER_SECTOR*SYN_SECTORS_PER_CLUSTER)
+#define SYN_PARTITION_SECTOR 2048	/*The NTFS partition starts 1MB into the image */
+#define SYN_MFT_LCN 16				/*First cluster of the MFT */
+#define SYN_BITMAP_RECORD 6			/*MFT record number of $Bitmap */
+#define SYN_SECURE_RECORD 9			/*MFT record number of $Secure */
+#define SYN_EXTEND_RECORD 11		/*MFT record number of $Extend */
+#define SYN_FIRST_SECURITY_ID 0x100	/*Security ID of the first synthetic descriptor */
+#define SYN_USERS_CHILDREN 5		/*Entries of syntheticTree held by the directory Users */
+#define SYN_OBJECT_IDS 4			/*Entries of syntheticTree, from the first, given an object ID */
+#define SYN_FIRST_DELETED_RECORD 12	/*Reserved records used for deleted files instead */
+#define SYN_CARVE_CLUSTERS 64		/*Unallocated clusters holding the content of deleted files */
+#define SYN_MAX_ENTRY_NAME 31		/*Longest name in the index of the root directory */
+#define SYN_INDEX_BITMAP 256		/*Most bytes of the bitmap of index blocks, which stays resident */
+#define SYN_INDX_FIXUP 0x28			/*Fixup array of a synthetic INDX block, a cluster long */
+#define SYN_INDX_ENTRIES 0x40		/*First entry of a synthetic INDX block */
+#define SYN_ENTRIES_PER_BLOCK ((SYN_BYTES_PER_CLUSTER - SYN_INDX_ENTRIES - 24) / \
+	((sizeof(INDEX_ENTRY_HEADER) + offsetof(FILE_NAME_ATTR, arrUnicodeFileName) + 2*SYN_MAX_ENTRY_NAME + 7)/8*8 + 8))
+
+static const char *syntheticMetafiles[SYN_FIRST_USER_RECORD] = {
+	"$MFT", "$MFTMirr", "$LogFile", "$Volume", "$AttrDef", ".", "$Bitmap", "$Boot",
+	"$BadClus", "$Secure", "$UpCase", "$Extend", "olddir", "holiday.jpg", "diagram.png", "report.pdf"
+};
+
+/* SIDs the synthetic security descriptors are made of: the identifier authority, the
+   number of sub-authorities, then those. SYSTEM, Administrators and a user */
+static const uint32_t syntheticSids[][7] = {
+	{ 5, 1, 18 },
+	{ 5, 2, 32, 544 },
+	{ 5, 5, 21, 1004336348, 1177238915, 682003330, 1001 }
+};
+
+/* The synthetic security descriptors, from SYN_FIRST_SECURITY_ID on: the owner and group
+   (of syntheticSids), then the ACEs of the DACL, each the SID + 1, negated to deny access.
+   A descriptor without ACEs has no DACL */
+static const int8_t syntheticDescriptors[][5] = {
+	{ 0, 0, 1, 2, 0 },
+	{ 1, 0, 2, 1, -3 },
+	{ 2, 2, 3, 1, 2 },
+	{ 2, 2, 0, 0, 0 }
+};
+#define SYN_DESCRIPTORS (sizeof(syntheticDescriptors)/sizeof(syntheticDescriptors[0]))
+
+/* A file of the small tree of links which follows the files of a synthetic image */
+typedef struct _SyntheticTreeEntry {
+	const char *name;
+	uint32_t tag;			/*Of its reparse point, 0 for none */
+	bool relative;			/*A relative symbolic link */
+	const char *target;		/*Substitute name of the link */
+} SyntheticTreeEntry;
+
+/* The directory Users, first, holding the next SYN_USERS_CHILDREN entries, which are a file
+   and links of every outcome: back to Users, to a file, to nothing, and to itself. The
+   rest are junctions in the root directory, to Users and to another volume. There are as
+   many entries as records in a cluster, so the MFT still ends with a cluster when the
+   number of files is a multiple of 4 */
+static const SyntheticTreeEntry syntheticTree[] = {
+	{ "Users", 0, false, NULL },
+	{ "notes.txt", 0, false, NULL },
+	{ "Home", IO_REPARSE_TAG_MOUNT_POINT, false, "\\??\\C:\\Users" },
+	{ "Data", IO_REPARSE_TAG_SYMLINK, true, "..\\file000001.bin" },
+	{ "Gone", IO_REPARSE_TAG_SYMLINK, false, "\\??\\C:\\Missing" },
+	{ "Loop", IO_REPARSE_TAG_SYMLINK, true, "Loop" },
+	{ "Shared", IO_REPARSE_TAG_MOUNT_POINT, false, "\\??\\C:\\Users" },
+	{ "Backup", IO_REPARSE_TAG_MOUNT_POINT, false, "\\??\\Volume{5eed0000-0000-0000-0000-000000000001}\\" }
+};
+#define SYN_TREE_RECORDS (sizeof(syntheticTree)/sizeof(syntheticTree[0]))
+
+/* The metafiles in $Extend, which follow syntheticTree; again as many as records in a cluster */
+static const char *syntheticExtend[] = { "$ObjId", "$Quota", "$Reparse", "$RmMetadata" };
+#define SYN_EXTEND_RECORDS (sizeof(syntheticExtend)/sizeof(syntheticExtend[0]))
+
+/**
+ * xorshift64* pseudo random generator, state must be non zero.
+ */
+uint64_t syntheticRand(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * Returns the number of bytes needed to store value as a signed little endian integer.
+ */
+uint8_t signedFieldSize(int64_t value) {
+	uint8_t size = 1;
+	while(size < 8 && (value < -(1LL << (8*size-1)) || value >= (1LL << (8*size-1)))) {
+		size++;
+	}
+	return size;
+}
+
+/**
+ * Encodes nRuns runs of lengths[] clusters at absolute clusters lcns[] as mapping pairs
+ * into dst, the inverse of decodeRunList(..). Returns the bytes written, terminator included.
+ */
+uint32_t encodeRunList(char *dst, uint64_t *lengths, uint64_t *lcns, int nRuns) {
+	uint32_t pos = 0;
+	int64_t prevLCN = 0;
+	int i;
+	for(i = 0; i < nRuns; i++) {
+		int64_t delta = (int64_t)lcns[i] - prevLCN;
+		uint8_t lengthSize = 1, offsetSize = signedFieldSize(delta);
+		while(lengthSize < 8 && (lengths[i] >> (8*lengthSize)) != 0) {
+			lengthSize++;
+		}
+		dst[pos++] = (char)((offsetSize << 4) | lengthSize);
+		memcpy(dst+pos, &lengths[i], lengthSize);
+		pos += lengthSize;
+		memcpy(dst+pos, &delta, offsetSize);
+		pos += offsetSize;
+		prevLCN = lcns[i];
+	}
+	dst[pos++] = 0x00;
+	return pos;
+}
+
+/**
+ * Writes the update sequence number to the end of every stride of record and moves the
+ * bytes it replaces into the fixup array, the inverse of applyFixup(..).
+ */
+void protectRecord(char *record, uint32_t recordLength, uint16_t sequenceNumber) {
+	uint16_t fixupOffset, fixupSize;
+	memcpy(&fixupOffset, record+4, sizeof(uint16_t));
+	memcpy(&fixupSize, record+6, sizeof(uint16_t));
+
+	uint16_t *fixupArray = (uint16_t *)(record+fixupOffset);
+	fixupArray[0] = sequenceNumber;
+	int i;
+	for(i = 1; i < fixupSize && i*FIXUP_STRIDE <= recordLength; i++) {
+		uint16_t *strideEnd = (uint16_t *)(record + i*FIXUP_STRIDE - sizeof(uint16_t));
+		fixupArray[i] = *strideEnd;
+		*strideEnd = sequenceNumber;
+	}
+}
+
+/**
+ * Writes the name of an attribute (NULL for none) after its header of headerLength bytes
+ * at offs. Returns the offset of what follows the name, from offs.
+ */
+uint16_t setAttributeName(char *record, uint16_t offs, uint16_t headerLength, const char *name) {
+	NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+offs);
+	uint8_t nameLength = name ? strlen(name) : 0;
+	int k;
+	attr->uchNameLength = nameLength;
+	attr->wNameOffset = headerLength;
+	for(k = 0; k < nameLength; k++) {
+		uint16_t c = (uint8_t)name[k];
+		memcpy(record+offs+headerLength+2*k, &c, sizeof(c));
+	}
+	return (headerLength + 2*nameLength + 7) & ~7;
+}
+
+/**
+ * Appends a resident attribute of attrType, named name (NULL for none), with content of
+ * length bytes at offs. Returns the offset following the attribute.
+ */
+uint16_t addResidentAttribute(char *record, uint16_t offs, uint32_t attrType, const char *name, uint16_t id,
+							  void *content, uint32_t length) {
+	NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+offs);
+	uint16_t contentOffset = setAttributeName(record, offs, 0x18, name);
+	attr->dwType = attrType;
+	attr->dwFullLength = (contentOffset + length + 7) & ~7;
+	attr->uchNonResFlag = false;
+	attr->wFlags = 0;
+	attr->wID = id;
+	attr->Attr.Resident.dwLength = length;
+	attr->Attr.Resident.wAttrOffset = contentOffset;
+	attr->Attr.Resident.uchIndexedTag = (attrType == FILE_NAME);
+	attr->Attr.Resident.uchPadding = 0;
+	memcpy(record+offs+contentOffset, content, length);
+	return offs + attr->dwFullLength;
+}
+
+/**
+ * Appends a non-resident attribute of attrType, named name (NULL for none), at offs, with
+ * the given runs. Returns the offset following the attribute.
+ */
+uint16_t addNonResidentAttribute(char *record, uint16_t offs, uint32_t attrType, const char *name, uint16_t id,
+								 uint64_t *lengths, uint64_t *lcns, int nRuns,
+								 uint64_t realSize, uint32_t bytesPerCluster) {
+	NTFS_ATTRIBUTE *attr = (NTFS_ATTRIBUTE *)(record+offs);
+	uint16_t runListOffset = setAttributeName(record, offs, 0x40, name);
+	uint64_t clusters = 0;
+	int i;
+	for(i = 0; i < nRuns; i++) {
+		clusters += lengths[i];
+	}
+	uint32_t runListLength = encodeRunList(record+offs+runListOffset, lengths, lcns, nRuns);
+
+	attr->dwType = attrType;
+	attr->dwFullLength = (runListOffset + runListLength + 7) & ~7;
+	attr->uchNonResFlag = true;
+	attr->wFlags = 0;
+	attr->wID = id;
+	attr->Attr.NonResident.n64StartVCN = 0;
+	attr->Attr.NonResident.n64EndVCN = clusters ? clusters-1 : 0;
+	attr->Attr.NonResident.wDatarunOffset = runListOffset;
+	attr->Attr.NonResident.wCompressionSize = 0;
+	memset(attr->Attr.NonResident.uchPadding, 0, sizeof(attr->Attr.NonResident.uchPadding));
+	attr->Attr.NonResident.n64AllocSize = clusters*bytesPerCluster;
+	attr->Attr.NonResident.n64RealSize = realSize;
+	attr->Attr.NonResident.n64StreamSize = realSize;
+	return offs + attr->dwFullLength;
+}
+
+/**
+ * Fills fileNameAttr with the $FILE_NAME of fileName in directory parentRecord, as found
+ * both in a FILE record and in the index entries of the directory. Returns its length.
+ */
+uint32_t buildFileName(FILE_NAME_ATTR *fileNameAttr, const char *fileName, uint64_t parentRecord,
+					   uint64_t fileTime, uint64_t realSize, bool directory, uint32_t bytesPerCluster) {
+	uint8_t nameLength = strlen(fileName) > 255 ? 255 : strlen(fileName);
+	int k;
+	memset(fileNameAttr, 0, sizeof(*fileNameAttr));
+	fileNameAttr->n64ParentDirReference = parentRecord | ((uint64_t)1 << 48);
+	fileNameAttr->n64FileCreationTime = fileNameAttr->n64FileAlterationTime = fileTime;
+	fileNameAttr->n64MFTChangedTime = fileNameAttr->n64ReadTime = fileTime;
+	fileNameAttr->n64RealFileSize = realSize;
+	fileNameAttr->n64AllocatedFileSize = (realSize + bytesPerCluster-1) / bytesPerCluster * bytesPerCluster;
+	fileNameAttr->dwFlags = directory ? 0x10000000 : ARCHIVE;
+	fileNameAttr->bFileNameLength = nameLength;
+	fileNameAttr->bFilenameNamespace = 1; /*Win32 */
+	for(k = 0; k < nameLength; k++) {
+		fileNameAttr->arrUnicodeFileName[k] = (uint8_t)fileName[k];
+	}
+	return offsetof(FILE_NAME_ATTR, arrUnicodeFileName) + 2*nameLength;
+}
+
+/**
+ * Starts a FILE record for recordNumber in record (MFT_RECORD_LENGTH bytes), with its
+ * header, $STANDARD_INFORMATION (giving it securityId) and $FILE_NAME attributes.
+ * Returns the offset at which the next attribute goes.
+ */
+uint16_t startFileRecord(char *record, uint32_t recordNumber, uint16_t flags, uint16_t sequence,
+						 char *fileName, uint64_t parentRecord, uint64_t fileTime, uint32_t securityId,
+						 uint64_t realSize, uint32_t bytesPerCluster) {
+	memset(record, 0, MFT_RECORD_LENGTH);
+
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	memcpy(header->fileSignature, "FILE", 4);
+	header->wFixupOffset = sizeof(NTFS_MFT_FILE_ENTRY_HEADER);
+	header->wFixupSize = MFT_RECORD_LENGTH/FIXUP_STRIDE + 1;
+	header->n64LogSeqNumber = fileTime >> 20;
+	header->wSequence = sequence;
+	header->wHardLinks = 1;
+	header->wFlags = flags;
+	header->dwAllLength = MFT_RECORD_LENGTH;
+	header->n64BaseMftRec = 0;
+	header->wNextAttrID = 2;
+	header->dwMFTRecNumber = recordNumber;
+
+	uint16_t offs = (header->wFixupOffset + 2*header->wFixupSize + 7) & ~7;
+	header->wAttribOffset = offs;
+
+	STD_INFORMATION stdInfo;
+	memset(&stdInfo, 0, sizeof(stdInfo));
+	stdInfo.fileCreateTime = stdInfo.fileAltTime = stdInfo.mftChangeTime = stdInfo.fileReadTime = fileTime;
+	stdInfo.filePermissions = ARCHIVE;
+	stdInfo.securityID2KONLY = securityId;
+	offs = addResidentAttribute(record, offs, STANDARD_INFORMATION, NULL, 0, &stdInfo, sizeof(stdInfo));
+
+	FILE_NAME_ATTR fileNameAttr;
+	uint32_t fileNameLength = buildFileName(&fileNameAttr, fileName, parentRecord, fileTime, realSize,
+											flags & DIRECTORY, bytesPerCluster);
+	return addResidentAttribute(record, offs, FILE_NAME, NULL, 1, &fileNameAttr, fileNameLength);
+}
+
+/**
+ * Ends a FILE record whose attributes fill it up to offs, having nAttributes of them, and
+ * puts it in its on-disk form.
+ */
+void finishFileRecord(char *record, uint16_t offs, uint16_t nAttributes, uint16_t sequence) {
+	NTFS_MFT_FILE_ENTRY_HEADER *header = (NTFS_MFT_FILE_ENTRY_HEADER *)record;
+	uint32_t endMarker = 0xFFFFFFFF;
+	memcpy(record+offs, &endMarker, sizeof(endMarker));
+	header->dwRecLength = offs + 8;
+	header->wNextAttrID = nAttributes;
+
+	protectRecord(record, MFT_RECORD_LENGTH, sequence);
+}
+
+/**
+ * Builds a complete FILE record for recordNumber into record (MFT_RECORD_LENGTH bytes) with
+ * $STANDARD_INFORMATION, $FILE_NAME and $DATA attributes, in its on-disk form.
+ * The $DATA attribute is resident, holding residentData, when nRuns is 0.
+ */
+void buildFileRecord(char *record, uint32_t recordNumber, uint16_t flags, uint16_t sequence,
+					 char *fileName, uint64_t parentRecord, uint64_t fileTime, uint32_t securityId,
+					 uint64_t realSize, char *residentData,
+					 uint64_t *lengths, uint64_t *lcns, int nRuns, uint32_t bytesPerCluster) {
+	uint16_t offs = startFileRecord(record, recordNumber, flags, sequence, fileName, parentRecord, fileTime,
+									securityId, realSize, bytesPerCluster);
+	if(nRuns == 0) {
+		offs = addResidentAttribute(record, offs, DATA, NULL, 2, residentData, realSize);
+	} else {
+		offs = addNonResidentAttribute(record, offs, DATA, NULL, 2, lengths, lcns, nRuns, realSize, bytesPerCluster);
+	}
+	finishFileRecord(record, offs, 3, sequence);
+}
+
+/**
+ * Fills records (nRecords*MFT_RECORD_LENGTH bytes) with a varied corpus of FILE records:
+ * names of 1 to 64 characters, mostly small resident files and non-resident files of up
+ * to SYN_MAX_RUNS runs, with some directories and unused records among them.
+ */
+void buildSyntheticCorpus(char *records, uint32_t nRecords, uint64_t seed) {
+	uint64_t state = seed ? seed : 1;
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-. ";
+	char fileName[65];
+	char residentData[512];
+	uint64_t lengths[SYN_MAX_RUNS], lcns[SYN_MAX_RUNS];
+	uint32_t i;
+
+	memset(residentData, 'x', sizeof(residentData));
+	for(i = 0; i < nRecords; i++) {
+		uint64_t r = syntheticRand(&state);
+		int nameLength = 1 + r % 64, k;
+		for(k = 0; k < nameLength; k++) {
+			fileName[k] = alphabet[syntheticRand(&state) % (sizeof(alphabet)-1)];
+		}
+		fileName[nameLength] = '\0';
+
+		uint16_t flags = IN_USE;
+		if((r >> 8) % 8 == 0) {
+			flags |= DIRECTORY;
+		} else if((r >> 8) % 8 == 1) {
+			flags = 0; /*Deleted */
+		}
+
+		int nRuns = 0;
+		uint64_t realSize = (r >> 16) % sizeof(residentData);
+		if((r >> 24) % 4 != 0) { /*Three in four files are non-resident */
+			nRuns = 1 + ((r >> 32) % 4 == 0 ? (r >> 40) % SYN_MAX_RUNS : 0);
+			realSize = 0;
+			for(k = 0; k < nRuns; k++) {
+				lengths[k] = 1 + syntheticRand(&state) % 256;
+				lcns[k] = 0x10000 + syntheticRand(&state) % 0x1000000; /*Runs land either side of the last */
+				realSize += lengths[k]*4096;
+			}
+		}
+
+		buildFileRecord(records + (uint64_t)i*MFT_RECORD_LENGTH, SYN_FIRST_USER_RECORD+i, flags,
+						1 + r % 0xFFFE, fileName, SYN_ROOT_RECORD,
+						130000000000000000ULL + (r % 10000000000000ULL), SYN_FIRST_SECURITY_ID + r % 4,
+						realSize, residentData, lengths, lcns, nRuns, 4096);
+	}
+}
+
+/**
+ * Writes count bytes of buff to fd at offset. Returns 0, or -1 after printing the error.
+ */
+int syntheticWrite(int fd, void *buff, size_t count, uint64_t offset) {
+	if(pwrite(fd, buff, count, offset) != (ssize_t)count) {
+		int errsv = errno;
+		printf("Failed to write synthetic image at offset %" PRIu64 ": %s.\n", offset, strerror(errsv));
+		return -1;
+	}
+	return 0;
+}
+
+/* Content of a deleted file left in unallocated space, for carving */
+typedef struct _SyntheticDeleted {
+	const char *header;
+	uint32_t headerLength;
+	const char *footer;		/*NULL if the file was cut short */
+	uint32_t footerLength;
+	uint32_t offset;		/*Bytes into the unallocated clusters */
+	uint32_t length;		/*Including header and footer */
+} SyntheticDeleted;
+
+static const SyntheticDeleted syntheticDeleted[] = {
+	{ "\xFF\xD8\xFF\xE0", 4, "\xFF\xD9", 2, 0, 10000 },
+	{ "\x89PNG\r\n\x1A\n", 8, "IEND\xAE\x42\x60\x82", 8, 8*SYN_BYTES_PER_CLUSTER, 20000 },
+	{ "%PDF-1.4", 8, "%%EOF", 5, 16*SYN_BYTES_PER_CLUSTER + 100, 30000 },
+	{ "GIF89a", 6, "\x00\x3B", 2, 32*SYN_BYTES_PER_CLUSTER + 512, 3000 },
+	{ "\xFF\xD8\xFF\xE1", 4, NULL, 0, 40*SYN_BYTES_PER_CLUSTER, 5000 }
+};
+
+/**
+ * Writes the deleted files of syntheticDeleted into the unallocated clusters starting at
+ * byte offset on fd. Their content is letters only, so holds no stray signatures.
+ * Returns 0, or -1 if a write failed.
+ */
+int writeSyntheticDeleted(int fd, uint64_t offset, uint64_t seed) {
+	uint64_t state = seed | 1;
+	char *content = malloc( SYN_CARVE_CLUSTERS*SYN_BYTES_PER_CLUSTER );
+	int i, ret = 0;
+	uint32_t k;
+	for(i = 0; i < sizeof(syntheticDeleted)/sizeof(SyntheticDeleted); i++) {
+		const SyntheticDeleted *deleted = &syntheticDeleted[i];
+		for(k = 0; k < deleted->length; k++) {
+			content[k] = 'a' + syntheticRand(&state) % 26;
+		}
+		memcpy(content, deleted->header, deleted->headerLength);
+		if(deleted->footer) {
+			memcpy(content + deleted->length - deleted->footerLength, deleted->footer, deleted->footerLength);
+		}
+		ret |= syntheticWrite(fd, content, deleted->length, offset + deleted->offset);
+	}
+	free(content);
+	return ret;
+}
+
+/**
+ * Marks count clusters from lcn as allocated in bitmap.
+ */
+void syntheticAllocate(uint8_t *bitmap, uint64_t lcn, uint64_t count) {
+	for(; count > 0; lcn++, count--) {
+		bitmap[lcn/8] |= 1 << (lcn%8);
+	}
+}
+
+/* An entry of the index of the synthetic root directory */
+typedef struct _SyntheticEntry {
+	uint32_t recordNumber;
+	char fileName[SYN_MAX_ENTRY_NAME+1];
+	uint64_t fileTime;
+	uint64_t realSize;
+	bool directory;
+} SyntheticEntry;
+
+/**
+ * Adds an entry for recordNumber, named fileName, to the nEntries in entries.
+ */
+void addSyntheticEntry(SyntheticEntry *entries, uint32_t *nEntries, uint32_t recordNumber, const char *fileName,
+					   uint64_t fileTime, uint64_t realSize, bool directory) {
+	SyntheticEntry *entry = &entries[(*nEntries)++];
+	entry->recordNumber = recordNumber;
+	snprintf(entry->fileName, sizeof(entry->fileName), "%s", fileName);
+	entry->fileTime = fileTime;
+	entry->realSize = realSize;
+	entry->directory = directory;
+}
+
+int compareSyntheticEntries(const void *a, const void *b) {
+	return strcasecmp(((const SyntheticEntry *)a)->fileName, ((const SyntheticEntry *)b)->fileName);
+}
+
+/**
+ * Writes the index entry of entry to dst, or the last entry of a node when entry is NULL,
+ * pointing to the sub-node at subnode unless it is negative. Returns its length.
+ */
+uint32_t writeIndexEntry(char *dst, SyntheticEntry *entry, int64_t subnode) {
+	INDEX_ENTRY_HEADER *header = (INDEX_ENTRY_HEADER *)dst;
+	uint32_t length = sizeof(INDEX_ENTRY_HEADER);
+	memset(header, 0, sizeof(INDEX_ENTRY_HEADER));
+	if(entry) {
+		FILE_NAME_ATTR fileNameAttr;
+		header->fileReference = entry->recordNumber | ((uint64_t)1 << 48);
+		header->keyLength = buildFileName(&fileNameAttr, entry->fileName, SYN_ROOT_RECORD, entry->fileTime,
+											 entry->realSize, entry->directory, SYN_BYTES_PER_CLUSTER);
+		memcpy(dst+length, &fileNameAttr, header->keyLength);
+		length = (length + header->keyLength + 7) & ~7;
+	} else {
+		header->flags |= INDEX_ENTRY_LAST;
+	}
+	if(subnode >= 0) {
+		header->flags |= INDEX_ENTRY_SUBNODE;
+		memcpy(dst+length, &subnode, sizeof(subnode));
+		length += sizeof(subnode);
+	}
+	header->entryLength = length;
+	return length;
+}
+
+/**
+ * Splits n entries among nChildren sub-nodes, with an entry between each two of them
+ * going to their parent. Returns the first entry, from 0, of sub-node child.
+ */
+uint32_t indexChildStart(uint32_t n, uint32_t nChildren, uint32_t child) {
+	uint32_t inChildren = n - (nChildren-1);
+	return (uint64_t)inChildren*child/nChildren + child;
+}
+
+/**
+ * Returns the number of sub-nodes the node of n entries is split into, or 0 if they fit in
+ * one INDX block. Every sub-node gets at least one entry.
+ */
+uint32_t indexChildren(uint32_t n) {
+	if(n <= SYN_ENTRIES_PER_BLOCK) {
+		return 0;
+	}
+	return SYN_ENTRIES_PER_BLOCK+1 < (n+1)/2 ? SYN_ENTRIES_PER_BLOCK+1 : (n+1)/2;
+}
+
+/**
+ * Returns the number of INDX blocks the B-tree of n entries takes.
+ */
+uint64_t countIndexBlocks(uint32_t n) {
+	uint32_t nChildren = indexChildren(n), c;
+	uint64_t blocks = 1;
+	for(c = 0; c < nChildren; c++) {
+		blocks += countIndexBlocks(indexChildStart(n, nChildren, c+1) - 1 - indexChildStart(n, nChildren, c));
+	}
+	return blocks;
+}
+
+/**
+ * Lays out the n sorted entries as a B-tree of INDX blocks in blocks, from block *nBlocks
+ * on, which is advanced past them. Returns the VCN of the block at the top.
+ */
+int64_t buildIndexBlocks(char *blocks, uint64_t *nBlocks, SyntheticEntry *entries, uint32_t n) {
+	int64_t vcn = (*nBlocks)++;
+	char *block = blocks + vcn*SYN_BYTES_PER_CLUSTER;
+	NTATTR_STANDARD_INDX_HEADER *header = (NTATTR_STANDARD_INDX_HEADER *)block;
+	INDEX_NODE_HEADER *node = (INDEX_NODE_HEADER *)(block + INDX_NODE_OFFSET);
+	uint32_t nChildren = indexChildren(n), offs = SYN_INDX_ENTRIES, c, i;
+
+	memset(block, 0, SYN_BYTES_PER_CLUSTER);
+	memcpy(header->magicNumber, "INDX", 4);
+	header->updateSeqOffs = SYN_INDX_FIXUP;
+	header->sizeOfUpdateSequenceNumberInWords = SYN_BYTES_PER_CLUSTER/FIXUP_STRIDE + 1;
+	header->vcnOfINDX = vcn;
+	if(nChildren == 0) {
+		for(i = 0; i < n; i++) {
+			offs += writeIndexEntry(block+offs, &entries[i], -1);
+		}
+		offs += writeIndexEntry(block+offs, NULL, -1);
+	} else {
+		node->flags = INDEX_NODE_LARGE;
+		for(c = 0; c < nChildren; c++) {
+			uint32_t first = indexChildStart(n, nChildren, c), last = indexChildStart(n, nChildren, c+1) - 1;
+			int64_t subnode = buildIndexBlocks(blocks, nBlocks, entries + first, last - first);
+			offs += writeIndexEntry(block+offs, c+1 < nChildren ? &entries[last] : NULL, subnode);
+		}
+	}
+	node->entriesOffset = SYN_INDX_ENTRIES - INDX_NODE_OFFSET;
+	node->indexLength = offs - INDX_NODE_OFFSET;
+	node->allocatedLength = SYN_BYTES_PER_CLUSTER - INDX_NODE_OFFSET;
+	protectRecord(block, SYN_BYTES_PER_CLUSTER, 1);
+	return vcn;
+}
+
+/**
+ * Appends to record, at offs, a $I30 index whose root node holds only its last entry,
+ * pointing to the INDX block at VCN top among the nBlocks at lcn (the directory is empty
+ * when nBlocks is 0). The bitmap of the blocks in use covers at most 8*SYN_INDEX_BITMAP of
+ * them. Returns the offset following the index, having counted its attributes in
+ * *nAttributes.
+ */
+uint16_t addDirectoryIndex(char *record, uint16_t offs, uint16_t *nAttributes, uint64_t lcn, uint64_t nBlocks,
+						   int64_t top) {
+	char root[sizeof(INDEX_ROOT_HEADER) + 2*sizeof(INDEX_ENTRY_HEADER)];
+	INDEX_ROOT_HEADER *rootHeader = (INDEX_ROOT_HEADER *)root;
+	uint8_t bitmap[SYN_INDEX_BITMAP];
+	uint64_t b, bitmapLength = (nBlocks+63)/64*8;
+
+	memset(root, 0, sizeof(root));
+	rootHeader->attrType = FILE_NAME;
+	rootHeader->collationRule = 1; /*File names */
+	rootHeader->indexBlockSize = SYN_BYTES_PER_CLUSTER;
+	rootHeader->clustersPerIndexBlock = 1;
+	rootHeader->node.entriesOffset = sizeof(INDEX_NODE_HEADER);
+	rootHeader->node.flags = nBlocks ? INDEX_NODE_LARGE : 0;
+	rootHeader->node.indexLength = sizeof(INDEX_NODE_HEADER) +
+								   writeIndexEntry(root + sizeof(INDEX_ROOT_HEADER), NULL, nBlocks ? top : -1);
+	rootHeader->node.allocatedLength = rootHeader->node.indexLength;
+	offs = addResidentAttribute(record, offs, INDEX_ROOT, "$I30", (*nAttributes)++, root,
+								offsetof(INDEX_ROOT_HEADER, node) + rootHeader->node.indexLength);
+	if(nBlocks == 0) {
+		return offs;
+	}
+	offs = addNonResidentAttribute(record, offs, INDEX_ALLOCATION, "$I30", (*nAttributes)++, &nBlocks, &lcn, 1,
+								   nBlocks*SYN_BYTES_PER_CLUSTER, SYN_BYTES_PER_CLUSTER);
+	memset(bitmap, 0, sizeof(bitmap));
+	for(b = 0; b < nBlocks && b < 8*sizeof(bitmap); b++) {
+		bitmap[b/8] |= 1 << b%8;
+	}
+	return addResidentAttribute(record, offs, BITMAP, "$I30", (*nAttributes)++, bitmap,
+								bitmapLength < sizeof(bitmap) ? bitmapLength : sizeof(bitmap));
+}
+
+/**
+ * Builds the FILE record of a directory into record, with the $I30 index of
+ * addDirectoryIndex(..), and puts it in its on-disk form.
+ */
+void buildDirectoryRecord(char *record, uint32_t recordNumber, uint16_t sequence, char *fileName,
+						  uint64_t parentRecord, uint64_t lcn, uint64_t nBlocks, int64_t top) {
+	uint16_t nAttributes = 2;
+	uint16_t offs = startFileRecord(record, recordNumber, IN_USE|DIRECTORY, sequence, fileName, parentRecord, 0,
+									SYN_FIRST_SECURITY_ID, 0, SYN_BYTES_PER_CLUSTER);
+	offs = addDirectoryIndex(record, offs, &nAttributes, lcn, nBlocks, top);
+	finishFileRecord(record, offs, nAttributes, sequence);
+}
+
+/**
+ * Writes the value of the $REPARSE_POINT of a mount point or symbolic link (of tag) to
+ * target, whose print name is target without its \??\ prefix, into dst. Returns its length.
+ */
+uint32_t buildReparsePoint(char *dst, uint32_t tag, const char *target, bool relative) {
+	REPARSE_POINT_HEADER *header = (REPARSE_POINT_HEADER *)dst;
+	LINK_REPARSE_DATA *link = (LINK_REPARSE_DATA *)(dst + sizeof(REPARSE_POINT_HEADER));
+	uint32_t pathOffset = tag == IO_REPARSE_TAG_SYMLINK ? sizeof(LINK_REPARSE_DATA) : offsetof(LINK_REPARSE_DATA, flags);
+	uint16_t *path = (uint16_t *)((char *)link + pathOffset);
+	const char *printName = strncmp(target, "\\??\\", 4) == 0 ? target + 4 : target;
+	uint32_t k, length = strlen(target), printLength = strlen(printName);
+
+	header->tag = tag;
+	header->reserved = 0;
+	link->substituteNameOffset = 0;
+	link->substituteNameLength = 2*length;
+	link->printNameOffset = 2*length;
+	link->printNameLength = 2*printLength;
+	if(tag == IO_REPARSE_TAG_SYMLINK) {
+		link->flags = relative ? SYMLINK_FLAG_RELATIVE : 0;
+	}
+	for(k = 0; k < length; k++) {
+		path[k] = (uint8_t)target[k];
+	}
+	for(k = 0; k < printLength; k++) {
+		path[length + k] = (uint8_t)printName[k];
+	}
+	header->dataLength = pathOffset + 2*(length + printLength);
+	return sizeof(REPARSE_POINT_HEADER) + header->dataLength;
+}
+
+/**
+ * Writes the object ID given to the file at recordNumber to guid (GUID_LENGTH bytes).
+ */
+void syntheticObjectId(uint32_t recordNumber, uint8_t *guid) {
+	uint64_t state = 0x0B1EC71DULL ^ ((uint64_t)recordNumber << 32);
+	uint64_t low = syntheticRand(&state), high = syntheticRand(&state);
+	memcpy(guid, &low, sizeof(low));
+	memcpy(guid + sizeof(low), &high, sizeof(high));
+}
+
+int compareSyntheticObjectIds(const void *a, const void *b) {
+	return memcmp(a, b, GUID_LENGTH);
+}
+
+/**
+ * Builds the FILE record of entry e of syntheticTree into record, as recordNumber in
+ * directory parentRecord: the directory Users with its index at lcn (nBlocks, top as for
+ * addDirectoryIndex(..)), a small file, or a link. A mount point is an empty directory
+ * and a symbolic link an empty file, each with its $REPARSE_POINT. The first
+ * SYN_OBJECT_IDS have an $OBJECT_ID.
+ */
+void buildTreeRecord(char *record, uint32_t e, uint32_t recordNumber, uint64_t parentRecord,
+					 uint64_t lcn, uint64_t nBlocks, int64_t top) {
+	const SyntheticTreeEntry *entry = &syntheticTree[e];
+	bool directory = e == 0 || entry->tag == IO_REPARSE_TAG_MOUNT_POINT;
+	char reparse[512];	/*The targets are short */
+	uint16_t nAttributes = 2;
+	uint16_t offs = startFileRecord(record, recordNumber, directory ? IN_USE|DIRECTORY : IN_USE, 1, (char *)entry->name,
+									parentRecord, 0, SYN_FIRST_SECURITY_ID, e == 1 ? 6 : 0, SYN_BYTES_PER_CLUSTER);
+	if(e < SYN_OBJECT_IDS) {
+		uint8_t guid[GUID_LENGTH];
+		syntheticObjectId(recordNumber, guid);
+		offs = addResidentAttribute(record, offs, OBJECT_ID, NULL, nAttributes++, guid, GUID_LENGTH);
+	}
+	if(directory) {
+		offs = addDirectoryIndex(record, offs, &nAttributes, lcn, e == 0 ? nBlocks : 0, top);
+	} else {
+		offs = addResidentAttribute(record, offs, DATA, NULL, nAttributes++, "notes\n", e == 1 ? 6 : 0);
+	}
+	if(entry->tag) {
+		offs = addResidentAttribute(record, offs, REPARSE_POINT, NULL, nAttributes++, reparse,
+									buildReparsePoint(reparse, entry->tag, entry->target, entry->relative));
+	}
+	finishFileRecord(record, offs, nAttributes, 1);
+}
+
+/**
+ * Returns the security ID given to file i of a synthetic image: one in five shares the
+ * descriptor of the metafiles, the rest cycle through the others.
+ */
+uint32_t syntheticSecurityId(uint32_t i) {
+	return SYN_FIRST_SECURITY_ID + (i % 5 == 0 ? 0 : 1 + i % (SYN_DESCRIPTORS-1));
+}
+
+/**
+ * Writes SID s of syntheticSids to dst. Returns its length.
+ */
+uint32_t writeSyntheticSid(char *dst, int s) {
+	SID_HEADER *sid = (SID_HEADER *)dst;
+	uint32_t k;
+	memset(sid, 0, sizeof(SID_HEADER));
+	sid->revision = 1;
+	sid->subAuthorityCount = syntheticSids[s][1];
+	sid->authority[5] = syntheticSids[s][0];
+	for(k = 0; k < sid->subAuthorityCount; k++) {
+		memcpy(dst + sizeof(SID_HEADER) + 4*k, &syntheticSids[s][2+k], sizeof(uint32_t));
+	}
+	return sizeof(SID_HEADER) + 4*sid->subAuthorityCount;
+}
+
+/**
+ * Writes descriptor d of syntheticDescriptors to dst in self-relative form: header, owner,
+ * group, then the DACL. Returns its length.
+ */
+uint32_t writeSyntheticDescriptor(char *dst, int d) {
+	SECURITY_DESCRIPTOR_HEADER *header = (SECURITY_DESCRIPTOR_HEADER *)dst;
+	uint32_t length = sizeof(SECURITY_DESCRIPTOR_HEADER);
+	int k;
+	memset(header, 0, sizeof(SECURITY_DESCRIPTOR_HEADER));
+	header->revision = 1;
+	header->control = SE_SELF_RELATIVE;
+	header->ownerOffset = length;
+	length += writeSyntheticSid(dst + length, syntheticDescriptors[d][0]);
+	header->groupOffset = length;
+	length += writeSyntheticSid(dst + length, syntheticDescriptors[d][1]);
+	if(syntheticDescriptors[d][2] == 0) {
+		return length;
+	}
+
+	ACL_HEADER *acl = (ACL_HEADER *)(dst + length);
+	header->control |= SE_DACL_PRESENT;
+	header->daclOffset = length;
+	memset(acl, 0, sizeof(ACL_HEADER));
+	acl->revision = 2;
+	acl->size = sizeof(ACL_HEADER);
+	for(k = 2; k < 5 && syntheticDescriptors[d][k]; k++) {
+		ACE_HEADER *ace = (ACE_HEADER *)((char *)acl + acl->size);
+		uint32_t mask = 0x1F01FF;	/*Full control */
+		int8_t sid = syntheticDescriptors[d][k];
+		ace->type = sid < 0 ? ACE_ACCESS_DENIED : ACE_ACCESS_ALLOWED;
+		ace->flags = 0;
+		memcpy((char *)ace + sizeof(ACE_HEADER), &mask, sizeof(mask));
+		ace->size = sizeof(ACE_HEADER) + sizeof(mask) +
+					writeSyntheticSid((char *)ace + sizeof(ACE_HEADER) + sizeof(mask), (sid < 0 ? -sid : sid) - 1);
+		acl->size += ace->size;
+		acl->aceCount++;
+	}
+	return length + acl->size;
+}
+
+/**
+ * Builds the $Secure record into record and the $SDS stream it points to, at lcn, into sds
+ * (a cluster): one entry per synthetic descriptor, each listed in $SII, an index small
+ * enough to stay in its root. Returns the length of $SDS.
+ */
+uint32_t buildSecureRecord(char *record, char *sds, uint64_t lcn) {
+	char root[sizeof(INDEX_ROOT_HEADER) + SYN_DESCRIPTORS*(sizeof(INDEX_ENTRY_HEADER) + 24) + sizeof(INDEX_ENTRY_HEADER)];
+	INDEX_ROOT_HEADER *rootHeader = (INDEX_ROOT_HEADER *)root;
+	uint32_t d, sdsLength = 0, rootLength = sizeof(INDEX_ROOT_HEADER);
+	uint64_t one = 1;
+	uint16_t offs = startFileRecord(record, SYN_SECURE_RECORD, IN_USE, 1, (char *)syntheticMetafiles[SYN_SECURE_RECORD],
+									SYN_ROOT_RECORD, 0, SYN_FIRST_SECURITY_ID, 0, SYN_BYTES_PER_CLUSTER);
+
+	memset(sds, 0, SYN_BYTES_PER_CLUSTER);
+	memset(root, 0, sizeof(root));
+	rootHeader->attrType = 0;			/*A view index */
+	rootHeader->collationRule = 0x10;	/*Unsigned 32 bit keys */
+	rootHeader->indexBlockSize = SYN_BYTES_PER_CLUSTER;
+	rootHeader->clustersPerIndexBlock = 1;
+	rootHeader->node.entriesOffset = sizeof(INDEX_NODE_HEADER);
+	for(d = 0; d < SYN_DESCRIPTORS; d++) {
+		SDS_ENTRY_HEADER *sdsEntry = (SDS_ENTRY_HEADER *)(sds + sdsLength);
+		uint32_t w, word, length = writeSyntheticDescriptor(sds + sdsLength + sizeof(SDS_ENTRY_HEADER), d);
+		sdsEntry->hash = 0;
+		for(w = 0; w < length/4; w++) {
+			memcpy(&word, sds + sdsLength + sizeof(SDS_ENTRY_HEADER) + 4*w, sizeof(word));
+			sdsEntry->hash = word + ((sdsEntry->hash >> 29) | (sdsEntry->hash << 3));
+		}
+		sdsEntry->securityId = SYN_FIRST_SECURITY_ID + d;
+		sdsEntry->offset = sdsLength;
+		sdsEntry->length = sizeof(SDS_ENTRY_HEADER) + length;
+
+		/*Keyed by security ID, with a copy of the header of the $SDS entry as data */
+		INDEX_ENTRY_HEADER *entry = (INDEX_ENTRY_HEADER *)(root + rootLength);
+		entry->data.dataOffset = sizeof(INDEX_ENTRY_HEADER) + sizeof(uint32_t);
+		entry->data.dataLength = sizeof(SDS_ENTRY_HEADER);
+		entry->keyLength = sizeof(uint32_t);
+		entry->entryLength = (entry->data.dataOffset + sizeof(SDS_ENTRY_HEADER) + 7) & ~7;
+		memcpy(root + rootLength + sizeof(INDEX_ENTRY_HEADER), &sdsEntry->securityId, sizeof(uint32_t));
+		memcpy(root + rootLength + entry->data.dataOffset, sdsEntry, sizeof(SDS_ENTRY_HEADER));
+		rootLength += entry->entryLength;
+		sdsLength = (sdsLength + sdsEntry->length + SDS_ALIGNMENT-1) & ~(SDS_ALIGNMENT-1);
+	}
+	((INDEX_ENTRY_HEADER *)(root + rootLength))->entryLength = sizeof(INDEX_ENTRY_HEADER);
+	((INDEX_ENTRY_HEADER *)(root + rootLength))->flags = INDEX_ENTRY_LAST;
+	rootLength += sizeof(INDEX_ENTRY_HEADER);
+	rootHeader->node.indexLength = rootLength - offsetof(INDEX_ROOT_HEADER, node);
+	rootHeader->node.allocatedLength = rootHeader->node.indexLength;
+
+	offs = addNonResidentAttribute(record, offs, DATA, "$SDS", 2, &one, &lcn, 1, sdsLength, SYN_BYTES_PER_CLUSTER);
+	offs = addResidentAttribute(record, offs, INDEX_ROOT, "$SII", 3, root, rootLength);
+	finishFileRecord(record, offs, 4, 1);
+	return sdsLength;
+}
+
+/**
+ * Builds the record of $Extend\$ObjId, recordNumber, into record. Its $O index, small
+ * enough to stay in its root, lists the object IDs of syntheticTree from treeRecord on but
+ * the last, and a stale one of deleted record SYN_FIRST_DELETED_RECORD+1.
+ */
+void buildObjIdRecord(char *record, uint32_t recordNumber, uint32_t treeRecord) {
+	char root[sizeof(INDEX_ROOT_HEADER) + SYN_OBJECT_IDS*(sizeof(INDEX_ENTRY_HEADER) + sizeof(OBJECT_ID_INDEX_DATA) +
+					GUID_LENGTH) + sizeof(INDEX_ENTRY_HEADER)];
+	INDEX_ROOT_HEADER *rootHeader = (INDEX_ROOT_HEADER *)root;
+	OBJECT_ID_INDEX_DATA indexed[SYN_OBJECT_IDS];
+	uint8_t guids[SYN_OBJECT_IDS][GUID_LENGTH + sizeof(uint32_t)];	/*Followed by the record number, to sort */
+	uint32_t e, rootLength = sizeof(INDEX_ROOT_HEADER);
+	uint16_t offs = startFileRecord(record, recordNumber, IN_USE, 1, (char *)syntheticExtend[0], SYN_EXTEND_RECORD, 0,
+									SYN_FIRST_SECURITY_ID, 0, SYN_BYTES_PER_CLUSTER);
+
+	for(e = 0; e < SYN_OBJECT_IDS; e++) {
+		uint32_t indexedRecord = e+1 < SYN_OBJECT_IDS ? treeRecord + e : SYN_FIRST_DELETED_RECORD+1;
+		syntheticObjectId(indexedRecord, guids[e]);
+		memcpy(guids[e] + GUID_LENGTH, &indexedRecord, sizeof(uint32_t));
+	}
+	qsort(guids, SYN_OBJECT_IDS, sizeof(guids[0]), compareSyntheticObjectIds);
+
+	memset(root, 0, sizeof(root));
+	memset(indexed, 0, sizeof(indexed));
+	rootHeader->attrType = 0;			/*A view index */
+	rootHeader->collationRule = 0x13;	/*Arrays of unsigned 32 bit values */
+	rootHeader->indexBlockSize = SYN_BYTES_PER_CLUSTER;
+	rootHeader->clustersPerIndexBlock = 1;
+	rootHeader->node.entriesOffset = sizeof(INDEX_NODE_HEADER);
+	for(e = 0; e < SYN_OBJECT_IDS; e++) {
+		uint32_t indexedRecord;
+		memcpy(&indexedRecord, guids[e] + GUID_LENGTH, sizeof(uint32_t));
+		indexed[e].fileReference = indexedRecord | ((uint64_t)1 << 48);
+
+		/*Keyed by GUID, with the file reference and birth IDs as data */
+		INDEX_ENTRY_HEADER *entry = (INDEX_ENTRY_HEADER *)(root + rootLength);
+		entry->data.dataOffset = sizeof(INDEX_ENTRY_HEADER) + GUID_LENGTH;
+		entry->data.dataLength = sizeof(OBJECT_ID_INDEX_DATA);
+		entry->keyLength = GUID_LENGTH;
+		entry->entryLength = (entry->data.dataOffset + sizeof(OBJECT_ID_INDEX_DATA) + 7) & ~7;
+		memcpy(root + rootLength + sizeof(INDEX_ENTRY_HEADER), guids[e], GUID_LENGTH);
+		memcpy(root + rootLength + entry->data.dataOffset, &indexed[e], sizeof(OBJECT_ID_INDEX_DATA));
+		rootLength += entry->entryLength;
+	}
+	((INDEX_ENTRY_HEADER *)(root + rootLength))->entryLength = sizeof(INDEX_ENTRY_HEADER);
+	((INDEX_ENTRY_HEADER *)(root + rootLength))->flags = INDEX_ENTRY_LAST;
+	rootLength += sizeof(INDEX_ENTRY_HEADER);
+	rootHeader->node.indexLength = rootLength - offsetof(INDEX_ROOT_HEADER, node);
+	rootHeader->node.allocatedLength = rootHeader->node.indexLength;
+
+	offs = addResidentAttribute(record, offs, INDEX_ROOT, "$O", 2, root, rootLength);
+	finishFileRecord(record, offs, 3, 1);
+}
+
+/**
+ * Writes a synthetic disk image to path: an MBR with one NTFS partition whose MFT holds
+ * the metafile records and nFiles files in the root directory. Each file has
+ * clustersPerFile clusters of seeded content (resident content if 0), split into
+ * fragmentsPerFile runs which are interleaved with those of the other files. Every second
+ * file has its runs laid out backwards, so its run offsets are negative.
+ * $Bitmap marks the clusters in use; the unallocated clusters after it hold the content
+ * of deleted files (syntheticDeleted) for carving, and reserved records 12 to 15 hold
+ * deleted records over some of it for recovery. The files in use are indexed by name in the
+ * $I30 index of the root directory, a B-tree of INDX blocks after those clusters, which
+ * are followed by the $SDS stream of $Secure with the descriptors of the files. After the
+ * files, syntheticTree adds a directory Users, with an index of its own, and links, some
+ * with object IDs; then come the metafiles of $Extend, indexed by it, $ObjId listing those.
+ *
+ * Returns 0, or -1 if the image could not be written.
+ */
+int writeSyntheticImage(char *path, uint32_t nFiles, uint32_t clustersPerFile,
+						uint32_t fragmentsPerFile, uint64_t seed) {
+	uint32_t nRecords = SYN_FIRST_USER_RECORD + nFiles + SYN_TREE_RECORDS + SYN_EXTEND_RECORDS;
+	uint32_t treeRecord = SYN_FIRST_USER_RECORD + nFiles;	/*First of syntheticTree */
+	uint32_t extendRecord = treeRecord + SYN_TREE_RECORDS;	/*First of syntheticExtend */
+	uint64_t mftClusters = ((uint64_t)nRecords*MFT_RECORD_LENGTH + SYN_BYTES_PER_CLUSTER-1) / SYN_BYTES_PER_CLUSTER;
+	uint64_t dataStartLCN = SYN_MFT_LCN + mftClusters + 16;
+	uint32_t fragments = fragmentsPerFile < 1 ? 1 : fragmentsPerFile;
+	if(clustersPerFile > 0 && fragments > clustersPerFile) {
+		fragments = clustersPerFile;
+	}
+	if(fragments > SYN_MAX_RUNS) {
+		fragments = SYN_MAX_RUNS;
+	}
+	uint64_t slotClusters = clustersPerFile ? (clustersPerFile + fragments-1) / fragments : 0;
+	if(slotClusters > 0) { /*No empty runs at the end */
+		fragments = (clustersPerFile + slotClusters-1) / slotClusters;
+	}
+	uint32_t nEntries = 0;
+	uint64_t indexBlocks = countIndexBlocks(SYN_FIRST_DELETED_RECORD + nFiles + SYN_TREE_RECORDS - SYN_USERS_CHILDREN);
+	uint64_t usersBlocks = countIndexBlocks(SYN_USERS_CHILDREN);
+	uint64_t extendBlocks = countIndexBlocks(SYN_EXTEND_RECORDS);
+	uint64_t bitmapLCN = dataStartLCN + slotClusters*fragments*nFiles + 16;
+	uint64_t bitmapClusters = 1, totalClusters = 0;
+	while(totalClusters == 0 || (totalClusters+7)/8 > bitmapClusters*SYN_BYTES_PER_CLUSTER) {
+		if(totalClusters) {
+			bitmapClusters++;
+		}
+		totalClusters = bitmapLCN + bitmapClusters + 8 + SYN_CARVE_CLUSTERS + 8 + indexBlocks + 1 + usersBlocks + extendBlocks + 8;
+	}
+	uint64_t carveLCN = bitmapLCN + bitmapClusters + 8;
+	uint64_t indexLCN = carveLCN + SYN_CARVE_CLUSTERS + 8;
+	uint64_t sdsLCN = indexLCN + indexBlocks;
+	uint64_t usersLCN = sdsLCN + 1;
+	uint64_t extendLCN = usersLCN + usersBlocks;
+	SyntheticEntry *entries = calloc( SYN_FIRST_DELETED_RECORD + nFiles + SYN_TREE_RECORDS, sizeof(SyntheticEntry) );
+	uint8_t *bitmap = calloc( 1, bitmapClusters*SYN_BYTES_PER_CLUSTER );
+	uint64_t partitionOffset = (uint64_t)SYN_PARTITION_SECTOR*SYN_BYTES_PER_SECTOR;
+	uint64_t lengths[SYN_MAX_RUNS], lcns[SYN_MAX_RUNS];
+	char record[MFT_RECORD_LENGTH];
+	char cluster[SYN_BYTES_PER_CLUSTER];
+	char residentData[256];
+	uint32_t i, j, k;
+	int fd, ret = 0;
+
+	if((fd = open(path, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+		int errsv = errno;
+		printf("Failed to create synthetic image %s: %s.\n", path, strerror(errsv));
+		free(bitmap);
+		free(entries);
+		return -1;
+	}
+	if(ftruncate(fd, partitionOffset + totalClusters*SYN_BYTES_PER_CLUSTER) == -1) {
+		int errsv = errno;
+		printf("Failed to size synthetic image %s: %s.\n", path, strerror(errsv));
+		free(bitmap);
+		free(entries);
+		close(fd);
+		return -1;
+	}
+	syntheticAllocate(bitmap, 0, 1);	/*Boot sector */
+	syntheticAllocate(bitmap, SYN_MFT_LCN, mftClusters);
+	syntheticAllocate(bitmap, bitmapLCN, bitmapClusters);
+	syntheticAllocate(bitmap, indexLCN, indexBlocks);
+	syntheticAllocate(bitmap, sdsLCN, 1);
+	syntheticAllocate(bitmap, usersLCN, usersBlocks);
+	syntheticAllocate(bitmap, extendLCN, extendBlocks);
+
+	/*------------------------ MBR with a single NTFS partition ------------------------*/
+	char mbr[SYN_BYTES_PER_SECTOR];
+	PARTITION part;
+	memset(mbr, 0, sizeof(mbr));
+	memset(&part, 0, sizeof(part));
+	part.chBootInd = 0x80;
+	part.chType = 0x07;
+	part.dwRelativeSector = SYN_PARTITION_SECTOR;
+	part.dwNumberSector = totalClusters*SYN_SECTORS_PER_CLUSTER;
+	memcpy(mbr+0x1BE, &part, sizeof(part));
+	mbr[510] = 0x55;
+	mbr[511] = (char)0xAA;
+	ret |= syntheticWrite(fd, mbr, sizeof(mbr), 0);
+
+	/*----------------------------------- Boot sector ----------------------------------*/
+	NTFS_BOOT_SECTOR boot;
+	memset(&boot, 0, sizeof(boot));
+	memcpy(boot.chJumpInstruction, "\xEB\x52\x90", 3);
+	memcpy(boot.chOemID, "NTFS", 4);
+	memcpy(boot.chDummy, "    ", 4);
+	boot.bpb.wBytesPerSec = SYN_BYTES_PER_SECTOR;
+	boot.bpb.uchSecPerClust = SYN_SECTORS_PER_CLUSTER;
+	boot.bpb.uchMediaDescriptor = 0xF8;
+	boot.bpb.dwHiddenSec = SYN_PARTITION_SECTOR;
+	boot.bpb.n64TotalSec = totalClusters*SYN_SECTORS_PER_CLUSTER - 1;
+	boot.bpb.n64MFTLogicalClustNum = SYN_MFT_LCN;
+	boot.bpb.n64MFTMirrLoficalClustNum = 2;
+	boot.bpb.nClustPerMFTRecord = -10;	/*2^10 byte records */
+	boot.bpb.nClustPerIndexRecord = 1;
+	boot.bpb.n64VolumeSerialNum = seed;
+	boot.wSecMark = 0xAA55;
+	ret |= syntheticWrite(fd, &boot, sizeof(boot), partitionOffset);
+
+	/*------------------------------- Metafile records ---------------------------------*/
+	for(i = 0; i < SYN_FIRST_USER_RECORD; i++) {
+		uint16_t flags = i < 12 ? IN_USE : 0;
+		if(i < SYN_FIRST_DELETED_RECORD) {
+			addSyntheticEntry(entries, &nEntries, i, syntheticMetafiles[i], 0, i == 0 ? (uint64_t)nRecords*MFT_RECORD_LENGTH :
+							  i == SYN_BITMAP_RECORD ? (totalClusters+7)/8 : 0, i == SYN_ROOT_RECORD || i == SYN_EXTEND_RECORD);
+		}
+		if(i == SYN_ROOT_RECORD || i == SYN_EXTEND_RECORD) {
+			continue;	/*Written once its index is complete */
+		}
+		if(i == 0) { /*$MFT describes itself */
+			lengths[0] = mftClusters;
+			lcns[0] = SYN_MFT_LCN;
+			buildFileRecord(record, 0, flags, 1, (char *)syntheticMetafiles[0], SYN_ROOT_RECORD, 0, SYN_FIRST_SECURITY_ID,
+							(uint64_t)nRecords*MFT_RECORD_LENGTH, NULL, lengths, lcns, 1, SYN_BYTES_PER_CLUSTER);
+		} else if(i == SYN_BITMAP_RECORD) {
+			lengths[0] = bitmapClusters;
+			lcns[0] = bitmapLCN;
+			buildFileRecord(record, i, flags, 1, (char *)syntheticMetafiles[i], SYN_ROOT_RECORD, 0, SYN_FIRST_SECURITY_ID,
+							(totalClusters+7)/8, NULL, lengths, lcns, 1, SYN_BYTES_PER_CLUSTER);
+		} else if(i == SYN_SECURE_RECORD) {
+			buildSecureRecord(record, cluster, sdsLCN);
+			ret |= syntheticWrite(fd, cluster, SYN_BYTES_PER_CLUSTER, partitionOffset + sdsLCN*SYN_BYTES_PER_CLUSTER);
+		} else if(i >= SYN_FIRST_DELETED_RECORD) {
+			/*Deleted records: a directory, a file whose clusters are all free, one with some
+			  taken by the MFT since and one, in the deleted directory, with all of them taken */
+			const SyntheticDeleted *deleted = &syntheticDeleted[i > SYN_FIRST_DELETED_RECORD ? i - SYN_FIRST_DELETED_RECORD-1 : 0];
+			uint64_t parent = SYN_ROOT_RECORD, realSize = deleted->length;
+			int nRuns = 1;
+			lengths[0] = (deleted->length + SYN_BYTES_PER_CLUSTER-1) / SYN_BYTES_PER_CLUSTER;
+			lcns[0] = carveLCN + deleted->offset/SYN_BYTES_PER_CLUSTER;
+			if(i == SYN_FIRST_DELETED_RECORD) {
+				flags = DIRECTORY;
+				realSize = 0;
+				nRuns = 0;
+			} else if(i == SYN_FIRST_DELETED_RECORD+2) {	/*Its last two clusters */
+				lengths[1] = 2;
+				lcns[1] = SYN_MFT_LCN;
+				lengths[0] -= 2;
+				nRuns = 2;
+			} else if(i == SYN_FIRST_DELETED_RECORD+3) {
+				parent = SYN_FIRST_DELETED_RECORD;
+				lcns[0] = SYN_MFT_LCN;
+				lengths[0] = 1;
+				realSize = SYN_BYTES_PER_CLUSTER;
+			}
+			buildFileRecord(record, i, flags, 2, (char *)syntheticMetafiles[i], parent, 0, SYN_FIRST_SECURITY_ID,
+							realSize, "", lengths, lcns, nRuns, SYN_BYTES_PER_CLUSTER);
+		} else {
+			buildFileRecord(record, i, flags, 1, (char *)syntheticMetafiles[i], SYN_ROOT_RECORD, 0, SYN_FIRST_SECURITY_ID,
+							0, NULL, NULL, NULL, 0, SYN_BYTES_PER_CLUSTER);
+		}
+		ret |= syntheticWrite(fd, record, MFT_RECORD_LENGTH,
+							  partitionOffset + SYN_MFT_LCN*SYN_BYTES_PER_CLUSTER + (uint64_t)i*MFT_RECORD_LENGTH);
+	}
+
+	/*------------------------------ File records and data -----------------------------*/
+	for(i = 0; i < nFiles && ret == 0; i++) {
+		uint32_t recordNumber = SYN_FIRST_USER_RECORD + i;
+		uint64_t state = (seed ^ ((uint64_t)recordNumber << 32)) | 1;
+		uint64_t fileTime = 130000000000000000ULL + syntheticRand(&state) % 10000000000000ULL;
+		uint64_t realSize = 0;
+		char fileName[32];
+		snprintf(fileName, sizeof(fileName), "file%06u.bin", i);
+
+		if(clustersPerFile == 0) {
+			realSize = syntheticRand(&state) % sizeof(residentData);
+			for(k = 0; k < realSize; k++) {
+				residentData[k] = syntheticRand(&state);
+			}
+		} else {
+			uint64_t remaining = clustersPerFile;
+			for(j = 0; j < fragments; j++) {
+				uint32_t slot = (i % 2) ? fragments-1-j : j;
+				lengths[j] = remaining < slotClusters ? remaining : slotClusters;
+				lcns[j] = dataStartLCN + ((uint64_t)slot*nFiles + i)*slotClusters;
+				remaining -= lengths[j];
+				syntheticAllocate(bitmap, lcns[j], lengths[j]);
+				for(k = 0; k < lengths[j]; k++) {
+					uint64_t *words = (uint64_t *)cluster;
+					uint32_t w;
+					for(w = 0; w < SYN_BYTES_PER_CLUSTER/sizeof(uint64_t); w++) {
+						words[w] = syntheticRand(&state);
+					}
+					ret |= syntheticWrite(fd, cluster, SYN_BYTES_PER_CLUSTER,
+										  partitionOffset + (lcns[j]+k)*SYN_BYTES_PER_CLUSTER);
+				}
+			}
+			/*Leave the last cluster part used */
+			realSize = (uint64_t)clustersPerFile*SYN_BYTES_PER_CLUSTER - recordNumber % SYN_BYTES_PER_CLUSTER;
+		}
+		addSyntheticEntry(entries, &nEntries, recordNumber, fileName, fileTime, realSize, false);
+		buildFileRecord(record, recordNumber, IN_USE, 1, fileName, SYN_ROOT_RECORD, fileTime,
+						syntheticSecurityId(i), realSize, residentData, lengths, lcns, clustersPerFile ? fragments : 0,
+						SYN_BYTES_PER_CLUSTER);
+		ret |= syntheticWrite(fd, record, MFT_RECORD_LENGTH,
+							  partitionOffset + SYN_MFT_LCN*SYN_BYTES_PER_CLUSTER + (uint64_t)recordNumber*MFT_RECORD_LENGTH);
+	}
+
+	/*------------------------ Users, its links and the junction to it ------------------------*/
+	if(ret == 0) {
+		SyntheticEntry users[SYN_USERS_CHILDREN];
+		char *blocks = calloc( usersBlocks, SYN_BYTES_PER_CLUSTER );
+		uint64_t nBlocks = 0;
+		uint32_t nUsers = 0;
+		for(i = 1; i <= SYN_USERS_CHILDREN; i++) {
+			addSyntheticEntry(users, &nUsers, treeRecord + i, syntheticTree[i].name, 0, i == 1 ? 6 : 0,
+							  syntheticTree[i].tag == IO_REPARSE_TAG_MOUNT_POINT);
+		}
+		qsort(users, nUsers, sizeof(SyntheticEntry), compareSyntheticEntries);
+		int64_t top = buildIndexBlocks(blocks, &nBlocks, users, nUsers);
+		ret |= syntheticWrite(fd, blocks, nBlocks*SYN_BYTES_PER_CLUSTER, partitionOffset + usersLCN*SYN_BYTES_PER_CLUSTER);
+		for(i = 0; i < SYN_TREE_RECORDS; i++) {
+			uint64_t parent = i == 0 || i > SYN_USERS_CHILDREN ? SYN_ROOT_RECORD : treeRecord;
+			if(parent == SYN_ROOT_RECORD) {
+				addSyntheticEntry(entries, &nEntries, treeRecord + i, syntheticTree[i].name, 0, 0, true);
+			}
+			buildTreeRecord(record, i, treeRecord + i, parent, usersLCN, nBlocks, top);
+			ret |= syntheticWrite(fd, record, MFT_RECORD_LENGTH,
+								  partitionOffset + SYN_MFT_LCN*SYN_BYTES_PER_CLUSTER + (uint64_t)(treeRecord + i)*MFT_RECORD_LENGTH);
+		}
+		free(blocks);
+	}
+
+	/*--------------------------- $Extend and the metafiles in it ---------------------------*/
+	if(ret == 0) {
+		SyntheticEntry extend[SYN_EXTEND_RECORDS];
+		char *blocks = calloc( extendBlocks, SYN_BYTES_PER_CLUSTER );
+		uint64_t nBlocks = 0;
+		uint32_t nExtend = 0;
+		for(i = 0; i < SYN_EXTEND_RECORDS; i++) {
+			addSyntheticEntry(extend, &nExtend, extendRecord + i, syntheticExtend[i], 0, 0, false);
+			if(i == 0) {
+				buildObjIdRecord(record, extendRecord, treeRecord);
+			} else {
+				buildFileRecord(record, extendRecord + i, IN_USE, 1, (char *)syntheticExtend[i], SYN_EXTEND_RECORD, 0,
+								SYN_FIRST_SECURITY_ID, 0, NULL, NULL, NULL, 0, SYN_BYTES_PER_CLUSTER);
+			}
+			ret |= syntheticWrite(fd, record, MFT_RECORD_LENGTH,
+								  partitionOffset + SYN_MFT_LCN*SYN_BYTES_PER_CLUSTER + (uint64_t)(extendRecord + i)*MFT_RECORD_LENGTH);
+		}
+		qsort(extend, nExtend, sizeof(SyntheticEntry), compareSyntheticEntries);
+		int64_t top = buildIndexBlocks(blocks, &nBlocks, extend, nExtend);
+		ret |= syntheticWrite(fd, blocks, nBlocks*SYN_BYTES_PER_CLUSTER, partitionOffset + extendLCN*SYN_BYTES_PER_CLUSTER);
+		buildDirectoryRecord(record, SYN_EXTEND_RECORD, 1, (char *)syntheticMetafiles[SYN_EXTEND_RECORD], SYN_ROOT_RECORD,
+							 extendLCN, nBlocks, top);
+		ret |= syntheticWrite(fd, record, MFT_RECORD_LENGTH,
+							  partitionOffset + SYN_MFT_LCN*SYN_BYTES_PER_CLUSTER + (uint64_t)SYN_EXTEND_RECORD*MFT_RECORD_LENGTH);
+		free(blocks);
+	}
+
+	/*-------------------- The root directory and its index, sorted by name ------------------*/
+	if(ret == 0) {
+		char *blocks = calloc( indexBlocks ? indexBlocks : 1, SYN_BYTES_PER_CLUSTER );
+		uint64_t nBlocks = 0;
+		qsort(entries, nEntries, sizeof(SyntheticEntry), compareSyntheticEntries);
+		int64_t top = buildIndexBlocks(blocks, &nBlocks, entries, nEntries);
+		ret |= syntheticWrite(fd, blocks, nBlocks*SYN_BYTES_PER_CLUSTER, partitionOffset + indexLCN*SYN_BYTES_PER_CLUSTER);
+		buildDirectoryRecord(record, SYN_ROOT_RECORD, 1, (char *)syntheticMetafiles[SYN_ROOT_RECORD], SYN_ROOT_RECORD,
+							 indexLCN, nBlocks, top);
+		ret |= syntheticWrite(fd, record, MFT_RECORD_LENGTH,
+							  partitionOffset + SYN_MFT_LCN*SYN_BYTES_PER_CLUSTER + (uint64_t)SYN_ROOT_RECORD*MFT_RECORD_LENGTH);
+		free(blocks);
+	}
+
+	if(ret == 0) {
+		ret |= syntheticWrite(fd, bitmap, bitmapClusters*SYN_BYTES_PER_CLUSTER,
+							  partitionOffset + bitmapLCN*SYN_BYTES_PER_CLUSTER);
+		ret |= writeSyntheticDeleted(fd, partitionOffset + carveLCN*SYN_BYTES_PER_CLUSTER, seed);
+	}
+	free(bitmap);
+	free(entries);
+	if(close(fd) == -1) {
+		ret = -1;
+	}
+	return ret ? -1 : 0;
+}
+
+#endif /* SYNTHETIC_H_ */
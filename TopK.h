@@ -0,0 +1,331 @@
+/*
+ * TopK.h
+ *
+ * Top K queries over the catalog: the largest, newest, most fragmented files, those with
+ * the longest names or the most random content. The record numbers are split into
+ * contiguous ranges, one per thread, and each thread keeps the K best files of its range
+ * in a bounded min-heap, whose root is the file to beat. The heaps are merged into one of
+ * K at the end and only those K are sorted, so a query takes O(n log K) rather than the
+ * O(n log n) of a full sort.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <time.h>
+#include "NTFSStruct.h"
+#include "FileLUT.h"
+#include "RunList.h"
+#include "MFTRecord.h"
+#include "Diff.h"
+#include "ClusterMap.h"
+#include "Entropy.h"
+#include "UserInterface.h"
+#include "Memory.h"
+#include "Trace.h"
+
+#ifndef TOPK_H_
+#define TOPK_H_
+
+#define TOP_DEFAULT_COUNT	10
+#define TOP_MAX_COUNT		1000000
+#define FILETIME_UNIX_EPOCH	11644473600ULL	/*Seconds from 1601, when FILETIME starts, to 1970 */
+
+/* What files are ranked by, the times in the order of diffTimeNames */
+typedef enum _TopKey {
+	TOP_SIZE, TOP_CREATED, TOP_MODIFIED, TOP_CHANGED, TOP_ACCESSED, TOP_FRAGMENTS, TOP_NAME, TOP_ENTROPY, TOP_KEYS
+} TopKey;
+
+static const char *topKeyNames[TOP_KEYS] = { "size", "created", "modified", "changed", "accessed", "fragments", "name", "entropy" };
+
+typedef struct _TopEntry {
+	uint64_t key;
+	uint32_t recordNumber;
+} TopEntry;
+
+/* At most k entries, as a min-heap: entries[0] ranks lowest */
+typedef struct _TopHeap {
+	TopEntry *entries;
+	uint32_t n, k;
+} TopHeap;
+
+/* A range of record numbers ranked by one thread */
+typedef struct _TopRange {
+	File **byRecord;
+	RecordSlots *slots;		/*The records of the MFT copy, for their times */
+	uint32_t first, last;	/*Records first to last-1 */
+	TopKey key;
+	char *glob;				/*Only files whose name matches, NULL for all */
+	TopHeap heap;
+	uint64_t nRanked;		/*Files which had a key */
+} TopRange;
+
+/**
+ * Returns true if a ranks below b: its key is lower, or equal with a higher record number,
+ * so the order does not depend on how the records were split among threads.
+ */
+static inline bool ranksBelow(TopEntry *a, TopEntry *b) {
+	return a->key < b->key || (a->key == b->key && a->recordNumber > b->recordNumber);
+}
+
+/*
+ * Restores the heap from index i down, once the entry there may rank above its children.
+ */
+void siftTopDown(TopHeap *heap, uint32_t i) {
+	for(;;) {
+		uint32_t lowest = i, left = 2*i + 1, right = 2*i + 2;
+		if(left < heap->n && ranksBelow(&heap->entries[left], &heap->entries[lowest])) {
+			lowest = left;
+		}
+		if(right < heap->n && ranksBelow(&heap->entries[right], &heap->entries[lowest])) {
+			lowest = right;
+		}
+		if(lowest == i) {
+			return;
+		}
+		TopEntry swap = heap->entries[i];
+		heap->entries[i] = heap->entries[lowest];
+		heap->entries[lowest] = swap;
+		i = lowest;
+	}
+}
+
+/**
+ * Offers entry to heap: it is kept if the heap is not full yet or it ranks above the
+ * lowest entry held, which it then replaces. O(log k).
+ */
+void offerTop(TopHeap *heap, TopEntry entry) {
+	if(heap->n < heap->k) {
+		uint32_t i = heap->n++;
+		while(i > 0 && ranksBelow(&entry, &heap->entries[(i - 1) / 2])) {
+			heap->entries[i] = heap->entries[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap->entries[i] = entry;
+	} else if(heap->k > 0 && ranksBelow(&heap->entries[0], &entry)) {
+		heap->entries[0] = entry;
+		siftTopDown(heap, 0);
+	}
+}
+
+/**
+ * Sorts the entries of heap from the highest ranked down, by popping the lowest to the end
+ * one at a time. The heap is no longer one afterwards.
+ */
+void sortTop(TopHeap *heap) {
+	uint32_t n = heap->n;
+	while(heap->n > 1) {
+		TopEntry lowest = heap->entries[0];
+		heap->entries[0] = heap->entries[--heap->n];
+		heap->entries[heap->n] = lowest;
+		siftTopDown(heap, 0);
+	}
+	heap->n = n;
+}
+
+/**
+ * Returns the fragments of the run list of file: the runs on disk, those which carry on
+ * where the one before ended counted once. Sparse runs take no clusters and are stepped over.
+ */
+uint64_t countFragments(File *file) {
+	DataRun *run;
+	int64_t lcn = 0, nextLcn = -1;
+	uint64_t fragments = 0;
+	for(run = file->runs; run; run = run->p_next) {
+		if(!run->offset) {
+			continue;
+		}
+		lcn += *run->offset;
+		if(lcn != nextLcn) {
+			fragments++;
+		}
+		nextLcn = lcn + *run->length;
+	}
+	return fragments;
+}
+
+/*
+ * Returns the characters of name, one byte each as the catalog keeps them: the low byte of
+ * each UTF-16 unit of the $FILE_NAME, whatever its value.
+ */
+uint64_t nameCharacters(char *name) {
+	return strlen(name);
+}
+
+/**
+ * Sets *key to the key of file to be ranked by, from the record of the MFT copy for its
+ * times. Returns false if it has none: a time without $STANDARD_INFORMATION, say.
+ */
+bool topKeyOf(TopRange *range, File *file, uint64_t *key) {
+	uint64_t times[DIFF_TIMES];
+	char *record;
+	switch(range->key) {
+		case TOP_SIZE : *key = file->realSize; return true;
+		case TOP_FRAGMENTS : *key = countFragments(file); return true;
+		case TOP_NAME :
+			*key = file->fileName ? nameCharacters(file->fileName) : 0;
+			return file->fileName != NULL;
+		case TOP_ENTROPY :
+			*key = file->entropy >= 0 ? (uint64_t)(file->entropy*1000000 + 0.5) : 0;	/*In millionths of bits */
+			return file->entropy >= 0;
+		default :
+			record = slotRecord(range->slots, file->recordNumber);
+			if(!record || !readStandardTimes(record, times)) {
+				return false;
+			}
+			*key = times[range->key - TOP_CREATED];
+			return true;
+	}
+}
+
+/**
+ * Ranks the files in use of a range of records into the heap of the range.
+ */
+void *rankRange(void *arg) {
+	TopRange *range = arg;
+	uint32_t r;
+	uint64_t traceStartNs = traceStart();
+	traceThreadName("top");
+	for(r = range->first; r < range->last; r++) {
+		File *file = range->byRecord[r];
+		TopEntry entry = { 0, r };
+		if(!file || !(file->recordFlags & IN_USE)) {
+			continue;
+		}
+		if(range->glob && (!file->fileName || fnmatch(range->glob, file->fileName, 0) != 0)) {
+			continue;
+		}
+		if(!topKeyOf(range, file, &entry.key)) {
+			continue;
+		}
+		range->nRanked++;
+		offerTop(&range->heap, entry);
+	}
+	traceSpan("rank", "top", traceStartNs, "first", range->first, "records", range->last - range->first);
+	return NULL;
+}
+
+/*
+ * Writes the key of an entry as it is printed into text (size bytes).
+ */
+void formatTopKey(TopKey key, uint64_t value, char *text, size_t size) {
+	struct tm tm;
+	time_t seconds;
+	switch(key) {
+		case TOP_SIZE : snprintf(text, size, "%" PRIu64 " bytes", value); break;
+		case TOP_FRAGMENTS : snprintf(text, size, "%" PRIu64 " fragments", value); break;
+		case TOP_NAME : snprintf(text, size, "%" PRIu64 " characters", value); break;
+		case TOP_ENTROPY : snprintf(text, size, "%.4f bits per byte", value/1e6); break;
+		default :
+			/*FILETIME counts 100ns from 1601, in UTC */
+			seconds = (time_t)(value / 10000000) - (time_t)FILETIME_UNIX_EPOCH;
+			if(value / 10000000 < FILETIME_UNIX_EPOCH || !gmtime_r(&seconds, &tm) ||
+			   strftime(text, size, "%Y-%m-%d %H:%M:%S UTC", &tm) == 0) {
+				snprintf(text, size, "0x%" PRIx64, value);
+			}
+	}
+}
+
+/**
+ * Prints the top files of the catalog in files by what args name: a key of topKeyNames,
+ * then the count of files (TOP_DEFAULT_COUNT if left out) and a name glob. Times come
+ * from the MFT copy, entropy from the columns saved next to it at mftCopyName by the
+ * entropy command. Ranked by nThreads threads, over contiguous ranges of record numbers.
+ * Returns 0, or -1 if args are not valid or no entropy was saved.
+ */
+int topFiles(File *files, MFTCopy *copy, char *mftCopyName, char **args, int nArgs, int nThreads) {
+	RecordSlots slots;
+	uint32_t nRecords, i;
+	uint64_t nRanked = 0, count = TOP_DEFAULT_COUNT;
+	int t, key;
+	char *glob = NULL, *end, path[MAX_PATH_LENGTH], value[64];
+	uint64_t startNs = traceStart();
+
+	for(key = 0; nArgs > 0 && key < TOP_KEYS && strcmp(args[0], topKeyNames[key]) != 0; key++);
+	if(nArgs < 1 || nArgs > 3 || key == TOP_KEYS) {
+		printf("top takes what to rank by (size, created, modified, changed, accessed, fragments, name or entropy), "
+			   "then the count of files and a name glob.\n");
+		return -1;
+	}
+	if(nArgs > 1 && strspn(args[1], "0123456789") == strlen(args[1])) {
+		count = strtoull(args[1], &end, 10);
+		if(count < 1 || count > TOP_MAX_COUNT) {
+			printf("The count of files must be from 1 to %d.\n", TOP_MAX_COUNT);
+			return -1;
+		}
+		glob = nArgs > 2 ? args[2] : NULL;
+	} else if(nArgs > 2) {
+		printf("top takes the count of files before the name glob.\n");
+		return -1;
+	} else if(nArgs > 1) {
+		glob = args[1];	/*The count left out */
+	}
+
+	File **byRecord = indexRecords(files, &nRecords);
+	if(key == TOP_ENTROPY) {
+		char columnsPath[CMD_BUFF + sizeof(ENTROPY_COLUMNS_SUFFIX)];
+		uint64_t limit;
+		snprintf(columnsPath, sizeof(columnsPath), "%s%s", mftCopyName, ENTROPY_COLUMNS_SUFFIX);
+		if(loadEntropyColumns(byRecord, nRecords, mftCopyKey(copy), columnsPath, &limit) != 0) {
+			printf("No entropy saved in %s for this MFT copy, run entropy first.\n", columnsPath);
+			memFree(byRecord);
+			return -1;
+		}
+		if(limit) {
+			printf("Entropy of the first %" PRIu64 " KB of each file.\n", limit/1024);
+		}
+	}
+	indexCopiedRecords(copy, &slots);
+	TopRange *ranges = calloc( nThreads, sizeof(TopRange) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	for(t = 0; t < nThreads; t++) {
+		ranges[t].byRecord = byRecord;
+		ranges[t].slots = &slots;
+		ranges[t].first = (uint64_t)nRecords*t/nThreads;
+		ranges[t].last = (uint64_t)nRecords*(t+1)/nThreads;
+		ranges[t].key = key;
+		ranges[t].glob = glob;
+		ranges[t].heap.k = count < ranges[t].last - ranges[t].first ? count : ranges[t].last - ranges[t].first;
+		ranges[t].heap.entries = memAlloc( MEM_CATALOG, (ranges[t].heap.k ? ranges[t].heap.k : 1)*sizeof(TopEntry) );
+		pthread_create(&threads[t], NULL, rankRange, &ranges[t]);
+	}
+
+	/*Merge the heaps of the threads into one of count */
+	TopHeap top = { NULL, 0, count < nRecords ? count : nRecords };
+	top.entries = memAlloc( MEM_CATALOG, (top.k ? top.k : 1)*sizeof(TopEntry) );
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+		nRanked += ranges[t].nRanked;
+		for(i = 0; i < ranges[t].heap.n; i++) {
+			offerTop(&top, ranges[t].heap.entries[i]);
+		}
+		memFree(ranges[t].heap.entries);
+	}
+	free(threads);
+	free(ranges);
+	sortTop(&top);
+
+	for(i = 0; i < top.n; i++) {
+		File *file = byRecord[top.entries[i].recordNumber];
+		if(filePath(byRecord, nRecords, file, path, sizeof(path)) == 0) {
+			snprintf(path, sizeof(path), "/");
+		}
+		formatTopKey(key, top.entries[i].key, value, sizeof(value));
+		printf("%u\t%s\trecord %u %s\n", i + 1, value, top.entries[i].recordNumber, path);
+	}
+	printf("Top %u of %" PRIu64 " files in use%s%s by %s.\n", top.n, nRanked,
+		   glob ? " matching " : "", glob ? glob : "", topKeyNames[key]);
+	traceSpan("top", "top", startNs, "records", nRecords, "count", count);
+
+	memFree(top.entries);
+	memFree(slots.records);
+	memFree(byRecord);
+	return 0;
+}
+
+#endif /* TOPK_H_ */
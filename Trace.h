@@ -0,0 +1,186 @@
+/*
+ * Trace.h
+ *
+ * Optional tracing of I/O and pipeline spans, exported as Chrome trace-event JSON
+ * (load it in chrome://tracing or ui.perfetto.dev).
+ * Each thread appends its spans to a buffer of its own without locking; the buffers are
+ * only read when the trace is written, after the threads recording them are done.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#define TRACE_CHUNK_EVENTS 1024		/*Events held by each chunk of a thread's buffer */
+#define TRACE_BATCH_RECORDS 256		/*MFT records covered by one parse span */
+
+/* One complete span, times in ns since the trace started */
+typedef struct _TraceEvent {
+	const char *name;
+	const char *category;
+	uint64_t start;
+	uint64_t duration;
+	const char *argNames[2];	/*NULL when the argument is unused */
+	uint64_t args[2];
+} TraceEvent;
+
+typedef struct _TraceChunk {
+	TraceEvent events[TRACE_CHUNK_EVENTS];
+	uint32_t nEvents;
+	struct _TraceChunk *p_next;
+} TraceChunk;
+
+typedef struct _TraceBuffer {
+	uint32_t tid;
+	const char *threadName;
+	TraceChunk *first, *last;
+	struct _TraceBuffer *p_next;
+} TraceBuffer;
+
+bool tracing = false;					/*Set by startTrace(..), spans are ignored until then */
+uint64_t traceEpoch = 0;
+TraceBuffer *traceBuffers = NULL;		/*Every thread's buffer, pushed atomically */
+uint32_t traceThreads = 0;
+__thread TraceBuffer *traceThreadBuffer = NULL;
+
+uint64_t traceClock() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+void startTrace() {
+	traceEpoch = traceClock();
+	tracing = true;
+}
+
+/**
+ * Returns the time at which a span starts, or 0 when not tracing.
+ */
+uint64_t traceStart() {
+	return tracing ? traceClock() - traceEpoch : 0;
+}
+
+/**
+ * Returns the buffer of the calling thread, creating and registering it on first use.
+ */
+TraceBuffer *traceBuffer() {
+	if(!traceThreadBuffer) {
+		TraceBuffer *buffer = calloc( 1, sizeof(TraceBuffer) );
+		buffer->tid = __sync_add_and_fetch(&traceThreads, 1);
+		buffer->first = buffer->last = calloc( 1, sizeof(TraceChunk) );
+		do {
+			buffer->p_next = traceBuffers;
+		} while(!__sync_bool_compare_and_swap(&traceBuffers, buffer->p_next, buffer));
+		traceThreadBuffer = buffer;
+	}
+	return traceThreadBuffer;
+}
+
+/**
+ * Names the calling thread in the trace.
+ */
+void traceThreadName(const char *name) {
+	if(tracing) {
+		traceBuffer()->threadName = name;
+	}
+}
+
+/**
+ * Records a span from start (as returned by traceStart()) until now, with up to two
+ * named arguments. Does nothing when not tracing.
+ */
+void traceSpan(const char *name, const char *category, uint64_t start,
+			   const char *argName0, uint64_t arg0, const char *argName1, uint64_t arg1) {
+	if(!tracing) {
+		return;
+	}
+	TraceBuffer *buffer = traceBuffer();
+	if(buffer->last->nEvents == TRACE_CHUNK_EVENTS) {
+		buffer->last->p_next = calloc( 1, sizeof(TraceChunk) );
+		buffer->last = buffer->last->p_next;
+	}
+	TraceEvent *event = &buffer->last->events[buffer->last->nEvents++];
+	event->name = name;
+	event->category = category;
+	event->start = start;
+	event->duration = traceClock() - traceEpoch - start;
+	event->argNames[0] = argName0;
+	event->args[0] = arg0;
+	event->argNames[1] = argName1;
+	event->args[1] = arg1;
+}
+
+/**
+ * Writes every span recorded to path as Chrome trace-event JSON and frees the buffers.
+ * Must only be called once the threads recording spans are done.
+ * Returns 0, or -1 if the file cannot be written.
+ */
+int writeTrace(char *path) {
+	TraceBuffer *buffer, *p_next_buffer;
+	FILE *out;
+	bool first = true;
+	int ret = 0;
+	uint32_t i;
+
+	tracing = false;
+	if((out = fopen(path, "w")) == NULL) {
+		int errsv = errno;
+		printf("Failed to create trace file %s: %s.\n", path, strerror(errsv));
+		ret = -1;
+	}
+	if(out) {
+		fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	}
+	for(buffer = traceBuffers; buffer; buffer = p_next_buffer) {
+		TraceChunk *chunk, *p_next_chunk;
+		if(out && buffer->threadName) {
+			fprintf(out, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+					first ? "" : ",", buffer->tid, buffer->threadName, buffer->tid);
+			first = false;
+		}
+		for(chunk = buffer->first; chunk; chunk = p_next_chunk) {
+			for(i = 0; out && i < chunk->nEvents; i++) {
+				TraceEvent *event = &chunk->events[i];
+				fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+						"\"ts\":%" PRIu64 ".%03u,\"dur\":%" PRIu64 ".%03u,\"args\":{",
+						first ? "" : ",", event->name, event->category, buffer->tid,
+						event->start/1000, (unsigned)(event->start%1000),
+						event->duration/1000, (unsigned)(event->duration%1000));
+				if(event->argNames[0]) {
+					fprintf(out, "\"%s\":%" PRIu64, event->argNames[0], event->args[0]);
+				}
+				if(event->argNames[1]) {
+					fprintf(out, ",\"%s\":%" PRIu64, event->argNames[1], event->args[1]);
+				}
+				fprintf(out, "}}");
+				first = false;
+			}
+			p_next_chunk = chunk->p_next;
+			free(chunk);
+		}
+		p_next_buffer = buffer->p_next;
+		free(buffer);
+	}
+	traceBuffers = NULL;
+	traceThreadBuffer = NULL;	/*Only the calling thread's, the others are done */
+	if(out) {
+		fprintf(out, "\n]}\n");
+		if(fclose(out) != 0) {
+			int errsv = errno;
+			printf("Failed to write trace file %s: %s.\n", path, strerror(errsv));
+			ret = -1;
+		}
+	}
+	return ret;
+}
+
+#endif /* TRACE_H_ */
@@ -6,6 +6,9 @@
  */
 
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdbool.h>
 
 #ifndef USERINTERFACE_H_
 #define USERINTERFACE_H_
@@ -22,27 +25,172 @@
 #define PRINT_HELP 	1
 #define PRINT_FILES 2
 #define EXIT		3
+#define PRINT_STATS 4
+#define TOP_FILES	5
 #define UNKNOWN		-1
 
 #define HELP_CMD			"help"
 #define PRINT_FILES_CMD		"print files"
 #define EXIT_CMD			"exit"
+#define PRINT_STATS_CMD		"print stats"
 
 #define HELP \
 "From here you can issue the following commands:\n\
 \t" KWHT "%s" KRESET " - Display this menu.\n\
 \t" KWHT "%s" KRESET " - Print out a list of all file names found on volume.\n\
+\t" KWHT "%s" KRESET " - Print the counters, timers and histograms gathered so far.\n\
+\t" KWHT "%s" KRESET " key [count] [name glob] - Print the files first by size, created, modified,\n\
+\t\tchanged, accessed, fragments, name length or entropy.\n\
 \t" KWHT "%s" KRESET " - Close this program.\n", \
 HELP_CMD, \
 PRINT_FILES_CMD, \
+PRINT_STATS_CMD, \
+TOP_CMD, \
 EXIT_CMD
 
+/* Workloads which run without the interactive prompt */
+#define SCAN_CMD			"scan"
+#define LIST_CMD			"list"
+#define HASH_CMD			"hash"
+#define EXTRACT_CMD			"extract"
+#define CARVE_CMD			"carve"
+#define OWNER_CMD			"owner"
+#define RECOVER_CMD			"recover"
+#define GREP_CMD			"grep"
+#define CHECK_CMD			"check"
+#define SECURITY_CMD		"security"
+#define LINKS_CMD			"links"
+#define OBJID_CMD			"objid"
+#define DIFF_CMD			"diff"
+#define TOP_CMD				"top"
+#define ENTROPY_CMD			"entropy"
+#define RESOLVE_CMD			"resolve"
+
+#define USAGE \
+"Usage: %s [-d device] [-t threads] [-q queue depth] [-c cache MB] [-o output dir] [-T trace file] [-I image] [-S] [-E error map] [-R retries] [-K hash set] [command [args]]\n\
+With -I, the device is imaged first, in one pass which also copies its MFTs, then read\n\
+from the image. With -S, hash and extract read the content of all files in one sweep of\n\
+the volume in disk order. Unreadable regions are zero filled, skipped and kept in the error\n\
+map (<device name>.errors by default), and with -R, retried that many times at the end.\n\
+With -K, hash and extract leave out the files whose SHA-256 is in the hash set.\n\
+Without a command, an interactive prompt follows the MFT scan. Commands:\n\
+\t" KWHT "%s" KRESET " - Scan the MFT and print totals.\n\
+\t" KWHT "%s" KRESET " - Print out a list of all file names found on volume.\n\
+\t" KWHT "%s" KRESET " - Print the SHA-256 of the content of every file.\n\
+\t" KWHT "%s" KRESET " - Copy the content of every file into the output dir.\n\
+\t" KWHT "%s" KRESET " - Carve deleted files out of unallocated clusters into the output dir.\n\
+\t" KWHT "%s" KRESET " [byte offset ...] - Print the file owning each offset on the partition.\n\
+\t" KWHT "%s" KRESET " [partial] - Score how recoverable each deleted file is, and copy those fully\n\
+\t\trecoverable (or partially, too) into the output dir.\n\
+\t" KWHT "%s" KRESET " [in:name glob ...] pattern ... - Print where the content of files holds each\n\
+\t\tpattern: a literal (with \\xHH escapes) or, after re:, an extended regular expression.\n\
+\t" KWHT "%s" KRESET " - Check the record flags, run lists and directory indexes against $Bitmap and\n\
+\t\teach other, and report the problems found.\n\
+\t" KWHT "%s" KRESET " [SID ...] - Print how many files each owner SID has, or the files owned by\n\
+\t\tthe SIDs given, from the security descriptors of $Secure.\n\
+\t" KWHT "%s" KRESET " [path ...] - Print every symbolic link and junction with what it resolves to,\n\
+\t\tor every file reachable under each directory given, following links.\n\
+\t" KWHT "%s" KRESET " [GUID ...] - Print the file each object ID of $ObjId leads to, or every object\n\
+\t\tID with its file and the object IDs of files missing from $ObjId.\n\
+\t" KWHT "%s" KRESET " baseline - Print the files created, deleted, renamed, moved, resized or with new\n\
+\t\ttimestamps since the MFT copy baseline was taken.\n\
+\t" KWHT "%s" KRESET " key [count] [name glob] - Print the count (10 by default) largest, newest, most\n\
+\t\tfragmented, longest named or most random files in use: by size, created, modified,\n\
+\t\tchanged, accessed, fragments, name or entropy.\n\
+\t" KWHT "%s" KRESET " [KB] - Print the entropy and byte chi-square of every file, or of its first KB,\n\
+\t\tflag those which look encrypted and save them for top.\n\
+\t" KWHT "%s" KRESET " [path list] - Print the record each path of the list (one per line, on stdin\n\
+\t\twithout it) leads to, searching the index of each directory once for all the paths under it.\n"
+
+/* Settings taken from the command line */
+typedef struct _Options {
+	char *device;		/*Block device or image to read */
+	char *command;		/*Workload to run, NULL for the interactive prompt */
+	char *outputDir;	/*Where extracted files are written */
+	char *tracePath;	/*Where the Chrome trace is written, NULL when not tracing */
+	char *imagePath;	/*Where the device is imaged to first, NULL when not imaging */
+	char *errorMapPath;	/*Where unreadable regions are kept, NULL for <device name>.errors */
+	char *knownPath;	/*Hash set of the files left out of hash and extract, NULL for none */
+	char **args;		/*Arguments following the command */
+	int nArgs;
+	int threads;		/*Worker threads for scanning, hashing and extracting */
+	int queueDepth;		/*Reads in flight at once on the device */
+	int cacheMB;		/*Size of the block cache, 0 disables it */
+	int retries;		/*Reads of each unreadable sector in the retry pass, 0 for none */
+	bool sweep;			/*Content is read in one sweep of the volume in disk order */
+} Options;
+
+/**
+ * Fills options from the command line, starting from defaults.
+ * Returns 0, or -1 after printing usage if the command line is not valid.
+ */
+int parseOptions(int argc, char *argv[], Options *options, const char *defaultDevice) {
+	int opt;
+	options->device = (char *)defaultDevice;
+	options->command = NULL;
+	options->outputDir = ".";
+	options->tracePath = NULL;
+	options->imagePath = NULL;
+	options->errorMapPath = NULL;
+	options->knownPath = NULL;
+	options->args = NULL;
+	options->nArgs = 0;
+	options->threads = 1;
+	options->queueDepth = 1;
+	options->cacheMB = 0;
+	options->retries = 0;
+	options->sweep = false;
+
+	while((opt = getopt(argc, argv, "d:t:q:c:o:T:I:SE:R:K:h")) != -1) {
+		switch(opt) {
+			case 'd' : options->device = optarg; break;
+			case 't' : options->threads = atoi(optarg); break;
+			case 'q' : options->queueDepth = atoi(optarg); break;
+			case 'c' : options->cacheMB = atoi(optarg); break;
+			case 'o' : options->outputDir = optarg; break;
+			case 'T' : options->tracePath = optarg; break;
+			case 'I' : options->imagePath = optarg; break;
+			case 'S' : options->sweep = true; break;
+			case 'E' : options->errorMapPath = optarg; break;
+			case 'R' : options->retries = atoi(optarg); break;
+			case 'K' : options->knownPath = optarg; break;
+			default :
+				printf(USAGE, argv[0], SCAN_CMD, LIST_CMD, HASH_CMD, EXTRACT_CMD, CARVE_CMD, OWNER_CMD, RECOVER_CMD, GREP_CMD, CHECK_CMD, SECURITY_CMD, LINKS_CMD, OBJID_CMD, DIFF_CMD, TOP_CMD, ENTROPY_CMD, RESOLVE_CMD);
+				return -1;
+		}
+	}
+	if(optind < argc) {
+		options->command = argv[optind];
+		options->args = argv + optind + 1;
+		options->nArgs = argc - optind - 1;
+		if(strcmp(options->command, SCAN_CMD) != 0 && strcmp(options->command, LIST_CMD) != 0 &&
+		   strcmp(options->command, HASH_CMD) != 0 && strcmp(options->command, EXTRACT_CMD) != 0 &&
+		   strcmp(options->command, CARVE_CMD) != 0 && strcmp(options->command, OWNER_CMD) != 0 &&
+		   strcmp(options->command, RECOVER_CMD) != 0 && strcmp(options->command, GREP_CMD) != 0 &&
+		   strcmp(options->command, CHECK_CMD) != 0 && strcmp(options->command, SECURITY_CMD) != 0 &&
+		   strcmp(options->command, LINKS_CMD) != 0 && strcmp(options->command, OBJID_CMD) != 0 &&
+		   strcmp(options->command, DIFF_CMD) != 0 && strcmp(options->command, TOP_CMD) != 0 &&
+		   strcmp(options->command, ENTROPY_CMD) != 0 && strcmp(options->command, RESOLVE_CMD) != 0) {
+			printf("Command \'%s\' not recognised.\n", options->command);
+			printf(USAGE, argv[0], SCAN_CMD, LIST_CMD, HASH_CMD, EXTRACT_CMD, CARVE_CMD, OWNER_CMD, RECOVER_CMD, GREP_CMD, CHECK_CMD, SECURITY_CMD, LINKS_CMD, OBJID_CMD, DIFF_CMD, TOP_CMD, ENTROPY_CMD, RESOLVE_CMD);
+			return -1;
+		}
+	}
+	if(options->threads < 1 || options->queueDepth < 1 || options->cacheMB < 0 || options->retries < 0) {
+		printf("Threads and queue depth must be at least 1, cache size and retries at least 0.\n");
+		return -1;
+	}
+	return 0;
+}
+
 int8_t parseUserInput(char * userInput) {
 
 	userInput[ strcspn(userInput, "\r\n") ] = 0; /*Replaces LF with \0 */
 
 	if		( ENTERED(HELP_CMD) ) 		 { return PRINT_HELP; }
 	else if ( ENTERED(PRINT_FILES_CMD) ) { return PRINT_FILES; }
+	else if ( ENTERED(PRINT_STATS_CMD) ) { return PRINT_STATS; }
+	else if ( ENTERED(TOP_CMD) || strncmp(userInput, TOP_CMD " ", strlen(TOP_CMD " ")) == 0 ) { return TOP_FILES; }
 	else if ( ENTERED(EXIT_CMD) ) 		 { return EXIT;	}
 	else 								 { return UNKNOWN; }
 
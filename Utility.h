@@ -24,7 +24,7 @@ int aSCIIcmpuni(char * utfString, uint16_t * uniString, uint8_t length) {
 			ret++;
 		}
 	}
-	if(DEBUG && VERBOSE) printf("utf8cmpuni returns: %d", ret);
+	VERBOSE_PRINT("utf8cmpuni returns: %d", ret);
 	return ret;
 }
 
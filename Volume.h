@@ -0,0 +1,210 @@
+/*
+ * Volume.h
+ *
+ * An NTFS volume on the block device, and the streaming of file content off it.
+ */
+
+#include <pthread.h>
+#include "NTFSStruct.h"
+#include "RunList.h"
+#include "FileLUT.h"
+#include "BlockReader.h"
+#include "Sink.h"
+#include "Memory.h"
+
+#ifndef VOLUME_H_
+#define VOLUME_H_
+
+#define STREAM_BUFFER_SIZE (1024*1024)	/*Content is handed to sinks in chunks of this size */
+
+typedef struct _Volume {
+	BlockReader *reader;
+	uint64_t partitionOffset;	/*Bytes from the start of the device to the partition */
+	uint32_t bytesPerCluster;
+	uint64_t totalClusters;		/*Clusters in the partition, from the boot sector */
+} Volume;
+
+/**
+ * Hands the unnamed $DATA stream of file from fileOffset up to size bytes to sink, in file
+ * order, without beginning or ending it. Runs are followed cluster by cluster and sparse
+ * runs are handed on as zeros. buffer must hold STREAM_BUFFER_SIZE bytes.
+ *
+ * Returns 0, or -1 if a read or the sink failed.
+ */
+int streamFileRange(Volume *volume, File *file, uint64_t fileOffset, uint64_t size, Sink *sink, char *buffer) {
+	uint64_t runStart = 0;
+	int64_t lcn = 0;
+	int ret = 0;
+	DataRun *p_current_item;
+
+	if(file->runs == NULL) { /*Resident, already in memory */
+		if(file->residentData && size > fileOffset) {
+			ret = sinkWrite(sink, file, fileOffset, file->residentData + fileOffset, size - fileOffset);
+		}
+		return ret;
+	}
+	for(p_current_item = file->runs; p_current_item && ret == 0 && fileOffset < size;
+		p_current_item = p_current_item->p_next) {
+		uint64_t runBytes = *p_current_item->length * volume->bytesPerCluster;
+		uint64_t runOffset = fileOffset > runStart ? fileOffset - runStart : 0;
+		if(p_current_item->offset) {
+			lcn += *p_current_item->offset;
+		}
+		while(runOffset < runBytes && fileOffset < size && ret == 0) {
+			size_t length = STREAM_BUFFER_SIZE;
+			if(length > runBytes - runOffset) {
+				length = runBytes - runOffset;
+			}
+			if(length > size - fileOffset) {
+				length = size - fileOffset;
+			}
+			if(!p_current_item->offset) { /*Sparse */
+				memset(buffer, 0, length);
+			} else if(readBlocks(volume->reader, volume->partitionOffset + lcn*volume->bytesPerCluster
+								 + runOffset, length, buffer) != 0) {
+				int errsv = errno;
+				printf("Failed to read record %u at cluster %" PRId64 " with error: %s.\n",
+					   file->recordNumber, lcn, strerror(errsv));
+				ret = -1;
+				break;
+			}
+			ret = sinkWrite(sink, file, fileOffset, buffer, length);
+			runOffset += length;
+			fileOffset += length;
+		}
+		runStart += runBytes;
+	}
+	return ret;
+}
+
+/**
+ * Streams the unnamed $DATA stream of file through sink, in file order.
+ * Runs are followed cluster by cluster, sparse runs are handed on as zeros and the
+ * stream is cut at its real size, or at the limit of the sink. buffer must hold
+ * STREAM_BUFFER_SIZE bytes.
+ *
+ * Returns 0, or -1 if a read or the sink failed.
+ */
+int streamFile(Volume *volume, File *file, Sink *sink, char *buffer) {
+	int ret;
+	uint64_t size = sink->limit && sink->limit < file->realSize ? sink->limit : file->realSize;
+
+	if(sink->begin(sink->ctx, file) != 0) {
+		return -1;
+	}
+	STAT_INC(STAT_SINK_FILES);
+	STAT_HIST(HIST_FILE_BYTES, file->realSize);
+	ret = streamFileRange(volume, file, 0, size, sink, buffer);
+	if(sink->end(sink->ctx, file) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/**
+ * Streams file->realSize bytes, or up to the limit of sink, found at offset on the
+ * partition through sink as the content of file, for content not described by a run
+ * list. buffer must hold STREAM_BUFFER_SIZE bytes.
+ *
+ * Returns 0, or -1 if a read or the sink failed.
+ */
+int streamExtent(Volume *volume, File *file, uint64_t offset, Sink *sink, char *buffer) {
+	uint64_t fileOffset = 0;
+	int ret = 0;
+	uint64_t size = sink->limit && sink->limit < file->realSize ? sink->limit : file->realSize;
+	if(sink->begin(sink->ctx, file) != 0) {
+		return -1;
+	}
+	STAT_INC(STAT_SINK_FILES);
+	STAT_HIST(HIST_FILE_BYTES, file->realSize);
+	while(fileOffset < size && ret == 0) {
+		size_t length = STREAM_BUFFER_SIZE;
+		if(length > size - fileOffset) {
+			length = size - fileOffset;
+		}
+		if(readBlocks(volume->reader, volume->partitionOffset + offset + fileOffset, length, buffer) != 0) {
+			int errsv = errno;
+			printf("Failed to read %s at offset %" PRIu64 " with error: %s.\n",
+				   file->fileName, offset + fileOffset, strerror(errsv));
+			ret = -1;
+			break;
+		}
+		ret = sinkWrite(sink, file, fileOffset, buffer, length);
+		fileOffset += length;
+	}
+	if(sink->end(sink->ctx, file) != 0) {
+		ret = -1;
+	}
+	return ret;
+}
+
+/* Work shared among the threads of streamFiles(..) */
+typedef struct _StreamJob {
+	Volume *volume;
+	File **files;
+	uint32_t nFiles;
+	uint32_t next;		/*Next file to take, taken atomically */
+	int failures;
+	bool (*wanted)(File *file);
+} StreamJob;
+
+typedef struct _StreamWorker {
+	StreamJob *job;
+	Sink *sink;
+} StreamWorker;
+
+void *streamWorker(void *arg) {
+	StreamWorker *worker = arg;
+	StreamJob *job = worker->job;
+	char *buffer = memAlloc( MEM_IO, STREAM_BUFFER_SIZE );
+	uint32_t i;
+	traceThreadName("stream");
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nFiles) {
+		if(!job->wanted(job->files[i])) {
+			continue;
+		}
+		uint64_t traceStartNs = traceStart();
+		if(streamFile(job->volume, job->files[i], worker->sink, buffer) != 0) {
+			__sync_fetch_and_add(&job->failures, 1);
+		}
+		traceSpan("file", "stream", traceStartNs, "record", job->files[i]->recordNumber,
+				  "size", job->files[i]->realSize);
+	}
+	memFree(buffer);
+	return NULL;
+}
+
+/**
+ * Streams every file among files for which wanted(..) is true through the sinks, using
+ * one thread per sink. Files are handed out one at a time, so large files do not hold up
+ * the others.
+ *
+ * Returns the number of files which failed.
+ */
+int streamSelectedFiles(Volume *volume, File **files, uint32_t nFiles, Sink *sinks, int nThreads,
+						bool (*wanted)(File *file)) {
+	StreamJob job = { volume, files, nFiles, 0, 0, wanted };
+	StreamWorker *workers = malloc( nThreads*sizeof(StreamWorker) );
+	pthread_t *threads = malloc( nThreads*sizeof(pthread_t) );
+	int t;
+	for(t = 0; t < nThreads; t++) {
+		workers[t].job = &job;
+		workers[t].sink = &sinks[t];
+		pthread_create(&threads[t], NULL, streamWorker, &workers[t]);
+	}
+	for(t = 0; t < nThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	free(threads);
+	free(workers);
+	return job.failures;
+}
+
+/**
+ * Streams every file with content among files through the sinks, as streamSelectedFiles(..).
+ */
+int streamFiles(Volume *volume, File **files, uint32_t nFiles, Sink *sinks, int nThreads) {
+	return streamSelectedFiles(volume, files, nFiles, sinks, nThreads, hasContent);
+}
+
+#endif /* VOLUME_H_ */